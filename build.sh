@@ -1,4 +1,4 @@
 #!/bin/sh
 
-clang++ src/lexer.cpp src/parser.cpp src/checker.cpp src/compiler.cpp src/main.cpp src/utils.cpp src/evaluator.cpp -std=c++20 \
-	 -g -pedantic -Wall -Wno-missing-braces -fsanitize=address -fsanitize=undefined -o tack
\ No newline at end of file
+clang++ src/lexer.cpp src/parser.cpp src/checker.cpp src/layout.cpp src/consteval.cpp src/compiler.cpp src/ir.cpp src/optimizer.cpp src/intrinsics.cpp src/inliner.cpp src/loops.cpp src/x86.cpp src/regalloc.cpp src/peephole.cpp src/assembler.cpp src/elf.cpp src/main.cpp src/utils.cpp src/evaluator.cpp src/batch.cpp src/watch.cpp -std=c++20 \
+	 -g -pedantic -Wall -Wno-missing-braces -fsanitize=address -fsanitize=undefined -pthread -ldl -o tack
\ No newline at end of file
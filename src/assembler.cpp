@@ -0,0 +1,656 @@
+#include "assembler.hpp"
+#include "utils.hpp"
+#include "format.hpp"
+
+namespace {
+	// a field inside a chunk that refers to a symbol
+	struct Fixup {
+		size_t offset;
+		std::string symbol;
+		int64_t addend;
+		RelocKind kind;
+		// bytes from the field to the end of the instruction, known once it's fully encoded
+		uint8_t pc_distance = 0;
+	};
+
+	// the encoding of a single instruction
+	struct Chunk {
+		std::vector<uint8_t> bytes;
+		std::vector<Fixup> fixups;
+		// jmp and jcc to a label get encoded once the layout is known,
+		// since whether the short form reaches depends on everything in between
+		bool is_branch = false;
+		bool long_branch = false;
+		Cond cond = Cond::None;
+		std::string target;
+
+		size_t size() const {
+			if (!is_branch) return bytes.size();
+			if (!long_branch) return 2;
+			return cond == Cond::None ? 5 : 6;
+		}
+	};
+
+	class Encoder {
+	public:
+		Encoder(Target target, Chunk& chunk) : m_target(target), m_chunk(chunk) {}
+
+		void encode(const Instr& instr);
+
+	private:
+		Target m_target;
+		Chunk& m_chunk;
+
+		void byte(uint8_t value) { m_chunk.bytes.push_back(value); }
+		void bytes(std::initializer_list<uint8_t> values) {
+			m_chunk.bytes.insert(m_chunk.bytes.end(), values.begin(), values.end());
+		}
+		void immediate(int64_t value, uint8_t size) {
+			for (uint8_t i = 0; i < size; ++i)
+				byte(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (i * 8)));
+		}
+		// an immediate that may be the address of a symbol
+		void immediate(const Operand& operand, uint8_t size, RelocKind kind);
+		void field(const std::string& symbol, int64_t addend, RelocKind kind, uint8_t size);
+
+		void rex(bool wide, RegId reg, RegId index, RegId base, bool force);
+		// prefixes, opcode and modrm for instructions taking a register (or opcode extension) and a r/m operand
+		void rm(std::initializer_list<uint8_t> opcode, uint8_t size, RegId reg, uint8_t extension, const Operand& rm,
+			bool default_64 = false, bool byte_regs = false);
+		void modrm(uint8_t reg_field, const Operand& rm);
+		// opcodes with the register encoded in the low bits, like push r and mov r, imm
+		void short_reg(uint8_t opcode, uint8_t size, RegId reg, bool default_64 = false);
+		void alu(uint8_t extension, const Instr& instr);
+		// sse and avx instructions, from the opcode map (1 for 0f, 2 for 0f 38, 3 for 0f 3a) and the mandatory
+		// prefix. with vex those both go into a c4 or c5 prefix instead, along with the extra source in vvvv
+		void simd(uint8_t prefix, uint8_t map, uint8_t opcode, RegId reg, uint8_t extension, const Operand& rm,
+			bool vex, RegId vvvv = no_reg, bool ymm = false);
+	};
+}
+
+static bool fits_i8(int64_t value) { return value >= INT8_MIN && value <= INT8_MAX; }
+static bool fits_i32(int64_t value) { return value >= INT32_MIN && value <= INT32_MAX; }
+static bool is_extended(RegId reg) { return reg != no_reg && reg >= 8; }
+// spl, bpl, sil and dil only exist with a rex prefix, without one they mean ah, ch, dh and bh
+static bool needs_rex_as_byte(RegId reg) { return reg >= 4 && reg < 8; }
+
+// xmm registers have their own numbers in the encoding
+static RegId hardware_reg(RegId reg) {
+	return reg != no_reg && reg >= reg_id(Reg::Xmm0) ? reg - reg_id(Reg::Xmm0) : reg;
+}
+
+static uint8_t cond_code(Cond cond) {
+	switch (cond) {
+		case Cond::E: return 0x4;
+		case Cond::Ne: return 0x5;
+		case Cond::L: return 0xC;
+		case Cond::Le: return 0xE;
+		case Cond::G: return 0xF;
+		case Cond::Ge: return 0xD;
+		case Cond::B: return 0x2;
+		case Cond::Be: return 0x6;
+		case Cond::A: return 0x7;
+		case Cond::Ae: return 0x3;
+		case Cond::None: break;
+	}
+	unhandled("condition code");
+}
+
+void Encoder::field(const std::string& symbol, int64_t addend, RelocKind kind, uint8_t size) {
+	m_chunk.fixups.push_back(Fixup { m_chunk.bytes.size(), symbol, addend, kind });
+	immediate(0, size);
+}
+
+void Encoder::immediate(const Operand& operand, uint8_t size, RelocKind kind) {
+	if (operand.label.empty())
+		immediate(operand.imm, size);
+	else
+		field(operand.label, operand.imm, kind, size);
+}
+
+void Encoder::rex(bool wide, RegId reg, RegId index, RegId base, bool force) {
+	const uint8_t value = (wide << 3) | (is_extended(reg) << 2) | (is_extended(index) << 1) | is_extended(base);
+	if (!value && !force) return;
+	assert(m_target == Target::X86_64, "64 bit registers used on x86");
+	byte(0x40 | value);
+}
+
+void Encoder::rm(std::initializer_list<uint8_t> opcode, uint8_t size, RegId reg, uint8_t extension, const Operand& operand,
+	bool default_64, bool byte_regs) {
+	if (size == 2) byte(0x66);
+	const auto base = operand.is_reg() || operand.is_mem() ? operand.reg : no_reg;
+	const auto index = operand.is_mem() ? operand.index : no_reg;
+	// movzx only has a byte register on the right
+	const bool force = byte_regs && ((reg != no_reg && size == 1 && needs_rex_as_byte(reg))
+		|| (operand.is_reg() && operand.size == 1 && needs_rex_as_byte(operand.reg)));
+	rex(size == 8 && !default_64, reg, index, base, force);
+	bytes(opcode);
+	modrm(reg != no_reg ? reg & 7 : extension, operand);
+}
+
+void Encoder::modrm(uint8_t reg_field, const Operand& operand) {
+	reg_field <<= 3;
+	if (operand.is_reg()) {
+		byte(0xC0 | reg_field | (operand.reg & 7));
+		return;
+	}
+	assert(operand.is_mem(), "expected a register or memory operand");
+	const auto base = operand.reg;
+	const auto index = operand.index;
+	const bool has_symbol = !operand.label.empty();
+	const auto displacement = [&](RelocKind kind) {
+		if (has_symbol)
+			field(operand.label, operand.imm, kind, 4);
+		else
+			immediate(operand.imm, 4);
+	};
+	const auto scale_bits = [&] {
+		switch (operand.scale) {
+			case 1: return 0;
+			case 2: return 1;
+			case 4: return 2;
+			case 8: return 3;
+		}
+		unhandled("memory operand scale");
+	};
+
+	if (base == no_reg && index == no_reg) {
+		if (m_target == Target::X86_64 && has_symbol) {
+			// rip relative
+			byte(0x05 | reg_field);
+			displacement(RelocKind::Rel32);
+		} else if (m_target == Target::X86_64) {
+			// [disp32] means rip relative on x86_64, an absolute address needs a sib byte
+			byte(0x04 | reg_field);
+			byte(0x25);
+			displacement(RelocKind::Abs32Signed);
+		} else {
+			byte(0x05 | reg_field);
+			displacement(RelocKind::Abs32);
+		}
+		return;
+	}
+	const auto absolute = m_target == Target::X86_64 ? RelocKind::Abs32Signed : RelocKind::Abs32;
+	if (base == no_reg) {
+		// index only, which always has a 32 bit displacement
+		byte(0x04 | reg_field);
+		byte((scale_bits() << 6) | ((index & 7) << 3) | 0x05);
+		displacement(absolute);
+		return;
+	}
+
+	uint8_t mod;
+	// ebp and r13 as a base with no displacement encode rip or disp32 instead
+	if (!has_symbol && operand.imm == 0 && (base & 7) != 5)
+		mod = 0x00;
+	else if (!has_symbol && fits_i8(operand.imm))
+		mod = 0x40;
+	else
+		mod = 0x80;
+
+	// esp and r12 as a base always need a sib byte
+	if (index != no_reg || (base & 7) == 4) {
+		assert(index != reg_id(Reg::Sp), "esp can't be an index");
+		byte(mod | reg_field | 0x04);
+		byte((scale_bits() << 6) | ((index != no_reg ? index & 7 : 4) << 3) | (base & 7));
+	} else {
+		byte(mod | reg_field | (base & 7));
+	}
+	if (mod == 0x40)
+		immediate(operand.imm, 1);
+	else if (mod == 0x80)
+		displacement(absolute);
+}
+
+void Encoder::short_reg(uint8_t opcode, uint8_t size, RegId reg, bool default_64) {
+	if (size == 2) byte(0x66);
+	rex(size == 8 && !default_64, no_reg, no_reg, reg, size == 1 && needs_rex_as_byte(reg));
+	byte(opcode + (reg & 7));
+}
+
+void Encoder::alu(uint8_t extension, const Instr& instr) {
+	const auto& dst = instr.operands[0];
+	const auto& src = instr.operands[1];
+	const auto size = dst.size;
+	const uint8_t wide = size != 1;
+	if (src.is_imm()) {
+		const auto imm_size = size == 1 ? 1 : 4;
+		if (size != 1 && src.label.empty() && fits_i8(src.imm)) {
+			rm({ 0x83 }, size, no_reg, extension, dst);
+			immediate(src.imm, 1);
+		} else if (dst.is_reg(reg_id(Reg::Ax))) {
+			// short form for the accumulator
+			if (size == 2) byte(0x66);
+			rex(size == 8, no_reg, no_reg, no_reg, false);
+			byte(static_cast<uint8_t>(extension * 8 + 4 + wide));
+			immediate(src, imm_size, RelocKind::Abs32Signed);
+		} else {
+			rm({ static_cast<uint8_t>(0x80 + wide) }, size, no_reg, extension, dst, false, size == 1);
+			immediate(src, imm_size, m_target == Target::X86_64 ? RelocKind::Abs32Signed : RelocKind::Abs32);
+		}
+	} else if (src.is_reg()) {
+		rm({ static_cast<uint8_t>(extension * 8 + wide) }, size, src.reg, 0, dst, false, size == 1);
+	} else {
+		rm({ static_cast<uint8_t>(extension * 8 + 2 + wide) }, size, dst.reg, 0, src, false, size == 1);
+	}
+}
+
+void Encoder::simd(uint8_t prefix, uint8_t map, uint8_t opcode, RegId reg, uint8_t extension, const Operand& rm,
+	bool vex, RegId vvvv, bool ymm) {
+	auto operand = rm;
+	if (operand.is_reg()) operand.reg = hardware_reg(operand.reg);
+	reg = hardware_reg(reg);
+	vvvv = hardware_reg(vvvv);
+	const auto base = operand.is_reg() || operand.is_mem() ? operand.reg : no_reg;
+	const auto index = operand.is_mem() ? operand.index : no_reg;
+	if (!vex) {
+		if (prefix) byte(prefix);
+		rex(false, reg, index, base, false);
+		byte(0x0F);
+		if (map == 2) byte(0x38);
+		if (map == 3) byte(0x3A);
+	} else {
+		assert(m_target == Target::X86_64 || (!is_extended(reg) && !is_extended(base) && !is_extended(vvvv)),
+			"64 bit registers used on x86");
+		const uint8_t pp = prefix == 0x66 ? 1 : prefix == 0xF3 ? 2 : prefix == 0xF2 ? 3 : 0;
+		// the register fields are stored inverted
+		const uint8_t last = static_cast<uint8_t>((~(vvvv != no_reg ? vvvv : 0) & 15) << 3 | (ymm << 2) | pp);
+		if (map == 1 && !is_extended(index) && !is_extended(base)) {
+			byte(0xC5);
+			byte(static_cast<uint8_t>(!is_extended(reg) << 7 | last));
+		} else {
+			byte(0xC4);
+			byte(static_cast<uint8_t>(!is_extended(reg) << 7 | !is_extended(index) << 6 | !is_extended(base) << 5 | map));
+			byte(last);
+		}
+	}
+	byte(opcode);
+	modrm(reg != no_reg ? reg & 7 : extension, operand);
+}
+
+void Encoder::encode(const Instr& instr) {
+	const auto& ops = instr.operands;
+	const auto absolute_imm = m_target == Target::X86_64 ? RelocKind::Abs32Signed : RelocKind::Abs32;
+	assert(operand_sizes_match(instr), "operand sizes don't match");
+	switch (instr.op) {
+		case Op::Label:
+			break;
+		case Op::Mov: {
+			const auto& dst = ops[0];
+			const auto& src = ops[1];
+			const auto size = dst.size;
+			// movdqu
+			if (size >= 16) {
+				if (dst.is_reg())
+					simd(0xF3, 1, 0x6F, dst.reg, 0, src, instr.vex, no_reg, size == 32);
+				else
+					simd(0xF3, 1, 0x7F, src.reg, 0, dst, instr.vex, no_reg, size == 32);
+				break;
+			}
+			const uint8_t wide = size != 1;
+			if (src.is_imm()) {
+				if (dst.is_reg() && size == 8 && src.label.empty() && !fits_i32(src.imm)) {
+					short_reg(0xB8, size, dst.reg);
+					immediate(src.imm, 8);
+				} else if (dst.is_reg() && size != 8) {
+					short_reg(size == 1 ? 0xB0 : 0xB8, size, dst.reg);
+					immediate(src, size == 1 ? 1 : size, RelocKind::Abs32);
+				} else {
+					rm({ static_cast<uint8_t>(0xC6 + wide) }, size, no_reg, 0, dst);
+					immediate(src, size == 1 ? 1 : size == 2 ? 2 : 4, absolute_imm);
+				}
+			} else if (src.is_reg()) {
+				rm({ static_cast<uint8_t>(0x88 + wide) }, size, src.reg, 0, dst, false, size == 1);
+			} else {
+				rm({ static_cast<uint8_t>(0x8A + wide) }, size, dst.reg, 0, src, false, size == 1);
+			}
+			break;
+		}
+		case Op::Movzx:
+			rm({ 0x0F, static_cast<uint8_t>(ops[1].size == 2 ? 0xB7 : 0xB6) }, ops[0].size, ops[0].reg, 0, ops[1], false, true);
+			break;
+		case Op::Lea:
+			rm({ 0x8D }, ops[0].size, ops[0].reg, 0, ops[1]);
+			break;
+		case Op::Add: alu(0, instr); break;
+		case Op::Or: alu(1, instr); break;
+		case Op::And: alu(4, instr); break;
+		case Op::Sub: alu(5, instr); break;
+		case Op::Xor: alu(6, instr); break;
+		case Op::Cmp: alu(7, instr); break;
+		case Op::Imul:
+			if (ops.size() == 1) {
+				rm({ 0xF7 }, ops[0].size, no_reg, 5, ops[0]);
+			} else if (ops.size() == 3) {
+				const bool small = ops[2].label.empty() && fits_i8(ops[2].imm);
+				rm({ static_cast<uint8_t>(small ? 0x6B : 0x69) }, ops[0].size, ops[0].reg, 0, ops[1]);
+				immediate(ops[2], small ? 1 : 4, absolute_imm);
+			} else {
+				rm({ 0x0F, 0xAF }, ops[0].size, ops[0].reg, 0, ops[1]);
+			}
+			break;
+		case Op::Neg:
+			rm({ static_cast<uint8_t>(ops[0].size == 1 ? 0xF6 : 0xF7) }, ops[0].size, no_reg, 3, ops[0], false, ops[0].size == 1);
+			break;
+		case Op::Not:
+			rm({ static_cast<uint8_t>(ops[0].size == 1 ? 0xF6 : 0xF7) }, ops[0].size, no_reg, 2, ops[0], false, ops[0].size == 1);
+			break;
+		case Op::Inc:
+		case Op::Dec:
+			rm({ static_cast<uint8_t>(ops[0].size == 1 ? 0xFE : 0xFF) }, ops[0].size, no_reg, instr.op == Op::Dec, ops[0], false, ops[0].size == 1);
+			break;
+		case Op::Shl:
+		case Op::Shr:
+		case Op::Sar:
+		case Op::Rol:
+		case Op::Ror: {
+			const auto extension = [&]() -> uint8_t {
+				switch (instr.op) {
+					case Op::Rol: return 0;
+					case Op::Ror: return 1;
+					case Op::Shl: return 4;
+					case Op::Shr: return 5;
+					default: return 7;
+				}
+			}();
+			const uint8_t wide = ops[0].size != 1;
+			// by cl
+			if (ops[1].is_reg()) {
+				rm({ static_cast<uint8_t>(0xD2 + wide) }, ops[0].size, no_reg, extension, ops[0], false, ops[0].size == 1);
+			} else if (ops[1].imm == 1) {
+				rm({ static_cast<uint8_t>(0xD0 + wide) }, ops[0].size, no_reg, extension, ops[0], false, ops[0].size == 1);
+			} else {
+				rm({ static_cast<uint8_t>(0xC0 + wide) }, ops[0].size, no_reg, extension, ops[0], false, ops[0].size == 1);
+				immediate(ops[1].imm, 1);
+			}
+			break;
+		}
+		case Op::Idiv:
+			rm({ static_cast<uint8_t>(ops[0].size == 1 ? 0xF6 : 0xF7) }, ops[0].size, no_reg, 7, ops[0], false, ops[0].size == 1);
+			break;
+		case Op::Test: {
+			const auto size = ops[0].size;
+			const uint8_t wide = size != 1;
+			if (ops[1].is_imm()) {
+				if (ops[0].is_reg(reg_id(Reg::Ax))) {
+					if (size == 2) byte(0x66);
+					rex(size == 8, no_reg, no_reg, no_reg, false);
+					byte(0xA8 + wide);
+				} else {
+					rm({ static_cast<uint8_t>(0xF6 + wide) }, size, no_reg, 0, ops[0], false, size == 1);
+				}
+				immediate(ops[1], size == 1 ? 1 : 4, absolute_imm);
+			} else {
+				rm({ static_cast<uint8_t>(0x84 + wide) }, size, ops[1].reg, 0, ops[0], false, size == 1);
+			}
+			break;
+		}
+		case Op::Bt:
+			rm({ 0x0F, 0xA3 }, ops[0].size, ops[1].reg, 0, ops[0]);
+			break;
+		case Op::Popcnt:
+		case Op::Lzcnt:
+		case Op::Tzcnt:
+			// the prefix has to go before rex
+			byte(0xF3);
+			[[fallthrough]];
+		case Op::Bsr:
+		case Op::Bsf: {
+			const uint8_t opcode = instr.op == Op::Popcnt ? 0xB8 : instr.op == Op::Lzcnt || instr.op == Op::Bsr ? 0xBD : 0xBC;
+			rm({ 0x0F, opcode }, ops[0].size, ops[0].reg, 0, ops[1]);
+			break;
+		}
+		case Op::Bswap:
+			rex(ops[0].size == 8, no_reg, no_reg, ops[0].reg, false);
+			bytes({ 0x0F, static_cast<uint8_t>(0xC8 + (ops[0].reg & 7)) });
+			break;
+		case Op::Setcc:
+			rm({ 0x0F, static_cast<uint8_t>(0x90 + cond_code(instr.cond)) }, 1, no_reg, 0, ops[0], false, true);
+			break;
+		case Op::Cdq:
+			// cqo with a 64 bit operand
+			if (!ops.empty() && ops[0].size == 8) rex(true, no_reg, no_reg, no_reg, false);
+			byte(0x99);
+			break;
+		case Op::Push:
+			if (ops[0].is_reg()) {
+				short_reg(0x50, ops[0].size, ops[0].reg, true);
+			} else if (ops[0].is_imm()) {
+				const bool small = ops[0].label.empty() && fits_i8(ops[0].imm);
+				byte(small ? 0x6A : 0x68);
+				immediate(ops[0], small ? 1 : 4, absolute_imm);
+			} else {
+				rm({ 0xFF }, ops[0].size, no_reg, 6, ops[0], true);
+			}
+			break;
+		case Op::Pop:
+			if (ops[0].is_reg())
+				short_reg(0x58, ops[0].size, ops[0].reg, true);
+			else
+				rm({ 0x8F }, ops[0].size, no_reg, 0, ops[0], true);
+			break;
+		case Op::Jmp:
+		case Op::Jcc:
+			if (ops[0].kind == Operand::Kind::Label) {
+				m_chunk.is_branch = true;
+				m_chunk.cond = instr.op == Op::Jcc ? instr.cond : Cond::None;
+				m_chunk.target = ops[0].label;
+			} else {
+				assert(instr.op == Op::Jmp, "conditional jumps need a label");
+				rm({ 0xFF }, m_target == Target::X86_64 ? 8 : 4, no_reg, 4, ops[0], true);
+			}
+			break;
+		case Op::Call:
+			if (ops[0].kind == Operand::Kind::Label) {
+				byte(0xE8);
+				field(ops[0].label, 0, RelocKind::Rel32, 4);
+			} else {
+				rm({ 0xFF }, m_target == Target::X86_64 ? 8 : 4, no_reg, 2, ops[0], true);
+			}
+			break;
+		case Op::Ret:
+			// with the number of argument bytes to pop
+			if (ops.empty()) {
+				byte(0xC3);
+			} else {
+				byte(0xC2);
+				immediate(ops[0].imm, 2);
+			}
+			break;
+		case Op::Int:
+			byte(0xCD);
+			immediate(ops[0].imm, 1);
+			break;
+		case Op::Syscall:
+			bytes({ 0x0F, 0x05 });
+			break;
+		case Op::Ud2:
+			bytes({ 0x0F, 0x0B });
+			break;
+		case Op::Rdtsc:
+			bytes({ 0x0F, 0x31 });
+			break;
+		case Op::Pause:
+			bytes({ 0xF3, 0x90 });
+			break;
+		case Op::Cmov:
+			rm({ 0x0F, static_cast<uint8_t>(0x40 + cond_code(instr.cond)) }, ops[0].size, ops[0].reg, 0, ops[1]);
+			break;
+		case Op::Movd:
+			if (ops[0].is_reg() && is_vector_reg(ops[0].reg))
+				simd(0x66, 1, 0x6E, ops[0].reg, 0, ops[1], instr.vex);
+			else
+				simd(0x66, 1, 0x7E, ops[1].reg, 0, ops[0], instr.vex);
+			break;
+		// two operand forms, with vex taking the destination as the first source too
+		case Op::Paddd:
+		case Op::Psubd:
+		case Op::Pmulld:
+		case Op::Pmuludq:
+		case Op::Pand:
+		case Op::Pandn:
+		case Op::Por:
+		case Op::Pxor:
+		case Op::Pcmpeqd:
+		case Op::Pcmpgtd:
+		case Op::Punpckldq: {
+			const auto opcode = [&]() -> uint8_t {
+				switch (instr.op) {
+					case Op::Paddd: return 0xFE;
+					case Op::Psubd: return 0xFA;
+					case Op::Pmulld: return 0x40;
+					case Op::Pmuludq: return 0xF4;
+					case Op::Pand: return 0xDB;
+					case Op::Pandn: return 0xDF;
+					case Op::Por: return 0xEB;
+					case Op::Pxor: return 0xEF;
+					case Op::Pcmpeqd: return 0x76;
+					case Op::Pcmpgtd: return 0x66;
+					default: return 0x62;
+				}
+			}();
+			simd(0x66, instr.op == Op::Pmulld ? 2 : 1, opcode, ops[0].reg, 0, ops[1], instr.vex, ops[0].reg, ops[0].size == 32);
+			break;
+		}
+		case Op::Pshufd:
+			simd(0x66, 1, 0x70, ops[0].reg, 0, ops[1], instr.vex, no_reg, ops[0].size == 32);
+			immediate(ops[2].imm, 1);
+			break;
+		case Op::Vpbroadcastd:
+			simd(0x66, 2, 0x58, ops[0].reg, 0, ops[1], true, no_reg, ops[0].size == 32);
+			break;
+		case Op::Vextracti128:
+			simd(0x66, 3, 0x39, ops[1].reg, 0, ops[0], true, no_reg, true);
+			immediate(ops[2].imm, 1);
+			break;
+		case Op::Vzeroupper:
+			bytes({ 0xC5, 0xF8, 0x77 });
+			break;
+	}
+	for (auto& fixup : m_chunk.fixups)
+		fixup.pc_distance = static_cast<uint8_t>(m_chunk.bytes.size() - fixup.offset);
+}
+
+static void write_le(std::vector<uint8_t>& bytes, size_t offset, int64_t value, uint8_t size) {
+	for (uint8_t i = 0; i < size; ++i)
+		bytes[offset + i] = static_cast<uint8_t>(static_cast<uint64_t>(value) >> (i * 8));
+}
+
+// the table a jmp goes through, as an address per entry in the data section
+static void add_jump_table(ObjectCode& object, const Instr& jump) {
+	const auto entry_size = object.target == Target::X86_64 ? 8 : 4;
+	object.data.resize((object.data.size() + entry_size - 1) / entry_size * entry_size);
+	object.symbols[jump.operands[0].label] = Symbol { SectionId::Data, object.data.size() };
+	for (const auto& target : jump.targets) {
+		object.relocations.push_back(Relocation {
+			SectionId::Data, object.data.size(), target, 0, entry_size == 8 ? RelocKind::Abs64 : RelocKind::Abs32
+		});
+		object.data.resize(object.data.size() + entry_size);
+	}
+}
+
+ObjectCode assemble(Target target, const std::vector<MachineFunction>& functions, const std::vector<std::string>& data,
+	const std::vector<Global>& globals) {
+	ObjectCode object { .target = target };
+	for (size_t i = 0; i < data.size(); ++i) {
+		const auto name = format("data_{}", i);
+		object.symbols[name] = Symbol { SectionId::Data, object.data.size() };
+		object.data.insert(object.data.end(), data[i].begin(), data[i].end());
+	}
+	for (const auto& global : globals) {
+		object.bss_size = (object.bss_size + 7) / 8 * 8;
+		object.symbols[global.name] = Symbol { SectionId::Bss, object.bss_size };
+		object.bss_size += global.size;
+	}
+
+	std::vector<Chunk> chunks;
+	// label -> index of the chunk it points at
+	std::unordered_map<std::string, size_t> labels;
+	for (const auto& function : functions) {
+		labels[function.name] = chunks.size();
+		object.symbol_order.push_back(function.name);
+		for (const auto& instr : function.code) {
+			if (instr.op == Op::Label) {
+				labels[instr.operands[0].label] = chunks.size();
+				continue;
+			}
+			Encoder(target, chunks.emplace_back()).encode(instr);
+			if (!instr.targets.empty())
+				add_jump_table(object, instr);
+		}
+	}
+
+	// start with every branch short and grow the ones that don't reach until nothing changes.
+	// branches only ever grow, so this terminates
+	std::vector<size_t> offsets(chunks.size() + 1);
+	const auto layout = [&] {
+		size_t offset = 0;
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			offsets[i] = offset;
+			offset += chunks[i].size();
+		}
+		offsets[chunks.size()] = offset;
+	};
+	const auto branch_displacement = [&](size_t i) {
+		return static_cast<int64_t>(offsets[labels.at(chunks[i].target)]) - static_cast<int64_t>(offsets[i] + chunks[i].size());
+	};
+	for (bool changed = true; changed;) {
+		layout();
+		changed = false;
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			auto& chunk = chunks[i];
+			if (!chunk.is_branch || chunk.long_branch) continue;
+			if (!labels.count(chunk.target) || !fits_i8(branch_displacement(i))) {
+				chunk.long_branch = true;
+				changed = true;
+			}
+		}
+	}
+
+	auto& text = object.text;
+	text.reserve(offsets.back());
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		auto& chunk = chunks[i];
+		if (chunk.is_branch) {
+			const bool internal = labels.count(chunk.target) != 0;
+			if (chunk.cond == Cond::None)
+				text.push_back(chunk.long_branch ? 0xE9 : 0xEB);
+			else if (chunk.long_branch)
+				text.insert(text.end(), { 0x0F, static_cast<uint8_t>(0x80 + cond_code(chunk.cond)) });
+			else
+				text.push_back(static_cast<uint8_t>(0x70 + cond_code(chunk.cond)));
+			const auto size = chunk.long_branch ? 4 : 1;
+			const auto field_offset = text.size();
+			text.resize(text.size() + size);
+			if (internal)
+				write_le(text, field_offset, branch_displacement(i), size);
+			else
+				object.relocations.push_back(Relocation { SectionId::Text, field_offset, chunk.target, 0, RelocKind::Rel32 });
+			continue;
+		}
+		const auto start = text.size();
+		text.insert(text.end(), chunk.bytes.begin(), chunk.bytes.end());
+		for (auto& fixup : chunk.fixups) {
+			const auto position = start + fixup.offset;
+			const auto label = labels.find(fixup.symbol);
+			if (fixup.kind == RelocKind::Rel32 && label != labels.end()) {
+				const auto value = static_cast<int64_t>(offsets[label->second]) + fixup.addend
+					- static_cast<int64_t>(position + fixup.pc_distance);
+				write_le(text, position, value, 4);
+			} else {
+				object.relocations.push_back(Relocation {
+					SectionId::Text, position, std::move(fixup.symbol), fixup.addend, fixup.kind, fixup.pc_distance
+				});
+			}
+		}
+	}
+
+	for (const auto& [label, index] : labels)
+		object.symbols[label] = Symbol { SectionId::Text, offsets[index] };
+	for (const auto& function : functions) {
+		auto& symbol = object.symbols[function.name];
+		symbol.function = true;
+		symbol.global = function.global;
+	}
+	return object;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "x86.hpp"
+#include <unordered_map>
+
+enum class SectionId : uint8_t {
+	Text,
+	Data,
+	// zeroed when the program starts, so it takes no space in the file
+	Bss,
+};
+
+struct Symbol {
+	SectionId section;
+	uint64_t offset;
+	// functions are the only symbols that make it into the object file,
+	// the rest are labels that only matter for relocations
+	bool function = false;
+	bool global = false;
+};
+
+enum class RelocKind : uint8_t {
+	// 32 bit, relative to the end of the instruction
+	Rel32,
+	// 32 bit absolute address, zero extended on x86_64
+	Abs32,
+	// 32 bit absolute address, sign extended on x86_64
+	Abs32Signed,
+	Abs64,
+};
+
+// a field that needs the address of a symbol filled in
+struct Relocation {
+	SectionId section;
+	uint64_t offset;
+	std::string symbol;
+	int64_t addend;
+	RelocKind kind;
+	// Rel32 only, the field is relative to section offset + offset + pc_distance
+	uint8_t pc_distance = 4;
+};
+
+// machine code for a whole program, before getting placed at an address
+struct ObjectCode {
+	Target target;
+	std::vector<uint8_t> text;
+	std::vector<uint8_t> data;
+	size_t bss_size = 0;
+	std::unordered_map<std::string, Symbol> symbols;
+	// in the order they were defined, for the symbol table
+	std::vector<std::string> symbol_order;
+	// anything that couldn't be resolved without knowing where sections end up
+	std::vector<Relocation> relocations;
+};
+
+// encodes the functions into x86 machine code. jumps between labels are resolved here,
+// choosing the short encoding whenever the target is in range
+ObjectCode assemble(Target target, const std::vector<MachineFunction>& functions, const std::vector<std::string>& data,
+	const std::vector<Global>& globals = {});
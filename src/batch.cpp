@@ -0,0 +1,117 @@
+#include "batch.hpp"
+#include "enums.hpp"
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <thread>
+
+using Value = Evaluator::Value;
+
+// splits a record line into its arguments, checking them against main's signature
+static bool parse_record(const std::string& line, const Function& main, std::vector<Value>& args, std::string& error) {
+	size_t pos = 0;
+	const auto skip_separators = [&] {
+		while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t' || line[pos] == ',' || line[pos] == '\r'))
+			++pos;
+	};
+	skip_separators();
+	while (pos < line.size()) {
+		const auto start = pos;
+		while (pos < line.size() && line[pos] != ' ' && line[pos] != '\t' && line[pos] != ',' && line[pos] != '\r')
+			++pos;
+		const std::string_view field(line.data() + start, pos - start);
+		skip_separators();
+
+		if (args.size() == main.arguments.size()) {
+			error = format("expected {} arguments", main.arguments.size());
+			return false;
+		}
+		const auto& type = main.arguments[args.size()].type;
+		if (type.name == "i32") {
+			int value = 0;
+			const auto [end, ec] = std::from_chars(field.data(), field.data() + field.size(), value);
+			if (ec != std::errc() || end != field.data() + field.size()) {
+				error = format("invalid i32 \"{}\"", field);
+				return false;
+			}
+			args.push_back(Value { type, value });
+		} else if (type.name == "bool") {
+			if (field != "true" && field != "false") {
+				error = format("invalid bool \"{}\"", field);
+				return false;
+			}
+			args.push_back(Value { type, field == "true" });
+		} else {
+			error = format("main argument type {} can't be read from input", type);
+			return false;
+		}
+	}
+	if (args.size() != main.arguments.size()) {
+		error = format("expected {} arguments, got {}", main.arguments.size(), args.size());
+		return false;
+	}
+	return true;
+}
+
+int run_batch(Parser& parser, std::istream& input, std::ostream& output, size_t thread_count, const EvalLimits& limits) {
+	const auto main_it = std::find_if(parser.m_functions.begin(), parser.m_functions.end(),
+		[](const auto& function) { return function.name == "main"; });
+	if (main_it == parser.m_functions.end()) {
+		print("[error] main not found\n");
+		return 1;
+	}
+
+	std::vector<std::vector<Value>> records;
+	std::string line;
+	std::string error;
+	for (size_t line_number = 1; std::getline(input, line); ++line_number) {
+		auto& args = records.emplace_back();
+		if (!parse_record(line, *main_it, args, error)) {
+			print("[error] batch record {}: {}\n", line_number, error);
+			return 1;
+		}
+	}
+
+	thread_count = std::clamp<size_t>(thread_count, 1, std::max<size_t>(records.size(), 1));
+	const auto start_time = std::chrono::steady_clock::now();
+
+	// records are handed out in small chunks so uneven run times still balance out
+	static constexpr size_t chunk_size = 64;
+	std::vector<std::string> results(records.size());
+	std::atomic<size_t> next_record = 0;
+	const auto match_tables = Evaluator::match_tables(parser);
+	const auto worker = [&] {
+		while (true) {
+			const auto first = next_record.fetch_add(chunk_size, std::memory_order_relaxed);
+			if (first >= records.size()) break;
+			const auto last = std::min(first + chunk_size, records.size());
+			for (size_t i = first; i < last; ++i) {
+				std::stringstream stream;
+				Evaluator evaluator(parser, stream, limits, &match_tables);
+				const auto result = evaluator.run(std::move(records[i]));
+				if (result.status == EvalStatus::Ok)
+					stream << result.value << '\n';
+				else
+					stream << "error: " << result.status << '\n';
+				results[i] = stream.str();
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < thread_count; ++i)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads)
+		thread.join();
+
+	const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+	for (const auto& result : results)
+		output << result;
+	output.flush();
+
+	format_to(std::cerr, "Batch: {} records in {}s on {} threads ({} records/s)\n",
+		records.size(), elapsed, thread_count, elapsed > 0 ? static_cast<size_t>(records.size() / elapsed) : 0);
+	return 0;
+}
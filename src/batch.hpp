@@ -0,0 +1,9 @@
+#pragma once
+#include "parser.hpp"
+#include "evaluator.hpp"
+
+// Runs main once per input record, where each line of input is an argument tuple
+// like `3, true`. Records are evaluated across thread_count threads sharing the
+// same checked AST and match tables, and results are written to output in input order.
+// The limits apply to each record separately, a record that hits them reports an error line.
+int run_batch(Parser& parser, std::istream& input, std::ostream& output, size_t thread_count, const EvalLimits& limits);
@@ -1,24 +1,141 @@
 #include "checker.hpp"
 #include "format.hpp"
 #include "enums.hpp"
+#include "intrinsics.hpp"
+#include "layout.hpp"
 
-TypeChecker::TypeChecker(Parser& parser) : m_parser(parser) {
+TypeChecker::TypeChecker(Parser& parser, std::optional<Target> target) : m_parser(parser), m_target(target) {
 
 }
 
 void TypeChecker::check() {
+	check_structs();
 	for (auto& function : m_parser.m_functions) {
 		check_function(function);
 	}
 }
 
+void TypeChecker::check_structs() {
+	auto& structs = m_parser.m_structs;
+	for (const auto& s : structs) {
+		if (s.name == "i32" || s.name == "bool" || s.name == "void")
+			error_at(s.span, format("Struct can't be called {}", s.name));
+		if (m_parser.find_struct(s.name) != &s)
+			error_at(s.span, format("Struct {} already exists", s.name));
+	}
+	enum class State : uint8_t { Waiting, Visiting, Done };
+	std::vector<State> states(structs.size());
+	const auto lay_out = [&](const auto& self, size_t index) -> void {
+		auto& s = structs[index];
+		if (states[index] == State::Done) return;
+		if (states[index] == State::Visiting)
+			error_at(s.span, format("Struct {} contains itself", s.name));
+		states[index] = State::Visiting;
+		for (size_t i = 0; i < s.fields.size(); ++i) {
+			const auto& field = s.fields[i];
+			for (size_t j = 0; j < i; ++j)
+				if (s.fields[j].name == field.name)
+					error_at(s.span, format("Struct {} already has a field {}", s.name, field.name));
+			const auto* inner = m_parser.find_struct(field.type.name);
+			if (field.type.is_pointer()) {
+				if (!inner)
+					error_at(s.span, format("Field {} can only point to a struct, not {}", field.name, field.type.name));
+				// they're different sizes on different targets
+				if (s.layout == StructLayout::Packed)
+					error_at(s.span, format("Packed struct {} can't have pointers", s.name));
+				// pointing to itself is fine, it doesn't need to be laid out first
+				continue;
+			}
+			if (field.type.name == "i32" || field.type.name == "bool") continue;
+			if (!inner)
+				error_at(s.span, format("Unknown type {} for field {}", field.type, field.name));
+			self(self, static_cast<size_t>(inner - structs.data()));
+		}
+		lay_out_struct(s, m_parser);
+		states[index] = State::Done;
+	};
+	for (size_t i = 0; i < structs.size(); ++i)
+		lay_out(lay_out, i);
+}
+
+const Struct* TypeChecker::struct_of(const Type& type) const {
+	if (type.is_array() || type.is_slice() || type.is_pointer()) return nullptr;
+	return m_parser.find_struct(type.name);
+}
+
 void TypeChecker::check_function(Function& function) {
 	if (function.builtin) return;
+	if (find_intrinsic(function.name))
+		error_at(function.span, format("{} is an intrinsic", function.name));
+	if (function.external) {
+		check_extern(function);
+		return;
+	}
+	if (function.constant) {
+		const auto scalar = [](const Type& type) { return type == Type { "i32" } || type == Type { "bool" }; };
+		for (const auto& argument : function.arguments)
+			if (!scalar(argument.type))
+				error_at(function.span, format("const fn {} can only take i32s and bools, not {}", function.name, argument.type));
+		if (!scalar(function.return_type))
+			error_at(function.span, format("const fn {} has to return an i32 or a bool", function.name));
+	}
+	// only --batch has anything to give them, _start doesn't
+	if (m_target && function.name == "main" && !function.arguments.empty())
+		error_at(function.span, "main can only take arguments when evaluated with --batch");
+	m_constants.clear();
 	for (auto& stmt : function.statements) {
 		check_statement(stmt, function);
 	}
 }
 
+void TypeChecker::check_extern(const Function& function) const {
+	if (function.name == "main")
+		error_at(function.span, "main can't be extern");
+	const auto& funcs = m_parser.m_functions;
+	const auto same_name = std::count_if(funcs.begin(), funcs.end(), [&](const Function& f) { return f.name == function.name; });
+	if (same_name > 1)
+		error_at(function.span, format("Function {} already exists", function.name));
+	for (const auto& argument : function.arguments) {
+		if (struct_of(argument.type))
+			error_at(function.span, format("Extern functions can't take structs, pass a pointer to {} instead", argument.type));
+	}
+	if (struct_of(function.return_type))
+		error_at(function.span, "Extern functions can't return structs");
+}
+
+bool TypeChecker::is_constant(const Expression& expression) const {
+	const auto all_constant = [&] {
+		return std::all_of(expression.children.begin(), expression.children.end(), [&](const auto& child) { return is_constant(child); });
+	};
+	switch (expression.type) {
+		case ExpressionType::Literal:
+			return true;
+		case ExpressionType::Cast:
+		case ExpressionType::Operator:
+			return all_constant();
+		case ExpressionType::Variable: {
+			const auto& name = std::get<Expression::VariableData>(expression.data).name;
+			return std::find(m_constants.begin(), m_constants.end(), name) != m_constants.end();
+		}
+		case ExpressionType::Call: {
+			// len is fine in const fns, but there's never a constant array for it to take
+			const auto& name = std::get<Expression::CallData>(expression.data).function_name;
+			return name != "len" && is_const_callable(name) && all_constant();
+		}
+		default:
+			return false;
+	}
+}
+
+bool TypeChecker::is_const_callable(const std::string& name) const {
+	if (name == "len") return true;
+	if (const auto* intrinsic = find_intrinsic(name))
+		return is_pure(intrinsic->op);
+	const auto& funcs = m_parser.m_functions;
+	const auto it = std::find_if(funcs.begin(), funcs.end(), [&](const Function& f) { return f.name == name; });
+	return it != funcs.end() && it->constant;
+}
+
 void replace_with_cast(Expression& expression, const Type& type) {
 	Expression cast(ExpressionType::Cast);
 	cast.value_type = type;
@@ -27,6 +144,16 @@ void replace_with_cast(Expression& expression, const Type& type) {
 	expression = std::move(cast);
 }
 
+// arrays can be used as a slice of all of them
+static void array_to_slice(Expression& expression, const Type& type, const Type& expected) {
+	if (!expected.is_slice() || !type.is_array() || type.name != expected.name) return;
+	Expression slice(ExpressionType::Slice);
+	slice.value_type = expected.remove_reference();
+	slice.span = expression.span;
+	slice.children.push_back(std::move(expression));
+	expression = std::move(slice);
+}
+
 void TypeChecker::check_statement(Statement& stmt, Function& parent) {
 	if (stmt.type == StatementType::Return) {
 		if (parent.return_type.name == "void") {
@@ -44,11 +171,16 @@ void TypeChecker::check_statement(Statement& stmt, Function& parent) {
 				replace_with_cast(stmt.expressions[0], parent.return_type);
 		}
 	} else if (stmt.type == StatementType::Expression) {
+		const auto& expression = stmt.expressions[0];
+		if (expression.type == ExpressionType::Declaration && std::get<Expression::DeclarationData>(expression.data).constant)
+			error_at_exp(expression, format("Constant {} needs a value", std::get<Expression::DeclarationData>(expression.data).var.name));
 		check_expression(stmt.expressions[0], parent);
 	} else if (stmt.type == StatementType::If || stmt.type == StatementType::While) {
 		const auto type = check_expression(stmt.expressions[0], parent, Type { "bool" });
-		if (type != Type { "bool" })
+		if (!type.unref_eq(Type { "bool" }))
 			error_at_exp(stmt.expressions.front(), "Expected bool expression");
+		if (type.reference)
+			replace_with_cast(stmt.expressions[0], type.remove_reference());
 		// TODO: proper scopes
 		for (auto& child : stmt.children) {
 			check_statement(child, parent);
@@ -56,10 +188,53 @@ void TypeChecker::check_statement(Statement& stmt, Function& parent) {
 		if (stmt.else_branch) {
 			check_statement(*stmt.else_branch, parent);
 		}
+	} else if (stmt.type == StatementType::For) {
+		// the bounds come before the variable exists
+		for (size_t i = 1; i < 3; ++i) {
+			const auto type = check_expression(stmt.expressions[i], parent);
+			if (!type.unref_eq(Type { "i32" }))
+				error_at_exp(stmt.expressions[i], format("Expected i32 range bound, got {}", type.remove_reference()));
+			if (type.reference)
+				replace_with_cast(stmt.expressions[i], type.remove_reference());
+		}
+		check_expression(stmt.expressions[0], parent);
+		const auto& name = std::get<Expression::DeclarationData>(stmt.expressions[0].data).var.name;
+		m_loop_variables.push_back(name);
+		for (auto& child : stmt.children) {
+			check_statement(child, parent);
+		}
+		m_loop_variables.pop_back();
 	} else if (stmt.type == StatementType::Else) {
 		for (auto& child : stmt.children) {
 			check_statement(child, parent);
 		}
+	} else if (stmt.type == StatementType::Match) {
+		const auto type = check_expression(stmt.expressions[0], parent);
+		if (!type.unref_eq(Type { "i32" }) && !type.unref_eq(Type { "bool" }))
+			error_at_exp(stmt.expressions[0], format("Can't match on {}", type.remove_reference()));
+		if (type.reference)
+			replace_with_cast(stmt.expressions[0], type.remove_reference());
+		std::vector<std::variant<int, bool, std::string>> seen;
+		bool has_else = false;
+		for (auto& arm : stmt.children) {
+			if (arm.expressions.empty()) {
+				if (has_else)
+					error_at_stmt(arm, "Match already has an else case");
+				has_else = true;
+			}
+			for (auto& value : arm.expressions) {
+				const auto value_type = check_expression(value, parent);
+				if (!value_type.unref_eq(type))
+					error_at_exp(value, format("Type mismatch, expected {} got {}", type.remove_reference(), value_type));
+				const auto& literal = std::get<Expression::LiteralData>(value.data).value;
+				if (std::find(seen.begin(), seen.end(), literal) != seen.end())
+					error_at_exp(value, "Value already has a case");
+				seen.push_back(literal);
+			}
+			for (auto& child : arm.children) {
+				check_statement(child, parent);
+			}
+		}
 	} else {
 		error_at_stmt(stmt, format("what the heck {}", stmt.type));
 	}
@@ -83,6 +258,10 @@ Type TypeChecker::check_expression(Expression& expression, Function& parent, con
 
 			if (!lhs_type.unref_eq(rhs_type))
 				error_at_exp(expression, format("Types didnt match {} {}", lhs_type, rhs_type));
+			if (lhs_type.is_array() || lhs_type.is_slice() || struct_of(lhs_type))
+				error_at_exp(expression, format("Can't use {} in operators", lhs_type.remove_reference()));
+			if (lhs_type.is_pointer() && data.op_type != OperatorType::Equals && data.op_type != OperatorType::NotEquals)
+				error_at_exp(expression, format("Pointers can only be compared with == and !=, not {}", data.op_type));
 
 			if (lhs_type.reference)
 				replace_with_cast(expression.children[0], lhs_type.remove_reference());
@@ -90,7 +269,12 @@ Type TypeChecker::check_expression(Expression& expression, Function& parent, con
 			if (rhs_type.reference)
 				replace_with_cast(expression.children[1], rhs_type.remove_reference());
 			
-			if (data.op_type == OperatorType::Equals || data.op_type == OperatorType::NotEquals) {
+			if (is_operator_logical(data.op_type) && !lhs_type.unref_eq(Type { "bool" }))
+				error_at_exp(expression, format("Expected bool operands, got {}", lhs_type.remove_reference()));
+			if (is_operator_comparison(data.op_type)) {
+				const bool ordered = data.op_type != OperatorType::Equals && data.op_type != OperatorType::NotEquals;
+				if (ordered && !lhs_type.unref_eq(Type { "i32" }))
+					error_at_exp(expression, format("Can't order {}", lhs_type.remove_reference()));
 				return expression.value_type = Type { "bool" };
 			} else {
 				return expression.value_type = lhs_type.remove_reference();
@@ -100,9 +284,69 @@ Type TypeChecker::check_expression(Expression& expression, Function& parent, con
 		}
 	} else if (expression.type == ExpressionType::Call) {
 		const auto& data = std::get<Expression::CallData>(expression.data);
+		if (parent.constant && !is_const_callable(data.function_name))
+			error_at_exp(expression, format("const fn {} can't call {}, which isn't a const fn", parent.name, data.function_name));
 		// TODO: better way of having builtins..
 		if (data.function_name == "syscall") {
-			return Type { "i32" };
+			return expression.value_type = Type { "i32" };
+		}
+		if (data.function_name == "alloc") {
+			// alloc(S) gives a pointer to a new zeroed S, alloc(i32, n) a slice of n zeroed i32s
+			const auto count = expression.children.size();
+			if (count != 1 && count != 2)
+				error_at_exp(expression, "Incorrect number of arguments");
+			auto& type = expression.children[0];
+			if (type.type != ExpressionType::Variable)
+				error_at_exp(type, "Expected the type to allocate");
+			const auto& name = std::get<Expression::VariableData>(type.data).name;
+			if (count == 1) {
+				if (!m_parser.find_struct(name))
+					error_at_exp(type, format("Can only point to structs, not {}", name));
+				return expression.value_type = Type { .name = name, .pointer = true };
+			}
+			if (name != "i32")
+				error_at_exp(type, "Only i32 slices are supported");
+			const auto length_type = check_expression(expression.children[1], parent);
+			if (!length_type.unref_eq(Type { "i32" }))
+				error_at_exp(expression.children[1], format("Expected i32 length, got {}", length_type.remove_reference()));
+			if (length_type.reference)
+				replace_with_cast(expression.children[1], length_type.remove_reference());
+			return expression.value_type = Type { .name = name, .slice = true };
+		}
+		if (data.function_name == "free") {
+			if (expression.children.size() != 1)
+				error_at_exp(expression, "Incorrect number of arguments");
+			const auto type = check_expression(expression.children[0], parent);
+			if (!type.is_pointer())
+				error_at_exp(expression.children[0], format("Can't free {}", type.remove_reference()));
+			if (type.reference)
+				replace_with_cast(expression.children[0], type.remove_reference());
+			return expression.value_type = Type { "void" };
+		}
+		if (data.function_name == "reset") {
+			if (!expression.children.empty())
+				error_at_exp(expression, "Incorrect number of arguments");
+			return expression.value_type = Type { "void" };
+		}
+		if (const auto* intrinsic = find_intrinsic(data.function_name)) {
+			if (expression.children.size() != intrinsic->arg_count)
+				error_at_exp(expression, "Incorrect number of arguments");
+			for (auto& child : expression.children) {
+				const auto type = check_expression(child, parent, Type { "i32" });
+				if (!type.unref_eq(Type { "i32" }))
+					error_at_exp(child, format("Expected i32, got {}", type.remove_reference()));
+				if (type.reference)
+					replace_with_cast(child, type.remove_reference());
+			}
+			return expression.value_type = Type { intrinsic->returns ? "i32" : "void" };
+		}
+		if (data.function_name == "len") {
+			if (expression.children.size() != 1)
+				error_at_exp(expression, "Incorrect number of arguments");
+			const auto type = check_expression(expression.children[0], parent);
+			if (!type.is_array() && !type.is_slice())
+				error_at_exp(expression.children[0], format("Can't take the length of {}", type.remove_reference()));
+			return expression.value_type = Type { "i32" };
 		}
 		const auto& funcs = m_parser.m_functions;
 		const auto it = std::find_if(funcs.begin(), funcs.end(), 
@@ -115,7 +359,9 @@ Type TypeChecker::check_expression(Expression& expression, Function& parent, con
 			error_at_exp(expression, "Incorrect number of arguments");
 		for (size_t i = 0; i < function.arguments.size(); ++i) {
 			const auto arg_type = function.arguments[i].type;
-			const auto type = check_expression(expression.children[i], parent, arg_type);
+			auto type = check_expression(expression.children[i], parent, arg_type);
+			array_to_slice(expression.children[i], type, arg_type);
+			type = expression.children[i].value_type;
 			
 			if (type.reference) {
 				replace_with_cast(expression.children[i], type.remove_reference());
@@ -125,7 +371,7 @@ Type TypeChecker::check_expression(Expression& expression, Function& parent, con
 				error_at_exp(expression.children[i], format("Type mismatch, expected {} got {}", type, arg_type));
 			}
 		}
-		return function.return_type;
+		return expression.value_type = function.return_type;
 	} else if (expression.type == ExpressionType::Variable) {
 		const auto& data = std::get<Expression::VariableData>(expression.data);
 		const auto& vars = parent.scope.variables;
@@ -141,13 +387,45 @@ Type TypeChecker::check_expression(Expression& expression, Function& parent, con
 		}
 	} else if (expression.type == ExpressionType::Declaration) {
 		const auto& data = std::get<Expression::DeclarationData>(expression.data);
+		const auto& name = data.var.type.name;
+		if (data.var.type.is_pointer() && !m_parser.find_struct(name))
+			error_at_exp(expression, format("Can only point to structs, not {}", name));
+		if (name != "i32" && name != "bool" && !m_parser.find_struct(name))
+			error_at_exp(expression, format("Unknown type {}", name));
+		const auto& vars = parent.scope.variables;
+		if (std::find(m_constants.begin(), m_constants.end(), data.var.name) != m_constants.end())
+			error_at_exp(expression, format("{} is already a constant", data.var.name));
+		if (data.constant) {
+			if (data.var.type != Type { "i32" } && data.var.type != Type { "bool" })
+				error_at_exp(expression, format("Constants can only be i32s and bools, not {}", data.var.type));
+			const auto same_name = [&](const Variable& var) { return var.name == data.var.name; };
+			if (std::any_of(vars.begin(), vars.end(), same_name) || std::any_of(parent.arguments.begin(), parent.arguments.end(), same_name))
+				error_at_exp(expression, format("{} already exists", data.var.name));
+			m_constants.push_back(data.var.name);
+		}
 		parent.scope.variables.push_back(data.var);
 		return expression.value_type = data.var.type.add_reference();
 	} else if (expression.type == ExpressionType::Assignment) {
-		const auto rhs_type = check_expression(expression.children[1], parent);
+		auto rhs_type = check_expression(expression.children[1], parent);
 		const auto lhs_type = check_expression(expression.children[0], parent, rhs_type);
+		array_to_slice(expression.children[1], rhs_type, lhs_type);
+		rhs_type = expression.children[1].value_type;
 		if (!lhs_type.reference)
 			error_at_exp(expression.children[0], "Left hand side is not a reference");
+		if (lhs_type.is_array())
+			error_at_exp(expression.children[0], "Can't assign whole arrays");
+		if (expression.children[0].type == ExpressionType::Variable) {
+			const auto& name = std::get<Expression::VariableData>(expression.children[0].data).name;
+			if (std::find(m_loop_variables.begin(), m_loop_variables.end(), name) != m_loop_variables.end())
+				error_at_exp(expression.children[0], format("Can't assign to loop variable {}", name));
+			if (std::find(m_constants.begin(), m_constants.end(), name) != m_constants.end())
+				error_at_exp(expression.children[0], format("Can't assign to constant {}", name));
+		}
+		const auto& lhs = expression.children[0];
+		if (lhs.type == ExpressionType::Declaration && std::get<Expression::DeclarationData>(lhs.data).constant
+			&& !is_constant(expression.children[1]))
+			error_at_exp(expression.children[1], format("The value of {} has to be known while compiling",
+				std::get<Expression::DeclarationData>(lhs.data).var.name));
 		
 		if (!lhs_type.unref_eq(rhs_type))
 			error_at_exp(expression, "Both sides are not the same type");
@@ -156,6 +434,80 @@ Type TypeChecker::check_expression(Expression& expression, Function& parent, con
 			replace_with_cast(expression.children[1], rhs_type.remove_reference());
 
 		return expression.value_type = lhs_type;
+	} else if (expression.type == ExpressionType::Index) {
+		const auto array_type = check_expression(expression.children[0], parent);
+		if (!array_type.is_array() && !array_type.is_slice())
+			error_at_exp(expression.children[0], format("Can't index {}", array_type.remove_reference()));
+		const auto index_type = check_expression(expression.children[1], parent);
+		if (!index_type.unref_eq(Type { "i32" }))
+			error_at_exp(expression.children[1], format("Expected i32 index, got {}", index_type.remove_reference()));
+		if (index_type.reference)
+			replace_with_cast(expression.children[1], index_type.remove_reference());
+		return expression.value_type = array_type.element().add_reference();
+	} else if (expression.type == ExpressionType::Slice) {
+		const auto array_type = check_expression(expression.children[0], parent);
+		if (!array_type.is_array() && !array_type.is_slice())
+			error_at_exp(expression.children[0], format("Can't slice {}", array_type.remove_reference()));
+		for (size_t i = 1; i < expression.children.size(); ++i) {
+			const auto bound_type = check_expression(expression.children[i], parent);
+			if (!bound_type.unref_eq(Type { "i32" }))
+				error_at_exp(expression.children[i], format("Expected i32 range bound, got {}", bound_type.remove_reference()));
+			if (bound_type.reference)
+				replace_with_cast(expression.children[i], bound_type.remove_reference());
+		}
+		return expression.value_type = Type { .name = array_type.name, .slice = true };
+	} else if (expression.type == ExpressionType::Field) {
+		const auto type = check_expression(expression.children[0], parent);
+		// pointers get followed to the struct they point to
+		const auto* s = type.is_pointer() ? m_parser.find_struct(type.name) : struct_of(type);
+		if (!s)
+			error_at_exp(expression, format("{} doesn't have fields", type.remove_reference()));
+		auto& data = std::get<Expression::FieldData>(expression.data);
+		const auto it = std::find_if(s->fields.begin(), s->fields.end(), [&](const auto& field) { return field.name == data.name; });
+		if (it == s->fields.end())
+			error_at_exp(expression, format("{} doesn't have a field {}", s->name, data.name));
+		data.index = static_cast<size_t>(it - s->fields.begin());
+		// a field of a variable or behind a pointer can be assigned to, one of a value that was returned can't
+		auto field_type = it->type;
+		field_type.reference = type.reference || type.is_pointer();
+		return expression.value_type = field_type;
+	} else if (expression.type == ExpressionType::Asm) {
+		const auto& data = std::get<Expression::AsmData>(expression.data);
+		if (parent.constant)
+			error_at_exp(expression, format("const fn {} can't have asm blocks", parent.name));
+		std::vector<RegId> inputs;
+		const auto general_reg = [&](const std::string& name) {
+			const auto reg = parse_register(name);
+			if (!reg)
+				error_at_exp(expression, format("Unknown register {}", name));
+			if (reg->first == reg_id(Reg::Sp) || reg->first == reg_id(Reg::Bp))
+				error_at_exp(expression, "esp and ebp belong to the compiler");
+			if (m_target == Target::X86 && reg->first >= 8)
+				error_at_exp(expression, format("{} only exists on x86_64", name));
+			return reg->first;
+		};
+		for (size_t i = 0; i < data.inputs.size(); ++i) {
+			const auto reg = general_reg(data.inputs[i]);
+			if (std::find(inputs.begin(), inputs.end(), reg) != inputs.end())
+				error_at_exp(expression, format("{} is already an input", data.inputs[i]));
+			inputs.push_back(reg);
+			// arrays go in as a pointer to their first element, like slices
+			auto& child = expression.children[i];
+			const auto type = check_expression(child, parent);
+			array_to_slice(child, type, Type { .name = type.name, .slice = true });
+			const auto& input_type = child.value_type;
+			if (!input_type.is_pointer() && !input_type.is_slice() && (input_type.is_array() || (input_type.name != "i32" && input_type.name != "bool")))
+				error_at_exp(child, format("{} doesn't fit in a register", input_type.remove_reference()));
+			if (input_type.reference)
+				replace_with_cast(child, input_type.remove_reference());
+		}
+		if (!data.output.empty())
+			general_reg(data.output);
+		std::vector<Instr> code;
+		const auto error = parse_asm(data.lines, m_target.value_or(Target::X86_64), "check", code);
+		if (!error.empty() && (m_target || !parse_asm(data.lines, Target::X86, "check", code).empty()))
+			error_at_exp(expression, error);
+		return expression.value_type = Type { data.output.empty() ? "void" : "i32" };
 	} else {
 		error_at_exp(expression, format("what is this {}", expression.type));
 	}
@@ -166,7 +518,7 @@ void TypeChecker::error_at(const Span& span, const std::string_view& msg) const
 	if (!m_parser.m_file_name.empty())
 		print_file_span(m_parser.m_file_name, span);
 	print('\n');
-	std::exit(1);
+	throw CompileError {};
 }
 
 void TypeChecker::error_at_exp(const Expression& exp, const std::string_view& msg) const {
@@ -1,18 +1,39 @@
 #pragma once
 #include "parser.hpp"
+#include "x86.hpp"
+#include <optional>
 
 class TypeChecker {
 	Parser& m_parser;
+	// variables of the for loops being checked, which their bodies can't assign to
+	std::vector<std::string> m_loop_variables;
+	// const locals of the function being checked, which can't be assigned to or declared again
+	std::vector<std::string> m_constants;
+	// the target being compiled for, which asm blocks get checked against. none when the program only gets
+	// evaluated, and then asm only has to make sense on one of the targets
+	std::optional<Target> m_target;
 	
 	[[noreturn]] void error_at_exp(const Expression& exp, const std::string_view& msg) const;
 	[[noreturn]] void error_at_stmt(const Statement& stmt, const std::string_view& msg) const;
 	[[noreturn]] void error_at(const Span& span, const std::string_view& msg) const;
 public:
-	TypeChecker(Parser& parser);
+	TypeChecker(Parser& parser, std::optional<Target> target = std::nullopt);
 
 	void check();
 
+	// validates the struct definitions and lays them out, inner ones first
+	void check_structs();
+	// the struct a type is, if it's one
+	const Struct* struct_of(const Type& type) const;
+
 	void check_function(Function& function);
+	// c only gets numbers, bools and pointers, with slices passed as a pointer to their first element
+	void check_extern(const Function& function) const;
+	// whether an expression only uses literals, const locals, operators and calls with constant arguments
+	// to const fns and intrinsics that always give the same result, so it can be worked out while compiling
+	bool is_constant(const Expression& expression) const;
+	// whether a const fn can call the function
+	bool is_const_callable(const std::string& name) const;
 	void check_statement(Statement& stmt, Function& parent);
 	// TODO: use scopes instead of Function..
 	Type check_expression(Expression& expr, Function& parent, const std::optional<Type>& infer_type = std::nullopt);
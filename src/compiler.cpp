@@ -1,261 +1,1674 @@
 #include "compiler.hpp"
+#include "regalloc.hpp"
+#include "peephole.hpp"
+#include "optimizer.hpp"
+#include "inliner.hpp"
 #include "enums.hpp"
 #include "format.hpp"
-#include <array>
+#include <bit>
+
+// the arena is one big mapping, made on the first alloc. memory past arena_dirty has never been
+// handed out, so it's still zeroed from the kernel. MAP_NORESERVE means only the pages touched count
+static constexpr size_t arena_size_x86 = size_t(1) << 28;
+static constexpr size_t arena_size_x86_64 = size_t(1) << 30;
+// blocks up to this many bytes get a free list per multiple of 8
+static constexpr size_t small_block = 256;
 
 void Compiler::compile() {
+	// entry point, calls main, flushes what it printed and exits with its return value
+	auto& start = m_functions.emplace_back(MachineFunction { .name = "_start", .target = m_target, .global = true });
+	start.code.emplace_back(Op::Call, std::vector { label_op("main") });
+	start.code.emplace_back(Op::Mov, std::vector { reg_op(Reg::Bx), reg_op(Reg::Ax) });
+	start.code.emplace_back(Op::Call, std::vector { label_op("flush") });
+	if (m_libc) {
+		// the stack is 16 byte aligned again at this point
+		if (m_target == Target::X86_64) {
+			start.code.emplace_back(Op::Mov, std::vector { reg_op(Reg::Di), reg_op(Reg::Bx) });
+		} else {
+			start.code.emplace_back(Op::Sub, std::vector { reg_op(Reg::Sp), imm_op(12) });
+			start.code.emplace_back(Op::Push, std::vector { reg_op(Reg::Bx) });
+		}
+		start.code.emplace_back(Op::Call, std::vector { label_op("exit") });
+	} else if (m_target == Target::X86_64) {
+		start.code.emplace_back(Op::Mov, std::vector { reg_op(Reg::Di), reg_op(Reg::Bx) });
+		start.code.emplace_back(Op::Mov, std::vector { reg_op(Reg::Ax), imm_op(60) });
+		start.code.emplace_back(Op::Syscall);
+	} else {
+		start.code.emplace_back(Op::Mov, std::vector { reg_op(Reg::Ax), imm_op(1) });
+		start.code.emplace_back(Op::Int, std::vector { imm_op(0x80) });
+	}
+	// where traps go, so what got printed before them still shows up. null pointers aren't checked
+	// for, so the segfault from going through one still loses what's buffered
+	auto& trap = m_functions.emplace_back(MachineFunction { .name = "runtime_trap", .target = m_target });
+	trap.code.emplace_back(Op::Call, std::vector { label_op("flush") });
+	trap.code.emplace_back(Op::Ud2);
+	m_globals.push_back(Global { "print_buffer", print_buffer_size });
+	m_globals.push_back(Global { "print_buffer_length", 4 });
+
+	for (auto& function : m_parser.m_functions)
+		if (!function.builtin && !function.external) m_ir.push_back(build_ir(function, m_parser));
+	optimize_program();
+
+	// the heap runtime only goes in when something uses it
+	const auto calls = [&](const std::string& name) {
+		return std::any_of(m_ir.begin(), m_ir.end(), [&](const IrFunction& function) {
+			return std::any_of(function.blocks.begin(), function.blocks.end(), [&](const IrBlock& block) {
+				return std::any_of(block.code.begin(), block.code.end(), [&](const IrInstr& instr) {
+					return instr.op == IrOp::Call && instr.name == name;
+				});
+			});
+		});
+	};
+	std::vector<Function> runtime;
+	if (calls("arena_alloc")) {
+		runtime.push_back(Function {
+			.return_type = Type { "i32" }, .name = "arena_alloc", .arguments = { Variable { Type { "i32" }, "bytes" } }, .builtin = true
+		});
+	}
+	if (calls("arena_free")) {
+		runtime.push_back(Function {
+			.return_type = Type { "void" },
+			.name = "arena_free",
+			.arguments = { Variable { Type { "i32" }, "block" }, Variable { Type { "i32" }, "bytes" } },
+			.builtin = true
+		});
+	}
+	if (calls("arena_reset"))
+		runtime.push_back(Function { .return_type = Type { "void" }, .name = "arena_reset", .builtin = true });
+	if (!runtime.empty()) {
+		for (const auto name : { "arena_next", "arena_end", "arena_base", "arena_dirty" })
+			m_globals.push_back(Global { name, pointer_size() });
+		m_globals.push_back(Global { "arena_lists", small_block / 8 * pointer_size() });
+	}
+	for (auto& function : runtime)
+		compile_function(function, nullptr);
+
 	for (auto& function : m_parser.m_functions) {
-		compile_function(function);
+		if (function.external) continue;
+		if (function.builtin) {
+			compile_function(function, nullptr);
+			continue;
+		}
+		const auto ir = std::find_if(m_ir.begin(), m_ir.end(), [&](const auto& ir) { return ir.name == function.name; });
+		// inlined everywhere it was called
+		if (ir == m_ir.end()) continue;
+		auto lowered = *ir;
+		compile_function(function, &lowered);
+	}
+}
+
+void Compiler::optimize_program() {
+	if (m_opt_level <= 0) return;
+	auto graph = build_call_graph(m_ir);
+	const auto original_call_sites = graph.call_sites;
+	// callees first, so they're already optimized when deciding whether to inline them
+	for (const auto index : graph.bottom_up) {
+		inline_calls(m_ir[index], m_ir, graph, m_inline_threshold);
+		optimize(m_ir[index], m_opt_level, m_unroll_factor, vector_lanes());
+	}
+	std::vector<bool> inlined_everywhere(m_ir.size());
+	for (size_t i = 0; i < m_ir.size(); ++i)
+		inlined_everywhere[i] = original_call_sites[i] && !graph.call_sites[i] && m_ir[i].name != "main";
+	size_t index = 0;
+	std::erase_if(m_ir, [&](const IrFunction&) { return inlined_everywhere[index++]; });
+}
+
+void Compiler::write_asm(std::ostream& stream) const {
+	if (m_target == Target::X86_64)
+		stream << "bits 64\n";
+	stream << "section .text\n";
+	for (const auto& function : m_functions)
+		if (function.global) format_to(stream, "global {}\n", function.name);
+	for (const auto& function : m_parser.m_functions)
+		if (function.external) format_to(stream, "extern {}\n", function.name);
+	if (m_libc)
+		stream << "extern exit\n";
+	stream << '\n';
+	for (const auto& function : m_functions) {
+		format_to(stream, "{}:\n", function.name);
+		for (const auto& instr : function.code)
+			format_to(stream, "{}\n", instr);
+		stream << '\n';
 	}
-	write("section .data");
+	stream << "section .data\n";
 	for (size_t i = 0; i < m_strings.size(); ++i) {
-		write("data_{}: db \"{}\"", i, m_strings[i]);
+		format_to(stream, "data_{}: db \"{}\"\n", i, m_strings[i]);
+	}
+	for (const auto& function : m_functions) {
+		for (const auto& instr : function.code) {
+			if (instr.targets.empty()) continue;
+			format_to(stream, "align {}\n{}:\n", int(pointer_size()), instr.operands[0].label);
+			for (const auto& target : instr.targets)
+				format_to(stream, "\t{} {}\n", m_target == Target::X86_64 ? "dq" : "dd", target);
+		}
+	}
+	if (m_globals.empty()) return;
+	stream << "section .bss\n";
+	for (const auto& global : m_globals)
+		format_to(stream, "alignb 8\n{}: resb {}\n", global.name, global.size);
+}
+
+void Compiler::write_ir(std::ostream& stream) const {
+	for (const auto& function : m_ir)
+		format_to(stream, "{}\n", function);
+}
+
+int Compiler::vector_lanes() const {
+	switch (m_simd) {
+		case Simd::None: return 1;
+		case Simd::Sse2: return 4;
+		case Simd::Avx2: return 8;
+	}
+	unhandled("simd level");
+}
+
+Instr& Compiler::emit(Op op, std::vector<Operand> operands, Cond cond) {
+	auto& instr = m_machine_function->code.emplace_back(op, std::move(operands), cond);
+	instr.loop_depth = m_loop_depth;
+	return instr;
+}
+
+std::string Compiler::new_label(const std::string_view& kind) {
+	return format("{}_{}_{}", m_cur_function->name, kind, m_label_counter++);
+}
+
+RegId Compiler::emit_syscall(const std::vector<Operand>& args, uint8_t result_size) {
+	const auto& regs = target_regs(m_target);
+	assert(args.size() <= regs.syscall_args.size(), "too many syscall arguments");
+	std::vector<RegId> uses;
+	for (size_t i = 0; i < args.size(); ++i) {
+		emit(Op::Mov, { reg_op(regs.syscall_args[i], args[i].size), args[i] });
+		uses.push_back(reg_id(regs.syscall_args[i]));
 	}
+	auto& instr = m_target == Target::X86_64 ? emit(Op::Syscall) : emit(Op::Int, { imm_op(0x80) });
+	instr.implicit_uses = std::move(uses);
+	instr.implicit_defs = { reg_id(Reg::Ax) };
+	for (const auto reg : regs.syscall_clobbers)
+		instr.implicit_defs.push_back(reg_id(reg));
+	const auto result = new_vreg();
+	emit(Op::Mov, { reg_op(result, result_size), reg_op(Reg::Ax, result_size) });
+	return result;
 }
 
-void Compiler::compile_function(Function& function) {
-	if (function.builtin) {
-		if (function.name == "print") {
-			write(R"(
-print:
-mov eax, [esp + 4] ; number
+Operand Compiler::global_op(const std::string& name, uint8_t size, RegId index, uint8_t scale) const {
+	return Operand {
+		.kind = Operand::Kind::Mem, .size = size, .index = index, .scale = scale, .address_size = pointer_size(), .label = name,
+	};
+}
+
+void Compiler::compile_arena_alloc(Function& function) {
+	const auto ptr_size = pointer_size();
+	const auto bytes = load_argument(0, function.arguments.size());
+	// rounded up to 8, so every block stays aligned for pointers
+	const auto size = new_vreg();
+	emit(Op::Mov, { reg_op(size), reg_op(bytes) });
+	emit(Op::Add, { reg_op(size), imm_op(7) });
+	emit(Op::And, { reg_op(size), imm_op(-8) });
+	const auto block = new_vreg();
+	const auto bump = new_label("bump");
+	const auto zero = new_label("zero");
+	const auto done = new_label("done");
+	const auto fail = new_label("fail");
+
+	// small blocks come off their free list first, sizes of 0 wrap around and skip it
+	const auto size_class = new_vreg();
+	emit(Op::Lea, { reg_op(size_class), mem(size, -1) });
+	emit(Op::Cmp, { reg_op(size_class), imm_op(static_cast<int64_t>(small_block - 1)) });
+	emit(Op::Jcc, { label_op(bump) }, Cond::A);
+	emit(Op::Shr, { reg_op(size_class), imm_op(3, 1) });
+	const auto list = global_op("arena_lists", ptr_size, size_class, ptr_size);
+	emit(Op::Mov, { reg_op(block, ptr_size), list });
+	emit(Op::Test, { reg_op(block, ptr_size), reg_op(block, ptr_size) });
+	emit(Op::Jcc, { label_op(bump) }, Cond::E);
+	const auto link = new_vreg();
+	emit(Op::Mov, { reg_op(link, ptr_size), mem(block, 0, ptr_size) });
+	emit(Op::Mov, { list, reg_op(link, ptr_size) });
+	emit(Op::Jmp, { label_op(zero) });
 
-mov ecx, esp ; buffer ptr
-sub esp, 12  ; buffer of 12 bytes
-mov ebx, 0   ; buffer count
+	emit(Op::Label, { label_op(bump) });
+	const auto end = new_vreg();
+	emit(Op::Mov, { reg_op(block, ptr_size), global_op("arena_next", ptr_size) });
+	emit(Op::Mov, { reg_op(end, ptr_size), reg_op(block, ptr_size) });
+	emit(Op::Add, { reg_op(end, ptr_size), reg_op(size, ptr_size) });
+	const auto grow = new_label("grow");
+	emit(Op::Cmp, { reg_op(end, ptr_size), global_op("arena_end", ptr_size) });
+	emit(Op::Jcc, { label_op(grow) }, Cond::A);
+	emit(Op::Mov, { global_op("arena_next", ptr_size), reg_op(end, ptr_size) });
+	emit(Op::Cmp, { reg_op(block, ptr_size), global_op("arena_dirty", ptr_size) });
+	emit(Op::Jcc, { label_op(done) }, Cond::Ae);
 
-print_loop:
-sub ecx, 1 ; move pointer to where we're writing
-; idiv
-mov esi, 10 ; divide by 10
-mov edx, 0 ; clear edx for idiv
-idiv esi ; divide edx|eax by 10, result -> eax, modulo -> edx
-add edx, '0' ; offset by ascii '0'
-mov BYTE [ecx], dl ; write edx (lower byte) into the buffer
-add ebx, 1 ; increase buffer count
+	// reused memory has whatever was left in it
+	emit(Op::Label, { label_op(zero) });
+	const auto offset = new_vreg();
+	emit(Op::Mov, { reg_op(offset), reg_op(size) });
+	emit(Op::Test, { reg_op(offset), reg_op(offset) });
+	emit(Op::Jcc, { label_op(done) }, Cond::E);
+	const auto zero_loop = new_label("zero_loop");
+	emit(Op::Label, { label_op(zero_loop) });
+	++m_loop_depth;
+	emit(Op::Sub, { reg_op(offset), imm_op(ptr_size) });
+	auto word = mem(block, 0, ptr_size);
+	word.index = offset;
+	emit(Op::Mov, { word, imm_op(0) });
+	emit(Op::Jcc, { label_op(zero_loop) }, Cond::Ne);
+	--m_loop_depth;
+	emit(Op::Jmp, { label_op(done) });
 
-cmp eax, 0
-jg print_loop ; jump if greater than 0
+	// the first alloc maps the arena, and running out of it traps
+	emit(Op::Label, { label_op(grow) });
+	const auto mapped = new_vreg();
+	emit(Op::Mov, { reg_op(mapped, ptr_size), global_op("arena_end", ptr_size) });
+	emit(Op::Test, { reg_op(mapped, ptr_size), reg_op(mapped, ptr_size) });
+	emit(Op::Jcc, { label_op(fail) }, Cond::Ne);
+	constexpr int64_t prot_read_write = 3;
+	// MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+	constexpr int64_t map_flags = 0x4022;
+	RegId base;
+	size_t arena_size;
+	if (m_target == Target::X86_64) {
+		arena_size = arena_size_x86_64;
+		base = emit_syscall({ imm_op(9), imm_op(0, 8), imm_op(static_cast<int64_t>(arena_size), 8), imm_op(prot_read_write),
+			imm_op(map_flags), imm_op(-1, 8), imm_op(0, 8) }, ptr_size);
+	} else {
+		// old_mmap, which takes its arguments in memory since there aren't enough registers for them
+		arena_size = arena_size_x86;
+		const auto args = m_machine_function->alloc_stack(24, 4);
+		const int64_t values[] = { 0, static_cast<int64_t>(arena_size), prot_read_write, map_flags, -1, 0 };
+		for (size_t i = 0; i < 6; ++i)
+			emit(Op::Mov, { mem(Reg::Bp, args + static_cast<int64_t>(i) * 4), imm_op(values[i]) });
+		const auto pointer = new_vreg();
+		emit(Op::Lea, { reg_op(pointer), mem(Reg::Bp, args) });
+		base = emit_syscall({ imm_op(90), reg_op(pointer) });
+	}
+	// errors come back as -4095 to -1
+	emit(Op::Cmp, { reg_op(base, ptr_size), imm_op(-4096) });
+	emit(Op::Jcc, { label_op(fail) }, Cond::A);
+	emit(Op::Mov, { global_op("arena_base", ptr_size), reg_op(base, ptr_size) });
+	emit(Op::Mov, { global_op("arena_next", ptr_size), reg_op(base, ptr_size) });
+	emit(Op::Mov, { global_op("arena_dirty", ptr_size), reg_op(base, ptr_size) });
+	emit(Op::Add, { reg_op(base, ptr_size), imm_op(static_cast<int64_t>(arena_size)) });
+	emit(Op::Mov, { global_op("arena_end", ptr_size), reg_op(base, ptr_size) });
+	emit(Op::Jmp, { label_op(bump) });
+	emit(Op::Label, { label_op(fail) });
+	emit(Op::Jmp, { label_op("runtime_trap") });
 
-mov eax, 4   ; WRITE syscall
-mov edx, ebx ; buf size
-mov ebx, 1   ; fd 1 (stdout)
-; ecx          buf*
-int 0x80 ; syscall
+	emit(Op::Label, { label_op(done) });
+	emit(Op::Mov, { reg_op(Reg::Ax, ptr_size), reg_op(block, ptr_size) });
+}
 
-mov eax, 4   ; WRITE syscall
-mov BYTE [ecx], 10 ; newline
-mov edx, 1   ; buf size
-int 0x80 ; syscall
+void Compiler::compile_arena_free(Function& function) {
+	const auto ptr_size = pointer_size();
+	const auto block = load_argument(0, function.arguments.size(), ptr_size);
+	const auto bytes = load_argument(1, function.arguments.size());
+	const auto done = new_label("done");
+	// freeing null does nothing, and neither does freeing a block too big for a free list
+	emit(Op::Test, { reg_op(block, ptr_size), reg_op(block, ptr_size) });
+	emit(Op::Jcc, { label_op(done) }, Cond::E);
+	const auto size_class = new_vreg();
+	emit(Op::Lea, { reg_op(size_class), mem(bytes, 7) });
+	emit(Op::And, { reg_op(size_class), imm_op(-8) });
+	emit(Op::Sub, { reg_op(size_class), imm_op(1) });
+	emit(Op::Cmp, { reg_op(size_class), imm_op(static_cast<int64_t>(small_block - 1)) });
+	emit(Op::Jcc, { label_op(done) }, Cond::A);
+	emit(Op::Shr, { reg_op(size_class), imm_op(3, 1) });
+	// the link to the next free block goes in the block itself
+	const auto list = global_op("arena_lists", ptr_size, size_class, ptr_size);
+	const auto link = new_vreg();
+	emit(Op::Mov, { reg_op(link, ptr_size), list });
+	emit(Op::Mov, { mem(block, 0, ptr_size), reg_op(link, ptr_size) });
+	emit(Op::Mov, { list, reg_op(block, ptr_size) });
+	emit(Op::Label, { label_op(done) });
+}
 
-add esp, 12 ; revert buffer
+void Compiler::compile_arena_reset(Function&) {
+	const auto ptr_size = pointer_size();
+	// everything handed out so far might need zeroing when it gets handed out again
+	const auto next = new_vreg();
+	const auto clean = new_label("clean");
+	emit(Op::Mov, { reg_op(next, ptr_size), global_op("arena_next", ptr_size) });
+	emit(Op::Cmp, { reg_op(next, ptr_size), global_op("arena_dirty", ptr_size) });
+	emit(Op::Jcc, { label_op(clean) }, Cond::Be);
+	emit(Op::Mov, { global_op("arena_dirty", ptr_size), reg_op(next, ptr_size) });
+	emit(Op::Label, { label_op(clean) });
+	const auto base = new_vreg();
+	emit(Op::Mov, { reg_op(base, ptr_size), global_op("arena_base", ptr_size) });
+	emit(Op::Mov, { global_op("arena_next", ptr_size), reg_op(base, ptr_size) });
 
-ret)");
-		} else {
-			assert(false, format("unknown builtin {}", function.name));
+	const auto offset = new_vreg();
+	emit(Op::Mov, { reg_op(offset), imm_op(static_cast<int64_t>(small_block / 8 * ptr_size)) });
+	const auto loop = new_label("loop");
+	emit(Op::Label, { label_op(loop) });
+	++m_loop_depth;
+	emit(Op::Sub, { reg_op(offset), imm_op(ptr_size) });
+	emit(Op::Mov, { global_op("arena_lists", ptr_size, offset), imm_op(0) });
+	emit(Op::Jcc, { label_op(loop) }, Cond::Ne);
+	--m_loop_depth;
+}
+
+void Compiler::compile_print(Function& function) {
+	const auto ptr_size = pointer_size();
+	const auto number = load_argument(0, function.arguments.size());
+
+	// making room first, since the text gets copied over 16 bytes at a time
+	const auto length = new_vreg();
+	const auto fits = new_label("fits");
+	emit(Op::Mov, { reg_op(length), global_op("print_buffer_length", 4) });
+	emit(Op::Cmp, { reg_op(length), imm_op(static_cast<int64_t>(print_buffer_size - 16)) });
+	emit(Op::Jcc, { label_op(fits) }, Cond::Be);
+	auto& call = emit(Op::Call, { label_op("flush") });
+	for (const auto reg : target_regs(m_target).caller_saved)
+		call.implicit_defs.push_back(reg_id(reg));
+	m_machine_function->has_calls = true;
+	emit(Op::Mov, { reg_op(length), imm_op(0) });
+	emit(Op::Label, { label_op(fits) });
+
+	// the text gets written backwards, ending 16 bytes into a 32 byte scratch buffer so copying 16
+	// bytes from its start never reads past it
+	const auto scratch = m_machine_function->alloc_stack(32, 4);
+	const auto text = new_vreg();
+	emit(Op::Lea, { reg_op(text, ptr_size), mem(Reg::Bp, scratch + 15) });
+	emit(Op::Mov, { mem(text, 0, 1), imm_op('\n', 1) });
+
+	// working with the negative of the magnitude, which INT_MIN has too
+	const auto value = new_vreg();
+	emit(Op::Mov, { reg_op(value), reg_op(number) });
+	emit(Op::Neg, { reg_op(value) });
+	emit(Op::Cmp, { reg_op(value), reg_op(number) });
+	emit(Op::Cmov, { reg_op(value), reg_op(number) }, Cond::G);
+
+	// two digits at a time, out of a table of 00 to 99
+	const auto digits = format("data_{}", m_strings.size());
+	auto& table = m_strings.emplace_back();
+	for (int i = 0; i < 100; ++i)
+		table += format("{}{}", i / 10, i % 10);
+	const auto pair = [&](RegId index) {
+		const auto chars = new_vreg();
+		emit(Op::Sub, { reg_op(text, ptr_size), imm_op(2) });
+		emit(Op::Mov, { reg_op(chars, 2), global_op(digits, 2, index, 2) });
+		emit(Op::Mov, { mem(text, 0, 2), reg_op(chars, 2) });
+	};
+	const auto loop = new_label("loop");
+	const auto last = new_label("last");
+	emit(Op::Label, { label_op(loop) });
+	++m_loop_depth;
+	emit(Op::Cmp, { reg_op(value), imm_op(-100) });
+	emit(Op::Jcc, { label_op(last) }, Cond::G);
+	const auto quotient = divide_by_constant(value, 100);
+	const auto remainder = remainder_by_constant(value, quotient, 100);
+	emit(Op::Neg, { reg_op(remainder) });
+	emit(Op::Mov, { reg_op(value), reg_op(quotient) });
+	pair(remainder);
+	emit(Op::Jmp, { label_op(loop) });
+	--m_loop_depth;
+
+	// then one or two more
+	emit(Op::Label, { label_op(last) });
+	const auto one = new_label("one");
+	const auto sign = new_label("sign");
+	emit(Op::Neg, { reg_op(value) });
+	emit(Op::Cmp, { reg_op(value), imm_op(10) });
+	emit(Op::Jcc, { label_op(one) }, Cond::L);
+	pair(value);
+	emit(Op::Jmp, { label_op(sign) });
+	emit(Op::Label, { label_op(one) });
+	emit(Op::Sub, { reg_op(text, ptr_size), imm_op(1) });
+	emit(Op::Add, { reg_op(value), imm_op('0') });
+	emit(Op::Mov, { mem(text, 0, 1), reg_op(value, 1) });
+	emit(Op::Label, { label_op(sign) });
+	const auto positive = new_label("positive");
+	emit(Op::Cmp, { reg_op(number), imm_op(0) });
+	emit(Op::Jcc, { label_op(positive) }, Cond::Ge);
+	emit(Op::Sub, { reg_op(text, ptr_size), imm_op(1) });
+	emit(Op::Mov, { mem(text, 0, 1), imm_op('-', 1) });
+	emit(Op::Label, { label_op(positive) });
+
+	const auto end = new_vreg();
+	emit(Op::Lea, { reg_op(end, ptr_size), global_op("print_buffer", ptr_size, length) });
+	const auto chunk = new_vreg();
+	for (int64_t i = 0; i < 16; i += ptr_size) {
+		emit(Op::Mov, { reg_op(chunk, ptr_size), mem(text, i, ptr_size) });
+		emit(Op::Mov, { mem(end, i, ptr_size), reg_op(chunk, ptr_size) });
+	}
+	const auto size = new_vreg();
+	emit(Op::Lea, { reg_op(size, ptr_size), mem(Reg::Bp, scratch + 16) });
+	emit(Op::Sub, { reg_op(size, ptr_size), reg_op(text, ptr_size) });
+	emit(Op::Add, { reg_op(length), reg_op(size) });
+	emit(Op::Mov, { global_op("print_buffer_length", 4), reg_op(length) });
+}
+
+void Compiler::compile_flush(Function&) {
+	const auto ptr_size = pointer_size();
+	const auto write_number = m_target == Target::X86_64 ? 1 : 4;
+	const auto left = new_vreg();
+	const auto data = new_vreg();
+	const auto loop = new_label("loop");
+	const auto done = new_label("done");
+	emit(Op::Mov, { reg_op(left), global_op("print_buffer_length", 4) });
+	emit(Op::Lea, { reg_op(data, ptr_size), global_op("print_buffer", ptr_size) });
+	emit(Op::Test, { reg_op(left), reg_op(left) });
+	emit(Op::Jcc, { label_op(done) }, Cond::E);
+	// writes to pipes can come up short
+	emit(Op::Label, { label_op(loop) });
+	++m_loop_depth;
+	// stdout
+	const auto written = emit_syscall({ imm_op(write_number), imm_op(1), reg_op(data, ptr_size), reg_op(left) });
+	// errors drop the rest instead of trying forever
+	emit(Op::Test, { reg_op(written), reg_op(written) });
+	emit(Op::Jcc, { label_op(done) }, Cond::Le);
+	emit(Op::Add, { reg_op(data, ptr_size), reg_op(written, ptr_size) });
+	emit(Op::Sub, { reg_op(left), reg_op(written) });
+	emit(Op::Jcc, { label_op(loop) }, Cond::Ne);
+	--m_loop_depth;
+	emit(Op::Label, { label_op(done) });
+	emit(Op::Mov, { global_op("print_buffer_length", 4), imm_op(0) });
+}
+
+void Compiler::compile_builtin(Function& function) {
+	if (function.name == "print") {
+		compile_print(function);
+	} else if (function.name == "flush") {
+		compile_flush(function);
+	} else if (function.name == "arena_alloc") {
+		compile_arena_alloc(function);
+	} else if (function.name == "arena_free") {
+		compile_arena_free(function);
+	} else if (function.name == "arena_reset") {
+		compile_arena_reset(function);
+	} else {
+		assert(false, format("unknown builtin {}", function.name));
+	}
+}
+
+namespace {
+	struct Magic {
+		int32_t multiplier;
+		int shift;
+	};
+}
+
+// the multiplier and shift for signed division by a constant that isn't 0, 1, -1 or a power of two.
+// the smallest p where 2^p / d rounded up is close enough to be exact for every i32 (Hacker's Delight 10-1)
+static Magic signed_magic(int32_t divisor) {
+	constexpr uint32_t two31 = 0x80000000;
+	const uint32_t magnitude = divisor < 0 ? -static_cast<uint32_t>(divisor) : static_cast<uint32_t>(divisor);
+	const uint32_t t = two31 + (static_cast<uint32_t>(divisor) >> 31);
+	// largest dividend whose remainder is magnitude - 1
+	const uint32_t limit = t - 1 - t % magnitude;
+	int p = 31;
+	uint32_t q1 = two31 / limit, r1 = two31 - q1 * limit;
+	uint32_t q2 = two31 / magnitude, r2 = two31 - q2 * magnitude;
+	uint32_t delta;
+	do {
+		++p;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= limit) {
+			++q1;
+			r1 -= limit;
 		}
-		return;
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= magnitude) {
+			++q2;
+			r2 -= magnitude;
+		}
+		delta = magnitude - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+	const uint32_t multiplier = q2 + 1;
+	return { static_cast<int32_t>(divisor < 0 ? -multiplier : multiplier), p - 32 };
+}
+
+RegId Compiler::divide_by_constant(RegId dividend, int64_t divisor) {
+	assert(divisor != 0, "division by zero");
+	const auto magnitude = static_cast<uint32_t>(divisor < 0 ? -divisor : divisor);
+	const auto quotient = new_vreg();
+	if (magnitude == 1 || std::has_single_bit(magnitude)) {
+		emit(Op::Mov, { reg_op(quotient), reg_op(dividend) });
+		if (magnitude != 1) {
+			const auto shift = std::countr_zero(magnitude);
+			// sar rounds down, so negative numbers get 2^shift - 1 added first to round towards zero
+			if (shift > 1)
+				emit(Op::Sar, { reg_op(quotient), imm_op(31, 1) });
+			emit(Op::Shr, { reg_op(quotient), imm_op(32 - shift, 1) });
+			emit(Op::Add, { reg_op(quotient), reg_op(dividend) });
+			emit(Op::Sar, { reg_op(quotient), imm_op(shift, 1) });
+		}
+		if (divisor < 0)
+			emit(Op::Neg, { reg_op(quotient) });
+		return quotient;
 	}
 
-	write("{}:", function.name);
+	const auto [multiplier, shift] = signed_magic(static_cast<int32_t>(divisor));
+	// high half of dividend * multiplier, which lands in edx
+	emit(Op::Mov, { reg_op(Reg::Ax), imm_op(multiplier) });
+	emit(Op::Imul, { reg_op(dividend) });
+	emit(Op::Mov, { reg_op(quotient), reg_op(Reg::Dx) });
+	// the multiplier didn't fit as a positive i32 and wrapped around
+	if (divisor > 0 && multiplier < 0)
+		emit(Op::Add, { reg_op(quotient), reg_op(dividend) });
+	else if (divisor < 0 && multiplier > 0)
+		emit(Op::Sub, { reg_op(quotient), reg_op(dividend) });
+	if (shift)
+		emit(Op::Sar, { reg_op(quotient), imm_op(shift, 1) });
+	// that rounded down, so add one to negative quotients
+	const auto sign = new_vreg();
+	emit(Op::Mov, { reg_op(sign), reg_op(quotient) });
+	emit(Op::Shr, { reg_op(sign), imm_op(31, 1) });
+	emit(Op::Add, { reg_op(quotient), reg_op(sign) });
+	return quotient;
+}
+
+RegId Compiler::remainder_by_constant(RegId dividend, RegId quotient, int64_t divisor) {
+	// dividend - quotient * divisor
+	const auto product = new_vreg();
+	if (divisor > 0 && std::has_single_bit(static_cast<uint64_t>(divisor))) {
+		emit(Op::Mov, { reg_op(product), reg_op(quotient) });
+		emit(Op::Shl, { reg_op(product), imm_op(std::countr_zero(static_cast<uint64_t>(divisor)), 1) });
+	} else {
+		emit(Op::Imul, { reg_op(product), reg_op(quotient), imm_op(divisor) });
+	}
+	const auto remainder = new_vreg();
+	emit(Op::Mov, { reg_op(remainder), reg_op(dividend) });
+	emit(Op::Sub, { reg_op(remainder), reg_op(product) });
+	return remainder;
+}
+
+bool Compiler::internal_convention(const std::string& function) const {
+	// main gets called by _start, which would be code from somewhere else if tack linked with anything.
+	// extern functions are that code
+	if (function == "main") return false;
+	const auto& functions = m_parser.m_functions;
+	return std::none_of(functions.begin(), functions.end(), [&](const Function& f) { return f.external && f.name == function; });
+}
+
+std::span<const Reg> Compiler::argument_regs(const std::string& function) const {
+	const auto& regs = target_regs(m_target);
+	return internal_convention(function) ? regs.internal_args : regs.args;
+}
+
+Operand Compiler::argument_slot(size_t index, size_t count, uint8_t size) {
+	const auto regs = argument_regs(m_cur_function->name);
+	// x86 pushes arguments in order, so the last one is right above the return address.
+	// x86_64 pushes the ones that didn't fit in registers in reverse
+	const auto offset = m_target == Target::X86_64
+		? 16 + (index - regs.size()) * 8
+		: (count - index + 1) * 4;
+	m_machine_function->needs_frame = true;
+	return mem(Reg::Bp, static_cast<int64_t>(offset), size);
+}
+
+RegId Compiler::load_argument(size_t index, size_t count, uint8_t size) {
+	const auto regs = argument_regs(m_cur_function->name);
+	const auto reg = new_vreg();
+	if (index < regs.size())
+		emit(Op::Mov, { reg_op(reg, size), reg_op(regs[index], size) });
+	else
+		emit(Op::Mov, { reg_op(reg, size), argument_slot(index, count, size) });
+	return reg;
+}
+
+void Compiler::compile_function(Function& function, IrFunction* ir) {
+	MachineFunction machine_function { .name = function.name, .target = m_target };
+	m_machine_function = &machine_function;
 	m_cur_function = &function;
-	m_var_counter = 0;
 	m_label_counter = 0;
-	m_variables.clear();
-	for (size_t i = 0; i < function.arguments.size(); ++i) {
-		m_variables[function.arguments[i].name] = -(function.arguments.size() - i - 1 + 2);
+	m_loop_depth = 0;
+	m_return_label = format("{}_return", function.name);
+	m_trap_label = format("{}_trap", function.name);
+	m_traps = false;
+
+	if (ir)
+		compile_ir(*ir);
+	else
+		compile_builtin(function);
+
+	emit(Op::Label, { label_op(m_return_label) });
+	auto& ret = emit(Op::Ret);
+	// slices take up two arguments
+	const auto arg_count = ir ? ir->arg_count : function.arguments.size();
+	const auto register_count = std::min(arg_count, argument_regs(function.name).size());
+	if (internal_convention(function.name) && arg_count > register_count)
+		ret.operands.push_back(imm_op(static_cast<int64_t>((arg_count - register_count) * pointer_size())));
+	// structs can come back in edx too
+	const auto return_count = ir ? ir->return_count : function.return_type.name != "void";
+	if (return_count >= 1)
+		ret.implicit_uses.push_back(reg_id(Reg::Ax));
+	if (return_count >= 2)
+		ret.implicit_uses.push_back(reg_id(Reg::Dx));
+	if (m_traps) {
+		emit(Op::Label, { label_op(m_trap_label) });
+		emit(Op::Jmp, { label_op("runtime_trap") });
+	}
+
+	allocate_registers(machine_function);
+	finish_function(machine_function);
+	if (m_opt_level >= 1)
+		peephole(machine_function);
+	m_functions.push_back(std::move(machine_function));
+
+	m_machine_function = nullptr;
+	m_cur_function = nullptr;
+}
+
+void Compiler::finish_function(MachineFunction& function) {
+	const auto ptr_size = function.pointer_size();
+	const auto sp = reg_op(Reg::Sp, ptr_size);
+	const auto bp = reg_op(Reg::Bp, ptr_size);
+	if (m_target == Target::X86_64 && function.has_calls) {
+		// calls need rsp 16 byte aligned, with the return address and rbp pushed
+		// that leaves the stack and saved registers to pad
+		function.needs_frame = true;
+		function.stack_size += (16 - (function.stack_size + function.saved_regs.size() * 8) % 16) % 16;
 	}
-	if (!function.scope.variables.empty() || !function.arguments.empty()) {
-		write("push ebp");
-		write("mov ebp, esp");
-		if (!function.scope.variables.empty())
-			write("sub esp, {}", function.scope.variables.size() * 4);
+
+	// mixing sse and avx code stalls on the upper halves of the ymm registers, so every vector
+	// instruction gets the vex encoding, and the upper halves are cleared before calling or returning
+	// to code that might use sse
+	if (function.uses_ymm) {
+		for (auto& instr : function.code)
+			instr.vex = std::any_of(instr.operands.begin(), instr.operands.end(),
+				[](const Operand& operand) { return operand.is_reg() && is_vector_reg(operand.reg); });
 	}
-	for (auto& statement : function.statements) {
-		compile_statement(statement);
+
+	std::vector<Instr> code;
+	if (function.needs_frame) {
+		code.emplace_back(Op::Push, std::vector { bp });
+		code.emplace_back(Op::Mov, std::vector { bp, sp });
+		if (function.stack_size)
+			code.emplace_back(Op::Sub, std::vector { sp, imm_op(static_cast<int64_t>(function.stack_size)) });
 	}
-	generate_return(function);
-	m_cur_function = nullptr;
-	write("");
-}
-
-void Compiler::compile_statement(Statement& statement) {
-	if (statement.type == StatementType::Return) {
-		if (!statement.expressions.empty()) {
-			// output should be in eax
-			compile_expression(statement.expressions[0]);
-		}
-		// shouldnt ever be null
-		if (m_cur_function != nullptr)
-			generate_return(*m_cur_function);
-	} else if (statement.type == StatementType::Expression) {
-		compile_expression(statement.expressions[0]);
-	} else if (statement.type == StatementType::If) {
-		compile_expression(statement.expressions[0]);
-		const auto end_label = format("{}_if_end_{}", m_cur_function->name, m_label_counter++);
-		const auto else_label = format("{}_if_else_{}", m_cur_function->name, m_label_counter++);
-		write("cmp al, 1");
-		write("jne {}", statement.else_branch ? else_label : end_label);
-		for (auto& child : statement.children) {
-			compile_statement(child);
-		}
-		if (statement.else_branch) {
-			write("jmp {}", end_label);
-			write("{}:", else_label);
-			compile_statement(*statement.else_branch);
-		}
-		write("{}:", end_label);
-	} else if (statement.type == StatementType::Else) {
-		// TODO: Else is basically just a block statement, maybe rename it?
-		for (auto& child : statement.children) {
-			compile_statement(child);
-		}
-	} else if (statement.type == StatementType::While) {
-		const auto label_start = format("{}_while_start_{}", m_cur_function->name, m_label_counter++);
-		const auto label_end = format("{}_while_end_{}", m_cur_function->name, m_label_counter++);
-		write("{}:", label_start);
-		compile_expression(statement.expressions[0]);
-		write("cmp al, 1");
-		write("jne {}", label_end);
-		for (auto& child : statement.children)
-			compile_statement(child);
-		write("jmp {}", label_start);
-		write("{}:", label_end);
-	} else {
-		unhandled(format("unimplemented statement {}", enum_name(statement.type)));
+	for (const auto reg : function.saved_regs)
+		code.emplace_back(Op::Push, std::vector { reg_op(reg, ptr_size) });
+
+	for (auto& instr : function.code) {
+		if (function.uses_ymm && (instr.op == Op::Ret || instr.op == Op::Call))
+			code.emplace_back(Op::Vzeroupper);
+		if (instr.op == Op::Ret) {
+			for (size_t j = function.saved_regs.size(); j--;)
+				code.emplace_back(Op::Pop, std::vector { reg_op(function.saved_regs[j], ptr_size) });
+			if (function.needs_frame) {
+				if (function.stack_size)
+					code.emplace_back(Op::Mov, std::vector { sp, bp });
+				code.emplace_back(Op::Pop, std::vector { bp });
+			}
+		}
+		code.push_back(std::move(instr));
+	}
+	function.code = std::move(code);
+}
+
+Operand Compiler::value_op(ValueId value) {
+	if (m_constants[value])
+		return imm_op(*m_constants[value]);
+	return value_rm(value);
+}
+
+RegId Compiler::value_reg(ValueId value) {
+	if (m_constants[value] || m_memory_values[value]) {
+		// rematerialized at every use, so constants never hold on to a register
+		const auto reg = new_vreg();
+		emit(Op::Mov, { reg_op(reg), value_op(value) });
+		return reg;
 	}
+	if (m_value_regs[value] == no_reg)
+		m_value_regs[value] = new_vreg();
+	return m_value_regs[value];
 }
 
-void Compiler::generate_return(const Function& function) {
-	if (!function.scope.variables.empty()) {
-		write("add esp, {}", function.scope.variables.size() * 4);
+Operand Compiler::value_rm(ValueId value) {
+	if (m_memory_values[value])
+		return *m_memory_values[value];
+	return reg_op(value_reg(value), m_value_sizes[value]);
+}
+
+std::string Compiler::block_label(const IrFunction& function, BlockId block) const {
+	return format("{}_{}_{}", function.name, function.blocks[block].kind, block);
+}
+
+void Compiler::emit_phi_copies(const IrFunction& function, BlockId from, BlockId to) {
+	const auto& block = function.blocks[to];
+	const auto index = std::find(block.preds.begin(), block.preds.end(), from) - block.preds.begin();
+	// the phis all take their values at once, so a phi read by another one's copy has to wait
+	// for it, and a cycle of them goes through a temporary
+	std::vector<std::pair<Operand, Operand>> copies;
+	for (const auto& instr : block.code) {
+		if (instr.op != IrOp::Phi) break;
+		const auto dest = reg_op(value_reg(instr.result), m_value_sizes[instr.result]);
+		const auto source = value_op(instr.args[index]);
+		if (!source.is_reg(dest.reg))
+			copies.push_back({ dest, source });
+	}
+	while (!copies.empty()) {
+		const auto ready = std::find_if(copies.begin(), copies.end(), [&](const auto& copy) {
+			return std::none_of(copies.begin(), copies.end(), [&](const auto& other) { return other.second.is_reg(copy.first.reg); });
+		});
+		if (ready != copies.end()) {
+			emit(Op::Mov, { ready->first, ready->second });
+			copies.erase(ready);
+			continue;
+		}
+		const auto blocked = copies.front().first;
+		const auto temp = reg_op(new_vreg(), blocked.size);
+		emit(Op::Mov, { temp, blocked });
+		for (auto& copy : copies)
+			if (copy.second.is_reg(blocked.reg)) copy.second = temp;
+	}
+}
+
+static Cond compare_cond(IrOp op) {
+	switch (op) {
+		case IrOp::Eq: return Cond::E;
+		case IrOp::Ne: return Cond::Ne;
+		case IrOp::Lt: return Cond::L;
+		case IrOp::Le: return Cond::Le;
+		case IrOp::Gt: return Cond::G;
+		case IrOp::Ge: return Cond::Ge;
+		default: unhandled("not a comparison");
 	}
-		
-	if (!function.scope.variables.empty() || !function.arguments.empty()) {
-		write("mov esp, ebp");
-		write("pop ebp");
+}
+
+Cond Compiler::emit_compare(const IrInstr& instr) {
+	auto lhs = instr.args[0];
+	auto rhs = instr.args[1];
+	auto cond = compare_cond(instr.op);
+	// cmp only takes an immediate on the right
+	if (m_constants[lhs] && !m_constants[rhs]) {
+		std::swap(lhs, rhs);
+		cond = swap_cond(cond);
 	}
-	write("ret");
+	// pointers get compared whole, including with null
+	const auto size = std::max(m_value_sizes[lhs], m_value_sizes[rhs]);
+	const auto right = value_op(rhs);
+	// comparing with zero only needs the sign and zero flags, which test sets the same way
+	if (right.is_imm() && right.imm == 0 && !m_memory_values[lhs]) {
+		const auto left = value_reg(lhs);
+		emit(Op::Test, { reg_op(left, size), reg_op(left, size) });
+		return cond;
+	}
+	// one side can be a stack slot, as long as the other isn't
+	const auto left = right.is_mem() || m_constants[lhs] ? reg_op(value_reg(lhs), size) : value_rm(lhs);
+	emit(Op::Cmp, { left, right });
+	return cond;
 }
 
-void Compiler::compile_expression(Expression& exp, bool /*by_reference*/) {
-	if (exp.type == ExpressionType::Literal) {
-		const auto& data = std::get<Expression::LiteralData>(exp.data);
-		std::visit(overloaded {
-			[&](int value) { write("mov eax, {}", value); },
-			[&](bool value) { write("mov al, {}", int(value)); },
-			[&](const std::string& value) {
-				write("mov eax, data_{}", m_data_counter++);
-				m_strings.push_back(value);
+// the lea patterns, matched against trees of additions and multiplications whose inner nodes are only
+// used by their parent and computed in the same block, so their operands are still around at the root.
+// a node either gets folded into the address, or its value is used as a register
+struct AddressMatcher {
+	const std::vector<const IrInstr*>& nodes;
+	const std::vector<std::optional<int64_t>>& constants;
+	Address address;
+	std::vector<ValueId> folded;
+
+	// value * scale as a register in the address
+	bool add_term(ValueId value, int64_t scale) {
+		if (scale == 1 && address.base == no_value) {
+			address.base = value;
+			return true;
+		}
+		if (address.index == no_value && (scale == 1 || scale == 2 || scale == 4 || scale == 8)) {
+			address.index = value;
+			address.scale = static_cast<uint8_t>(scale);
+			return true;
+		}
+		return false;
+	}
+
+	// adds value * scale to the address, folding in its node if that fits
+	bool match(ValueId value, int64_t scale) {
+		if (constants[value]) {
+			address.disp += *constants[value] * scale;
+			return true;
+		}
+		if (nodes[value]) {
+			const auto saved_address = address;
+			const auto saved_folded = folded.size();
+			if (match_node(*nodes[value], scale)) {
+				folded.push_back(value);
+				return true;
 			}
-		}, data.value);
-	} else if (exp.type == ExpressionType::Operator) {
-		const auto& data = std::get<Expression::OperatorData>(exp.data);
-		if (data.op_type == OperatorType::Negation) {
-			compile_expression(exp.children[0]);
-			write("neg eax");
-		} else if (data.op_type == OperatorType::Bitflip) {
-			compile_expression(exp.children[0]);
-			write("not eax");
-		} else if (data.op_type == OperatorType::Not) {
-			compile_expression(exp.children[0]);
-			write("cmp eax, 0");
-			write("mov eax, 0");
-			write("sete al");
-		} else if (data.op_type == OperatorType::Addition) {
-			compile_expression(exp.children[0]);
-			write("push eax");
-			compile_expression(exp.children[1]);
-			write("pop ecx");
-			write("add eax, ecx");
-		} else if (data.op_type == OperatorType::Subtraction) {
-			compile_expression(exp.children[0]);
-			write("push eax");
-			compile_expression(exp.children[1]);
-			write("pop ecx");
-			write("sub ecx, eax");
-			write("mov eax, ecx");
-		} else if (data.op_type == OperatorType::Multiplication) {
-			compile_expression(exp.children[0]);
-			write("push eax");
-			compile_expression(exp.children[1]);
-			write("pop ecx");
-			write("imul eax, ecx");
-		} else if (data.op_type == OperatorType::Equals) {
-			compile_expression(exp.children[0]);
-			write("push eax");
-			compile_expression(exp.children[1]);
-			write("pop ecx");
-			write("cmp eax, ecx");
-			write("sete al");
-		} else if (data.op_type == OperatorType::NotEquals) {
-			compile_expression(exp.children[0]);
-			write("push eax");
-			compile_expression(exp.children[1]);
-			write("pop ecx");
-			write("cmp eax, ecx");
-			write("setne al");
-		} else {
-			assert(false, "unimplemented");
-		}
-	} else if (exp.type == ExpressionType::Declaration) {
-		const auto& data = std::get<Expression::DeclarationData>(exp.data);
-		// stores a pointer to the variable in eax because idk how to deal with this yet
-		write("lea eax, [ebp - {}]", m_var_counter * 4); // hardcode every variable to be 4 bytes trololol
-		m_variables[data.var.name] = m_var_counter;
-		++m_var_counter;
-	} else if (exp.type == ExpressionType::Assignment) {
-		compile_expression(exp.children[1]);
-		write("push eax");
-		// assumes its a var declaration, which stores a pointer to eax
-		compile_expression(exp.children[0], true);
-		write("pop ecx");
-		write("mov [eax], ecx");
-		// assignment evaluates to the rhs
-		write("mov eax, ecx");
-	} else if (exp.type == ExpressionType::Variable) {
-		const auto& data = std::get<Expression::VariableData>(exp.data);
-		if (!m_variables.count(data.name))
-			assert(false, "unknown variable!");
-		static constexpr auto format_offset = [](int off) -> std::string {
-			if (off == 0) return "";
-			else if (off < 0) return format("- {}", -off);
-			else return format("+ {}", off);
-		};
-		write("lea eax, [ebp {}]", format_offset(-m_variables[data.name] * 4));
-	} else if (exp.type == ExpressionType::Call) {
-		for (auto& child : exp.children) {
-			compile_expression(child);
-			write("push eax");
-		}
-		const auto& target_name = std::get<Expression::CallData>(exp.data).function_name;
-		// TODO: better builtins
-		if (target_name == "syscall") {
-			// TODO: save ebp, since its used as the 7th arg
-			std::array regs{"eax", "ebx", "ecx", "edx", "esi", "edi"};
-			for (size_t i = 0; i < exp.children.size(); ++i) {
-				write("pop {}", regs.at(exp.children.size() - 1 - i));
+			address = saved_address;
+			folded.resize(saved_folded);
+		}
+		return add_term(value, scale);
+	}
+
+	bool match_node(const IrInstr& instr, int64_t scale) {
+		const auto& args = instr.args;
+		switch (instr.op) {
+			// a + b
+			case IrOp::Add:
+				return match(args[0], scale) && match(args[1], scale);
+			// a - c
+			case IrOp::Sub:
+				if (!constants[args[1]]) return false;
+				address.disp -= *constants[args[1]] * scale;
+				return match(args[0], scale);
+			case IrOp::Mul: {
+				const bool left = constants[args[0]].has_value();
+				if (left == constants[args[1]].has_value()) return false;
+				const auto factor = *constants[args[left ? 0 : 1]];
+				const auto value = args[left ? 1 : 0];
+				// a * 2, 4 or 8 as a scaled index
+				const auto scaled = factor * scale;
+				if (scaled == 2 || scaled == 4 || scaled == 8)
+					return match(value, scaled);
+				// a * 3, 5 or 9 as [a + a * 2, 4 or 8]
+				if (scale == 1 && (factor == 3 || factor == 5 || factor == 9))
+					return add_term(value, 1) && add_term(value, factor - 1);
+				return false;
+			}
+			default:
+				return false;
+		}
+	}
+};
+
+void Compiler::select_addresses(const IrFunction& function, BlockId block, const std::vector<uint32_t>& use_count) {
+	const auto& code = function.blocks[block].code;
+	const auto arithmetic = [](IrOp op) { return op == IrOp::Add || op == IrOp::Sub || op == IrOp::Mul; };
+	// nodes that can be folded into their user, if that's in this block too
+	std::vector<const IrInstr*> nodes(function.next_value);
+	for (const auto& instr : code)
+		if (arithmetic(instr.op) && use_count[instr.result] == 1) nodes[instr.result] = &instr;
+	// users come after what they use, so going backwards sees the roots of the trees first
+	for (size_t i = code.size(); i--;) {
+		const auto& instr = code[i];
+		if (!arithmetic(instr.op) || m_folded[instr.result]) continue;
+		AddressMatcher matcher { .nodes = nodes, .constants = m_constants };
+		if (!matcher.match_node(instr, 1)) continue;
+		auto& address = matcher.address;
+		if (address.base == no_value && address.index == no_value) continue;
+		// lea only saves something over add and imul when it does more than one of them, or a multiply by 3, 5 or 9
+		const bool multiply = instr.op == IrOp::Mul && address.base == address.index;
+		if (matcher.folded.empty() && !multiply) continue;
+		// the address wraps around like the arithmetic it replaces
+		address.disp = static_cast<int32_t>(static_cast<uint32_t>(address.disp));
+		for (const auto value : matcher.folded)
+			m_folded[value] = true;
+		m_addresses[instr.result] = address;
+	}
+}
+
+void Compiler::compile_switch(const IrFunction& function, BlockId block, const IrInstr& instr) {
+	for (const auto succ : function.blocks[block].successors())
+		emit_phi_copies(function, block, succ);
+	const auto other = block_label(function, instr.targets.back());
+	const auto jump_to_other = [&] {
+		if (instr.targets.back() != m_next_block)
+			emit(Op::Jmp, { label_op(other) });
+	};
+	std::vector<std::pair<int64_t, std::string>> cases;
+	for (size_t i = 0; i < instr.cases.size(); ++i)
+		cases.push_back({ instr.cases[i], block_label(function, instr.targets[i]) });
+	std::sort(cases.begin(), cases.end());
+	if (cases.empty()) {
+		jump_to_other();
+		return;
+	}
+	const auto value = value_reg(instr.args[0]);
+	const auto count = static_cast<int64_t>(cases.size());
+	const auto low = cases.front().first;
+	const auto high = cases.back().first;
+	std::vector<std::string> places;
+	for (const auto& [case_value, label] : cases)
+		if (std::find(places.begin(), places.end(), label) == places.end()) places.push_back(label);
+
+	// value - start, with anything outside of [start, high] going to the else. the subtraction gets skipped
+	// when starting at zero instead only costs a few more entries
+	const auto index_from = [&](int64_t start) {
+		auto index = value;
+		if (start != 0) {
+			index = new_vreg();
+			emit(Op::Mov, { reg_op(index), reg_op(value) });
+			emit(Op::Sub, { reg_op(index), imm_op(start) });
+		}
+		// unsigned, so values below start wrap around and fail too
+		emit(Op::Cmp, { reg_op(index), imm_op(high - start) });
+		emit(Op::Jcc, { label_op(other) }, Cond::A);
+		return index;
+	};
+
+	if (count >= 3 && high - low < 32 && places.size() <= 3) {
+		// a mask per place with the bits of its cases set, tested with bt
+		const auto start = low >= 0 && high < 32 ? 0 : low;
+		const auto index = index_from(start);
+		for (const auto& place : places) {
+			uint32_t mask = 0;
+			for (const auto& [case_value, label] : cases)
+				if (label == place) mask |= uint32_t(1) << (case_value - start);
+			const auto bits = new_vreg();
+			emit(Op::Mov, { reg_op(bits), imm_op(static_cast<int32_t>(mask)) });
+			emit(Op::Bt, { reg_op(bits), reg_op(index) });
+			emit(Op::Jcc, { label_op(place) }, Cond::B);
+		}
+		jump_to_other();
+		return;
+	}
+
+	if (count >= 4 && high - low < count * 3) {
+		const auto start = low >= 0 && low < 4 ? 0 : low;
+		const auto index = index_from(start);
+		const auto ptr_size = pointer_size();
+		auto& jump = emit(Op::Jmp, { Operand {
+			.kind = Operand::Kind::Mem,
+			.size = ptr_size,
+			.index = index,
+			.scale = ptr_size,
+			.address_size = ptr_size,
+			.label = new_label("table"),
+		} });
+		jump.targets.assign(static_cast<size_t>(high - start + 1), other);
+		for (const auto& [case_value, label] : cases)
+			jump.targets[static_cast<size_t>(case_value - start)] = label;
+		return;
+	}
+
+	// binary search down to a few compares in a row
+	const auto search = [&](const auto& self, size_t first, size_t last) -> void {
+		if (last - first <= 3) {
+			for (auto i = first; i < last; ++i) {
+				emit(Op::Cmp, { reg_op(value), imm_op(cases[i].first) });
+				emit(Op::Jcc, { label_op(cases[i].second) }, Cond::E);
 			}
-			write("int 0x80");
+			emit(Op::Jmp, { label_op(other) });
 			return;
 		}
-		write("call {}", target_name);
-		// clean up stack if theres arguments
-		for (const auto& function : m_parser.m_functions) {
-			if (function.name == target_name && !function.arguments.empty()) {
-				write("add esp, {}", function.arguments.size() * 4);
+		const auto middle = first + (last - first) / 2;
+		const auto above = new_label("cases");
+		emit(Op::Cmp, { reg_op(value), imm_op(cases[middle].first) });
+		emit(Op::Jcc, { label_op(cases[middle].second) }, Cond::E);
+		emit(Op::Jcc, { label_op(above) }, Cond::G);
+		self(self, first, middle);
+		emit(Op::Label, { label_op(above) });
+		self(self, middle + 1, last);
+	};
+	search(search, 0, cases.size());
+	// the last jmp can fall through instead
+	if (instr.targets.back() == m_next_block)
+		m_machine_function->code.pop_back();
+}
+
+Operand Compiler::element_op(const IrInstr& instr, uint8_t size) {
+	auto operand = mem(Reg::Bp, m_array_slots[static_cast<size_t>(instr.imm)], size);
+	if (const auto index = m_constants[instr.args[0]]) {
+		operand.imm += *index * 4;
+	} else {
+		// i32s are zero extended in 64 bit registers, which is right for every index in bounds
+		operand.index = value_reg(instr.args[0]);
+		operand.scale = 4;
+	}
+	return operand;
+}
+
+Operand Compiler::pointer_element_op(ValueId pointer, ValueId index, uint8_t size) {
+	auto operand = mem(value_reg(pointer), 0, size);
+	if (const auto constant = m_constants[index]) {
+		operand.imm = *constant * 4;
+	} else {
+		operand.index = value_reg(index);
+		operand.scale = 4;
+	}
+	return operand;
+}
+
+void Compiler::compile_check(const IrInstr& instr) {
+	const auto index = instr.args[0];
+	const auto limit = instr.args[1];
+	m_traps = true;
+	// compared unsigned, so negative indices look too big
+	if (m_constants[index] && m_constants[limit]) {
+		if (static_cast<uint32_t>(*m_constants[index]) >= static_cast<uint32_t>(*m_constants[limit]))
+			emit(Op::Jmp, { label_op(m_trap_label) });
+		return;
+	}
+	// cmp only takes an immediate on the right
+	const bool swapped = m_constants[index].has_value();
+	const auto left_value = swapped ? limit : index;
+	const auto right = value_op(swapped ? index : limit);
+	const auto left = right.is_mem() ? reg_op(value_reg(left_value)) : value_rm(left_value);
+	emit(Op::Cmp, { left, right });
+	emit(Op::Jcc, { label_op(m_trap_label) }, swapped ? Cond::Be : Cond::Ae);
+}
+
+void Compiler::compile_vector(const IrInstr& instr) {
+	const auto& args = instr.args;
+	const auto size = static_cast<uint8_t>(instr.lanes * 4);
+	if (size == 32) m_machine_function->uses_ymm = true;
+	const auto vector = [&](ValueId value) { return reg_op(value_reg(value), size); };
+	const auto temp = [&](uint8_t bytes) { return reg_op(new_vreg(), bytes); };
+	// sse only has the two operand forms
+	const auto binary = [&](Op op, const Operand& dest, const Operand& a, const Operand& b) {
+		emit(Op::Mov, { dest, a });
+		emit(op, { dest, b });
+	};
+	const auto invert = [&](const Operand& dest) {
+		const auto ones = temp(dest.size);
+		emit(Op::Pcmpeqd, { ones, ones });
+		emit(Op::Pxor, { dest, ones });
+	};
+	// (a & mask) | (b & ~mask)
+	const auto select = [&](const Operand& dest, const Operand& mask, const Operand& a, const Operand& b) {
+		const auto rest = temp(dest.size);
+		binary(Op::Pandn, rest, mask, b);
+		binary(Op::Pand, dest, a, mask);
+		emit(Op::Por, { dest, rest });
+	};
+
+	switch (instr.op) {
+		case IrOp::Phi:
+			break;
+		case IrOp::Splat: {
+			const auto result = vector(instr.result);
+			const auto constant = m_constants[args[0]];
+			if (instr.imm) {
+				// different in every lane, which only happens before a loop, so the lanes get put together in memory
+				const auto slot = m_machine_function->alloc_stack(size, 16);
+				for (int64_t lane = 0; lane < instr.lanes; ++lane) {
+					const auto step = lane * instr.imm;
+					if (constant) {
+						emit(Op::Mov, { mem(Reg::Bp, slot + lane * 4), imm_op(static_cast<int32_t>(*constant + step)) });
+						continue;
+					}
+					const auto value = reg_op(new_vreg());
+					emit(Op::Mov, { value, value_rm(args[0]) });
+					if (step) emit(Op::Add, { value, imm_op(static_cast<int32_t>(step)) });
+					emit(Op::Mov, { mem(Reg::Bp, slot + lane * 4), value });
+				}
+				emit(Op::Mov, { result, mem(Reg::Bp, slot, size) });
+			} else if (constant == 0) {
+				emit(Op::Pxor, { result, result });
+			} else if (constant == -1) {
+				emit(Op::Pcmpeqd, { result, result });
+			} else {
+				const auto low = reg_op(result.reg, 16);
+				emit(Op::Movd, { low, constant ? reg_op(value_reg(args[0])) : value_rm(args[0]) });
+				if (size == 32)
+					emit(Op::Vpbroadcastd, { result, low });
+				else
+					emit(Op::Pshufd, { result, low, imm_op(0, 1) });
+			}
+			break;
+		}
+		case IrOp::Add: binary(Op::Paddd, vector(instr.result), vector(args[0]), vector(args[1])); break;
+		case IrOp::Sub: binary(Op::Psubd, vector(instr.result), vector(args[0]), vector(args[1])); break;
+		case IrOp::And: binary(Op::Pand, vector(instr.result), vector(args[0]), vector(args[1])); break;
+		case IrOp::Or: binary(Op::Por, vector(instr.result), vector(args[0]), vector(args[1])); break;
+		case IrOp::Mul: {
+			const auto result = vector(instr.result);
+			const auto a = vector(args[0]);
+			const auto b = vector(args[1]);
+			if (m_simd == Simd::Avx2) {
+				binary(Op::Pmulld, result, a, b);
 				break;
 			}
+			// pmuludq multiplies lanes 0 and 2 into 64 bits, so lanes 1 and 3 get moved down for another one,
+			// and the low halves of the products get put back together
+			const auto even = temp(size);
+			binary(Op::Pmuludq, even, a, b);
+			const auto odd = temp(size);
+			const auto odd_b = temp(size);
+			emit(Op::Pshufd, { odd, a, imm_op(0xF5, 1) });
+			emit(Op::Pshufd, { odd_b, b, imm_op(0xF5, 1) });
+			emit(Op::Pmuludq, { odd, odd_b });
+			const auto high = temp(size);
+			emit(Op::Pshufd, { result, even, imm_op(0x08, 1) });
+			emit(Op::Pshufd, { high, odd, imm_op(0x08, 1) });
+			emit(Op::Punpckldq, { result, high });
+			break;
 		}
-	} else if (exp.type == ExpressionType::Cast) {
-		compile_expression(exp.children[0]);
-		if (!exp.value_type.reference && exp.children[0].value_type.reference) {
-			write("mov eax, [eax]");
+		// all ones in the lanes where they're true
+		case IrOp::Eq:
+		case IrOp::Ne:
+			binary(Op::Pcmpeqd, vector(instr.result), vector(args[0]), vector(args[1]));
+			if (instr.op == IrOp::Ne) invert(vector(instr.result));
+			break;
+		case IrOp::Gt:
+		case IrOp::Le:
+			binary(Op::Pcmpgtd, vector(instr.result), vector(args[0]), vector(args[1]));
+			if (instr.op == IrOp::Le) invert(vector(instr.result));
+			break;
+		case IrOp::Lt:
+		case IrOp::Ge:
+			binary(Op::Pcmpgtd, vector(instr.result), vector(args[1]), vector(args[0]));
+			if (instr.op == IrOp::Ge) invert(vector(instr.result));
+			break;
+		case IrOp::Select:
+			select(vector(instr.result), vector(args[0]), vector(args[1]), vector(args[2]));
+			break;
+		case IrOp::Reduce: {
+			const auto combine = [&](const Operand& a, const Operand& b) {
+				if (instr.imm == static_cast<int64_t>(IrOp::Add)) {
+					emit(Op::Paddd, { a, b });
+					return a;
+				}
+				// the smaller or larger one of each lane
+				const auto mask = temp(16);
+				if (instr.imm == static_cast<int64_t>(IrOp::Lt))
+					binary(Op::Pcmpgtd, mask, a, b);
+				else
+					binary(Op::Pcmpgtd, mask, b, a);
+				const auto result = temp(16);
+				select(result, mask, b, a);
+				return result;
+			};
+			const auto source = vector(args[0]);
+			auto rest = temp(16);
+			if (size == 32) {
+				emit(Op::Vextracti128, { rest, source, imm_op(1, 1) });
+				rest = combine(rest, reg_op(source.reg, 16));
+			} else {
+				emit(Op::Mov, { rest, source });
+			}
+			// halves, then quarters
+			for (const auto lanes : { 0x0E, 0x01 }) {
+				const auto other = temp(16);
+				emit(Op::Pshufd, { other, rest, imm_op(lanes, 1) });
+				rest = combine(rest, other);
+			}
+			emit(Op::Movd, { reg_op(value_reg(instr.result)), rest });
+			break;
+		}
+		default:
+			unhandled("vector instruction");
+	}
+}
+
+void Compiler::compile_bit_count(const IrInstr& instr) {
+	const auto result = value_reg(instr.result);
+	if (m_simd == Simd::Avx2) {
+		const auto op = instr.op == IrOp::Popcount ? Op::Popcnt : instr.op == IrOp::Clz ? Op::Lzcnt : Op::Tzcnt;
+		emit(op, { reg_op(result), value_rm(instr.args[0]) });
+		return;
+	}
+	if (instr.op != IrOp::Popcount) {
+		// bsr and bsf give the index of the highest or lowest set bit, setting the zero flag for 0 instead
+		const bool leading = instr.op == IrOp::Clz;
+		const auto zero = new_vreg();
+		emit(leading ? Op::Bsr : Op::Bsf, { reg_op(result), value_rm(instr.args[0]) });
+		emit(Op::Mov, { reg_op(zero), imm_op(leading ? 63 : 32) });
+		emit(Op::Cmov, { reg_op(result), reg_op(zero) }, Cond::E);
+		// 31 - index, and 63 becomes 32
+		if (leading)
+			emit(Op::Xor, { reg_op(result), imm_op(31) });
+		return;
+	}
+	// the bits added up in pairs, then nibbles, then bytes, which the multiply sums into the top one
+	const auto half = new_vreg();
+	const auto fold = [&](int64_t shift, int64_t mask, bool mask_both) {
+		emit(Op::Mov, { reg_op(half), reg_op(result) });
+		emit(Op::Shr, { reg_op(half), imm_op(shift) });
+		if (mask_both) {
+			emit(Op::And, { reg_op(result), imm_op(mask) });
+			emit(Op::And, { reg_op(half), imm_op(mask) });
+			emit(Op::Add, { reg_op(result), reg_op(half) });
 		} else {
-			assert(false, format("unhandled cast between {} and {}", exp.value_type, exp.children[0].value_type));
+			emit(Op::Add, { reg_op(result), reg_op(half) });
+			emit(Op::And, { reg_op(result), imm_op(mask) });
 		}
-	} else {
-		print("{}\n", exp.type);
-		assert(false, "unimplemented");
+	};
+	emit(Op::Mov, { reg_op(result), value_op(instr.args[0]) });
+	// x - (x >> 1 & 0x55555555) is how many bits each pair has
+	emit(Op::Mov, { reg_op(half), reg_op(result) });
+	emit(Op::Shr, { reg_op(half), imm_op(1) });
+	emit(Op::And, { reg_op(half), imm_op(0x55555555) });
+	emit(Op::Sub, { reg_op(result), reg_op(half) });
+	fold(2, 0x33333333, true);
+	fold(4, 0x0F0F0F0F, false);
+	emit(Op::Imul, { reg_op(result), reg_op(result), imm_op(0x01010101) });
+	emit(Op::Shr, { reg_op(result), imm_op(24) });
+}
+
+void Compiler::compile_asm(const IrFunction& function, const IrInstr& instr) {
+	const auto& block = function.asm_blocks[static_cast<size_t>(instr.imm)];
+	const auto physical = [&](const std::string& name) {
+		const auto reg = parse_register(name)->first;
+		assert(m_target == Target::X86_64 || reg < 8, format("{} only exists on x86_64", name));
+		return reg;
+	};
+	std::vector<Instr> code;
+	const auto error = parse_asm(block.lines, m_target, new_label("asm"), code);
+	assert(error.empty(), error);
+	for (size_t i = 0; i < instr.args.size(); ++i) {
+		const auto arg = instr.args[i];
+		emit(Op::Mov, { reg_op(physical(block.inputs[i]), m_value_sizes[arg]), value_op(arg) });
+	}
+	for (auto& written : code) {
+		written.loop_depth = m_loop_depth;
+		m_machine_function->code.push_back(std::move(written));
+	}
+	if (instr.result != no_value)
+		emit(Op::Mov, { reg_op(value_reg(instr.result)), reg_op(physical(block.output)) });
+}
+
+void Compiler::compile_instr(const IrFunction& function, BlockId block, const IrInstr& instr) {
+	const auto& args = instr.args;
+	const auto binary = [&](Op op, bool commutative) {
+		auto lhs = args[0];
+		auto rhs = args[1];
+		if (commutative && m_constants[lhs] && !m_constants[rhs])
+			std::swap(lhs, rhs);
+		const auto result = value_reg(instr.result);
+		if (const auto& address = m_addresses[instr.result]) {
+			const auto base = address->base != no_value ? value_reg(address->base) : no_reg;
+			auto operand = mem(base, address->disp);
+			if (address->index != no_value) {
+				operand.index = address->index == address->base ? base : value_reg(address->index);
+				operand.scale = address->scale;
+			}
+			emit(Op::Lea, { reg_op(result), operand });
+			return;
+		}
+		if (op == Op::Imul && m_constants[rhs]) {
+			emit(Op::Imul, { reg_op(result), value_rm(lhs), value_op(rhs) });
+			return;
+		}
+		emit(Op::Mov, { reg_op(result), value_op(lhs) });
+		emit(op, { reg_op(result), value_op(rhs) });
+	};
+	const auto compare = [&]() {
+		// done by the branch or select instead
+		if (m_fused_compares[instr.result]) return;
+		const auto cond = emit_compare(instr);
+		const auto flag = new_vreg();
+		emit(Op::Setcc, { reg_op(flag, 1) }, cond);
+		emit(Op::Movzx, { reg_op(value_reg(instr.result)), reg_op(flag, 1) });
+	};
+	const auto divide = [&](bool remainder) {
+		const auto result = value_reg(instr.result);
+		// -1 goes through idiv too, so int min / -1 traps the same as it does without optimizing
+		if (const auto divisor = m_constants[args[1]]; divisor && *divisor != 0 && *divisor != -1) {
+			const auto dividend = value_reg(args[0]);
+			const auto quotient = divide_by_constant(dividend, *divisor);
+			emit(Op::Mov, { reg_op(result), reg_op(remainder ? remainder_by_constant(dividend, quotient, *divisor) : quotient) });
+			return;
+		}
+		// idiv faults on 0 and int min / -1, which would lose whatever is still in the print buffer, so
+		// those go to the trap instead
+		const auto divisor = value_reg(args[1]);
+		const auto constant = m_constants[args[1]];
+		const auto dividend = m_constants[args[0]];
+		m_traps = true;
+		if (!constant) {
+			emit(Op::Test, { reg_op(divisor), reg_op(divisor) });
+			emit(Op::Jcc, { label_op(m_trap_label) }, Cond::E);
+		} else if (*constant == 0) {
+			emit(Op::Jmp, { label_op(m_trap_label) });
+		}
+		// quotient -> eax, remainder -> edx
+		emit(Op::Mov, { reg_op(Reg::Ax), value_op(args[0]) });
+		if ((!constant || *constant == -1) && (!dividend || *dividend == INT32_MIN)) {
+			const auto fine = new_label("divisor");
+			if (!constant) {
+				emit(Op::Cmp, { reg_op(divisor), imm_op(-1) });
+				emit(Op::Jcc, { label_op(fine) }, Cond::Ne);
+			}
+			emit(Op::Cmp, { reg_op(Reg::Ax), imm_op(INT32_MIN) });
+			emit(Op::Jcc, { label_op(m_trap_label) }, Cond::E);
+			emit(Op::Label, { label_op(fine) });
+		}
+		emit(Op::Cdq);
+		emit(Op::Idiv, { reg_op(divisor) });
+		emit(Op::Mov, { reg_op(result), reg_op(remainder ? Reg::Dx : Reg::Ax) });
+	};
+	const auto unary = [&](Op op) {
+		const auto result = value_reg(instr.result);
+		emit(Op::Mov, { reg_op(result), value_op(args[0]) });
+		emit(op, { reg_op(result) });
+	};
+	const auto phi_copies = [&]() {
+		for (const auto succ : function.blocks[block].successors())
+			emit_phi_copies(function, block, succ);
+	};
+	// computed by whatever uses it
+	if (instr.result != no_value && m_folded[instr.result]) return;
+	const bool memory = instr.op == IrOp::Load || instr.op == IrOp::Store || instr.op == IrOp::Read || instr.op == IrOp::Write;
+	if (instr.lanes > 1 && !memory) {
+		compile_vector(instr);
+		return;
+	}
+
+	switch (instr.op) {
+		// constants are folded into their users, phis are copied into by their preds
+		case IrOp::Const:
+		case IrOp::Phi:
+			break;
+		case IrOp::Arg:
+			if (!m_memory_values[instr.result])
+				m_value_regs[instr.result] = load_argument(static_cast<size_t>(instr.imm), function.arg_count, m_value_sizes[instr.result]);
+			break;
+		case IrOp::Add: binary(Op::Add, true); break;
+		case IrOp::Sub: binary(Op::Sub, false); break;
+		case IrOp::Mul: binary(Op::Imul, true); break;
+		case IrOp::Div: divide(false); break;
+		case IrOp::Mod: divide(true); break;
+		case IrOp::Neg: unary(Op::Neg); break;
+		case IrOp::Not: unary(Op::Not); break;
+		case IrOp::And: binary(Op::And, true); break;
+		case IrOp::Or: binary(Op::Or, true); break;
+		case IrOp::Popcount:
+		case IrOp::Clz:
+		case IrOp::Ctz:
+			compile_bit_count(instr);
+			break;
+		case IrOp::Bswap: unary(Op::Bswap); break;
+		case IrOp::Rotl:
+		case IrOp::Rotr: {
+			const auto op = instr.op == IrOp::Rotl ? Op::Rol : Op::Ror;
+			const auto result = value_reg(instr.result);
+			emit(Op::Mov, { reg_op(result), value_op(args[0]) });
+			if (const auto amount = m_constants[args[1]]) {
+				emit(op, { reg_op(result), imm_op(*amount & 31) });
+			} else {
+				emit(Op::Mov, { reg_op(Reg::Cx), value_op(args[1]) });
+				emit(op, { reg_op(result), reg_op(Reg::Cx, 1) });
+			}
+			break;
+		}
+		case IrOp::Rdtsc:
+			emit(Op::Rdtsc);
+			emit(Op::Mov, { reg_op(value_reg(instr.result)), reg_op(Reg::Ax) });
+			break;
+		case IrOp::Pause:
+			emit(Op::Pause);
+			break;
+		case IrOp::Asm:
+			compile_asm(function, instr);
+			break;
+		case IrOp::Shl:
+		case IrOp::Shr: {
+			const auto amount = m_constants[args[1]];
+			assert(amount.has_value(), "shift by a variable amount");
+			const auto result = value_reg(instr.result);
+			emit(Op::Mov, { reg_op(result), value_op(args[0]) });
+			emit(instr.op == IrOp::Shl ? Op::Shl : Op::Shr, { reg_op(result), imm_op(*amount) });
+			break;
+		}
+		case IrOp::Eq:
+		case IrOp::Ne:
+		case IrOp::Lt:
+		case IrOp::Le:
+		case IrOp::Gt:
+		case IrOp::Ge:
+			compare();
+			break;
+		case IrOp::Select: {
+			const auto result = value_reg(instr.result);
+			// cmov doesn't take an immediate, and loading one after the cmp could clobber the flags
+			const auto chosen = value_rm(args[1]);
+			emit(Op::Mov, { reg_op(result), value_op(args[2]) });
+			Cond cond = Cond::Ne;
+			if (const auto compare = m_fused_compares[args[0]]) {
+				cond = emit_compare(*compare);
+			} else {
+				const auto condition = value_reg(args[0]);
+				emit(Op::Test, { reg_op(condition), reg_op(condition) });
+			}
+			emit(Op::Cmov, { reg_op(result), chosen }, cond);
+			break;
+		}
+		case IrOp::Load: {
+			const auto size = m_value_sizes[instr.result];
+			emit(Op::Mov, { reg_op(value_reg(instr.result), size), element_op(instr, size) });
+			break;
+		}
+		case IrOp::Store: {
+			const auto size = instr.pointer ? pointer_size() : m_value_sizes[args[1]];
+			auto value = value_op(args[1]);
+			if (value.is_mem())
+				value = reg_op(value_reg(args[1]));
+			emit(Op::Mov, { element_op(instr, size), value });
+			break;
+		}
+		case IrOp::Address:
+			emit(Op::Lea, { reg_op(value_reg(instr.result), pointer_size()), mem(Reg::Bp, m_array_slots[static_cast<size_t>(instr.imm)]) });
+			break;
+		case IrOp::Offset:
+			emit(Op::Lea, { reg_op(value_reg(instr.result), pointer_size()), pointer_element_op(args[0], args[1], pointer_size()) });
+			break;
+		case IrOp::Read: {
+			const auto size = m_value_sizes[instr.result];
+			emit(Op::Mov, { reg_op(value_reg(instr.result), size), pointer_element_op(args[0], args[1], size) });
+			break;
+		}
+		case IrOp::Write: {
+			const auto size = instr.pointer ? pointer_size() : m_value_sizes[args[2]];
+			auto value = value_op(args[2]);
+			if (value.is_mem())
+				value = reg_op(value_reg(args[2]));
+			emit(Op::Mov, { pointer_element_op(args[0], args[1], size), value });
+			break;
+		}
+		case IrOp::Check:
+			compile_check(instr);
+			break;
+		case IrOp::Splat:
+		case IrOp::Reduce:
+			unhandled("scalar vector instruction");
+		case IrOp::Syscall: {
+			std::vector<Operand> operands;
+			for (const auto arg : args)
+				operands.push_back(value_op(arg));
+			const auto result = emit_syscall(operands);
+			emit(Op::Mov, { reg_op(value_reg(instr.result)), reg_op(result) });
+			break;
+		}
+		case IrOp::Call: {
+			const auto& regs = target_regs(m_target);
+			const auto arg_regs = argument_regs(instr.name);
+			const auto ptr_size = pointer_size();
+			const auto register_count = std::min(args.size(), arg_regs.size());
+			const auto stack_count = args.size() - register_count;
+			const bool internal = internal_convention(instr.name);
+			// internal functions pop their own arguments
+			size_t stack_bytes = internal ? 0 : stack_count * ptr_size;
+			const auto push = [&](ValueId arg) {
+				auto operand = value_op(arg);
+				operand.size = ptr_size;
+				emit(Op::Push, { operand });
+			};
+			// c code on x86 expects esp 16 byte aligned at calls too, which tack doesn't keep it at
+			auto saved_sp = no_reg;
+			if (m_target == Target::X86 && !internal) {
+				saved_sp = new_vreg();
+				emit(Op::Mov, { reg_op(saved_sp), reg_op(Reg::Sp) });
+				emit(Op::And, { reg_op(Reg::Sp), imm_op(-16) });
+				if (const auto padding = (16 - stack_bytes % 16) % 16)
+					emit(Op::Sub, { reg_op(Reg::Sp), imm_op(static_cast<int64_t>(padding)) });
+			}
+			if (m_target == Target::X86_64) {
+				// keep rsp 16 byte aligned
+				if (stack_count % 2) {
+					emit(Op::Sub, { reg_op(Reg::Sp, ptr_size), imm_op(8) });
+					stack_bytes += 8;
+				}
+			}
+			// c wants the first argument on top, which x86_64 does for every call
+			if (m_target == Target::X86_64 || !internal) {
+				for (size_t i = args.size(); i-- > register_count;)
+					push(args[i]);
+			} else {
+				for (size_t i = register_count; i < args.size(); ++i)
+					push(args[i]);
+			}
+			std::vector<RegId> uses;
+			for (size_t i = 0; i < register_count; ++i) {
+				emit(Op::Mov, { reg_op(arg_regs[i], m_value_sizes[args[i]]), value_op(args[i]) });
+				uses.push_back(reg_id(arg_regs[i]));
+			}
+			auto& call = emit(Op::Call, { label_op(instr.name) });
+			call.implicit_uses = std::move(uses);
+			for (const auto reg : regs.caller_saved)
+				call.implicit_defs.push_back(reg_id(reg));
+			m_machine_function->has_calls = true;
+			// clean up stack if theres arguments
+			if (saved_sp != no_reg)
+				emit(Op::Mov, { reg_op(Reg::Sp), reg_op(saved_sp) });
+			else if (stack_bytes)
+				emit(Op::Add, { reg_op(Reg::Sp, ptr_size), imm_op(static_cast<int64_t>(stack_bytes)) });
+			// the second value of a struct, which has to be taken before anything else can use edx
+			const auto& code = function.blocks[block].code;
+			const auto next = static_cast<size_t>(&instr - code.data()) + 1;
+			if (next < code.size() && code[next].op == IrOp::Result)
+				emit(Op::Mov, { reg_op(value_reg(code[next].result)), reg_op(Reg::Dx) });
+			if (instr.result != no_value) {
+				const auto size = m_value_sizes[instr.result];
+				emit(Op::Mov, { reg_op(value_reg(instr.result), size), reg_op(Reg::Ax, size) });
+			}
+			break;
+		}
+		case IrOp::Result: {
+			// taken by the call
+			const auto& code = function.blocks[block].code;
+			const auto index = static_cast<size_t>(&instr - code.data());
+			assert(index > 0 && code[index - 1].op == IrOp::Call && code[index - 1].result == args[0], "result not straight after its call");
+			break;
+		}
+		case IrOp::Jump:
+			phi_copies();
+			if (instr.targets[0] != m_next_block)
+				emit(Op::Jmp, { label_op(block_label(function, instr.targets[0])) });
+			break;
+		case IrOp::Branch: {
+			Cond cond = Cond::Ne;
+			if (const auto compare = m_fused_compares[args[0]]) {
+				cond = emit_compare(*compare);
+			} else {
+				const auto condition = value_reg(args[0]);
+				emit(Op::Test, { reg_op(condition), reg_op(condition) });
+			}
+			// movs leave the flags alone
+			phi_copies();
+			const auto& targets = instr.targets;
+			if (targets[0] == m_next_block) {
+				emit(Op::Jcc, { label_op(block_label(function, targets[1])) }, invert_cond(cond));
+			} else {
+				emit(Op::Jcc, { label_op(block_label(function, targets[0])) }, cond);
+				if (targets[1] != m_next_block)
+					emit(Op::Jmp, { label_op(block_label(function, targets[1])) });
+			}
+			break;
+		}
+		case IrOp::Switch:
+			compile_switch(function, block, instr);
+			break;
+		case IrOp::Return:
+			// output should be in eax, and edx for the second half of a struct
+			if (!args.empty())
+				emit(Op::Mov, { reg_op(Reg::Ax, m_value_sizes[args[0]]), value_op(args[0]) });
+			if (args.size() > 1)
+				emit(Op::Mov, { reg_op(Reg::Dx), value_op(args[1]) });
+			emit(Op::Jmp, { label_op(m_return_label) });
+			break;
+	}
+}
+
+void Compiler::compile_ir(IrFunction& function) {
+	const auto block_count = function.blocks.size();
+	split_critical_edges(function);
+	m_value_regs.assign(function.next_value, no_reg);
+	m_constants.assign(function.next_value, std::nullopt);
+	m_memory_values.assign(function.next_value, std::nullopt);
+	m_folded.assign(function.next_value, false);
+	m_addresses.assign(function.next_value, std::nullopt);
+	m_value_sizes.assign(function.next_value, 4);
+	m_array_slots.clear();
+	for (const auto length : function.arrays)
+		m_array_slots.push_back(m_machine_function->alloc_stack(length * 4, 16));
+	std::vector<uint32_t> use_count(function.next_value);
+	// deepest loop each value is used in
+	std::vector<uint8_t> use_depth(function.next_value);
+	for (const auto& block : function.blocks) {
+		for (const auto& instr : block.code) {
+			if (instr.op == IrOp::Const) m_constants[instr.result] = instr.imm;
+			if (instr.lanes > 1 && instr.result != no_value && instr.op != IrOp::Reduce) m_value_sizes[instr.result] = static_cast<uint8_t>(instr.lanes * 4);
+			for (const auto arg : instr.args) {
+				++use_count[arg];
+				use_depth[arg] = std::max(use_depth[arg], block.loop_depth);
+			}
+		}
+	}
+	// pointers are as wide as the target's addresses. they come from arrays, slice arguments and the heap,
+	// and get passed to slice arguments, with phis and selects of them being pointers too. constants are
+	// shared by everything using the same value, so null being 0 mustn't make every other 0 a pointer
+	std::vector<bool> pointers(function.next_value);
+	for (const auto& block : function.blocks) {
+		for (const auto& instr : block.code) {
+			if (instr.op == IrOp::Address || instr.op == IrOp::Offset || (instr.pointer && instr.result != no_value))
+				pointers[instr.result] = true;
+			if (instr.op == IrOp::Arg && function.pointer_args[static_cast<size_t>(instr.imm)])
+				pointers[instr.result] = true;
+			if (instr.op == IrOp::Offset || instr.op == IrOp::Read || instr.op == IrOp::Write)
+				pointers[instr.args[0]] = true;
+			if (instr.op != IrOp::Call) continue;
+			const auto callee = std::find_if(m_ir.begin(), m_ir.end(), [&](const auto& ir) { return ir.name == instr.name; });
+			if (callee == m_ir.end()) continue;
+			for (size_t i = 0; i < instr.args.size(); ++i)
+				if (callee->pointer_args[i]) pointers[instr.args[i]] = true;
+		}
+	}
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (const auto& block : function.blocks) {
+			for (const auto& instr : block.code) {
+				if (instr.op != IrOp::Phi && instr.op != IrOp::Select) continue;
+				// the condition of a select isn't one of what it picks
+				const auto first = instr.args.begin() + (instr.op == IrOp::Select);
+				const bool pointer = pointers[instr.result] || std::any_of(first, instr.args.end(), [&](ValueId arg) {
+					return pointers[arg] && !m_constants[arg];
+				});
+				if (!pointer) continue;
+				for (auto value = first; value != instr.args.end(); ++value) {
+					if (m_constants[*value]) continue;
+					changed |= !pointers[*value];
+					pointers[*value] = true;
+				}
+				changed |= !pointers[instr.result];
+				pointers[instr.result] = true;
+			}
+		}
+	}
+	for (ValueId value = 0; value < function.next_value; ++value)
+		if (pointers[value] && !m_constants[value]) m_value_sizes[value] = pointer_size();
+
+	// arguments passed on the stack are already in memory, so one use outside of a loop can read it from
+	// there instead of loading it into a register first
+	const auto register_args = argument_regs(function.name).size();
+	for (const auto& instr : function.blocks[0].code) {
+		if (instr.op == IrOp::Arg && static_cast<size_t>(instr.imm) >= register_args && use_count[instr.result] == 1
+			&& use_depth[instr.result] == 0)
+			m_memory_values[instr.result] = argument_slot(static_cast<size_t>(instr.imm), function.arg_count, m_value_sizes[instr.result]);
+	}
+	for (BlockId b = 0; b < function.blocks.size(); ++b)
+		select_addresses(function, b, use_count);
+	m_fused_compares.assign(function.next_value, nullptr);
+	for (const auto& block : function.blocks) {
+		std::vector<const IrInstr*> compares(function.next_value);
+		for (const auto& instr : block.code) {
+			if (is_comparison(instr.op) && instr.lanes == 1 && use_count[instr.result] == 1)
+				compares[instr.result] = &instr;
+			const bool fuses = instr.op == IrOp::Branch || (instr.op == IrOp::Select && instr.lanes == 1);
+			if (fuses && compares[instr.args[0]])
+				m_fused_compares[instr.args[0]] = compares[instr.args[0]];
+		}
+	}
+
+	// blocks stay in source order, with the ones splitting an edge right after where the edge starts
+	std::vector<BlockId> order;
+	for (BlockId b = 0; b < block_count; ++b) {
+		order.push_back(b);
+		for (BlockId split = block_count; split < function.blocks.size(); ++split)
+			if (function.blocks[split].preds[0] == b) order.push_back(split);
+	}
+
+	for (size_t i = 0; i < order.size(); ++i) {
+		const auto b = order[i];
+		const auto& block = function.blocks[b];
+		m_next_block = i + 1 < order.size() ? order[i + 1] : no_block;
+		m_loop_depth = block.loop_depth;
+		emit(Op::Label, { label_op(block_label(function, b)) });
+		for (const auto& instr : block.code)
+			compile_instr(function, b, instr);
 	}
+	m_loop_depth = 0;
 }
@@ -1,32 +1,149 @@
 #pragma once
 #include "parser.hpp"
-#include <unordered_map>
+#include "ir.hpp"
+#include "x86.hpp"
+
+// what lea computes, base + index * scale + disp, with the registers given as the ir values in them
+struct Address {
+	ValueId base = no_value;
+	ValueId index = no_value;
+	uint8_t scale = 1;
+	int64_t disp = 0;
+};
+
+// vector instructions loops can get vectorized with
+enum class Simd : uint8_t {
+	None,
+	Sse2,
+	Avx2,
+};
 
 class Compiler {
 public:
-	std::ostream& m_stream;
 	Parser& m_parser;
+	Target m_target;
+	// 0 lowers the ir as built, 1 optimizes it and cleans up the machine code, 2 optimizes harder
+	int m_opt_level = 2;
+	// how much bigger than the call it replaces a function can be and still get inlined
+	int m_inline_threshold = 10;
+	// iterations per trip around a partially unrolled loop, 1 turns unrolling off
+	int m_unroll_factor = 4;
+	Simd m_simd = Simd::Sse2;
+	// gets linked with the c library, so the program exits through its exit to flush what c code buffered
+	bool m_libc = false;
 	Function* m_cur_function = nullptr;
-	// TODO: not
-	size_t m_var_counter = 0;
-	std::unordered_map<std::string, int> m_variables;
+	// function currently being lowered
+	MachineFunction* m_machine_function = nullptr;
+	// virtual register of every ir value, phis included
+	std::vector<RegId> m_value_regs;
+	// the value of every ir constant, which get folded into their users instead of living in registers
+	std::vector<std::optional<int64_t>> m_constants;
+	// arguments used straight from their stack slot instead of getting loaded into a register
+	std::vector<std::optional<Operand>> m_memory_values;
+	// values computed by the instruction using them, so they don't get compiled on their own
+	std::vector<bool> m_folded;
+	// additions, with whatever got folded into them, done with a single lea
+	std::vector<std::optional<Address>> m_addresses;
+	// comparisons only used by the branch ending their block or a select in it, which get compiled into
+	// a cmp and jcc or cmov there
+	std::vector<const IrInstr*> m_fused_compares;
+	// bytes in every ir value, which is more than 4 for vectors and pointers on x86_64
+	std::vector<uint8_t> m_value_sizes;
+	// where every array of the function starts, relative to ebp
+	std::vector<int64_t> m_array_slots;
+	// the block laid out after the current one, which jumps to it can fall through to instead
+	BlockId m_next_block = no_block;
+	std::string m_return_label;
+	// where failed bounds checks and divisions that would fault jump, which only gets emitted after the
+	// return if something does
+	std::string m_trap_label;
+	bool m_traps = false;
 	size_t m_label_counter = 0;
-	size_t m_data_counter = 0;
+	uint8_t m_loop_depth = 0;
+	// optimized ir of every non builtin function that's still called, for --emit-ir
+	std::vector<IrFunction> m_ir;
+	// finished functions, _start first, ready to be written out or assembled
+	std::vector<MachineFunction> m_functions;
+	// contents of data_N
 	std::vector<std::string> m_strings;
+	// zeroed memory the runtime keeps its state in
+	std::vector<Global> m_globals;
 
-	Compiler(std::ostream& output, Parser& parser) : m_stream(output), m_parser(parser) {}
+	Compiler(Parser& parser, Target target = Target::X86, int opt_level = 2)
+		: m_parser(parser), m_target(target), m_opt_level(opt_level) {}
 
-	template <class... Args>
-	void write(const std::string_view& format, Args&&... args) {
-		format_to(m_stream, format, args...);
-		m_stream << '\n';
-	}
+	Instr& emit(Op op, std::vector<Operand> operands = {}, Cond cond = Cond::None);
+	RegId new_vreg() { return m_machine_function->new_vreg(); }
+	std::string new_label(const std::string_view& kind);
+	uint8_t pointer_size() const { return target_regs(m_target).pointer_size; }
+	// i32s in a vector, 1 when not vectorizing
+	int vector_lanes() const;
+	// memory at base + disp, with the base being a pointer sized register
+	Operand mem(RegId base, int64_t disp, uint8_t size = 4) const { return mem_op(base, disp, size, pointer_size()); }
+	Operand mem(Reg base, int64_t disp, uint8_t size = 4) const { return mem(reg_id(base), disp, size); }
 
-	void compile_expression(Expression&, bool by_reference = false);
-	void compile_statement(Statement&);
-	void compile_function(Function&);
+	// register, immediate or stack slot holding an ir value
+	Operand value_op(ValueId value);
+	// register holding an ir value, moving constants and stack slots into one first
+	RegId value_reg(ValueId value);
+	// register or stack slot holding an ir value, for operands that can't be immediates
+	Operand value_rm(ValueId value);
+	std::string block_label(const IrFunction&, BlockId block) const;
+	// copies the values flowing into the phis of to along the edge from from
+	void emit_phi_copies(const IrFunction&, BlockId from, BlockId to);
+	// emits the cmp for a comparison, returning the condition it's true on
+	Cond emit_compare(const IrInstr& instr);
+	// picks the additions in block worth turning into a lea, and the single use operands folded into them
+	void select_addresses(const IrFunction&, BlockId block, const std::vector<uint32_t>& use_count);
+	// a jump table when the cases are dense, a bit test when they go to a few places, otherwise a binary search
+	void compile_switch(const IrFunction&, BlockId block, const IrInstr& instr);
+	// the array element a Load or Store goes to, as a memory operand of size bytes
+	Operand element_op(const IrInstr& instr, uint8_t size);
+	// element index of what pointer points to, as a memory operand of size bytes
+	Operand pointer_element_op(ValueId pointer, ValueId index, uint8_t size);
+	// jumps to m_trap_label unless 0 <= args[0] < args[1]
+	void compile_check(const IrInstr& instr);
+	// instructions working on several lanes at once
+	void compile_vector(const IrInstr& instr);
+	// popcount, clz and ctz, which only get an instruction of their own with avx2
+	void compile_bit_count(const IrInstr& instr);
+	// moves the inputs into their registers, then copies the block in as it was written
+	void compile_asm(const IrFunction&, const IrInstr& instr);
+	void compile_instr(const IrFunction&, BlockId block, const IrInstr& instr);
+	void compile_ir(IrFunction&);
+	// whether calls to function pass the first arguments in internal_args and have it pop the rest, instead
+	// of going by the platform's c calling convention
+	bool internal_convention(const std::string& function) const;
+	std::span<const Reg> argument_regs(const std::string& function) const;
+	// stack slot of an argument that didn't get passed in a register
+	Operand argument_slot(size_t index, size_t count, uint8_t size = 4);
+	// loads argument index of the current function into a new virtual register
+	RegId load_argument(size_t index, size_t count, uint8_t size = 4);
+	// compiles ir into function, or function itself if it's a builtin
+	void compile_function(Function& function, IrFunction* ir);
+	void compile_builtin(Function&);
+	// inlines and optimizes m_ir
+	void optimize_program();
+	// moves the number and arguments into place and does the syscall, returning the result
+	RegId emit_syscall(const std::vector<Operand>& args, uint8_t result_size = 4);
+	// memory at a global, plus index * scale when there is one
+	Operand global_op(const std::string& name, uint8_t size, RegId index = no_reg, uint8_t scale = 1) const;
+	// print formats into a buffer in .bss, which flush writes out when it fills up and at exit
+	void compile_print(Function&);
+	void compile_flush(Function&);
+	// the heap runtime: bump allocation out of an mmapped arena, with free lists for small blocks
+	void compile_arena_alloc(Function&);
+	void compile_arena_free(Function&);
+	void compile_arena_reset(Function&);
+	// signed division by a non zero constant, with shifts or a multiply by its reciprocal instead of idiv
+	RegId divide_by_constant(RegId dividend, int64_t divisor);
+	RegId remainder_by_constant(RegId dividend, RegId quotient, int64_t divisor);
 
-	void generate_return(const Function& function);
+	// adds the prologue and epilogue to an allocated function
+	void finish_function(MachineFunction&);
 
 	void compile();
+	// nasm syntax
+	void write_asm(std::ostream&) const;
+	void write_ir(std::ostream&) const;
 };
@@ -0,0 +1,120 @@
+#include "consteval.hpp"
+#include "enums.hpp"
+#include "format.hpp"
+#include "intrinsics.hpp"
+#include "ir.hpp"
+
+namespace {
+	class ConstFolder {
+		Parser& m_parser;
+		const EvalLimits& m_limits;
+		Function* m_function = nullptr;
+		// the const locals of m_function worked out so far
+		std::vector<std::pair<std::string, Expression::LiteralData>> m_values;
+
+		const Expression::LiteralData* value_of(const std::string& name) const {
+			for (const auto& [var_name, value] : m_values)
+				if (var_name == name) return &value;
+			return nullptr;
+		}
+
+		bool is_const_fn(const std::string& name) const {
+			const auto& funcs = m_parser.m_functions;
+			const auto it = std::find_if(funcs.begin(), funcs.end(), [&](const Function& f) { return f.name == name; });
+			return it != funcs.end() && it->constant;
+		}
+
+		// whether the evaluator can work out an expression on its own. calls to const fns in it have already
+		// been folded by the time this gets asked, so the ones left couldn't be
+		static bool is_constant(const Expression& expression) {
+			const auto all_constant = [&] {
+				return std::all_of(expression.children.begin(), expression.children.end(), is_constant);
+			};
+			switch (expression.type) {
+				case ExpressionType::Literal:
+					return true;
+				case ExpressionType::Cast:
+				case ExpressionType::Operator:
+					return all_constant();
+				case ExpressionType::Call: {
+					const auto* intrinsic = find_intrinsic(std::get<Expression::CallData>(expression.data).function_name);
+					return intrinsic && is_pure(intrinsic->op) && all_constant();
+				}
+				default:
+					return false;
+			}
+		}
+
+		static Expression literal(const Expression& replaced, const Expression::LiteralData& value) {
+			Expression result(ExpressionType::Literal);
+			result.data = value;
+			result.span = replaced.span;
+			result.value_type = replaced.value_type.remove_reference();
+			return result;
+		}
+
+		// replaces expression with a literal of its value, unless the evaluator can't get one
+		bool evaluate(Expression& expression, const std::string_view what) {
+			Evaluator evaluator(m_parser, std::cout, m_limits);
+			const auto result = evaluator.evaluate(expression, *m_function);
+			if (result.status != EvalStatus::Ok) {
+				print("[warning] Couldn't work out {} while compiling ({}), so it's left to run at runtime", what, result.status);
+				print_file_span(m_parser.m_file_name, expression.span);
+				print('\n');
+				return false;
+			}
+			const auto value = expression.value_type.name == "bool"
+				? Expression::LiteralData { result.value != 0 }
+				: Expression::LiteralData { result.value };
+			expression = literal(expression, value);
+			return true;
+		}
+
+		void fold_expression(Expression& expression) {
+			for (auto& child : expression.children)
+				fold_expression(child);
+			if (expression.type == ExpressionType::Cast && expression.children[0].type == ExpressionType::Variable) {
+				if (const auto* value = value_of(std::get<Expression::VariableData>(expression.children[0].data).name))
+					expression = literal(expression, *value);
+			} else if (expression.type == ExpressionType::Call) {
+				const auto& name = std::get<Expression::CallData>(expression.data).function_name;
+				const auto constant_args = std::all_of(expression.children.begin(), expression.children.end(), is_constant);
+				if (is_const_fn(name) && constant_args)
+					evaluate(expression, format("the call to {}", name));
+			} else if (expression.type == ExpressionType::Assignment && expression.children[0].type == ExpressionType::Declaration) {
+				const auto& data = std::get<Expression::DeclarationData>(expression.children[0].data);
+				auto& value = expression.children[1];
+				if (!data.constant || !is_constant(value)) return;
+				if (value.type == ExpressionType::Literal || evaluate(value, format("the value of {}", data.var.name)))
+					m_values.emplace_back(data.var.name, std::get<Expression::LiteralData>(value.data));
+			}
+		}
+
+		void fold_statement(Statement& statement) {
+			for (auto& expression : statement.expressions)
+				fold_expression(expression);
+			for (auto& child : statement.children)
+				fold_statement(child);
+			if (statement.else_branch)
+				fold_statement(*statement.else_branch);
+		}
+
+	public:
+		ConstFolder(Parser& parser, const EvalLimits& limits) : m_parser(parser), m_limits(limits) {}
+
+		void fold(Function& function) {
+			m_function = &function;
+			m_values.clear();
+			for (auto& statement : function.statements)
+				fold_statement(statement);
+		}
+	};
+}
+
+void fold_const_calls(Parser& parser, const EvalLimits& limits) {
+	ConstFolder folder(parser, limits);
+	for (auto& function : parser.m_functions) {
+		if (function.builtin || function.external) continue;
+		folder.fold(function);
+	}
+}
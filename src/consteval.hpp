@@ -0,0 +1,8 @@
+#pragma once
+#include "evaluator.hpp"
+
+// Runs the calls to const fns with only constant arguments through the evaluator, replacing them with a
+// literal of what they gave back. const locals get worked out the same way, and their uses replaced with
+// the literal. anything that runs out of fuel or traps is left as it was, to happen at runtime instead,
+// where it does the same thing. only i32s and bools ever come out, so the compiled code just sees literals.
+void fold_const_calls(Parser& parser, const EvalLimits& limits);
@@ -0,0 +1,322 @@
+#include "elf.hpp"
+#include "utils.hpp"
+#include "format.hpp"
+#include <elf.h>
+#include <algorithm>
+
+namespace {
+	struct Elf32 {
+		using Ehdr = Elf32_Ehdr;
+		using Phdr = Elf32_Phdr;
+		using Shdr = Elf32_Shdr;
+		using Sym = Elf32_Sym;
+		// i386 uses implicit addends, stored in the field itself
+		using Rel = Elf32_Rel;
+		static constexpr bool rela = false;
+		static constexpr uint8_t elf_class = ELFCLASS32;
+		static constexpr uint16_t machine = EM_386;
+		static constexpr uint64_t base_address = 0x08048000;
+
+		static uint32_t reloc_info(uint32_t symbol, RelocKind kind) {
+			switch (kind) {
+				case RelocKind::Rel32: return ELF32_R_INFO(symbol, R_386_PC32);
+				case RelocKind::Abs32:
+				case RelocKind::Abs32Signed: return ELF32_R_INFO(symbol, R_386_32);
+				case RelocKind::Abs64: break;
+			}
+			unhandled("64 bit relocation on x86");
+		}
+		static uint8_t symbol_info(uint8_t bind, uint8_t type) { return ELF32_ST_INFO(bind, type); }
+	};
+
+	struct Elf64 {
+		using Ehdr = Elf64_Ehdr;
+		using Phdr = Elf64_Phdr;
+		using Shdr = Elf64_Shdr;
+		using Sym = Elf64_Sym;
+		using Rel = Elf64_Rela;
+		static constexpr bool rela = true;
+		static constexpr uint8_t elf_class = ELFCLASS64;
+		static constexpr uint16_t machine = EM_X86_64;
+		static constexpr uint64_t base_address = 0x400000;
+
+		static uint64_t reloc_info(uint32_t symbol, RelocKind kind) {
+			switch (kind) {
+				case RelocKind::Rel32: return ELF64_R_INFO(symbol, R_X86_64_PC32);
+				case RelocKind::Abs32: return ELF64_R_INFO(symbol, R_X86_64_32);
+				case RelocKind::Abs32Signed: return ELF64_R_INFO(symbol, R_X86_64_32S);
+				case RelocKind::Abs64: return ELF64_R_INFO(symbol, R_X86_64_64);
+			}
+			unhandled("relocation kind");
+		}
+		static uint8_t symbol_info(uint8_t bind, uint8_t type) { return ELF64_ST_INFO(bind, type); }
+	};
+
+	class Buffer {
+	public:
+		std::vector<uint8_t> bytes;
+
+		size_t size() const { return bytes.size(); }
+		template <class T>
+		void append(const T& value) {
+			const auto data = reinterpret_cast<const uint8_t*>(&value);
+			bytes.insert(bytes.end(), data, data + sizeof(T));
+		}
+		void append(const std::vector<uint8_t>& data) { bytes.insert(bytes.end(), data.begin(), data.end()); }
+		void append(const std::string& data) { bytes.insert(bytes.end(), data.begin(), data.end()); }
+		void align(size_t alignment) { bytes.resize((bytes.size() + alignment - 1) / alignment * alignment); }
+		template <class T>
+		void write_at(size_t offset, const T& value) {
+			std::copy_n(reinterpret_cast<const uint8_t*>(&value), sizeof(T), bytes.begin() + offset);
+		}
+	};
+
+	// string table builder, offset 0 is the empty string
+	class StringTable {
+	public:
+		std::string data = std::string(1, '\0');
+
+		uint32_t add(const std::string& string) {
+			const auto offset = data.size();
+			data += string;
+			data += '\0';
+			return static_cast<uint32_t>(offset);
+		}
+	};
+}
+
+static void patch(std::vector<uint8_t>& bytes, uint64_t offset, int64_t value, uint8_t size) {
+	for (uint8_t i = 0; i < size; ++i)
+		bytes[offset + i] = static_cast<uint8_t>(static_cast<uint64_t>(value) >> (i * 8));
+}
+
+static uint8_t field_size(RelocKind kind) {
+	return kind == RelocKind::Abs64 ? 8 : 4;
+}
+
+// the object file and executable share everything but program headers and relocations,
+// which an executable has applied already
+template <class E>
+static void write_elf(std::ostream& output, const ObjectCode& object, bool executable) {
+	using Addr = decltype(E::Ehdr::e_entry);
+	auto text = object.text;
+	auto data = object.data;
+
+	const size_t phnum = executable ? (data.empty() && !object.bss_size ? 1 : 2) : 0;
+	Buffer buffer;
+	buffer.bytes.resize(sizeof(typename E::Ehdr) + phnum * sizeof(typename E::Phdr));
+	buffer.align(16);
+	const auto text_offset = buffer.size();
+	buffer.bytes.resize(text_offset + text.size());
+	buffer.align(16);
+	const auto data_offset = buffer.size();
+
+	// executables get mapped straight from the file, with the data one page further
+	// so it never shares a page with the (read only) text
+	// with the bss right after the data, in the same segment
+	uint64_t text_address = 0, data_address = 0, bss_address = 0;
+	if (executable) {
+		text_address = E::base_address + text_offset;
+		data_address = E::base_address + 0x1000 + data_offset;
+		bss_address = data_address + (data.size() + 7) / 8 * 8;
+	}
+	const auto section_address = [&](SectionId section) {
+		return section == SectionId::Text ? text_address : section == SectionId::Data ? data_address : bss_address;
+	};
+	const auto section_bytes = [&](SectionId section) -> std::vector<uint8_t>& {
+		return section == SectionId::Text ? text : data;
+	};
+
+	// symbol table, locals have to come first
+	StringTable strtab;
+	std::vector<typename E::Sym> symbols(1);
+	const auto add_symbol = [&](uint32_t name, uint8_t bind, uint8_t type, uint16_t section, uint64_t value, uint64_t size) {
+		typename E::Sym symbol {};
+		symbol.st_name = name;
+		symbol.st_info = E::symbol_info(bind, type);
+		symbol.st_shndx = section;
+		symbol.st_value = static_cast<Addr>(value);
+		symbol.st_size = static_cast<decltype(symbol.st_size)>(size);
+		symbols.push_back(symbol);
+		return static_cast<uint32_t>(symbols.size() - 1);
+	};
+	// section header indices
+	constexpr uint16_t text_index = 1, data_index = 2, bss_index = 3;
+	const uint32_t text_symbol = add_symbol(0, STB_LOCAL, STT_SECTION, text_index, text_address, 0);
+	const uint32_t data_symbol = add_symbol(0, STB_LOCAL, STT_SECTION, data_index, data_address, 0);
+	const uint32_t bss_symbol = add_symbol(0, STB_LOCAL, STT_SECTION, bss_index, bss_address, 0);
+
+	std::vector<std::pair<std::string, Symbol>> functions;
+	for (const auto& name : object.symbol_order)
+		functions.emplace_back(name, object.symbols.at(name));
+	std::stable_sort(functions.begin(), functions.end(), [](const auto& a, const auto& b) { return a.second.offset < b.second.offset; });
+	const auto function_size = [&](size_t i) {
+		const auto end = i + 1 < functions.size() ? functions[i + 1].second.offset : text.size();
+		return end - functions[i].second.offset;
+	};
+	for (const bool global : { false, true }) {
+		for (size_t i = 0; i < functions.size(); ++i) {
+			const auto& [name, symbol] = functions[i];
+			if (symbol.global != global) continue;
+			add_symbol(strtab.add(name), global ? STB_GLOBAL : STB_LOCAL, STT_FUNC, text_index,
+				text_address + symbol.offset, function_size(i));
+		}
+	}
+	const auto first_global = std::find_if(symbols.begin() + 1, symbols.end(),
+		[](const auto& symbol) { return (symbol.st_info >> 4) == STB_GLOBAL; }) - symbols.begin();
+
+	// relocations, which an executable applies right away
+	std::unordered_map<std::string, uint32_t> undefined;
+	std::vector<typename E::Rel> relocations[2];
+	for (const auto& relocation : object.relocations) {
+		const auto it = object.symbols.find(relocation.symbol);
+		const auto pc_adjust = relocation.kind == RelocKind::Rel32 ? relocation.pc_distance : 0;
+		auto& bytes = section_bytes(relocation.section);
+		if (executable) {
+			assert(it != object.symbols.end(), format("undefined symbol {}", relocation.symbol));
+			const auto target = static_cast<int64_t>(section_address(it->second.section) + it->second.offset) + relocation.addend;
+			auto value = target;
+			if (relocation.kind == RelocKind::Rel32)
+				value -= static_cast<int64_t>(section_address(relocation.section) + relocation.offset + pc_adjust);
+			patch(bytes, relocation.offset, value, field_size(relocation.kind));
+			continue;
+		}
+
+		uint32_t symbol;
+		int64_t addend = relocation.addend - pc_adjust;
+		if (it != object.symbols.end()) {
+			// defined symbols are referred to through their section
+			const auto section = it->second.section;
+			symbol = section == SectionId::Text ? text_symbol : section == SectionId::Data ? data_symbol : bss_symbol;
+			addend += static_cast<int64_t>(it->second.offset);
+		} else {
+			auto& index = undefined[relocation.symbol];
+			if (!index)
+				index = add_symbol(strtab.add(relocation.symbol), STB_GLOBAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+			symbol = index;
+		}
+		typename E::Rel rel {};
+		rel.r_offset = static_cast<Addr>(relocation.offset);
+		rel.r_info = E::reloc_info(symbol, relocation.kind);
+		if constexpr (E::rela)
+			rel.r_addend = addend;
+		else
+			patch(bytes, relocation.offset, addend, field_size(relocation.kind));
+		relocations[static_cast<size_t>(relocation.section)].push_back(rel);
+	}
+
+	std::copy(text.begin(), text.end(), buffer.bytes.begin() + text_offset);
+	buffer.append(data);
+
+	// section headers
+	StringTable shstrtab;
+	std::vector<typename E::Shdr> sections(1);
+	const auto add_section = [&](uint32_t name, uint32_t type, uint64_t flags, uint64_t address,
+		size_t offset, size_t size, uint64_t alignment) -> typename E::Shdr& {
+		typename E::Shdr section {};
+		section.sh_name = name;
+		section.sh_type = type;
+		section.sh_flags = static_cast<decltype(section.sh_flags)>(flags);
+		section.sh_addr = static_cast<Addr>(address);
+		section.sh_offset = static_cast<decltype(section.sh_offset)>(offset);
+		section.sh_size = static_cast<decltype(section.sh_size)>(size);
+		section.sh_addralign = static_cast<decltype(section.sh_addralign)>(alignment);
+		return sections.emplace_back(section);
+	};
+	add_section(shstrtab.add(".text"), SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, text_address, text_offset, text.size(), 16);
+	add_section(shstrtab.add(".data"), SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, data_address, data_offset, data.size(), 8);
+	add_section(shstrtab.add(".bss"), SHT_NOBITS, SHF_ALLOC | SHF_WRITE, bss_address, data_offset + data.size(), object.bss_size, 8);
+
+	const auto symtab_index = static_cast<uint32_t>(sections.size() + !relocations[0].empty() + !relocations[1].empty());
+	const char* const rel_names[] = { E::rela ? ".rela.text" : ".rel.text", E::rela ? ".rela.data" : ".rel.data" };
+	for (uint32_t i = 0; i < 2; ++i) {
+		if (relocations[i].empty()) continue;
+		buffer.align(8);
+		const auto offset = buffer.size();
+		for (const auto& rel : relocations[i])
+			buffer.append(rel);
+		auto& section = add_section(shstrtab.add(rel_names[i]), E::rela ? SHT_RELA : SHT_REL, 0, 0, offset,
+			buffer.size() - offset, 8);
+		section.sh_link = symtab_index;
+		section.sh_info = i == 0 ? text_index : data_index;
+		section.sh_entsize = sizeof(typename E::Rel);
+	}
+
+	buffer.align(8);
+	const auto symtab_offset = buffer.size();
+	for (const auto& symbol : symbols)
+		buffer.append(symbol);
+	auto& symtab = add_section(shstrtab.add(".symtab"), SHT_SYMTAB, 0, 0, symtab_offset, buffer.size() - symtab_offset, 8);
+	symtab.sh_link = symtab_index + 1;
+	symtab.sh_info = static_cast<uint32_t>(first_global);
+	symtab.sh_entsize = sizeof(typename E::Sym);
+
+	add_section(shstrtab.add(".strtab"), SHT_STRTAB, 0, 0, buffer.size(), strtab.data.size(), 1);
+	buffer.append(strtab.data);
+	const auto shstrtab_name = shstrtab.add(".shstrtab");
+	add_section(shstrtab_name, SHT_STRTAB, 0, 0, buffer.size(), shstrtab.data.size(), 1);
+	buffer.append(shstrtab.data);
+
+	buffer.align(8);
+	const auto section_headers = buffer.size();
+	for (const auto& section : sections)
+		buffer.append(section);
+
+	typename E::Ehdr header {};
+	std::copy_n(ELFMAG, SELFMAG, header.e_ident);
+	header.e_ident[EI_CLASS] = E::elf_class;
+	header.e_ident[EI_DATA] = ELFDATA2LSB;
+	header.e_ident[EI_VERSION] = EV_CURRENT;
+	header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	header.e_type = executable ? ET_EXEC : ET_REL;
+	header.e_machine = E::machine;
+	header.e_version = EV_CURRENT;
+	header.e_ehsize = sizeof(typename E::Ehdr);
+	header.e_shoff = static_cast<decltype(header.e_shoff)>(section_headers);
+	header.e_shentsize = sizeof(typename E::Shdr);
+	header.e_shnum = static_cast<uint16_t>(sections.size());
+	header.e_shstrndx = static_cast<uint16_t>(sections.size() - 1);
+	if (executable) {
+		const auto start = object.symbols.find("_start");
+		assert(start != object.symbols.end(), "missing _start");
+		header.e_entry = static_cast<Addr>(text_address + start->second.offset);
+		header.e_phoff = sizeof(typename E::Ehdr);
+		header.e_phentsize = sizeof(typename E::Phdr);
+		header.e_phnum = static_cast<uint16_t>(phnum);
+
+		typename E::Phdr segment {};
+		segment.p_type = PT_LOAD;
+		// the headers get mapped along with the text, like ld does
+		segment.p_offset = 0;
+		segment.p_vaddr = segment.p_paddr = static_cast<Addr>(E::base_address);
+		segment.p_filesz = segment.p_memsz = static_cast<decltype(segment.p_filesz)>(text_offset + text.size());
+		segment.p_flags = PF_R | PF_X;
+		segment.p_align = 0x1000;
+		buffer.write_at(header.e_phoff, segment);
+		if (phnum > 1) {
+			segment.p_offset = static_cast<decltype(segment.p_offset)>(data_offset);
+			segment.p_vaddr = segment.p_paddr = static_cast<Addr>(data_address);
+			segment.p_filesz = static_cast<decltype(segment.p_filesz)>(data.size());
+			segment.p_memsz = static_cast<decltype(segment.p_memsz)>(bss_address + object.bss_size - data_address);
+			segment.p_flags = PF_R | PF_W;
+			buffer.write_at(header.e_phoff + sizeof(segment), segment);
+		}
+	}
+	buffer.write_at(0, header);
+
+	output.write(reinterpret_cast<const char*>(buffer.bytes.data()), static_cast<std::streamsize>(buffer.size()));
+}
+
+void write_object(std::ostream& output, const ObjectCode& object) {
+	if (object.target == Target::X86_64)
+		write_elf<Elf64>(output, object, false);
+	else
+		write_elf<Elf32>(output, object, false);
+}
+
+void write_executable(std::ostream& output, const ObjectCode& object) {
+	if (object.target == Target::X86_64)
+		write_elf<Elf64>(output, object, true);
+	else
+		write_elf<Elf32>(output, object, true);
+}
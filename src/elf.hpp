@@ -0,0 +1,9 @@
+#pragma once
+#include "assembler.hpp"
+#include <ostream>
+
+// relocatable object file, to be linked with other objects
+void write_object(std::ostream& output, const ObjectCode& object);
+
+// statically linked executable, entering at _start. every symbol has to be defined
+void write_executable(std::ostream& output, const ObjectCode& object);
@@ -1,6 +1,7 @@
 #pragma once
 #include "lexer.hpp"
 #include "parser.hpp"
+#include "evaluator.hpp"
 
 inline const char* enum_name(const TokenType& t) {
 	switch (t) {
@@ -14,10 +15,15 @@ inline const char* enum_name(const TokenType& t) {
 		case TokenType::Identifier: return "Identifier";
 		case TokenType::LeftBracket: return "LeftBracket";
 		case TokenType::RightBracket: return "RightBracket";
+		case TokenType::LeftSquare: return "LeftSquare";
+		case TokenType::RightSquare: return "RightSquare";
 		case TokenType::Assign: return "Assign";
 		case TokenType::Comma: return "Comma";
 		case TokenType::Keyword: return "Keyword";
 		case TokenType::Operator: return "Operator";
+		case TokenType::Arrow: return "Arrow";
+		case TokenType::Range: return "Range";
+		case TokenType::Dot: return "Dot";
 	}
 	return "";
 }
@@ -28,7 +34,10 @@ inline const char* enum_name(const StatementType& t) {
 		case StatementType::Return: return "Return";
 		case StatementType::If: return "If";
 		case StatementType::While: return "While";
+		case StatementType::For: return "For";
 		case StatementType::Else: return "Else";
+		case StatementType::Match: return "Match";
+		case StatementType::Case: return "Case";
 	}
 	return "";
 }
@@ -42,6 +51,10 @@ inline const char* enum_name(const ExpressionType& t) {
 		case ExpressionType::Operator: return "Operator";
 		case ExpressionType::Call: return "Call";
 		case ExpressionType::Cast: return "Cast";
+		case ExpressionType::Index: return "Index";
+		case ExpressionType::Slice: return "Slice";
+		case ExpressionType::Field: return "Field";
+		case ExpressionType::Asm: return "Asm";
 	}
 	return "";
 }
@@ -55,8 +68,31 @@ inline const char* enum_name(const OperatorType& t) {
 		case OperatorType::Subtraction: return "Subtraction";
 		case OperatorType::Multiplication: return "Multiplication";
 		case OperatorType::Division: return "Division";
+		case OperatorType::Modulo: return "Modulo";
 		case OperatorType::Equals: return "Equals";
 		case OperatorType::NotEquals: return "NotEquals";
+		case OperatorType::Less: return "Less";
+		case OperatorType::LessEquals: return "LessEquals";
+		case OperatorType::Greater: return "Greater";
+		case OperatorType::GreaterEquals: return "GreaterEquals";
+		case OperatorType::And: return "And";
+		case OperatorType::Or: return "Or";
+	}
+	return "";
+}
+
+inline const char* enum_name(const EvalStatus& t) {
+	switch (t) {
+		case EvalStatus::Ok: return "Ok";
+		case EvalStatus::OutOfFuel: return "OutOfFuel";
+		case EvalStatus::CallDepthExceeded: return "CallDepthExceeded";
+		case EvalStatus::DivisionByZero: return "DivisionByZero";
+		case EvalStatus::DivisionOverflow: return "DivisionOverflow";
+		case EvalStatus::OutOfBounds: return "OutOfBounds";
+		case EvalStatus::NullPointer: return "NullPointer";
+		case EvalStatus::OutOfMemory: return "OutOfMemory";
+		case EvalStatus::ExternUnavailable: return "ExternUnavailable";
+		case EvalStatus::AsmUnavailable: return "AsmUnavailable";
 	}
 	return "";
 }
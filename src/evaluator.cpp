@@ -1,28 +1,198 @@
 #include "evaluator.hpp"
 #include "enums.hpp"
+#include "intrinsics.hpp"
+#include <charconv>
+#include <dlfcn.h>
 
-int Evaluator::run() {
+// i32 arithmetic wraps around, same as the compiled code
+template <class Value, class Op>
+static int wrapping(const Value& lhs, const Value& rhs, Op&& op) {
+	return static_cast<int>(op(static_cast<uint32_t>(std::get<int>(lhs.data)), static_cast<uint32_t>(std::get<int>(rhs.data))));
+}
+
+EvalResult Evaluator::run(std::vector<Value> args) {
+	if (m_reload_pending.load(std::memory_order_acquire))
+		apply_reload();
+	auto* main = find_function("main");
+	assert(main != nullptr, "main not found");
+	const char marker = 0;
+	m_stack_base = reinterpret_cast<uintptr_t>(&marker);
+	m_depth = 0;
+	try {
+		const auto value = eval_function(*main, std::move(args));
+		assert(std::holds_alternative<int>(value.data), format("oh cmon {}", value.data.index()));
+		flush();
+		return EvalResult { EvalStatus::Ok, std::get<int>(value.data) };
+	} catch (const Trap& trap) {
+		flush();
+		return EvalResult { trap.status };
+	}
+}
+
+EvalResult Evaluator::evaluate(Expression& expression, Function& parent) {
+	const char marker = 0;
+	m_stack_base = reinterpret_cast<uintptr_t>(&marker);
+	m_depth = 0;
+	try {
+		Scope scope;
+		const auto value = eval_expression(expression, parent, scope);
+		flush();
+		if (const auto* boolean = std::get_if<bool>(&value.data))
+			return EvalResult { EvalStatus::Ok, *boolean };
+		return EvalResult { EvalStatus::Ok, std::get<int>(value.data) };
+	} catch (const Trap& trap) {
+		flush();
+		return EvalResult { trap.status };
+	}
+}
+
+void Evaluator::flush() {
+	m_output.write(m_print_buffer.data(), static_cast<std::streamsize>(m_print_buffer.size()));
+	m_output.flush();
+	m_print_buffer.clear();
+}
+
+void Evaluator::post_reload(std::vector<std::unique_ptr<Function>> functions) {
+	const std::lock_guard lock(m_reload_mutex);
+	for (auto& function : functions)
+		m_pending_functions.push_back(std::move(function));
+	m_reload_pending.store(true, std::memory_order_release);
+}
+
+void Evaluator::apply_reload() {
+	const std::lock_guard lock(m_reload_mutex);
+	for (auto& function : m_pending_functions) {
+		m_function_overrides[function->name] = function.get();
+		m_reloaded_functions.push_back(std::move(function));
+	}
+	m_pending_functions.clear();
+	m_reload_pending.store(false, std::memory_order_relaxed);
+}
+
+Function* Evaluator::find_function(const std::string& name) {
+	if (!m_function_overrides.empty()) {
+		const auto it = m_function_overrides.find(name);
+		if (it != m_function_overrides.end()) return it->second;
+	}
 	for (auto& function : m_parser.m_functions) {
-		if (function.name == "main") {
-			const auto value = eval_function(function, {});
-			assert(std::holds_alternative<int>(value.data), format("oh cmon {}", value.data.index()));
-			return std::get<int>(value.data);
+		if (function.name == name) return &function;
+	}
+	return nullptr;
+}
+
+Evaluator::Value Evaluator::initial_value(const Type& type) {
+	Value value { type };
+	const auto* s = type.is_array() || type.is_slice() || type.is_pointer() ? nullptr : m_parser.find_struct(type.name);
+	if (type.is_pointer()) {
+		value.data = Pointer {};
+	} else if (type.is_array()) {
+		// arrays start out zeroed, like in the compiled code, and slices empty
+		value.data = Elements { std::make_shared<std::vector<Value>>(type.length, Value { type.element(), 0 }), 0, type.length };
+	} else if (type.is_slice()) {
+		value.data = Elements {};
+	} else if (s) {
+		Fields fields;
+		for (const auto& field : s->fields) {
+			auto& added = fields.values.emplace_back(initial_value(field.type));
+			if (field.type.name == "i32") added.data = 0;
+			if (field.type.name == "bool") added.data = false;
 		}
+		value.data = std::move(fields);
+	}
+	return value;
+}
+
+Evaluator::Value Evaluator::eval_heap_builtin(Expression& expression, Function& parent, Scope& scope) {
+	const auto& name = std::get<Expression::CallData>(expression.data).function_name;
+	if (name == "reset") {
+		m_heap_bytes = 0;
+		return Value { expression.value_type };
+	}
+	if (name == "free") {
+		eval_expression(expression.children[0], parent, scope);
+		return Value { expression.value_type };
+	}
+	const auto take = [&](size_t bytes) {
+		m_heap_bytes += (bytes + 7) / 8 * 8;
+		if (m_heap_bytes > m_max_heap_bytes) throw Trap { EvalStatus::OutOfMemory };
+	};
+	if (expression.children.size() == 1) {
+		const auto* s = m_parser.find_struct(expression.value_type.name);
+		take(s->size);
+		return Value { expression.value_type, Pointer { std::make_shared<Value>(initial_value(Type { s->name })) } };
+	}
+	const auto length = std::get<int>(eval_expression(expression.children[1], parent, scope).data);
+	if (length < 0 || static_cast<size_t>(length) > max_alloc_length)
+		throw Trap { EvalStatus::OutOfBounds };
+	const auto count = static_cast<size_t>(length);
+	take(count * 4);
+	return Value { expression.value_type, Elements { std::make_shared<std::vector<Value>>(count, Value { Type { "i32" }, 0 }), 0, count } };
+}
+
+Evaluator::Value Evaluator::eval_builtin(Function& function, std::vector<Value>& args) {
+	if (function.name == "print") {
+		// same as the compiled code, which only writes out once the buffer fills up
+		if (m_print_buffer.size() > print_buffer_size - 16) flush();
+		char digits[16];
+		const auto end = std::to_chars(digits, digits + sizeof(digits), std::get<int>(args[0].data)).ptr;
+		m_print_buffer.append(digits, end);
+		m_print_buffer += '\n';
+		return Value { function.return_type };
+	}
+	if (function.name == "flush") {
+		flush();
+		return Value { function.return_type };
+	}
+	unhandled(format("unknown builtin {}", function.name));
+}
+
+Evaluator::Value Evaluator::eval_extern(Function& function, std::vector<Value>& args) {
+	auto& symbol = m_externs[function.name];
+	if (!symbol)
+		symbol = dlsym(RTLD_DEFAULT, function.name.c_str());
+	// pointers and slices here aren't memory c could use
+	const auto number = [](const Type& type) { return type == Type { "i32" } || type == Type { "bool" }; };
+	const auto& returned = function.return_type;
+	if (!symbol || args.size() > 6 || !std::all_of(function.arguments.begin(), function.arguments.end(),
+		[&](const Variable& argument) { return number(argument.type); }) || (returned != Type { "void" } && !number(returned)))
+		throw Trap { EvalStatus::ExternUnavailable };
+	intptr_t words[6] = {};
+	for (size_t i = 0; i < args.size(); ++i) {
+		const auto& data = args[i].data;
+		words[i] = std::holds_alternative<int>(data) ? std::get<int>(data) : std::get<bool>(data);
 	}
-	assert(false, "main not found");
-	return -1;
+	// the caller cleans up in the c conventions, so passing arguments the function doesn't take is harmless
+	using Extern = intptr_t (*)(intptr_t, intptr_t, intptr_t, intptr_t, intptr_t, intptr_t);
+	const auto result = reinterpret_cast<Extern>(symbol)(words[0], words[1], words[2], words[3], words[4], words[5]);
+	if (returned == Type { "i32" })
+		return Value { returned, static_cast<int>(result) };
+	if (returned == Type { "bool" })
+		return Value { returned, (result & 0xff) != 0 };
+	return Value { returned };
 }
 
 Evaluator::Value Evaluator::eval_function(Function& function, std::vector<Value> args) {
 	Scope scope;
 	assert(function.arguments.size() == args.size(), "function args mismatch");
+	if (function.builtin)
+		return eval_builtin(function, args);
+	if (function.external)
+		return eval_extern(function, args);
+	consume_fuel();
+	const char marker = 0;
+	if (m_depth == m_max_depth || m_stack_base - reinterpret_cast<uintptr_t>(&marker) > m_max_stack_bytes)
+		throw Trap { EvalStatus::CallDepthExceeded };
+	++m_depth;
 	for (size_t i = 0; i < args.size(); ++i) {
 		scope.add_variable(function.arguments[i].name, std::move(args[i]));
 	}
 	args.clear();
 	for (auto& stmt : function.statements) {
 		const auto result = eval_statement(stmt, function, scope);
-		if (result) return *result;
+		if (result) {
+			--m_depth;
+			return *result;
+		}
 	}
 	unhandled("No return statement was reached.. implement implicit return for void");
 }
@@ -60,6 +230,32 @@ std::optional<Evaluator::Value> Evaluator::eval_statement(Statement& stmt, Funct
 				const auto result = eval_statement(stmt, parent, scope);
 				if (result) return *result;
 			}
+			consume_fuel();
+		}
+	} else if (stmt.type == StatementType::For) {
+		const auto start = std::get<int>(eval_expression(stmt.expressions[1], parent, scope).data);
+		const auto end = std::get<int>(eval_expression(stmt.expressions[2], parent, scope).data);
+		eval_expression(stmt.expressions[0], parent, scope);
+		const auto& name = std::get<Expression::DeclarationData>(stmt.expressions[0].data).var.name;
+		// looked up every time, since declarations in the body can move the variables around
+		for (int i = start; i < end; ++i) {
+			scope.get_variable(name)->get().data = i;
+			for (auto& stmt : stmt.children) {
+				const auto result = eval_statement(stmt, parent, scope);
+				if (result) return *result;
+			}
+			consume_fuel();
+		}
+		scope.get_variable(name)->get().data = std::max(start, end);
+	} else if (stmt.type == StatementType::Match) {
+		const auto value = eval_expression(stmt.expressions[0], parent, scope);
+		const auto key = std::holds_alternative<bool>(value.data) ? std::get<bool>(value.data) : std::get<int>(value.data);
+		const auto arm = match_table(stmt).find(key);
+		if (arm != MatchTable::no_case) {
+			for (auto& stmt : stmt.children[arm].children) {
+				const auto result = eval_statement(stmt, parent, scope);
+				if (result) return *result;
+			}
 		}
 	} else {
 		assert(false, format("Unhandled statement: {}", enum_name(stmt.type)));
@@ -67,6 +263,73 @@ std::optional<Evaluator::Value> Evaluator::eval_statement(Statement& stmt, Funct
 	return std::nullopt;
 }
 
+uint32_t Evaluator::MatchTable::find(int value) const {
+	if (!cases.empty()) {
+		const auto index = static_cast<uint64_t>(value - first);
+		return index < cases.size() ? cases[index] : else_case;
+	}
+	const auto it = sparse.find(value);
+	return it != sparse.end() ? it->second : else_case;
+}
+
+Evaluator::MatchTable::MatchTable(const Statement& match) {
+	std::vector<std::pair<int, uint32_t>> values;
+	for (uint32_t arm = 0; arm < match.children.size(); ++arm) {
+		const auto& expressions = match.children[arm].expressions;
+		if (expressions.empty())
+			else_case = arm;
+		for (const auto& expression : expressions) {
+			const auto& literal = std::get<Expression::LiteralData>(expression.data).value;
+			values.push_back({ std::holds_alternative<bool>(literal) ? std::get<bool>(literal) : std::get<int>(literal), arm });
+		}
+	}
+	if (values.empty()) return;
+	const auto [min, max] = std::minmax_element(values.begin(), values.end());
+	const auto range = static_cast<int64_t>(max->first) - min->first + 1;
+	// an array as long as it's not mostly holes
+	if (range <= static_cast<int64_t>(values.size()) * 4 + 16) {
+		first = min->first;
+		cases.assign(static_cast<size_t>(range), else_case);
+		for (const auto& [value, arm] : values)
+			cases[static_cast<size_t>(value - first)] = arm;
+	} else {
+		for (const auto& [value, arm] : values)
+			sparse[value] = arm;
+	}
+}
+
+static void add_match_tables(const Statement& statement, Evaluator::MatchTables& tables) {
+	if (statement.type == StatementType::Match)
+		tables.try_emplace(&statement, statement);
+	for (const auto& child : statement.children)
+		add_match_tables(child, tables);
+	if (statement.else_branch)
+		add_match_tables(*statement.else_branch, tables);
+}
+
+Evaluator::MatchTables Evaluator::match_tables(const Parser& parser) {
+	MatchTables tables;
+	for (const auto& function : parser.m_functions)
+		for (const auto& statement : function.statements)
+			add_match_tables(statement, tables);
+	return tables;
+}
+
+const Evaluator::MatchTable& Evaluator::match_table(const Statement& match) {
+	if (m_shared_match_tables) {
+		const auto it = m_shared_match_tables->find(&match);
+		if (it != m_shared_match_tables->end()) return it->second;
+	}
+	return m_match_tables.try_emplace(&match, match).first->second;
+}
+
+// the elements of an array or slice, whether it's a reference to the variable or a copy of it
+static const Evaluator::Elements& elements_of(const Evaluator::Value& value) {
+	if (const auto* reference = std::get_if<std::reference_wrapper<Evaluator::Value>>(&value.data))
+		return std::get<Evaluator::Elements>(reference->get().data);
+	return std::get<Evaluator::Elements>(value.data);
+}
+
 Evaluator::Value Evaluator::eval_expression(Expression& expression, Function& parent, Scope& scope) {
 	return expression.match(
 		[&](const Expression::LiteralData& data) {
@@ -77,13 +340,48 @@ Evaluator::Value Evaluator::eval_expression(Expression& expression, Function& pa
 		[&](const Expression::OperatorData& data) {
 			// TODO: OperatorKind or smth, at least have some way to separate into binary and unary
 			auto lhs = eval_expression(expression.children[0], parent, scope);
+			if (is_operator_logical(data.op_type)) {
+				// the rhs only runs if the lhs doesn't already decide it
+				const bool decided = std::get<bool>(lhs.data) == (data.op_type == OperatorType::Or);
+				if (decided) return Value { expression.value_type, std::get<bool>(lhs.data) };
+				return Value { expression.value_type, std::get<bool>(eval_expression(expression.children[1], parent, scope).data) };
+			}
 			auto rhs = eval_expression(expression.children[1], parent, scope);
 			if (data.op_type == OperatorType::Addition) {
 				if (expression.value_type.name == "i32") {
 					return Value {
-						expression.value_type, std::get<int>(lhs.data) + std::get<int>(rhs.data)
+						expression.value_type, wrapping(lhs, rhs, [](uint32_t a, uint32_t b) { return a + b; })
+					};
+				}
+			} else if (data.op_type == OperatorType::Subtraction) {
+				if (expression.value_type.name == "i32") {
+					return Value {
+						expression.value_type, wrapping(lhs, rhs, [](uint32_t a, uint32_t b) { return a - b; })
+					};
+				}
+			} else if (data.op_type == OperatorType::Multiplication) {
+				if (expression.value_type.name == "i32") {
+					return Value {
+						expression.value_type, wrapping(lhs, rhs, [](uint32_t a, uint32_t b) { return a * b; })
 					};
 				}
+			} else if (data.op_type == OperatorType::Division || data.op_type == OperatorType::Modulo) {
+				if (expression.value_type.name == "i32") {
+					const auto a = static_cast<int64_t>(std::get<int>(lhs.data));
+					const auto b = static_cast<int64_t>(std::get<int>(rhs.data));
+					if (b == 0) throw Trap { EvalStatus::DivisionByZero };
+					if (a == INT32_MIN && b == -1) throw Trap { EvalStatus::DivisionOverflow };
+					const auto result = data.op_type == OperatorType::Division ? a / b : a % b;
+					return Value { expression.value_type, static_cast<int>(static_cast<uint32_t>(result)) };
+				}
+			} else if (data.op_type == OperatorType::Less) {
+				return Value { expression.value_type, std::get<int>(lhs.data) < std::get<int>(rhs.data) };
+			} else if (data.op_type == OperatorType::LessEquals) {
+				return Value { expression.value_type, std::get<int>(lhs.data) <= std::get<int>(rhs.data) };
+			} else if (data.op_type == OperatorType::Greater) {
+				return Value { expression.value_type, std::get<int>(lhs.data) > std::get<int>(rhs.data) };
+			} else if (data.op_type == OperatorType::GreaterEquals) {
+				return Value { expression.value_type, std::get<int>(lhs.data) >= std::get<int>(rhs.data) };
 			} else if (data.op_type == OperatorType::Equals) {
 				return Value {
 					expression.value_type,
@@ -113,7 +411,7 @@ Evaluator::Value Evaluator::eval_expression(Expression& expression, Function& pa
 			std::abort();
 		},
 		[&](const Expression::DeclarationData& data) {
-			Value& value = scope.add_variable(data.var.name, Value { data.var.type });
+			Value& value = scope.add_variable(data.var.name, initial_value(data.var.type));
 			return Value { data.var.type.add_reference(), std::ref(value) };
 		},
 		[&](const Expression::VariableData& data) {
@@ -132,12 +430,60 @@ Evaluator::Value Evaluator::eval_expression(Expression& expression, Function& pa
 			return lhs;
 		},
 		[&](const Expression::CallData& data) {
+			if (data.function_name == "len")
+				return Value { expression.value_type, static_cast<int>(elements_of(eval_expression(expression.children[0], parent, scope)).length) };
+			if (data.function_name == "alloc" || data.function_name == "free" || data.function_name == "reset")
+				return eval_heap_builtin(expression, parent, scope);
+			if (const auto* intrinsic = find_intrinsic(data.function_name)) {
+				std::vector<int32_t> args;
+				for (auto& child : expression.children)
+					args.push_back(std::get<int>(eval_expression(child, parent, scope).data));
+				const auto result = intrinsic->evaluate(args);
+				return intrinsic->returns ? Value { expression.value_type, result } : Value { expression.value_type };
+			}
 			std::vector<Value> values;
 			for (auto& child : expression.children) {
 				values.emplace_back(eval_expression(child, parent, scope));
 			}
-			auto& function = m_parser.function_by_name(data.function_name);
-			return eval_function(function, values);
+			// function calls are the boundary where hot reloaded code gets swapped in
+			if (m_reload_pending.load(std::memory_order_relaxed))
+				apply_reload();
+			auto* function = find_function(data.function_name);
+			assert(function != nullptr, "function not found in evaluator, should not happen");
+			return eval_function(*function, values);
+		},
+		[&](const Expression::FieldData& data) {
+			auto value = eval_expression(expression.children[0], parent, scope);
+			const auto* reference = std::get_if<std::reference_wrapper<Value>>(&value.data);
+			if (const auto* pointer = std::get_if<Pointer>(reference ? &reference->get().data : &value.data)) {
+				if (!pointer->target) throw Trap { EvalStatus::NullPointer };
+				return Value { expression.value_type, std::ref(std::get<Fields>(pointer->target->data).values[data.index]) };
+			}
+			if (reference)
+				return Value { expression.value_type, std::ref(std::get<Fields>(reference->get().data).values[data.index]) };
+			return std::move(std::get<Fields>(value.data).values[data.index]);
+		},
+		[&](const Expression::AsmData&) -> Value {
+			throw Trap { EvalStatus::AsmUnavailable };
+		},
+		[&](MatchValue<ExpressionType::Index>) {
+			const auto index = std::get<int>(eval_expression(expression.children[1], parent, scope).data);
+			const auto elements = elements_of(eval_expression(expression.children[0], parent, scope));
+			if (index < 0 || static_cast<size_t>(index) >= elements.length)
+				throw Trap { EvalStatus::OutOfBounds };
+			return Value { expression.value_type, std::ref((*elements.storage)[elements.start + static_cast<size_t>(index)]) };
+		},
+		[&](MatchValue<ExpressionType::Slice>) {
+			auto elements = elements_of(eval_expression(expression.children[0], parent, scope));
+			if (expression.children.size() == 1)
+				return Value { expression.value_type, elements };
+			const auto start = std::get<int>(eval_expression(expression.children[1], parent, scope).data);
+			const auto end = std::get<int>(eval_expression(expression.children[2], parent, scope).data);
+			if (start < 0 || start > end || static_cast<size_t>(end) > elements.length)
+				throw Trap { EvalStatus::OutOfBounds };
+			elements.start += static_cast<size_t>(start);
+			elements.length = static_cast<size_t>(end - start);
+			return Value { expression.value_type, elements };
 		},
 		[&](MatchValue<ExpressionType::Cast>) {
 			auto value = eval_expression(expression.children[0], parent, scope);
@@ -148,6 +494,7 @@ Evaluator::Value Evaluator::eval_expression(Expression& expression, Function& pa
 			if (child_type.reference && !expression.value_type.reference) {
 				return std::get<std::reference_wrapper<Value>>(value.data).get();
 			}
+			return value;
 		},
 		[&](auto) {
 			assert(false, format("unhandled expression: {}", enum_name(expression.type)));
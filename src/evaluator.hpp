@@ -1,14 +1,127 @@
 #pragma once
 
 #include "parser.hpp"
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+enum class EvalStatus {
+	Ok,
+	OutOfFuel,
+	CallDepthExceeded,
+	DivisionByZero,
+	// int min / -1, which idiv traps on too
+	DivisionOverflow,
+	OutOfBounds,
+	NullPointer,
+	// allocated more than max_heap_bytes since the last reset
+	OutOfMemory,
+	// called an extern function that isn't in the evaluator's process, or takes or returns something
+	// other than numbers and bools
+	ExternUnavailable,
+	// ran an asm block, which only compiled code can
+	AsmUnavailable,
+};
+
+struct EvalLimits {
+	// fuel is only spent on function entries and loop back edges, so straight line code runs unmetered
+	uint64_t fuel = UINT64_MAX;
+	size_t max_depth = 10000;
+	// eval_function recurses natively, so deep recursion is also cut off once this much
+	// native stack is used, well under the usual 8MB main and thread stacks
+	size_t max_stack_bytes = 4 * 1024 * 1024;
+	// what alloc can hand out before a reset, which is as much as the compiled code's arena has on x86_64.
+	// free doesn't give anything back, since only the compiled code reuses memory
+	size_t max_heap_bytes = size_t(1) << 30;
+};
+
+struct EvalResult {
+	EvalStatus status = EvalStatus::Ok;
+	int value = 0;
+};
 
 class Evaluator {
-	Parser& m_parser;
+public:
+	struct Value;
+	// an array, or a slice of one sharing its storage
+	struct Elements {
+		std::shared_ptr<std::vector<Value>> storage;
+		size_t start = 0;
+		size_t length = 0;
+	};
+	// a struct's fields, in the order they were written
+	struct Fields {
+		std::vector<Value> values;
+	};
+	// a struct somewhere on the heap, or nothing when it's null
+	struct Pointer {
+		std::shared_ptr<Value> target;
 
+		bool operator==(const Pointer&) const = default;
+	};
 	struct Value {
 		Type type;
-		std::variant<std::monostate, int, bool, std::string, std::reference_wrapper<Value>> data;
+		std::variant<std::monostate, int, bool, std::string, std::reference_wrapper<Value>, Elements, Fields, Pointer> data;
 	};
+	// which case of a match statement each value goes to
+	struct MatchTable {
+		static constexpr uint32_t no_case = UINT32_MAX;
+		// cases[value - first] when the values are close enough together, otherwise looked up in sparse
+		int64_t first = 0;
+		std::vector<uint32_t> cases;
+		std::unordered_map<int, uint32_t> sparse;
+		uint32_t else_case = no_case;
+
+		explicit MatchTable(const Statement& match);
+		uint32_t find(int value) const;
+	};
+	using MatchTables = std::unordered_map<const Statement*, MatchTable>;
+	// the tables of every match statement in the program, so evaluators running it at the same time, like
+	// batch workers, can share them instead of each building their own
+	static MatchTables match_tables(const Parser& parser);
+private:
+	Parser& m_parser;
+	std::ostream& m_output;
+	// what print wrote that hasn't gone to m_output yet
+	std::string m_print_buffer;
+	// extern functions found in the process so far
+	std::unordered_map<std::string, void*> m_externs;
+
+	uint64_t m_fuel;
+	size_t m_max_depth;
+	size_t m_max_stack_bytes;
+	size_t m_max_heap_bytes;
+	// allocated since the last reset, rounded up to 8 bytes like the compiled code does
+	size_t m_heap_bytes = 0;
+	size_t m_depth = 0;
+	uintptr_t m_stack_base = 0;
+
+	// thrown when a limit is hit, unwinding all the way back to run()
+	struct Trap {
+		EvalStatus status;
+	};
+	void consume_fuel() {
+		if (m_fuel-- == 0) throw Trap { EvalStatus::OutOfFuel };
+	}
+
+	// hot reloading. new function bodies are posted from another thread and swapped in
+	// at the next call boundary. the old bodies are kept alive since frames may still be running them
+	std::atomic<bool> m_reload_pending = false;
+	std::mutex m_reload_mutex;
+	std::vector<std::unique_ptr<Function>> m_pending_functions;
+	std::vector<std::unique_ptr<Function>> m_reloaded_functions;
+	std::unordered_map<std::string, Function*> m_function_overrides;
+
+	void apply_reload();
+	Function* find_function(const std::string& name);
+
+	// tables of the match statements the shared ones don't have, like ones in reloaded functions,
+	// built the first time the statement runs
+	const MatchTables* m_shared_match_tables;
+	MatchTables m_match_tables;
+	const MatchTable& match_table(const Statement& match);
+
 	struct Scope {
 		std::vector<std::pair<std::string, Value>> variables;
 
@@ -22,15 +135,38 @@ class Evaluator {
 			return std::nullopt;
 		}
 		Value& add_variable(const std::string& name, Value&& value) {
+			// declaring a name again reuses its slot, like the compiler does
+			if (auto existing = get_variable(name)) return existing->get() = value;
 			variables.push_back({name, value});
 			return variables.back().second;
 		}
 	};
+	// what a variable of type starts out as, with structs zeroed like they are in the compiled code
+	Value initial_value(const Type& type);
+	// alloc, free and reset
+	Value eval_heap_builtin(Expression&, Function& parent, Scope& scope);
+	Value eval_builtin(Function& function, std::vector<Value>& args);
+	// looks the function up with dlsym, so whatever the evaluator got linked with can be called
+	Value eval_extern(Function& function, std::vector<Value>& args);
+	// writes out what print buffered
+	void flush();
 	Value eval_function(Function& function, std::vector<Value> args);
 	std::optional<Value> eval_statement(Statement&, Function& parent, Scope& scope);
 	Value eval_expression(Expression&, Function& parent, Scope& scope);
 public:
-	Evaluator(Parser& parser) : m_parser(parser) {}
+	// output is where builtins like print write to, so batch runs can capture it per record. match_tables
+	// is only read, and has to outlive the evaluator
+	Evaluator(Parser& parser, std::ostream& output = std::cout, const EvalLimits& limits = {},
+		const MatchTables* match_tables = nullptr)
+		: m_parser(parser), m_output(output), m_fuel(limits.fuel), m_max_depth(limits.max_depth),
+		m_max_stack_bytes(limits.max_stack_bytes), m_max_heap_bytes(limits.max_heap_bytes),
+		m_shared_match_tables(match_tables) {}
+
+	EvalResult run(std::vector<Value> args = {});
+	// evaluates an expression that doesn't use any variables, calling whatever functions it needs to.
+	// bools come back as 0 or 1
+	EvalResult evaluate(Expression& expression, Function& parent);
 
-	int run();
+	// thread safe, takes effect on the next function call made by the running program
+	void post_reload(std::vector<std::unique_ptr<Function>> functions);
 };
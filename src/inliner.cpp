@@ -0,0 +1,267 @@
+#include "inliner.hpp"
+#include "format.hpp"
+#include "utils.hpp"
+
+size_t CallGraph::index_of(const std::string& name) const {
+	const auto it = indices.find(name);
+	return it != indices.end() ? it->second : SIZE_MAX;
+}
+
+CallGraph build_call_graph(const std::vector<IrFunction>& functions) {
+	const auto count = functions.size();
+	CallGraph graph { .recursive = std::vector<bool>(count), .call_sites = std::vector<size_t>(count) };
+	for (size_t f = 0; f < count; ++f)
+		graph.indices[functions[f].name] = f;
+	std::vector<std::vector<size_t>> callees(count);
+	for (size_t f = 0; f < count; ++f) {
+		for (const auto& block : functions[f].blocks) {
+			for (const auto& instr : block.code) {
+				if (instr.op != IrOp::Call) continue;
+				const auto callee = graph.index_of(instr.name);
+				if (callee == SIZE_MAX) continue;
+				callees[f].push_back(callee);
+				++graph.call_sites[callee];
+				if (callee == f) graph.recursive[f] = true;
+			}
+		}
+	}
+
+	// Tarjan's strongly connected components, which come out callees first
+	std::vector<size_t> index(count, SIZE_MAX);
+	std::vector<size_t> low(count);
+	std::vector<bool> on_stack(count);
+	std::vector<size_t> stack;
+	size_t counter = 0;
+	const auto connect = [&](const auto& self, size_t f) -> void {
+		index[f] = low[f] = counter++;
+		stack.push_back(f);
+		on_stack[f] = true;
+		for (const auto callee : callees[f]) {
+			if (index[callee] == SIZE_MAX) {
+				self(self, callee);
+				low[f] = std::min(low[f], low[callee]);
+			} else if (on_stack[callee]) {
+				low[f] = std::min(low[f], index[callee]);
+			}
+		}
+		if (low[f] != index[f]) return;
+		const auto first = graph.bottom_up.size();
+		size_t member;
+		do {
+			member = stack.back();
+			stack.pop_back();
+			on_stack[member] = false;
+			graph.bottom_up.push_back(member);
+		} while (member != f);
+		if (graph.bottom_up.size() - first > 1)
+			for (auto i = first; i < graph.bottom_up.size(); ++i) graph.recursive[graph.bottom_up[i]] = true;
+	};
+	for (size_t f = 0; f < count; ++f)
+		if (index[f] == SIZE_MAX) connect(connect, f);
+	return graph;
+}
+
+// roughly how many machine instructions an ir instruction turns into
+static int instr_cost(const IrInstr& instr) {
+	switch (instr.op) {
+		case IrOp::Const:
+		case IrOp::Arg:
+		case IrOp::Phi:
+		case IrOp::Jump:
+			return 0;
+		case IrOp::Return:
+			return 1;
+		// cmp, setcc, movzx
+		case IrOp::Eq:
+		case IrOp::Ne:
+		case IrOp::Lt:
+		case IrOp::Le:
+		case IrOp::Gt:
+		case IrOp::Ge:
+			return 3;
+		// moves into eax, cdq, idiv, and one out
+		case IrOp::Div:
+		case IrOp::Mod:
+			return 4;
+		case IrOp::Call:
+		case IrOp::Syscall:
+			return 2 + static_cast<int>(instr.args.size());
+		// a compare and jump per case at worst, but usually a table or a search
+		case IrOp::Switch:
+			return 3 + static_cast<int>(instr.cases.size()) / 2;
+		default:
+			return 2;
+	}
+}
+
+static int function_cost(const IrFunction& function) {
+	int cost = 0;
+	for (const auto& block : function.blocks)
+		for (const auto& instr : block.code)
+			cost += instr_cost(instr);
+	return cost;
+}
+
+// what inlining saves: the argument pushes, call, ret, stack cleanup and frame setup,
+// plus every use of an argument that turns out to be a constant, since those fold away
+static int call_benefit(const IrFunction& caller, const IrInstr& call, const IrFunction& callee) {
+	const auto defs = find_defs(caller);
+	int benefit = 6 + static_cast<int>(call.args.size());
+	std::vector<bool> constant_arg(callee.next_value);
+	for (const auto& instr : callee.blocks[0].code) {
+		if (instr.op != IrOp::Arg) continue;
+		const auto def = defs[call.args[instr.imm]];
+		constant_arg[instr.result] = caller.blocks[def.block].code[def.index].op == IrOp::Const;
+	}
+	for (const auto& block : callee.blocks)
+		for (const auto& instr : block.code)
+			for (const auto arg : instr.args)
+				benefit += constant_arg[arg];
+	return benefit;
+}
+
+// splits the call at code[index] out of block into a copy of callee's blocks, continuing in a new
+// block with the rest of the code. returns the new blocks, in the order they should be laid out
+static std::vector<BlockId> inline_call(IrFunction& caller, BlockId block, size_t index, const IrFunction& callee) {
+	auto& blocks = caller.blocks;
+	const auto call = blocks[block].code[index];
+	const auto value_base = caller.next_value;
+	caller.next_value += callee.next_value;
+	const auto array_base = static_cast<int64_t>(caller.arrays.size());
+	caller.arrays.insert(caller.arrays.end(), callee.arrays.begin(), callee.arrays.end());
+	const auto check_base = static_cast<int64_t>(caller.checks.size());
+	caller.checks.insert(caller.checks.end(), callee.checks.begin(), callee.checks.end());
+	const auto asm_base = static_cast<int64_t>(caller.asm_blocks.size());
+	caller.asm_blocks.insert(caller.asm_blocks.end(), callee.asm_blocks.begin(), callee.asm_blocks.end());
+	const auto block_base = static_cast<BlockId>(blocks.size());
+	const auto tail = static_cast<BlockId>(block_base + callee.blocks.size());
+
+	std::vector<ValueId> argument(callee.next_value, no_value);
+	for (const auto& instr : callee.blocks[0].code)
+		if (instr.op == IrOp::Arg) argument[instr.result] = call.args[instr.imm];
+	const auto map_value = [&](ValueId value) {
+		return argument[value] != no_value ? argument[value] : value_base + value;
+	};
+
+	std::vector<BlockId> added;
+	// the return value, with an argument per return
+	IrInstr result { .op = IrOp::Phi, .result = call.result };
+	// and the second one of structs returned in two, if it's used
+	const auto& code = blocks[block].code;
+	const bool pair = index + 1 < code.size() && code[index + 1].op == IrOp::Result;
+	IrInstr second { .op = IrOp::Phi, .result = pair ? code[index + 1].result : no_value };
+	std::vector<BlockId> tail_preds;
+	for (BlockId b = 0; b < callee.blocks.size(); ++b) {
+		const auto& source = callee.blocks[b];
+		IrBlock copy {
+			.kind = format("{}_{}", callee.name, source.kind),
+			.loop_depth = static_cast<uint8_t>(source.loop_depth + blocks[block].loop_depth),
+			.unrolled = source.unrolled,
+			.vectorized = source.vectorized,
+		};
+		for (const auto pred : source.preds)
+			copy.preds.push_back(block_base + pred);
+		for (const auto& instr : source.code) {
+			if (instr.op == IrOp::Arg) continue;
+			if (instr.op == IrOp::Return) {
+				if (call.result != no_value)
+					result.args.push_back(map_value(instr.args[0]));
+				if (pair)
+					second.args.push_back(map_value(instr.args[1]));
+				copy.code.push_back(IrInstr { .op = IrOp::Jump, .targets = { tail } });
+				tail_preds.push_back(block_base + b);
+				continue;
+			}
+			auto& mapped = copy.code.emplace_back(instr);
+			if (mapped.result != no_value)
+				mapped.result = value_base + mapped.result;
+			for (auto& arg : mapped.args)
+				arg = map_value(arg);
+			for (auto& target : mapped.targets)
+				target += block_base;
+			if (mapped.op == IrOp::Load || mapped.op == IrOp::Store || mapped.op == IrOp::Address)
+				mapped.imm += array_base;
+			if (mapped.op == IrOp::Check)
+				mapped.imm += check_base;
+			if (mapped.op == IrOp::Asm)
+				mapped.imm += asm_base;
+		}
+		blocks.push_back(std::move(copy));
+		added.push_back(block_base + b);
+	}
+	blocks[block_base].preds = { block };
+
+	// the rest of the block continues after the call returns
+	auto& original = blocks[block];
+	IrBlock rest { .preds = std::move(tail_preds), .kind = original.kind, .loop_depth = original.loop_depth };
+	if (call.result != no_value)
+		rest.code.push_back(std::move(result));
+	if (pair)
+		rest.code.push_back(std::move(second));
+	std::move(original.code.begin() + static_cast<std::ptrdiff_t>(index + 1 + pair), original.code.end(), std::back_inserter(rest.code));
+	original.code.resize(index);
+	original.code.push_back(IrInstr { .op = IrOp::Jump, .targets = { block_base } });
+	for (const auto succ : rest.successors())
+		std::replace(blocks[succ].preds.begin(), blocks[succ].preds.end(), block, tail);
+	blocks.push_back(std::move(rest));
+	added.push_back(tail);
+	return added;
+}
+
+bool inline_calls(IrFunction& caller, const std::vector<IrFunction>& functions, CallGraph& graph, int threshold) {
+	const auto original_count = static_cast<BlockId>(caller.blocks.size());
+	// blocks that go right after each block once they get split up by inlining
+	std::vector<std::vector<BlockId>> after(original_count);
+	std::vector<BlockId> work;
+	for (BlockId b = original_count; b--;)
+		work.push_back(b);
+	bool changed = false;
+
+	while (!work.empty()) {
+		const auto block = work.back();
+		work.pop_back();
+		auto& code = caller.blocks[block].code;
+		for (size_t i = 0; i < code.size(); ++i) {
+			if (code[i].op != IrOp::Call) continue;
+			const auto index = graph.index_of(code[i].name);
+			if (index == SIZE_MAX || graph.recursive[index]) continue;
+			const auto& callee = functions[index];
+			if (&callee == &caller) continue;
+			const auto depth = caller.blocks[block].loop_depth;
+			// calls in loops run more often, so they're worth more growth
+			const int benefit = call_benefit(caller, code[i], callee) * (1 + depth);
+			if (graph.call_sites[index] != 1 && function_cost(callee) - benefit > threshold) continue;
+
+			--graph.call_sites[index];
+			for (const auto& callee_block : callee.blocks) {
+				for (const auto& instr : callee_block.code) {
+					if (instr.op != IrOp::Call) continue;
+					const auto nested = graph.index_of(instr.name);
+					if (nested != SIZE_MAX) ++graph.call_sites[nested];
+				}
+			}
+			const auto added = inline_call(caller, block, i, callee);
+			after.resize(caller.blocks.size());
+			after[block] = added;
+			// the rest of the block might have more calls
+			work.push_back(added.back());
+			changed = true;
+			break;
+		}
+	}
+	if (!changed) return false;
+
+	std::vector<BlockId> order;
+	const auto place = [&](const auto& self, BlockId block) -> void {
+		order.push_back(block);
+		for (const auto next : after[block])
+			self(self, next);
+	};
+	// the added blocks get placed by whatever they were split from
+	for (BlockId b = 0; b < original_count; ++b)
+		place(place, b);
+	reorder_blocks(caller, order);
+	remove_unreachable_blocks(caller);
+	remove_trivial_phis(caller);
+	return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "ir.hpp"
+#include <unordered_map>
+
+struct CallGraph {
+	// indices into the functions, callees before their callers except within a cycle of calls
+	std::vector<size_t> bottom_up;
+	// part of a cycle of calls, including calling itself directly
+	std::vector<bool> recursive;
+	// how many calls to each function there are in all the others
+	std::vector<size_t> call_sites;
+	// index of every function by name, so call sites don't have to search for their callee
+	std::unordered_map<std::string, size_t> indices;
+
+	// SIZE_MAX for functions that aren't in the graph, like builtins
+	size_t index_of(const std::string& name) const;
+};
+
+CallGraph build_call_graph(const std::vector<IrFunction>& functions);
+
+// Replaces calls in caller with a copy of the callee's body when the callee isn't recursive and
+// either has no other call site, or is cheap enough: its estimated size minus what the call
+// itself costs (pushing arguments, the call, the frame) has to be at most threshold. Calls to
+// functions that aren't in functions, like builtins, are left alone.
+// Returns whether anything got inlined, and keeps graph.call_sites up to date.
+bool inline_calls(IrFunction& caller, const std::vector<IrFunction>& functions, CallGraph& graph, int threshold);
@@ -0,0 +1,39 @@
+#include "intrinsics.hpp"
+#include <bit>
+#include <chrono>
+
+static uint32_t bits(int32_t value) { return static_cast<uint32_t>(value); }
+
+static int32_t byteswap(uint32_t value) {
+	return static_cast<int32_t>((value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) | (value << 24));
+}
+
+static constexpr Intrinsic intrinsics[] = {
+	{ "popcount", IrOp::Popcount, 1, true, [](std::span<const int32_t> args) { return std::popcount(bits(args[0])); } },
+	// 32 for 0, like lzcnt and tzcnt
+	{ "clz", IrOp::Clz, 1, true, [](std::span<const int32_t> args) { return std::countl_zero(bits(args[0])); } },
+	{ "ctz", IrOp::Ctz, 1, true, [](std::span<const int32_t> args) { return std::countr_zero(bits(args[0])); } },
+	{ "bswap", IrOp::Bswap, 1, true, [](std::span<const int32_t> args) { return byteswap(bits(args[0])); } },
+	// the amount wraps around at 32, like rol and ror only look at its low bits
+	{ "rotl", IrOp::Rotl, 2, true, [](std::span<const int32_t> args) { return static_cast<int32_t>(std::rotl(bits(args[0]), args[1] & 31)); } },
+	{ "rotr", IrOp::Rotr, 2, true, [](std::span<const int32_t> args) { return static_cast<int32_t>(std::rotr(bits(args[0]), args[1] & 31)); } },
+	// the low half of the time stamp counter, which is only good for differences. the evaluator counts
+	// nanoseconds instead
+	{ "rdtsc", IrOp::Rdtsc, 0, true, [](std::span<const int32_t>) {
+		return static_cast<int32_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+	} },
+	// tells the cpu it's in a spin loop
+	{ "pause", IrOp::Pause, 0, false, [](std::span<const int32_t>) { return 0; } },
+};
+
+const Intrinsic* find_intrinsic(std::string_view name) {
+	for (const auto& intrinsic : intrinsics)
+		if (intrinsic.name == name) return &intrinsic;
+	return nullptr;
+}
+
+const Intrinsic* find_intrinsic(IrOp op) {
+	for (const auto& intrinsic : intrinsics)
+		if (intrinsic.op == op) return &intrinsic;
+	return nullptr;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "ir.hpp"
+#include <span>
+#include <string_view>
+
+// functions that are a single instruction or close to it, called like any other function. they all
+// take and give back i32s
+struct Intrinsic {
+	std::string_view name;
+	IrOp op;
+	uint8_t arg_count;
+	// gives back an i32, otherwise it's void
+	bool returns;
+	// what it does, for the evaluator and for folding calls with constant arguments when the op is pure
+	int32_t (*evaluate)(std::span<const int32_t> args);
+};
+
+const Intrinsic* find_intrinsic(std::string_view name);
+const Intrinsic* find_intrinsic(IrOp op);
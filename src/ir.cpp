@@ -0,0 +1,1389 @@
+#include "ir.hpp"
+#include "enums.hpp"
+#include "format.hpp"
+#include "intrinsics.hpp"
+#include "layout.hpp"
+#include <map>
+
+bool is_terminator(IrOp op) {
+	return op == IrOp::Jump || op == IrOp::Branch || op == IrOp::Switch || op == IrOp::Return;
+}
+
+bool is_pure(IrOp op) {
+	switch (op) {
+		case IrOp::Const:
+		case IrOp::Arg:
+		case IrOp::Phi:
+		case IrOp::Add:
+		case IrOp::Sub:
+		case IrOp::Mul:
+		case IrOp::Div:
+		case IrOp::Mod:
+		case IrOp::Neg:
+		case IrOp::Not:
+		case IrOp::And:
+		case IrOp::Or:
+		case IrOp::Shl:
+		case IrOp::Shr:
+		case IrOp::Popcount:
+		case IrOp::Clz:
+		case IrOp::Ctz:
+		case IrOp::Bswap:
+		case IrOp::Rotl:
+		case IrOp::Rotr:
+		case IrOp::Eq:
+		case IrOp::Ne:
+		case IrOp::Lt:
+		case IrOp::Le:
+		case IrOp::Gt:
+		case IrOp::Ge:
+		case IrOp::Select:
+		case IrOp::Splat:
+		case IrOp::Reduce:
+		case IrOp::Address:
+		case IrOp::Offset:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool is_read(IrOp op) {
+	return op == IrOp::Load || op == IrOp::Read || op == IrOp::Result;
+}
+
+bool is_commutative(IrOp op) {
+	return op == IrOp::Add || op == IrOp::Mul || op == IrOp::And || op == IrOp::Or || op == IrOp::Eq || op == IrOp::Ne;
+}
+
+bool is_comparison(IrOp op) {
+	switch (op) {
+		case IrOp::Eq:
+		case IrOp::Ne:
+		case IrOp::Lt:
+		case IrOp::Le:
+		case IrOp::Gt:
+		case IrOp::Ge:
+			return true;
+		default:
+			return false;
+	}
+}
+
+namespace {
+
+// variable name -> its current value. ordered so phis come out in the same order every time
+using Variables = std::map<std::string, ValueId>;
+
+// Builds SSA directly from the structured statements: a variable's value is tracked through
+// the code as it gets lowered, and wherever control flow joins, the values from each side
+// are merged with a phi. Loop headers get a phi for every variable up front, since the
+// body hasn't been seen yet, and the ones the loop doesn't change get cleaned up afterwards.
+class IrBuilder {
+public:
+	const Parser& m_parser;
+	IrFunction m_function;
+	BlockId m_block = 0;
+	uint8_t m_loop_depth = 0;
+	Variables m_variables;
+	// array name -> its index in m_function.arrays
+	std::map<std::string, size_t> m_arrays;
+	// the struct the function returns, if it does
+	const Struct* m_returned = nullptr;
+	// where the caller wants a struct too big for registers returned
+	ValueId m_return_pointer = no_value;
+
+	IrBuilder(const Parser& parser) : m_parser(parser) {}
+
+	IrBlock& block() { return m_function.blocks[m_block]; }
+
+	BlockId new_block(const std::string_view& kind) {
+		m_function.blocks.push_back(IrBlock { .kind = std::string(kind), .loop_depth = m_loop_depth });
+		return static_cast<BlockId>(m_function.blocks.size() - 1);
+	}
+
+	bool is_open() {
+		const auto& code = block().code;
+		return code.empty() || !is_terminator(code.back().op);
+	}
+
+	IrInstr& emit(IrOp op, std::vector<ValueId> args = {}, bool has_result = true) {
+		auto& instr = block().code.emplace_back(IrInstr { .op = op, .args = std::move(args) });
+		if (has_result)
+			instr.result = m_function.new_value();
+		return instr;
+	}
+
+	ValueId constant(int64_t value) {
+		auto& instr = emit(IrOp::Const);
+		instr.imm = value;
+		return instr.result;
+	}
+
+	// a constant at the end of another block, even if it already ends in a terminator
+	ValueId constant_in(BlockId id, int64_t value) {
+		auto& code = m_function.blocks[id].code;
+		const auto at = !code.empty() && is_terminator(code.back().op) ? code.end() - 1 : code.end();
+		const auto result = m_function.new_value();
+		code.insert(at, IrInstr { .op = IrOp::Const, .result = result, .imm = value });
+		return result;
+	}
+
+	void link(BlockId from, BlockId to) {
+		m_function.blocks[to].preds.push_back(from);
+	}
+
+	void jump(BlockId target) {
+		emit(IrOp::Jump, {}, false).targets = { target };
+		link(m_block, target);
+	}
+
+	ValueId read_variable(const std::string& name) {
+		const auto it = m_variables.find(name);
+		// declared on a path that didn't get here
+		if (it == m_variables.end())
+			return m_variables[name] = constant(0);
+		return it->second;
+	}
+
+	struct Exit {
+		BlockId block;
+		Variables variables;
+	};
+
+	// a branch target that gets filled in once the block it goes to exists
+	struct Edge {
+		BlockId block;
+		size_t target;
+		Variables variables;
+	};
+
+	// where a condition goes when it's true and when it's false
+	struct Branches {
+		std::vector<Edge> if_true;
+		std::vector<Edge> if_false;
+	};
+
+	Branches branch(ValueId condition) {
+		emit(IrOp::Branch, { condition }, false).targets = { no_block, no_block };
+		return { { Edge { m_block, 0, m_variables } }, { Edge { m_block, 1, m_variables } } };
+	}
+
+	// points the edges at target, as its first preds. they can be joined there like any other exit
+	std::vector<Exit> patch(const std::vector<Edge>& edges, BlockId target) {
+		std::vector<Exit> exits;
+		for (const auto& edge : edges) {
+			m_function.blocks[edge.block].terminator().targets[edge.target] = target;
+			link(edge.block, target);
+			exits.push_back({ edge.block, edge.variables });
+		}
+		return exits;
+	}
+
+	// continues in target, which the exits flow into in order. the ones still open jump there
+	void join(const std::vector<Exit>& exits, BlockId target) {
+		Variables merged;
+		std::vector<std::string> names;
+		for (const auto& exit : exits)
+			for (const auto& [name, value] : exit.variables)
+				if (std::find(names.begin(), names.end(), name) == names.end()) names.push_back(name);
+
+		for (const auto& name : names) {
+			std::vector<ValueId> values;
+			for (const auto& exit : exits) {
+				const auto it = exit.variables.find(name);
+				values.push_back(it == exit.variables.end() ? constant_in(exit.block, 0) : it->second);
+			}
+			if (std::all_of(values.begin(), values.end(), [&](ValueId v) { return v == values[0]; })) {
+				merged[name] = values[0];
+			} else {
+				const auto result = m_function.new_value();
+				m_function.blocks[target].code.push_back(IrInstr { .op = IrOp::Phi, .result = result, .args = values });
+				merged[name] = result;
+			}
+		}
+
+		for (const auto& exit : exits) {
+			m_block = exit.block;
+			if (is_open()) jump(target);
+		}
+		m_block = target;
+		// nothing gets here, the variables don't matter
+		if (!exits.empty())
+			m_variables = std::move(merged);
+	}
+
+	// a loop running body while condition() is true, with step() lowered at the end of every iteration
+	template <class Condition, class Step>
+	void compile_loop(const std::string_view& kind, std::vector<Statement>& body, Condition&& condition, Step&& step) {
+		++m_loop_depth;
+		const auto header = new_block(format("{}_start", kind));
+		jump(header);
+		m_block = header;
+		// every variable might change in the body, which hasn't been lowered yet
+		const auto entry_variables = m_variables;
+		for (auto& [name, value] : m_variables) {
+			const auto result = m_function.new_value();
+			block().code.push_back(IrInstr { .op = IrOp::Phi, .result = result, .args = { value } });
+			value = result;
+		}
+		const Branches branches = condition();
+		const auto body_block = new_block(format("{}_body", kind));
+		join(patch(branches.if_true, body_block), body_block);
+
+		for (auto& child : body)
+			compile_statement(child);
+		step();
+		// the phis are the first instructions of the header, in the same order as the variables
+		size_t phi = 0;
+		for (const auto& [name, value] : entry_variables) {
+			const auto back_value = read_variable(name);
+			m_function.blocks[header].code[phi++].args.push_back(back_value);
+		}
+		jump(header);
+		--m_loop_depth;
+
+		const auto end_block = new_block(format("{}_end", kind));
+		join(patch(branches.if_false, end_block), end_block);
+	}
+
+	void compile_statement(Statement& statement) {
+		if (statement.type == StatementType::Return && m_returned) {
+			return_struct(compile_struct(statement.expressions[0]));
+			m_block = new_block("dead");
+		} else if (statement.type == StatementType::Return) {
+			std::vector<ValueId> value;
+			if (!statement.expressions.empty())
+				value.push_back(compile_expression(statement.expressions[0]));
+			emit(IrOp::Return, std::move(value), false);
+			// anything after the return is unreachable, and gets removed afterwards
+			m_block = new_block("dead");
+		} else if (statement.type == StatementType::Expression) {
+			compile_expression(statement.expressions[0]);
+		} else if (statement.type == StatementType::If) {
+			const auto branches = compile_condition(statement.expressions[0]);
+			const auto then_block = new_block("if_then");
+			join(patch(branches.if_true, then_block), then_block);
+			for (auto& child : statement.children)
+				compile_statement(child);
+			const Exit then_exit { m_block, m_variables };
+
+			std::vector<Exit> exits;
+			if (statement.else_branch) {
+				const auto else_block = new_block("if_else");
+				join(patch(branches.if_false, else_block), else_block);
+				compile_statement(*statement.else_branch);
+				exits = { then_exit, Exit { m_block, m_variables } };
+			}
+			const auto end_block = new_block("if_end");
+			if (!statement.else_branch) {
+				// the condition branches straight to the end, so it comes first in its preds
+				exits = patch(branches.if_false, end_block);
+				exits.push_back(then_exit);
+			}
+			join(exits, end_block);
+		} else if (statement.type == StatementType::Else) {
+			for (auto& child : statement.children)
+				compile_statement(child);
+		} else if (statement.type == StatementType::Match) {
+			const auto value = compile_expression(statement.expressions[0]);
+			const auto switch_block = m_block;
+			const auto before = m_variables;
+			emit(IrOp::Switch, { value }, false);
+			std::vector<BlockId> targets;
+			std::vector<int64_t> cases;
+			BlockId else_block = no_block;
+
+			std::vector<Exit> exits;
+			for (auto& arm : statement.children) {
+				const auto arm_block = new_block("match_case");
+				for (const auto& expression : arm.expressions) {
+					const auto& literal = std::get<Expression::LiteralData>(expression.data).value;
+					cases.push_back(std::holds_alternative<bool>(literal) ? std::get<bool>(literal) : std::get<int>(literal));
+					targets.push_back(arm_block);
+					link(switch_block, arm_block);
+				}
+				if (arm.expressions.empty()) {
+					else_block = arm_block;
+					link(switch_block, arm_block);
+				}
+				m_block = arm_block;
+				m_variables = before;
+				for (auto& child : arm.children)
+					compile_statement(child);
+				exits.push_back({ m_block, m_variables });
+			}
+			const auto end_block = new_block("match_end");
+			if (else_block == no_block) {
+				// values without a case go straight to the end, so the switch comes first in its preds
+				else_block = end_block;
+				exits.insert(exits.begin(), Exit { switch_block, before });
+				link(switch_block, end_block);
+			}
+			targets.push_back(else_block);
+			auto& terminator = m_function.blocks[switch_block].terminator();
+			terminator.targets = std::move(targets);
+			terminator.cases = std::move(cases);
+			join(exits, end_block);
+		} else if (statement.type == StatementType::While) {
+			compile_loop("while", statement.children, [&] { return compile_condition(statement.expressions[0]); }, [] {});
+		} else if (statement.type == StatementType::For) {
+			// the end is only worked out once, before the variable exists
+			const auto start = compile_expression(statement.expressions[1]);
+			const auto end = compile_expression(statement.expressions[2]);
+			const auto& name = variable_name(statement.expressions[0]);
+			m_variables[name] = start;
+			compile_loop("for", statement.children, [&] { return branch(emit(IrOp::Lt, { read_variable(name), end }).result); }, [&] {
+				m_variables[name] = emit(IrOp::Add, { read_variable(name), constant(1) }).result;
+			});
+		} else {
+			unhandled(format("unimplemented statement {}", enum_name(statement.type)));
+		}
+	}
+
+	size_t array_id(const Expression& exp) {
+		return m_arrays.at(variable_name(exp));
+	}
+
+	// arrays live for the whole function, declaring one again reuses it. they start out zeroed,
+	// every time the declaration runs
+	void declare_array(const Variable& var) {
+		auto [it, added] = m_arrays.try_emplace(var.name, m_function.arrays.size());
+		if (added)
+			m_function.arrays.push_back(var.type.length);
+		auto& length = m_function.arrays[it->second];
+		length = std::max(length, var.type.length);
+		// the counter can't clash with a variable, since names can't have dots
+		const std::string counter = var.name + ".zero";
+		std::vector<Statement> body;
+		m_variables[counter] = constant(0);
+		compile_loop("zero", body, [&] {
+			return branch(emit(IrOp::Lt, { read_variable(counter), constant(static_cast<int64_t>(var.type.length)) }).result);
+		}, [&] {
+			auto& store = emit(IrOp::Store, { read_variable(counter), constant(0) }, false);
+			store.imm = static_cast<int64_t>(it->second);
+			m_variables[counter] = emit(IrOp::Add, { read_variable(counter), constant(1) }).result;
+		});
+		m_variables.erase(counter);
+	}
+
+	void check(ValueId index, ValueId limit, const Span& span) {
+		emit(IrOp::Check, { index, limit }, false).imm = static_cast<int64_t>(m_function.checks.size());
+		m_function.checks.push_back(span);
+	}
+
+	// slices are two variables, which can't clash with anything else since names can't have dots
+	static std::string data_name(const std::string& name) { return name + ".data"; }
+	static std::string length_name(const std::string& name) { return name + ".length"; }
+
+	// lowers something with a slice type into its pointer and length
+	std::pair<ValueId, ValueId> compile_slice(Expression& exp) {
+		if (exp.type == ExpressionType::Cast)
+			return compile_slice(exp.children[0]);
+		if (exp.type == ExpressionType::Declaration) {
+			const auto& name = variable_name(exp);
+			// empty until something gets assigned
+			return { m_variables[data_name(name)] = constant(0), m_variables[length_name(name)] = constant(0) };
+		}
+		if (exp.type == ExpressionType::Assignment) {
+			compile_assignment(exp);
+			const auto& name = variable_name(exp);
+			return { read_variable(data_name(name)), read_variable(length_name(name)) };
+		}
+		if (exp.type == ExpressionType::Variable) {
+			const auto& name = variable_name(exp);
+			return { read_variable(data_name(name)), read_variable(length_name(name)) };
+		}
+		if (exp.type == ExpressionType::Call)
+			return compile_alloc(exp);
+		if (exp.type != ExpressionType::Slice)
+			unhandled(format("can't slice {}", exp.type));
+
+		auto& base = exp.children[0];
+		ValueId data, length;
+		if (base.value_type.is_array()) {
+			auto& address = emit(IrOp::Address);
+			address.imm = static_cast<int64_t>(array_id(base));
+			data = address.result;
+			length = constant(static_cast<int64_t>(base.value_type.length));
+		} else {
+			std::tie(data, length) = compile_slice(base);
+		}
+		if (exp.children.size() == 1)
+			return { data, length };
+		const auto start = compile_expression(exp.children[1]);
+		const auto end = compile_expression(exp.children[2]);
+		// end <= length first, then start <= end
+		check(end, emit(IrOp::Add, { length, constant(1) }).result, exp.span);
+		check(start, emit(IrOp::Add, { end, constant(1) }).result, exp.span);
+		const auto offset = emit(IrOp::Offset, { data, start }).result;
+		return { offset, emit(IrOp::Sub, { end, start }).result };
+	}
+
+	// alloc(S) as a pointer, or alloc(i32, n) as a slice. both come zeroed out of the runtime
+	std::pair<ValueId, ValueId> compile_alloc(Expression& exp) {
+		ValueId bytes, length = no_value;
+		if (exp.children.size() == 1) {
+			// the type being allocated, which isn't a value
+			const auto& name = std::get<Expression::VariableData>(exp.children[0].data).name;
+			bytes = constant(static_cast<int64_t>(m_parser.find_struct(name)->size));
+		} else {
+			length = compile_expression(exp.children[1]);
+			check(length, constant(static_cast<int64_t>(max_alloc_length + 1)), exp.span);
+			bytes = emit(IrOp::Mul, { length, constant(4) }).result;
+		}
+		auto& call = emit(IrOp::Call, { bytes });
+		call.name = "arena_alloc";
+		call.pointer = true;
+		return { call.result, length };
+	}
+
+	// an element being indexed, with its index already worked out and checked. data is the slice's
+	// pointer, or no_value when it's in array
+	struct Element {
+		size_t array;
+		ValueId index;
+		ValueId data = no_value;
+	};
+
+	Element compile_element(Expression& exp) {
+		auto& base = exp.children[0];
+		if (base.value_type.is_array()) {
+			const auto index = compile_expression(exp.children[1]);
+			check(index, constant(static_cast<int64_t>(base.value_type.length)), exp.span);
+			return { array_id(base), index };
+		}
+		const auto [data, length] = compile_slice(base);
+		const auto index = compile_expression(exp.children[1]);
+		check(index, length, exp.span);
+		return { 0, index, data };
+	}
+
+	// lowers an assignment, returning the value along with the element it went to, if it was one
+	std::pair<ValueId, std::optional<Element>> compile_assignment(Expression& exp) {
+		auto& target = exp.children[0];
+		if (target.value_type.is_slice()) {
+			const auto [data, length] = compile_slice(exp.children[1]);
+			if (target.type == ExpressionType::Assignment)
+				compile_slice(target);
+			const auto& name = variable_name(target);
+			m_variables[data_name(name)] = data;
+			m_variables[length_name(name)] = length;
+			return { no_value, std::nullopt };
+		}
+		if (const auto* s = struct_of(target.value_type)) {
+			const auto values = compile_struct(exp.children[1]);
+			if (behind_pointer(target)) {
+				write_pointee(target, values);
+				return { no_value, std::nullopt };
+			}
+			if (target.type == ExpressionType::Assignment)
+				compile_assignment(target);
+			write_struct(target_name(target), *s, values);
+			return { no_value, std::nullopt };
+		}
+		const auto value = compile_expression(exp.children[1]);
+		std::optional<Element> element;
+		if (behind_pointer(target)) {
+			write_pointee(target, { value });
+			return { value, std::nullopt };
+		}
+		if (target.type == ExpressionType::Assignment) {
+			// (a[f()] = x) = y only calls f once
+			element = compile_assignment(target).second;
+		} else if (target.type == ExpressionType::Index) {
+			// the index gets worked out after the value, like in the evaluator
+			element = compile_element(target);
+		}
+		if (element && element->data != no_value)
+			emit(IrOp::Write, { element->data, element->index, value }, false);
+		else if (element)
+			emit(IrOp::Store, { element->index, value }, false).imm = static_cast<int64_t>(element->array);
+		else
+			m_variables[target_name(target)] = value;
+		return { value, element };
+	}
+
+	// the variable an assignment ends up going to, which can be a field of one
+	static std::string target_name(const Expression& exp) {
+		if (exp.type == ExpressionType::Assignment)
+			return target_name(exp.children[0]);
+		if (exp.type == ExpressionType::Field)
+			return *place_of(exp);
+		return variable_name(exp);
+	}
+
+	static const std::string& variable_name(const Expression& exp) {
+		if (exp.type == ExpressionType::Declaration)
+			return std::get<Expression::DeclarationData>(exp.data).var.name;
+		if (exp.type == ExpressionType::Variable)
+			return std::get<Expression::VariableData>(exp.data).name;
+		if (exp.type == ExpressionType::Assignment)
+			return variable_name(exp.children[0]);
+		unhandled(format("can't assign to {}", exp.type));
+	}
+
+	const Struct* struct_of(const Type& type) const {
+		if (type.is_array() || type.is_slice() || type.is_pointer()) return nullptr;
+		return m_parser.find_struct(type.name);
+	}
+
+	// structs are a variable for every scalar in them, named by the variable and the path to the scalar,
+	// which can't clash with anything since names can't have dots. this is the name of the variable or
+	// field an expression refers to, if it's one
+	static std::optional<std::string> place_of(const Expression& exp) {
+		if (exp.type == ExpressionType::Variable)
+			return variable_name(exp);
+		if (exp.type == ExpressionType::Cast)
+			return place_of(exp.children[0]);
+		if (exp.type == ExpressionType::Field && !behind_pointer(exp)) {
+			if (const auto base = place_of(exp.children[0]))
+				return *base + "." + std::get<Expression::FieldData>(exp.data).name;
+		}
+		return std::nullopt;
+	}
+
+	// whether an expression is a field of a struct some pointer points to, which lives in memory
+	// instead of in variables
+	static bool behind_pointer(const Expression& exp) {
+		if (exp.type == ExpressionType::Cast)
+			return behind_pointer(exp.children[0]);
+		if (exp.type != ExpressionType::Field)
+			return false;
+		const auto& base = exp.children[0];
+		return base.value_type.is_pointer() || behind_pointer(base);
+	}
+
+	// the pointer a field behind one is reached through, and the field's byte offset from it
+	std::pair<ValueId, size_t> compile_pointee(Expression& exp) {
+		if (exp.type == ExpressionType::Cast)
+			return compile_pointee(exp.children[0]);
+		auto& base = exp.children[0];
+		const auto field = std::get<Expression::FieldData>(exp.data).index;
+		if (base.value_type.is_pointer())
+			return { compile_expression(base), m_parser.find_struct(base.value_type.name)->offsets[field] };
+		const auto [pointer, offset] = compile_pointee(base);
+		return { pointer, offset + struct_of(base.value_type)->offsets[field] };
+	}
+
+	// the scalars of a field behind a pointer, in the order of type_leaves
+	std::vector<ValueId> read_pointee(Expression& exp) {
+		const auto [pointer, offset] = compile_pointee(exp);
+		std::vector<ValueId> values;
+		for (auto leaf : type_leaves(exp.value_type, m_parser)) {
+			leaf.offset += offset;
+			values.push_back(extract(leaf, [&](size_t word) {
+				auto& read = emit(IrOp::Read, { pointer, constant(static_cast<int64_t>(word)) });
+				read.pointer = leaf.size == 8;
+				return read.result;
+			}));
+		}
+		return values;
+	}
+
+	void write_pointee(Expression& exp, const std::vector<ValueId>& values) {
+		const auto [pointer, offset] = compile_pointee(exp);
+		const auto leaves = type_leaves(exp.value_type, m_parser);
+		for (size_t i = 0; i < leaves.size(); ++i) {
+			const auto start = (offset + leaves[i].offset) * 8;
+			const auto end = start + leaves[i].size * 8;
+			const auto first = start / 32;
+			if (start % 32 == 0 && end - start >= 32) {
+				auto& write = emit(IrOp::Write, { pointer, constant(static_cast<int64_t>(first)), values[i] }, false);
+				write.pointer = leaves[i].size == 8;
+				continue;
+			}
+			// bools and the i32s of packed structs only change their own bits of the words they're in
+			for (auto word = first; word * 32 < end; ++word) {
+				const auto low = std::max(start, word * 32) - word * 32;
+				const auto high = std::min(end, word * 32 + 32) - word * 32;
+				const auto mask = ((uint64_t(1) << (high - low)) - 1) << low;
+				const auto index = constant(static_cast<int64_t>(word));
+				const auto old = emit(IrOp::Read, { pointer, index }).result;
+				const auto kept = emit(IrOp::And, { old, constant(static_cast<int32_t>(~mask)) }).result;
+				const auto part = start >= word * 32
+					? (low ? emit(IrOp::Shl, { values[i], constant(static_cast<int64_t>(low)) }).result : values[i])
+					: emit(IrOp::Shr, { values[i], constant(static_cast<int64_t>(word * 32 - start)) }).result;
+				emit(IrOp::Write, { pointer, index, emit(IrOp::Or, { kept, part }).result }, false);
+			}
+		}
+	}
+
+	std::vector<ValueId> read_struct(const std::string& place, const Struct& s) {
+		std::vector<ValueId> values;
+		for (const auto& leaf : struct_leaves(s, m_parser))
+			values.push_back(read_variable(place + leaf.path));
+		return values;
+	}
+
+	void write_struct(const std::string& place, const Struct& s, const std::vector<ValueId>& values) {
+		const auto leaves = struct_leaves(s, m_parser);
+		for (size_t i = 0; i < leaves.size(); ++i)
+			m_variables[place + leaves[i].path] = values[i];
+	}
+
+	// the values of the scalars in a field, out of the ones of the whole struct
+	std::vector<ValueId> field_values(const Struct& s, const std::vector<ValueId>& values, const std::string& field) const {
+		const auto path = "." + field;
+		const auto leaves = struct_leaves(s, m_parser);
+		std::vector<ValueId> picked;
+		for (size_t i = 0; i < leaves.size(); ++i)
+			if (leaves[i].path == path || leaves[i].path.starts_with(path + "."))
+				picked.push_back(values[i]);
+		return picked;
+	}
+
+	static size_t word_count(const Struct& s) { return (s.size + 3) / 4; }
+
+	// the scalars of a struct put together into the i32s its layout takes up, with the padding zeroed
+	std::vector<ValueId> pack(const Struct& s, const std::vector<ValueId>& values) {
+		const auto leaves = struct_leaves(s, m_parser);
+		std::vector<ValueId> words(word_count(s), no_value);
+		const auto add = [&](size_t word, ValueId part) {
+			words[word] = words[word] == no_value ? part : emit(IrOp::Or, { words[word], part }).result;
+		};
+		for (size_t i = 0; i < leaves.size(); ++i) {
+			const auto word = leaves[i].offset / 4;
+			if (leaves[i].size == 8) {
+				words[word] = values[i];
+				continue;
+			}
+			const auto shift = static_cast<int64_t>(leaves[i].offset % 4 * 8);
+			add(word, shift ? emit(IrOp::Shl, { values[i], constant(shift) }).result : values[i]);
+			// an i32 in a packed struct can be split between two
+			if (shift + leaves[i].size * 8 > 32)
+				add(word + 1, emit(IrOp::Shr, { values[i], constant(32 - shift) }).result);
+		}
+		for (auto& word : words)
+			if (word == no_value) word = constant(0);
+		return words;
+	}
+
+	// a scalar out of the words it's in, which come from word(index)
+	template <class Word>
+	ValueId extract(const StructLeaf& leaf, Word&& word) {
+		const auto index = leaf.offset / 4;
+		// pointers are always whole
+		if (leaf.size == 8)
+			return word(index);
+		const auto shift = static_cast<int64_t>(leaf.offset % 4 * 8);
+		const auto bits = shift + leaf.size * 8;
+		auto value = word(index);
+		if (shift)
+			value = emit(IrOp::Shr, { value, constant(shift) }).result;
+		if (bits > 32)
+			value = emit(IrOp::Or, { value, emit(IrOp::Shl, { word(index + 1), constant(32 - shift) }).result }).result;
+		else if (bits < 32)
+			value = emit(IrOp::And, { value, constant((int64_t(1) << (leaf.size * 8)) - 1) }).result;
+		return value;
+	}
+
+	// the other way around
+	std::vector<ValueId> unpack(const Struct& s, const std::vector<ValueId>& words) {
+		std::vector<ValueId> values;
+		for (const auto& leaf : struct_leaves(s, m_parser))
+			values.push_back(extract(leaf, [&](size_t word) { return words[word]; }));
+		return values;
+	}
+
+	// structs go in registers when they're small enough, and don't have pointers, which don't fit
+	// in an i32 on x86_64
+	static bool in_registers(const Struct& s) { return s.size <= max_register_struct && !s.pointers; }
+
+	// which words of a struct start a pointer, which takes up the one after it too
+	std::vector<bool> pointer_words(const Struct& s) const {
+		std::vector<bool> pointers(word_count(s));
+		for (const auto& leaf : struct_leaves(s, m_parser))
+			if (leaf.size == 8) pointers[leaf.offset / 4] = true;
+		return pointers;
+	}
+
+	// puts the words of a struct in memory, through pointer, or in array when it's no_value
+	void store_words(const Struct& s, const std::vector<ValueId>& words, ValueId pointer, size_t array = 0) {
+		const auto pointers = pointer_words(s);
+		for (size_t i = 0; i < words.size(); i += 1 + pointers[i]) {
+			const auto index = constant(static_cast<int64_t>(i));
+			auto& store = pointer != no_value
+				? emit(IrOp::Write, { pointer, index, words[i] }, false)
+				: emit(IrOp::Store, { index, words[i] }, false);
+			if (pointer == no_value) store.imm = static_cast<int64_t>(array);
+			store.pointer = pointers[i];
+		}
+	}
+
+	std::vector<ValueId> load_words(const Struct& s, ValueId pointer, size_t array = 0) {
+		const auto pointers = pointer_words(s);
+		std::vector<ValueId> words(word_count(s), no_value);
+		for (size_t i = 0; i < words.size(); i += 1 + pointers[i]) {
+			const auto index = constant(static_cast<int64_t>(i));
+			auto& load = pointer != no_value ? emit(IrOp::Read, { pointer, index }) : emit(IrOp::Load, { index });
+			if (pointer == no_value) load.imm = static_cast<int64_t>(array);
+			load.pointer = pointers[i];
+			words[i] = load.result;
+		}
+		return words;
+	}
+
+	// space in the frame for a struct passed or returned through a pointer
+	size_t new_buffer(const Struct& s) {
+		m_function.arrays.push_back(word_count(s));
+		return m_function.arrays.size() - 1;
+	}
+
+	ValueId address(size_t array) {
+		auto& instr = emit(IrOp::Address);
+		instr.imm = static_cast<int64_t>(array);
+		return instr.result;
+	}
+
+	// lowers something with a struct type into the values of its scalars, in the order of struct_leaves
+	std::vector<ValueId> compile_struct(Expression& exp) {
+		const auto& s = *struct_of(exp.value_type);
+		if (const auto place = place_of(exp))
+			return read_struct(*place, s);
+		if (exp.type == ExpressionType::Declaration) {
+			// zeroed, like arrays
+			const std::vector<ValueId> zeros(struct_leaves(s, m_parser).size(), constant(0));
+			write_struct(variable_name(exp), s, zeros);
+			return zeros;
+		}
+		if (exp.type == ExpressionType::Assignment && behind_pointer(exp.children[0])) {
+			const auto values = compile_struct(exp.children[1]);
+			write_pointee(exp.children[0], values);
+			return values;
+		}
+		if (exp.type == ExpressionType::Assignment) {
+			compile_assignment(exp);
+			return read_struct(target_name(exp), s);
+		}
+		if (behind_pointer(exp))
+			return read_pointee(exp);
+		if (exp.type == ExpressionType::Field) {
+			auto& base = exp.children[0];
+			return field_values(*struct_of(base.value_type), compile_struct(base), std::get<Expression::FieldData>(exp.data).name);
+		}
+		if (exp.type == ExpressionType::Cast)
+			return compile_struct(exp.children[0]);
+		if (exp.type == ExpressionType::Call)
+			return compile_call(exp);
+		unhandled(format("can't lower {} as a struct", exp.type));
+	}
+
+	// returns a struct in registers when it's small enough, otherwise through the pointer the caller passed
+	void return_struct(const std::vector<ValueId>& values) {
+		auto words = pack(*m_returned, values);
+		if (m_return_pointer != no_value) {
+			store_words(*m_returned, words, m_return_pointer);
+			words.clear();
+		}
+		emit(IrOp::Return, std::move(words), false);
+	}
+
+	// lowers a call, returning the value it returned, the scalars of the struct it returned, or nothing.
+	// slices get passed as their pointer and then their length, small structs as the words they take up,
+	// and bigger ones as a pointer to a copy the callee reads straight from. extern functions only get the
+	// pointer of slices, like c functions taking an array and its length separately want
+	std::vector<ValueId> compile_call(Expression& exp) {
+		const auto& name = std::get<Expression::CallData>(exp.data).function_name;
+		const auto& functions = m_parser.m_functions;
+		const auto callee = std::find_if(functions.begin(), functions.end(), [&](const Function& f) { return f.name == name; });
+		const bool external = callee != functions.end() && callee->external;
+		const auto* returned = struct_of(exp.value_type);
+		std::vector<ValueId> args;
+		// where a struct too big for registers gets returned, passed before everything else
+		std::optional<size_t> buffer;
+		if (returned && !in_registers(*returned)) {
+			buffer = new_buffer(*returned);
+			args.push_back(address(*buffer));
+		}
+		// values are immutable, so later arguments assigning to variables can't change earlier ones
+		for (auto& child : exp.children) {
+			if (child.value_type.is_slice()) {
+				const auto [data, length] = compile_slice(child);
+				args.push_back(data);
+				if (!external)
+					args.push_back(length);
+			} else if (const auto* s = struct_of(child.value_type)) {
+				const auto words = pack(*s, compile_struct(child));
+				if (in_registers(*s)) {
+					args.insert(args.end(), words.begin(), words.end());
+					continue;
+				}
+				const auto copy = new_buffer(*s);
+				store_words(*s, words, no_value, copy);
+				args.push_back(address(copy));
+			} else {
+				args.push_back(compile_expression(child));
+			}
+		}
+		// TODO: better builtins
+		if (name == "syscall")
+			return { emit(IrOp::Syscall, std::move(args)).result };
+		if (name == "free") {
+			// the runtime needs the size to know which free list it goes on
+			args.push_back(constant(static_cast<int64_t>(m_parser.find_struct(exp.children[0].value_type.name)->size)));
+			emit(IrOp::Call, std::move(args), false).name = "arena_free";
+			return {};
+		}
+		if (name == "reset") {
+			emit(IrOp::Call, {}, false).name = "arena_reset";
+			return {};
+		}
+		const bool has_result = returned ? !buffer && returned->size > 0 : exp.value_type.name != "void";
+		auto& call = emit(IrOp::Call, std::move(args), has_result);
+		call.name = name;
+		call.pointer = exp.value_type.is_pointer();
+		const auto result = call.result;
+		if (!returned)
+			return has_result ? std::vector { result } : std::vector<ValueId> {};
+		std::vector<ValueId> words;
+		if (buffer) {
+			words = load_words(*returned, no_value, *buffer);
+		} else if (has_result) {
+			words.push_back(result);
+			if (word_count(*returned) == 2)
+				words.push_back(emit(IrOp::Result, { result }).result);
+		}
+		return unpack(*returned, words);
+	}
+
+	// whether leaving an expression out could change what the program does, traps included.
+	// indexing out of bounds is one, at least in the evaluator
+	static bool has_side_effects(const Expression& exp) {
+		if (exp.type == ExpressionType::Call || exp.type == ExpressionType::Assignment || exp.type == ExpressionType::Declaration
+			|| exp.type == ExpressionType::Index || exp.type == ExpressionType::Asm || behind_pointer(exp))
+			return true;
+		if (exp.type == ExpressionType::Operator) {
+			const auto op = std::get<Expression::OperatorData>(exp.data).op_type;
+			if (op == OperatorType::Division || op == OperatorType::Modulo) return true;
+		}
+		return std::any_of(exp.children.begin(), exp.children.end(), has_side_effects);
+	}
+
+	// lowers a condition straight into branches, so && and || become chains of them instead of
+	// bools that get computed and then tested
+	Branches compile_condition(Expression& exp) {
+		if (exp.type != ExpressionType::Operator || !is_operator_logical(std::get<Expression::OperatorData>(exp.data).op_type))
+			return branch(compile_expression(exp));
+		const bool is_and = std::get<Expression::OperatorData>(exp.data).op_type == OperatorType::And;
+		auto lhs = compile_condition(exp.children[0]);
+		// the rhs only runs when the lhs doesn't already decide it
+		const auto rhs_block = new_block(is_and ? "and_rhs" : "or_rhs");
+		join(patch(is_and ? lhs.if_true : lhs.if_false, rhs_block), rhs_block);
+		auto rhs = compile_condition(exp.children[1]);
+		const auto& decided = is_and ? lhs.if_false : lhs.if_true;
+		auto& same_way = is_and ? rhs.if_false : rhs.if_true;
+		same_way.insert(same_way.begin(), decided.begin(), decided.end());
+		return rhs;
+	}
+
+	// && or || as a value. when the rhs does nothing but make a bool, doing it anyway is cheaper than
+	// branching around it
+	ValueId compile_logical(Expression& exp) {
+		const bool is_and = std::get<Expression::OperatorData>(exp.data).op_type == OperatorType::And;
+		if (!has_side_effects(exp.children[1])) {
+			const auto lhs = compile_expression(exp.children[0]);
+			const auto rhs = compile_expression(exp.children[1]);
+			return emit(is_and ? IrOp::And : IrOp::Or, { lhs, rhs }).result;
+		}
+		auto lhs = compile_condition(exp.children[0]);
+		const auto rhs_block = new_block(is_and ? "and_rhs" : "or_rhs");
+		join(patch(is_and ? lhs.if_true : lhs.if_false, rhs_block), rhs_block);
+		const auto rhs = compile_expression(exp.children[1]);
+		const Exit rhs_exit { m_block, m_variables };
+
+		const auto end_block = new_block(is_and ? "and_end" : "or_end");
+		auto exits = patch(is_and ? lhs.if_false : lhs.if_true, end_block);
+		// the edges the lhs decided come first, with the value it decided on
+		std::vector<ValueId> values;
+		for (const auto& exit : exits)
+			values.push_back(constant_in(exit.block, !is_and));
+		values.push_back(rhs);
+		exits.push_back(rhs_exit);
+		join(exits, end_block);
+		return emit(IrOp::Phi, std::move(values)).result;
+	}
+
+	ValueId compile_expression(Expression& exp) {
+		// only for what they do, like a call whose result isn't used
+		if (struct_of(exp.value_type)) {
+			compile_struct(exp);
+			return no_value;
+		}
+		if (exp.type == ExpressionType::Literal) {
+			const auto& data = std::get<Expression::LiteralData>(exp.data);
+			return std::visit(overloaded {
+				[&](int value) { return constant(value); },
+				[&](bool value) { return constant(value); },
+				[&](const std::string&) -> ValueId { unhandled("string literals"); },
+			}, data.value);
+		} else if (exp.type == ExpressionType::Operator) {
+			const auto& data = std::get<Expression::OperatorData>(exp.data);
+			if (is_operator_logical(data.op_type))
+				return compile_logical(exp);
+			if (!is_operator_binary(data.op_type)) {
+				const auto value = compile_expression(exp.children[0]);
+				if (data.op_type == OperatorType::Negation)
+					return emit(IrOp::Neg, { value }).result;
+				if (data.op_type == OperatorType::Bitflip)
+					return emit(IrOp::Not, { value }).result;
+				// logical not, bools are 0 or 1
+				return emit(IrOp::Eq, { value, constant(0) }).result;
+			}
+			const auto lhs = compile_expression(exp.children[0]);
+			const auto rhs = compile_expression(exp.children[1]);
+			switch (data.op_type) {
+				case OperatorType::Addition: return emit(IrOp::Add, { lhs, rhs }).result;
+				case OperatorType::Subtraction: return emit(IrOp::Sub, { lhs, rhs }).result;
+				case OperatorType::Multiplication: return emit(IrOp::Mul, { lhs, rhs }).result;
+				case OperatorType::Division: return emit(IrOp::Div, { lhs, rhs }).result;
+				case OperatorType::Modulo: return emit(IrOp::Mod, { lhs, rhs }).result;
+				case OperatorType::Equals: return emit(IrOp::Eq, { lhs, rhs }).result;
+				case OperatorType::NotEquals: return emit(IrOp::Ne, { lhs, rhs }).result;
+				case OperatorType::Less: return emit(IrOp::Lt, { lhs, rhs }).result;
+				case OperatorType::LessEquals: return emit(IrOp::Le, { lhs, rhs }).result;
+				case OperatorType::Greater: return emit(IrOp::Gt, { lhs, rhs }).result;
+				case OperatorType::GreaterEquals: return emit(IrOp::Ge, { lhs, rhs }).result;
+				default: unhandled(format("unimplemented operator {}", data.op_type));
+			}
+		} else if (exp.type == ExpressionType::Declaration) {
+			// declared without a value
+			const auto& var = std::get<Expression::DeclarationData>(exp.data).var;
+			if (var.type.is_array()) {
+				declare_array(var);
+				return no_value;
+			}
+			if (var.type.is_slice()) {
+				compile_slice(exp);
+				return no_value;
+			}
+			return m_variables[var.name] = constant(0);
+		} else if (exp.type == ExpressionType::Assignment) {
+			return compile_assignment(exp).first;
+		} else if (exp.type == ExpressionType::Index) {
+			const auto element = compile_element(exp);
+			if (element.data != no_value)
+				return emit(IrOp::Read, { element.data, element.index }).result;
+			auto& load = emit(IrOp::Load, { element.index });
+			load.imm = static_cast<int64_t>(element.array);
+			return load.result;
+		} else if (exp.type == ExpressionType::Variable) {
+			return read_variable(variable_name(exp));
+		} else if (exp.type == ExpressionType::Call) {
+			const auto& name = std::get<Expression::CallData>(exp.data).function_name;
+			if (name == "len") {
+				auto& arg = exp.children[0];
+				if (arg.value_type.is_array())
+					return constant(static_cast<int64_t>(arg.value_type.length));
+				return compile_slice(arg).second;
+			}
+			if (name == "alloc")
+				return compile_alloc(exp).first;
+			if (const auto* intrinsic = find_intrinsic(name)) {
+				std::vector<ValueId> args;
+				for (auto& child : exp.children)
+					args.push_back(compile_expression(child));
+				return emit(intrinsic->op, std::move(args), intrinsic->returns).result;
+			}
+			const auto values = compile_call(exp);
+			return values.empty() ? no_value : values[0];
+		} else if (exp.type == ExpressionType::Field) {
+			if (behind_pointer(exp))
+				return read_pointee(exp)[0];
+			if (const auto place = place_of(exp))
+				return read_variable(*place);
+			auto& base = exp.children[0];
+			return field_values(*struct_of(base.value_type), compile_struct(base), std::get<Expression::FieldData>(exp.data).name)[0];
+		} else if (exp.type == ExpressionType::Asm) {
+			const auto& data = std::get<Expression::AsmData>(exp.data);
+			std::vector<ValueId> args;
+			for (auto& child : exp.children)
+				args.push_back(child.value_type.is_slice() ? compile_slice(child).first : compile_expression(child));
+			auto& instr = emit(IrOp::Asm, std::move(args), !data.output.empty());
+			instr.imm = static_cast<int64_t>(m_function.asm_blocks.size());
+			m_function.asm_blocks.push_back(data);
+			return instr.result;
+		} else if (exp.type == ExpressionType::Cast) {
+			// references are just the variable's value
+			if (!exp.value_type.reference && exp.children[0].value_type.reference)
+				return compile_expression(exp.children[0]);
+			unhandled(format("unhandled cast between {} and {}", exp.value_type, exp.children[0].value_type));
+		}
+		unhandled(format("unimplemented expression {}", exp.type));
+	}
+};
+
+}
+
+IrFunction build_ir(Function& function, const Parser& parser) {
+	IrBuilder builder(parser);
+	auto& ir = builder.m_function;
+	ir.name = function.name;
+	builder.m_returned = builder.struct_of(function.return_type);
+
+	builder.new_block("entry");
+	const auto argument = [&](bool pointer) {
+		auto& arg = builder.emit(IrOp::Arg);
+		arg.imm = static_cast<int64_t>(ir.arg_count++);
+		ir.pointer_args.push_back(pointer);
+		return arg.result;
+	};
+	if (const auto* s = builder.m_returned) {
+		if (!IrBuilder::in_registers(*s))
+			builder.m_return_pointer = argument(true);
+		else
+			ir.return_count = IrBuilder::word_count(*s);
+	} else {
+		ir.return_count = function.return_type.name != "void";
+	}
+	for (const auto& var : function.arguments) {
+		if (var.type.is_slice()) {
+			builder.m_variables[IrBuilder::data_name(var.name)] = argument(true);
+			builder.m_variables[IrBuilder::length_name(var.name)] = argument(false);
+		} else if (const auto* s = builder.struct_of(var.type)) {
+			std::vector<ValueId> words;
+			if (IrBuilder::in_registers(*s)) {
+				for (size_t i = 0; i < IrBuilder::word_count(*s); ++i)
+					words.push_back(argument(false));
+			} else {
+				words = builder.load_words(*s, argument(true));
+			}
+			builder.write_struct(var.name, *s, builder.unpack(*s, words));
+		} else {
+			builder.m_variables[var.name] = argument(var.type.is_pointer());
+		}
+	}
+	for (auto& statement : function.statements)
+		builder.compile_statement(statement);
+	// falling off the end
+	if (builder.is_open() && builder.m_returned) {
+		builder.return_struct(std::vector(struct_leaves(*builder.m_returned, parser).size(), builder.constant(0)));
+	} else if (builder.is_open()) {
+		std::vector<ValueId> value;
+		if (ir.return_count)
+			value.push_back(builder.constant(0));
+		builder.emit(IrOp::Return, std::move(value), false);
+	}
+
+	remove_unreachable_blocks(ir);
+	remove_trivial_phis(ir);
+	return std::move(ir);
+}
+
+std::vector<IrDef> find_defs(const IrFunction& function) {
+	std::vector<IrDef> defs(function.next_value);
+	for (BlockId b = 0; b < function.blocks.size(); ++b) {
+		const auto& code = function.blocks[b].code;
+		for (size_t i = 0; i < code.size(); ++i)
+			if (code[i].result != no_value) defs[code[i].result] = { b, i };
+	}
+	return defs;
+}
+
+void replace_values(IrFunction& function, std::vector<ValueId>& replacements) {
+	const auto resolve = [&](ValueId value) {
+		auto result = value;
+		while (replacements[result] != no_value && replacements[result] != result)
+			result = replacements[result];
+		// shorten the chain for next time
+		if (result != value) replacements[value] = result;
+		return result;
+	};
+	for (auto& block : function.blocks)
+		for (auto& instr : block.code)
+			for (auto& arg : instr.args)
+				arg = resolve(arg);
+}
+
+BlockId switch_target(const IrInstr& instr, int64_t value) {
+	const auto it = std::find(instr.cases.begin(), instr.cases.end(), value);
+	return instr.targets[static_cast<size_t>(it - instr.cases.begin())];
+}
+
+void remove_pred(IrBlock& block, BlockId pred) {
+	const auto it = std::find(block.preds.begin(), block.preds.end(), pred);
+	assert(it != block.preds.end(), "not a pred");
+	const auto index = it - block.preds.begin();
+	block.preds.erase(it);
+	for (auto& instr : block.code) {
+		if (instr.op != IrOp::Phi) break;
+		instr.args.erase(instr.args.begin() + index);
+	}
+}
+
+bool remove_unreachable_blocks(IrFunction& function) {
+	auto& blocks = function.blocks;
+	std::vector<bool> reachable(blocks.size());
+	std::vector<BlockId> stack { 0 };
+	reachable[0] = true;
+	while (!stack.empty()) {
+		const auto block = stack.back();
+		stack.pop_back();
+		for (const auto succ : blocks[block].successors()) {
+			if (!reachable[succ]) {
+				reachable[succ] = true;
+				stack.push_back(succ);
+			}
+		}
+	}
+	if (std::all_of(reachable.begin(), reachable.end(), [](bool r) { return r; }))
+		return false;
+
+	for (BlockId b = 0; b < blocks.size(); ++b) {
+		if (reachable[b]) continue;
+		for (const auto succ : blocks[b].successors())
+			if (reachable[succ]) remove_pred(blocks[succ], b);
+	}
+
+	std::vector<BlockId> order;
+	for (BlockId b = 0; b < blocks.size(); ++b)
+		if (reachable[b]) order.push_back(b);
+	reorder_blocks(function, order);
+	return true;
+}
+
+void reorder_blocks(IrFunction& function, const std::vector<BlockId>& order) {
+	auto& blocks = function.blocks;
+	std::vector<BlockId> new_id(blocks.size(), no_block);
+	for (BlockId i = 0; i < order.size(); ++i)
+		new_id[order[i]] = i;
+	std::vector<IrBlock> reordered;
+	reordered.reserve(order.size());
+	for (const auto b : order) {
+		auto& block = reordered.emplace_back(std::move(blocks[b]));
+		for (auto& pred : block.preds) pred = new_id[pred];
+		for (auto& target : block.terminator().targets) target = new_id[target];
+	}
+	blocks = std::move(reordered);
+}
+
+bool remove_trivial_phis(IrFunction& function) {
+	std::vector<ValueId> replacements(function.next_value, no_value);
+	bool any = false;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (auto& block : function.blocks) {
+			for (auto& instr : block.code) {
+				if (instr.op != IrOp::Phi) break;
+				if (replacements[instr.result] != no_value) continue;
+				ValueId same = no_value;
+				bool trivial = true;
+				for (auto arg : instr.args) {
+					while (replacements[arg] != no_value) arg = replacements[arg];
+					if (arg == same || arg == instr.result) continue;
+					if (same != no_value) {
+						trivial = false;
+						break;
+					}
+					same = arg;
+				}
+				// only refers to itself, can only happen in unreachable loops
+				if (trivial && same != no_value) {
+					replacements[instr.result] = same;
+					changed = any = true;
+				}
+			}
+		}
+	}
+	if (!any) return false;
+	for (auto& block : function.blocks) {
+		std::erase_if(block.code, [&](const IrInstr& instr) {
+			return instr.op == IrOp::Phi && replacements[instr.result] != no_value;
+		});
+	}
+	replace_values(function, replacements);
+	return true;
+}
+
+void split_critical_edges(IrFunction& function) {
+	const auto count = function.blocks.size();
+	for (BlockId b = 0; b < count; ++b) {
+		if (function.blocks[b].successors().size() < 2) continue;
+		for (size_t t = 0; t < function.blocks[b].successors().size(); ++t) {
+			const auto succ = function.blocks[b].successors()[t];
+			// without phis there's nothing to put on the edge, like the arms of a match
+			if (function.blocks[succ].preds.size() < 2 || function.blocks[succ].code[0].op != IrOp::Phi) continue;
+			const auto split = static_cast<BlockId>(function.blocks.size());
+			auto& edge = function.blocks.emplace_back(IrBlock {
+				.preds = { b },
+				.kind = "edge",
+				.loop_depth = function.blocks[succ].loop_depth,
+			});
+			edge.code.push_back(IrInstr { .op = IrOp::Jump, .targets = { succ } });
+			function.blocks[b].terminator().targets[t] = split;
+			// only the first matching pred, a block branching here both ways gets two splits
+			auto& preds = function.blocks[succ].preds;
+			*std::find(preds.begin(), preds.end(), b) = split;
+		}
+	}
+}
+
+std::vector<BlockId> reverse_postorder(const IrFunction& function) {
+	std::vector<BlockId> order;
+	std::vector<bool> visited(function.blocks.size());
+	// (block, next successor to look at)
+	std::vector<std::pair<BlockId, size_t>> stack { { 0, 0 } };
+	visited[0] = true;
+	while (!stack.empty()) {
+		auto& [block, next] = stack.back();
+		const auto& succs = function.blocks[block].successors();
+		if (next < succs.size()) {
+			const auto succ = succs[next++];
+			if (!visited[succ]) {
+				visited[succ] = true;
+				stack.push_back({ succ, 0 });
+			}
+		} else {
+			order.push_back(block);
+			stack.pop_back();
+		}
+	}
+	std::reverse(order.begin(), order.end());
+	return order;
+}
+
+// Cooper, Harvey and Kennedy's "A Simple, Fast Dominance Algorithm"
+std::vector<BlockId> compute_idoms(const IrFunction& function) {
+	const auto order = reverse_postorder(function);
+	std::vector<size_t> position(function.blocks.size(), SIZE_MAX);
+	for (size_t i = 0; i < order.size(); ++i)
+		position[order[i]] = i;
+
+	std::vector<BlockId> idom(function.blocks.size(), no_block);
+	idom[0] = 0;
+	const auto intersect = [&](BlockId a, BlockId b) {
+		while (a != b) {
+			while (position[a] > position[b]) a = idom[a];
+			while (position[b] > position[a]) b = idom[b];
+		}
+		return a;
+	};
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i = 1; i < order.size(); ++i) {
+			const auto block = order[i];
+			BlockId new_idom = no_block;
+			for (const auto pred : function.blocks[block].preds) {
+				if (idom[pred] == no_block) continue;
+				new_idom = new_idom == no_block ? pred : intersect(pred, new_idom);
+			}
+			if (idom[block] != new_idom) {
+				idom[block] = new_idom;
+				changed = true;
+			}
+		}
+	}
+	return idom;
+}
+
+static const char* ir_op_name(IrOp op) {
+	switch (op) {
+		case IrOp::Const: return "const";
+		case IrOp::Arg: return "arg";
+		case IrOp::Phi: return "phi";
+		case IrOp::Add: return "add";
+		case IrOp::Sub: return "sub";
+		case IrOp::Mul: return "mul";
+		case IrOp::Div: return "div";
+		case IrOp::Mod: return "mod";
+		case IrOp::Neg: return "neg";
+		case IrOp::Not: return "not";
+		case IrOp::And: return "and";
+		case IrOp::Or: return "or";
+		case IrOp::Shl: return "shl";
+		case IrOp::Shr: return "shr";
+		case IrOp::Popcount: return "popcount";
+		case IrOp::Clz: return "clz";
+		case IrOp::Ctz: return "ctz";
+		case IrOp::Bswap: return "bswap";
+		case IrOp::Rotl: return "rotl";
+		case IrOp::Rotr: return "rotr";
+		case IrOp::Rdtsc: return "rdtsc";
+		case IrOp::Pause: return "pause";
+		case IrOp::Eq: return "eq";
+		case IrOp::Ne: return "ne";
+		case IrOp::Lt: return "lt";
+		case IrOp::Le: return "le";
+		case IrOp::Gt: return "gt";
+		case IrOp::Ge: return "ge";
+		case IrOp::Select: return "select";
+		case IrOp::Call: return "call";
+		case IrOp::Result: return "result";
+		case IrOp::Syscall: return "syscall";
+		case IrOp::Asm: return "asm";
+		case IrOp::Load: return "load";
+		case IrOp::Store: return "store";
+		case IrOp::Address: return "address";
+		case IrOp::Offset: return "offset";
+		case IrOp::Read: return "read";
+		case IrOp::Write: return "write";
+		case IrOp::Check: return "check";
+		case IrOp::Splat: return "splat";
+		case IrOp::Reduce: return "reduce";
+		case IrOp::Jump: return "jump";
+		case IrOp::Branch: return "branch";
+		case IrOp::Switch: return "switch";
+		case IrOp::Return: return "return";
+	}
+	return "";
+}
+
+std::ostream& operator<<(std::ostream& stream, const IrInstr& instr) {
+	if (instr.result != no_value)
+		stream << 'v' << instr.result << " = ";
+	stream << ir_op_name(instr.op);
+	if (instr.lanes > 1)
+		stream << '.' << int(instr.lanes);
+	if (instr.pointer)
+		stream << ".ptr";
+	bool first = true;
+	const auto separator = [&]() -> std::ostream& {
+		stream << (first ? " " : ", ");
+		first = false;
+		return stream;
+	};
+	if (instr.op == IrOp::Const || instr.op == IrOp::Arg)
+		separator() << instr.imm;
+	if (instr.op == IrOp::Load || instr.op == IrOp::Store || instr.op == IrOp::Address)
+		separator() << 'a' << instr.imm;
+	if (instr.op == IrOp::Check)
+		separator() << 'c' << instr.imm;
+	if (instr.op == IrOp::Asm)
+		separator() << "block " << instr.imm;
+	if (instr.op == IrOp::Reduce)
+		separator() << ir_op_name(static_cast<IrOp>(instr.imm));
+	if (!instr.name.empty())
+		separator() << instr.name;
+	for (const auto arg : instr.args)
+		separator() << 'v' << arg;
+	if (instr.op == IrOp::Splat && instr.imm)
+		separator() << "step " << instr.imm;
+	for (size_t i = 0; i < instr.targets.size(); ++i) {
+		if (instr.op == IrOp::Switch)
+			separator() << (i < instr.cases.size() ? format("{} -> ", instr.cases[i]) : "else -> ") << 'b' << instr.targets[i];
+		else
+			separator() << 'b' << instr.targets[i];
+	}
+	return stream;
+}
+
+std::ostream& operator<<(std::ostream& stream, const IrFunction& function) {
+	format_to(stream, "fn {}({}) {{\n", function.name, function.arg_count);
+	for (size_t i = 0; i < function.arrays.size(); ++i)
+		format_to(stream, "a{}: [{}]\n", i, function.arrays[i]);
+	for (BlockId b = 0; b < function.blocks.size(); ++b) {
+		const auto& block = function.blocks[b];
+		format_to(stream, "b{}: ; {}", b, block.kind);
+		if (!block.preds.empty()) {
+			stream << ", preds";
+			for (const auto pred : block.preds)
+				stream << " b" << pred;
+		}
+		stream << '\n';
+		for (const auto& instr : block.code)
+			format_to(stream, "\t{}\n", instr);
+	}
+	return stream << "}\n";
+}
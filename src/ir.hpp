@@ -0,0 +1,187 @@
+#pragma once
+#include "parser.hpp"
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// SSA values are numbered per function, and every instruction producing one defines a new id
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+
+static constexpr ValueId no_value = UINT32_MAX;
+static constexpr BlockId no_block = UINT32_MAX;
+
+enum class IrOp : uint8_t {
+	Const, // imm
+	Arg,   // imm is the argument index
+	Phi,   // args line up with the block's preds
+	Add,
+	Sub,
+	Mul,
+	// signed, rounding towards zero. traps on zero like idiv does
+	Div,
+	Mod,
+	Neg,
+	// bitwise
+	Not,
+	And,
+	Or,
+	// by args[1], which is a constant between 1 and 31. Shr shifts zeros in
+	Shl,
+	Shr,
+	// the intrinsics, which are pure up to Rotr. counts of zero bits are 32 for 0
+	Popcount,
+	Clz,
+	Ctz,
+	Bswap,
+	// by args[1], wrapping around at 32
+	Rotl,
+	Rotr,
+	// the low half of the time stamp counter
+	Rdtsc,
+	Pause,
+	Eq,
+	Ne,
+	// signed
+	Lt,
+	Le,
+	Gt,
+	Ge,
+	// args[1] if args[0] is non zero, else args[2]
+	Select,
+	Call,  // calls name
+	// the second value a call to a function returning two of them gave back, straight after the call
+	Result,
+	Syscall,
+	// asm_blocks[imm], with args going into its input registers and the result coming out of its output one
+	Asm,
+	// imm is the array, args[0] the index
+	Load,
+	// stores args[1] at index args[0] of array imm
+	Store,
+	// pointer to the first element of array imm, which is how arrays become slices
+	Address,
+	// pointer args[0] moved along by args[1] elements
+	Offset,
+	// the element at index args[1] from pointer args[0]
+	Read,
+	// stores args[2] at index args[1] from pointer args[0]
+	Write,
+	// traps unless 0 <= args[0] < args[1]. imm is the index of what it's checking in checks
+	Check,
+	// vectors only, which the vectorizer makes
+	Splat,  // args[0] + lane * imm in every lane
+	Reduce, // the lanes of args[0] combined with imm, an IrOp: Add, Lt for the smallest or Gt for the largest
+	// terminators
+	Jump,   // to targets[0]
+	Branch, // to targets[0] if args[0] is non zero, else targets[1]
+	Switch, // to targets[i] if args[0] is cases[i], else the last target
+	Return, // args[0] if the function returns something
+};
+
+struct IrInstr {
+	IrOp op;
+	ValueId result = no_value;
+	std::vector<ValueId> args;
+	int64_t imm = 0;
+	std::string name;
+	std::vector<BlockId> targets;
+	// Switch only, lined up with the targets but the last
+	std::vector<int64_t> cases;
+	// more than one makes it work on that many consecutive i32s at once, with comparisons giving
+	// a lane with every bit set where they're true. Reduce gets a scalar out of that many
+	uint8_t lanes = 1;
+	// Load, Read and Call only: the result is a pointer. Store and Write only: the element is one, even if
+	// what gets stored is a null constant. pointers everywhere else follow from where they came from
+	bool pointer = false;
+};
+
+struct IrBlock {
+	// phis first, then the rest, ending with exactly one terminator
+	std::vector<IrInstr> code;
+	// can have the same block twice, if it branches here both ways
+	std::vector<BlockId> preds;
+	// what made the block, ends up in its label
+	std::string kind;
+	uint8_t loop_depth = 0;
+	// heads a loop made by unrolling another one, so it doesn't get unrolled again
+	bool unrolled = false;
+	// heads a vectorized loop, or the one doing the iterations left over after it
+	bool vectorized = false;
+
+	IrInstr& terminator() { return code.back(); }
+	const IrInstr& terminator() const { return code.back(); }
+	const std::vector<BlockId>& successors() const { return code.back().targets; }
+};
+
+struct IrFunction {
+	std::string name;
+	size_t arg_count = 0;
+	// what every Return takes, which is two for structs going back in two registers
+	size_t return_count = 0;
+	// blocks[0] is the entry, which never has preds
+	std::vector<IrBlock> blocks;
+	ValueId next_value = 0;
+	// how many elements each array Load and Store refer to has
+	std::vector<size_t> arrays;
+	// where the indexing or slicing every Check is for came from
+	std::vector<Span> checks;
+	// which arguments are pointers, which slices get passed as along with their length
+	std::vector<bool> pointer_args;
+	// the asm blocks Asm instructions are for, which only get parsed once the target is known
+	std::vector<Expression::AsmData> asm_blocks;
+
+	ValueId new_value() { return next_value++; }
+};
+
+bool is_terminator(IrOp op);
+// whether an instruction can be removed or merged with an equal one when its result isn't needed.
+// division counts, since a trap only has to happen if something uses the result
+bool is_pure(IrOp op);
+// whether an instruction only reads something, so it can go when its result isn't needed, but can't be
+// moved or merged since what it reads can change
+bool is_read(IrOp op);
+bool is_commutative(IrOp op);
+bool is_comparison(IrOp op);
+// where a switch goes for value
+BlockId switch_target(const IrInstr& instr, int64_t value);
+
+// structs this big or smaller get passed and returned in registers, a word at a time, unless they have
+// pointers in them. the rest go through a pointer to the caller's copy
+static constexpr size_t max_register_struct = 8;
+
+// lowers a checked function into SSA form, with trivial phis and unreachable blocks already cleaned out.
+// structs become a value per scalar in them
+IrFunction build_ir(Function& function, const Parser& parser);
+
+// where a value is defined, indexed by value id. no_block for values that aren't defined anymore
+struct IrDef {
+	BlockId block = no_block;
+	size_t index = 0;
+};
+std::vector<IrDef> find_defs(const IrFunction& function);
+
+// renames every use of a value to replacements[value], following chains. no_value keeps the value
+void replace_values(IrFunction& function, std::vector<ValueId>& replacements);
+
+// drops the edge from pred to block, along with its phi arguments
+void remove_pred(IrBlock& block, BlockId pred);
+// drops the blocks not reachable from the entry and renumbers the rest
+bool remove_unreachable_blocks(IrFunction& function);
+// puts the blocks in the given order, which has to start with the entry. blocks left out have to be
+// unreachable already
+void reorder_blocks(IrFunction& function, const std::vector<BlockId>& order);
+// replaces phis whose arguments are all the same value (or the phi itself) with that value
+bool remove_trivial_phis(IrFunction& function);
+// puts an empty block on every edge from a block with several successors to one with
+// several preds, so phi copies have somewhere to go
+void split_critical_edges(IrFunction& function);
+
+// blocks in reverse postorder, starting at the entry
+std::vector<BlockId> reverse_postorder(const IrFunction& function);
+// immediate dominator of every block, with the entry being its own. no_block for unreachable blocks
+std::vector<BlockId> compute_idoms(const IrFunction& function);
+
+std::ostream& operator<<(std::ostream& stream, const IrInstr& instr);
+std::ostream& operator<<(std::ostream& stream, const IrFunction& function);
@@ -0,0 +1,64 @@
+#include "layout.hpp"
+#include <numeric>
+
+static bool is_scalar(const Type& type) {
+	return type.is_pointer() || type.name == "i32" || type.name == "bool";
+}
+
+// bools are a single byte in structs, even though they take up a whole register elsewhere
+static std::pair<size_t, size_t> field_size_align(const Type& type, const Parser& parser) {
+	if (type.is_pointer()) return { 8, 8 };
+	if (type.name == "i32") return { 4, 4 };
+	if (type.name == "bool") return { 1, 1 };
+	const auto* inner = parser.find_struct(type.name);
+	assert(inner != nullptr, "unknown field type");
+	return { inner->size, inner->align };
+}
+
+void lay_out_struct(Struct& s, const Parser& parser) {
+	const auto count = s.fields.size();
+	std::vector<size_t> order(count);
+	std::iota(order.begin(), order.end(), 0);
+	if (s.layout == StructLayout::Reordered) {
+		// ties keep the order they were written in
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return field_size_align(s.fields[a].type, parser).second > field_size_align(s.fields[b].type, parser).second;
+		});
+	}
+	s.offsets.assign(count, 0);
+	s.size = 0;
+	s.align = 1;
+	s.pointers = false;
+	for (const auto field : order) {
+		const auto& type = s.fields[field].type;
+		s.pointers |= type.is_pointer() || (!is_scalar(type) && parser.find_struct(type.name)->pointers);
+		auto [size, align] = field_size_align(type, parser);
+		if (s.layout == StructLayout::Packed) align = 1;
+		s.size = (s.size + align - 1) / align * align;
+		s.offsets[field] = s.size;
+		s.size += size;
+		s.align = std::max(s.align, align);
+	}
+	// keeps the size a multiple of the alignment, for the structs this one goes in
+	s.size = (s.size + s.align - 1) / s.align * s.align;
+}
+
+std::vector<StructLeaf> struct_leaves(const Struct& s, const Parser& parser) {
+	std::vector<StructLeaf> leaves;
+	for (size_t i = 0; i < s.fields.size(); ++i) {
+		const auto& field = s.fields[i];
+		const auto path = "." + field.name;
+		for (auto leaf : type_leaves(field.type, parser)) {
+			leaf.path = path + leaf.path;
+			leaf.offset += s.offsets[i];
+			leaves.push_back(std::move(leaf));
+		}
+	}
+	return leaves;
+}
+
+std::vector<StructLeaf> type_leaves(const Type& type, const Parser& parser) {
+	if (is_scalar(type))
+		return { StructLeaf { "", 0, static_cast<uint8_t>(field_size_align(type, parser).first) } };
+	return struct_leaves(*parser.find_struct(type.name), parser);
+}
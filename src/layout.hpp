@@ -0,0 +1,23 @@
+#pragma once
+#include "parser.hpp"
+
+// a scalar somewhere in a struct, with the structs in it flattened out
+struct StructLeaf {
+	// the fields leading to it, like .a.b
+	std::string path;
+	size_t offset;
+	// 4 for i32s, 1 for bools and 8 for pointers, which take that much on every target so layouts don't
+	// depend on it
+	uint8_t size;
+};
+
+// Works out where the fields of a struct go, filling in its offsets, size and alignment. the structs
+// it has fields of have to be laid out already. unless it's packed or ordered, the fields get sorted
+// by alignment, largest first: sizes are multiples of alignments, which are powers of two, so every
+// field then starts aligned without any padding in between, leaving only what the end needs.
+void lay_out_struct(Struct& s, const Parser& parser);
+
+// the scalars of a laid out struct in the order its fields were written, nested structs included
+std::vector<StructLeaf> struct_leaves(const Struct& s, const Parser& parser);
+// the same for anything that can be a field, which is just itself when it's not a struct
+std::vector<StructLeaf> type_leaves(const Type& type, const Parser& parser);
@@ -42,17 +42,39 @@ std::optional<Token> Lexer::get_token() {
 				return ret(Token(TokenType::String, str));
 			}
 			case ',': return ret(TokenType::Comma);
+			case '.': {
+				if (m_stream.peek() == '.') {
+					m_stream.get(c);
+					return ret(TokenType::Range);
+				}
+				return ret(TokenType::Dot);
+			}
 			case '=': {
 				if (m_stream.peek() == '=') {
 					m_stream.get(c);
 					return ret(Token(TokenType::Operator, "=="));
 				}
+				if (m_stream.peek() == '>') {
+					m_stream.get(c);
+					return ret(TokenType::Arrow);
+				}
 				return ret(TokenType::Assign);
 			}
+			case '<':
+			case '>': {
+				std::string op(1, c);
+				if (m_stream.peek() == '=') {
+					m_stream.get();
+					op.push_back('=');
+				}
+				return ret(Token(TokenType::Operator, op));
+			}
 			case '(': return ret(TokenType::LeftParen);
 			case ')': return ret(TokenType::RightParen);
 			case '{': return ret(TokenType::LeftBracket);
 			case '}': return ret(TokenType::RightBracket);
+			case '[': return ret(TokenType::LeftSquare);
+			case ']': return ret(TokenType::RightSquare);
 			case ':': return ret(TokenType::TypeIndicator);
 			case '0':
 			case '1':
@@ -82,6 +104,7 @@ std::optional<Token> Lexer::get_token() {
 			case '~': return ret(Token(TokenType::Operator, "~"));
 			case '+': return ret(Token(TokenType::Operator, "+"));
 			case '*': return ret(Token(TokenType::Operator, "*"));
+			case '%': return ret(Token(TokenType::Operator, "%"));
 			case '!': {
 				if (m_stream.peek() == '=') {
 					m_stream.get();
@@ -90,6 +113,13 @@ std::optional<Token> Lexer::get_token() {
 					return ret(Token(TokenType::Operator, "!"));
 				}
 			}
+			case '&':
+			case '|': {
+				// only the logical ones, there's no bitwise and or or yet
+				if (m_stream.peek() != c) return ret(TokenType::Unknown);
+				m_stream.get();
+				return ret(Token(TokenType::Operator, std::string(2, c)));
+			}
 			case '/': {
 				if (m_stream.peek() == '/') {
 					std::string comment;
@@ -112,7 +142,9 @@ std::optional<Token> Lexer::get_token() {
 						break;
 				}
 				// TODO: clean this up
-				if (str == "fn" || str == "let" || str == "return" || str == "true" || str == "false" || str == "if" || str == "while" || str == "else")
+				if (str == "fn" || str == "let" || str == "return" || str == "true" || str == "false" || str == "if" || str == "while" || str == "else"
+					|| str == "match" || str == "for" || str == "in" || str == "struct" || str == "extern"
+					|| str == "asm" || str == "const")
 					return ret(Token(TokenType::Keyword, str));
 				else
 					return ret(Token(TokenType::Identifier, str));
@@ -12,6 +12,8 @@ enum class TokenType {
 	RightParen,
 	LeftBracket,
 	RightBracket,
+	LeftSquare,
+	RightSquare,
 	TypeIndicator, // :
 	Number,
 	Identifier,
@@ -19,6 +21,9 @@ enum class TokenType {
 	Comma,
 	Keyword,
 	Operator,
+	Arrow, // =>
+	Range, // ..
+	Dot,
 };
 
 struct Span {
@@ -54,7 +59,8 @@ class Lexer {
 	}
 	void eat_until(std::string& buffer, char target);
 public:
-	Lexer(std::istream& stream) : m_stream(stream) {}
+	// first_line lets a piece of a file be lexed with the spans it has in the whole file
+	Lexer(std::istream& stream, size_t first_line = 1) : m_stream(stream), m_line(first_line) {}
 
 	std::optional<Token> get_token();
 	std::vector<Token> get_tokens();
@@ -0,0 +1,1427 @@
+#include "loops.hpp"
+#include "utils.hpp"
+#include <map>
+#include <set>
+
+bool Loop::contains(BlockId block) const {
+	return std::find(blocks.begin(), blocks.end(), block) != blocks.end();
+}
+
+static bool dominates(const std::vector<BlockId>& idom, BlockId a, BlockId b) {
+	while (a != b) {
+		if (b == 0 || idom[b] == no_block) return false;
+		b = idom[b];
+	}
+	return true;
+}
+
+static std::optional<int64_t> constant_value(const IrFunction& function, const std::vector<IrDef>& defs, ValueId value) {
+	const auto def = defs[value];
+	if (def.block == no_block) return {};
+	const auto& instr = function.blocks[def.block].code[def.index];
+	if (instr.op != IrOp::Const) return {};
+	return instr.imm;
+}
+
+static int64_t wrap(int64_t value) {
+	return static_cast<int32_t>(static_cast<uint32_t>(value));
+}
+
+// every loop is a header plus the blocks that can get back to it without going through it,
+// where a back edge is an edge to a block that dominates where it comes from
+static std::vector<Loop> natural_loops(const IrFunction& function) {
+	const auto& blocks = function.blocks;
+	const auto idom = compute_idoms(function);
+	std::vector<Loop> loops;
+	for (BlockId h = 0; h < blocks.size(); ++h) {
+		std::vector<BlockId> latches;
+		for (const auto pred : blocks[h].preds)
+			if (dominates(idom, h, pred) && std::find(latches.begin(), latches.end(), pred) == latches.end())
+				latches.push_back(pred);
+		if (latches.empty()) continue;
+
+		Loop loop { .header = h, .blocks = { h } };
+		if (latches.size() == 1) loop.latch = latches[0];
+		auto work = latches;
+		while (!work.empty()) {
+			const auto block = work.back();
+			work.pop_back();
+			if (loop.contains(block)) continue;
+			loop.blocks.push_back(block);
+			for (const auto pred : blocks[block].preds)
+				if (!loop.contains(pred)) work.push_back(pred);
+		}
+		loops.push_back(std::move(loop));
+	}
+	// a loop inside another one has fewer blocks
+	std::stable_sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) { return a.blocks.size() < b.blocks.size(); });
+	for (size_t i = 0; i < loops.size(); ++i) {
+		for (size_t j = i + 1; j < loops.size(); ++j) {
+			if (loops[j].contains(loops[i].header)) {
+				loops[i].parent = j;
+				break;
+			}
+		}
+	}
+	return loops;
+}
+
+// puts a block in front of the header that everything from outside the loop goes through,
+// unless there already is one. returns whether it added one
+static bool ensure_preheader(IrFunction& function, const Loop& loop) {
+	auto& blocks = function.blocks;
+	const auto& header_preds = blocks[loop.header].preds;
+	std::vector<size_t> outside;
+	for (size_t i = 0; i < header_preds.size(); ++i)
+		if (!loop.contains(header_preds[i])) outside.push_back(i);
+	if (outside.empty()) return false;
+	if (outside.size() == 1 && blocks[header_preds[outside[0]]].successors().size() == 1) return false;
+
+	const auto id = static_cast<BlockId>(blocks.size());
+	auto& header = blocks[loop.header];
+	IrBlock preheader { .kind = "preheader", .loop_depth = static_cast<uint8_t>(header.loop_depth ? header.loop_depth - 1 : 0) };
+	for (const auto i : outside)
+		preheader.preds.push_back(header.preds[i]);
+	// the header phis get one value from outside now, merged in the preheader if there were several
+	for (auto& phi : header.code) {
+		if (phi.op != IrOp::Phi) break;
+		ValueId value = phi.args[outside[0]];
+		if (outside.size() > 1) {
+			auto& merged = preheader.code.emplace_back(IrInstr { .op = IrOp::Phi, .result = function.new_value() });
+			for (const auto i : outside)
+				merged.args.push_back(phi.args[i]);
+			value = merged.result;
+		}
+		std::vector<ValueId> args { value };
+		for (size_t i = 0; i < phi.args.size(); ++i)
+			if (std::find(outside.begin(), outside.end(), i) == outside.end()) args.push_back(phi.args[i]);
+		phi.args = std::move(args);
+	}
+	std::vector<BlockId> preds { id };
+	for (const auto pred : header.preds)
+		if (loop.contains(pred)) preds.push_back(pred);
+	header.preds = std::move(preds);
+	preheader.code.push_back(IrInstr { .op = IrOp::Jump, .targets = { loop.header } });
+	for (const auto pred : preheader.preds)
+		for (auto& target : blocks[pred].terminator().targets)
+			if (target == loop.header) target = id;
+	blocks.push_back(std::move(preheader));
+
+	std::vector<BlockId> order;
+	for (BlockId b = 0; b < id; ++b) {
+		if (b == loop.header) order.push_back(id);
+		order.push_back(b);
+	}
+	reorder_blocks(function, order);
+	return true;
+}
+
+static void find_induction_variables(const IrFunction& function, const std::vector<IrDef>& defs, Loop& loop) {
+	const auto& header = function.blocks[loop.header];
+	if (loop.latch == no_block || header.preds.size() != 2) return;
+	const size_t from_preheader = header.preds[0] == loop.preheader ? 0 : 1;
+	for (const auto& phi : header.code) {
+		if (phi.op != IrOp::Phi) break;
+		const auto next = phi.args[1 - from_preheader];
+		const auto def = defs[next];
+		if (def.block == no_block || !loop.contains(def.block)) continue;
+		const auto& increment = function.blocks[def.block].code[def.index];
+		std::optional<int64_t> step;
+		if (increment.op == IrOp::Add) {
+			if (increment.args[0] == phi.result)
+				step = constant_value(function, defs, increment.args[1]);
+			else if (increment.args[1] == phi.result)
+				step = constant_value(function, defs, increment.args[0]);
+		} else if (increment.op == IrOp::Sub && increment.args[0] == phi.result) {
+			if (const auto value = constant_value(function, defs, increment.args[1]))
+				step = -*value;
+		}
+		if (!step || *step == 0) continue;
+		const auto init = phi.args[from_preheader];
+		loop.induction_variables.push_back({ phi.result, init, next, *step, constant_value(function, defs, init) });
+	}
+}
+
+// the comparison with its operands swapped, a < b is b > a
+static IrOp mirror(IrOp op) {
+	switch (op) {
+		case IrOp::Lt: return IrOp::Gt;
+		case IrOp::Le: return IrOp::Ge;
+		case IrOp::Gt: return IrOp::Lt;
+		case IrOp::Ge: return IrOp::Le;
+		default: return op;
+	}
+}
+
+// the comparison that's true when op isn't
+static IrOp negate(IrOp op) {
+	switch (op) {
+		case IrOp::Eq: return IrOp::Ne;
+		case IrOp::Ne: return IrOp::Eq;
+		case IrOp::Lt: return IrOp::Ge;
+		case IrOp::Le: return IrOp::Gt;
+		case IrOp::Gt: return IrOp::Le;
+		case IrOp::Ge: return IrOp::Lt;
+		default: unhandled("not a comparison");
+	}
+}
+
+static void find_trip_count(const IrFunction& function, const std::vector<IrDef>& defs, Loop& loop) {
+	for (const auto block : loop.blocks) {
+		if (block == loop.header) continue;
+		for (const auto succ : function.blocks[block].successors())
+			if (!loop.contains(succ)) return;
+	}
+	const auto& branch = function.blocks[loop.header].terminator();
+	if (branch.op != IrOp::Branch) return;
+	const auto def = defs[branch.args[0]];
+	const auto& condition = function.blocks[def.block].code[def.index];
+	if (!is_comparison(condition.op)) return;
+	const bool stays_if_true = loop.contains(branch.targets[0]);
+
+	for (const auto& variable : loop.induction_variables) {
+		if (!variable.initial) continue;
+		// what the loop keeps going on, as variable op bound
+		auto op = condition.op;
+		std::optional<int64_t> bound;
+		if (condition.args[0] == variable.phi) {
+			bound = constant_value(function, defs, condition.args[1]);
+		} else if (condition.args[1] == variable.phi) {
+			bound = constant_value(function, defs, condition.args[0]);
+			op = mirror(op);
+		}
+		if (!bound) continue;
+		if (!stays_if_true) op = negate(op);
+
+		const auto init = *variable.initial;
+		const auto step = variable.step;
+		std::optional<int64_t> count;
+		if (op == IrOp::Ne) {
+			const auto distance = *bound - init;
+			// anything but hitting the bound exactly goes all the way around, which isn't worth working out
+			if (distance % step == 0 && distance / step >= 0) count = distance / step;
+		} else if ((op == IrOp::Lt || op == IrOp::Le) && step > 0) {
+			const auto end = op == IrOp::Lt ? *bound : *bound + 1;
+			count = end <= init ? 0 : (end - init + step - 1) / step;
+		} else if ((op == IrOp::Gt || op == IrOp::Ge) && step < 0) {
+			const auto end = op == IrOp::Gt ? *bound : *bound - 1;
+			count = init <= end ? 0 : (init - end - step - 1) / -step;
+		}
+		if (!count) continue;
+		// wrapping around on the way would make the comparison see something else
+		const auto last = init + *count * step;
+		if (last < INT32_MIN || last > INT32_MAX) continue;
+		loop.trip_count = count;
+		loop.counter = variable.phi;
+		return;
+	}
+}
+
+std::vector<Loop> find_loops(IrFunction& function) {
+	while (true) {
+		auto loops = natural_loops(function);
+		// adding a preheader renumbers the blocks, so start over after each one
+		if (std::any_of(loops.begin(), loops.end(), [&](const Loop& loop) { return ensure_preheader(function, loop); }))
+			continue;
+
+		const auto defs = find_defs(function);
+		for (auto& loop : loops) {
+			for (const auto pred : function.blocks[loop.header].preds)
+				if (!loop.contains(pred)) loop.preheader = pred;
+			find_induction_variables(function, defs, loop);
+			find_trip_count(function, defs, loop);
+		}
+		return loops;
+	}
+}
+
+// whether a value is defined in one of the loop's blocks
+static std::vector<bool> loop_values(const IrFunction& function, const Loop& loop) {
+	std::vector<bool> inside(function.next_value);
+	for (const auto block : loop.blocks)
+		for (const auto& instr : function.blocks[block].code)
+			if (instr.result != no_value) inside[instr.result] = true;
+	return inside;
+}
+
+// adds an instruction to the end of the preheader, returning its result
+static ValueId add_to_preheader(IrFunction& function, const Loop& loop, IrInstr instr) {
+	auto& code = function.blocks[loop.preheader].code;
+	instr.result = function.new_value();
+	code.insert(code.end() - 1, std::move(instr));
+	return code[code.size() - 2].result;
+}
+
+static bool hoist_invariants(IrFunction& function, const Loop& loop) {
+	auto inside = loop_values(function, loop);
+	// outer blocks first, so whole chains of invariant instructions come out in one go
+	const auto order = reverse_postorder(function);
+	std::vector<BlockId> blocks;
+	for (const auto block : order)
+		if (loop.contains(block)) blocks.push_back(block);
+
+	std::vector<std::optional<int64_t>> constants(function.next_value);
+	for (const auto& block : function.blocks)
+		for (const auto& instr : block.code)
+			if (instr.op == IrOp::Const) constants[instr.result] = instr.imm;
+
+	auto& preheader = function.blocks[loop.preheader].code;
+	bool changed = false;
+	for (const auto block : blocks) {
+		auto& code = function.blocks[block].code;
+		std::erase_if(code, [&](const IrInstr& instr) {
+			// these end up running even if the loop body wouldn't have, so only what can't trap.
+			// division only traps on zero, or int min by -1
+			if (!is_pure(instr.op) || instr.op == IrOp::Phi || instr.op == IrOp::Arg) return false;
+			if (instr.op == IrOp::Div || instr.op == IrOp::Mod) {
+				const auto divisor = constants[instr.args[1]];
+				if (!divisor || *divisor == 0 || *divisor == -1) return false;
+			}
+			if (std::any_of(instr.args.begin(), instr.args.end(), [&](ValueId arg) { return inside[arg]; })) return false;
+			preheader.insert(preheader.end() - 1, instr);
+			inside[instr.result] = false;
+			changed = true;
+			return true;
+		});
+	}
+	return changed;
+}
+
+// i * c, with i an induction variable and c invariant, becomes its own induction variable
+// j = phi(init * c, j + step * c). returns whether it found one to replace
+static bool reduce_one(IrFunction& function, const Loop& loop) {
+	const auto inside = loop_values(function, loop);
+	for (const auto& variable : loop.induction_variables) {
+		for (const auto block : loop.blocks) {
+			auto& code = function.blocks[block].code;
+			for (size_t i = 0; i < code.size(); ++i) {
+				const auto& mul = code[i];
+				if (mul.op != IrOp::Mul) continue;
+				const int which = mul.args[0] == variable.phi ? 1 : mul.args[1] == variable.phi ? 0 : -1;
+				if (which < 0 || inside[mul.args[which]]) continue;
+				const auto factor = mul.args[which];
+				const auto product = mul.result;
+				code.erase(code.begin() + static_cast<std::ptrdiff_t>(i));
+
+				const auto start = add_to_preheader(function, loop, { .op = IrOp::Mul, .args = { variable.init, factor } });
+				const auto step = add_to_preheader(function, loop, { .op = IrOp::Const, .imm = variable.step });
+				const auto increment = add_to_preheader(function, loop, { .op = IrOp::Mul, .args = { step, factor } });
+
+				const auto next = function.new_value();
+				auto& header = function.blocks[loop.header];
+				IrInstr phi { .op = IrOp::Phi, .result = function.new_value() };
+				for (const auto pred : header.preds)
+					phi.args.push_back(pred == loop.preheader ? start : next);
+				const auto reduced = phi.result;
+				header.code.insert(header.code.begin(), std::move(phi));
+
+				// added to right where the original variable is, which the latch has to go through
+				const auto def = find_defs(function)[variable.next];
+				auto& def_code = function.blocks[def.block].code;
+				def_code.insert(def_code.begin() + static_cast<std::ptrdiff_t>(def.index) + 1,
+					IrInstr { .op = IrOp::Add, .result = next, .args = { reduced, increment } });
+
+				std::vector<ValueId> replacements(function.next_value, no_value);
+				replacements[product] = reduced;
+				replace_values(function, replacements);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// after a loop with a known trip count, an induction variable is always the same
+static bool replace_exit_values(IrFunction& function, const Loop& loop) {
+	if (!loop.trip_count) return false;
+	bool changed = false;
+	for (const auto& variable : loop.induction_variables) {
+		if (!variable.initial) continue;
+		const auto final_value = wrap(*variable.initial + *loop.trip_count * variable.step);
+		ValueId constant = no_value;
+		for (BlockId b = 0; b < function.blocks.size(); ++b) {
+			if (loop.contains(b)) continue;
+			for (auto& instr : function.blocks[b].code) {
+				for (auto& arg : instr.args) {
+					if (arg != variable.phi) continue;
+					// the preheader dominates everything after the loop, since the header is the only way out
+					if (constant == no_value)
+						constant = add_to_preheader(function, loop, { .op = IrOp::Const, .imm = final_value });
+					arg = constant;
+					changed = true;
+				}
+			}
+		}
+	}
+	return changed;
+}
+
+// a loop that ends, with nothing after it using its values, doesn't need to run
+static bool remove_dead_loop(IrFunction& function, const Loop& loop) {
+	if (!loop.trip_count) return false;
+	for (const auto block : loop.blocks)
+		for (const auto& instr : function.blocks[block].code)
+			if (!is_pure(instr.op) && !is_terminator(instr.op)) return false;
+	const auto inside = loop_values(function, loop);
+	for (BlockId b = 0; b < function.blocks.size(); ++b) {
+		if (loop.contains(b)) continue;
+		for (const auto& instr : function.blocks[b].code)
+			if (std::any_of(instr.args.begin(), instr.args.end(), [&](ValueId arg) { return inside[arg]; })) return false;
+	}
+
+	const auto& branch = function.blocks[loop.header].terminator();
+	const auto exit = loop.contains(branch.targets[0]) ? branch.targets[1] : branch.targets[0];
+	// the exit phis take the same values from the preheader, which can't be from inside the loop,
+	// and the edge from the header goes away with the rest of the loop
+	auto& exit_block = function.blocks[exit];
+	const auto index = std::find(exit_block.preds.begin(), exit_block.preds.end(), loop.header) - exit_block.preds.begin();
+	exit_block.preds.push_back(loop.preheader);
+	for (auto& phi : exit_block.code) {
+		if (phi.op != IrOp::Phi) break;
+		phi.args.push_back(phi.args[static_cast<size_t>(index)]);
+	}
+	function.blocks[loop.preheader].terminator().targets = { exit };
+	remove_unreachable_blocks(function);
+	return true;
+}
+
+bool optimize_loops(IrFunction& function) {
+	const auto block_count = function.blocks.size();
+	auto loops = find_loops(function);
+	bool changed = function.blocks.size() != block_count;
+
+	for (const auto& loop : loops) {
+		changed |= hoist_invariants(function, loop);
+		while (reduce_one(function, loop))
+			changed = true;
+		changed |= replace_exit_values(function, loop);
+	}
+
+	// removing a loop renumbers the blocks, so look again after each one
+	bool removed = true;
+	while (removed) {
+		loops = find_loops(function);
+		removed = std::any_of(loops.begin(), loops.end(), [&](const Loop& loop) { return remove_dead_loop(function, loop); });
+		changed |= removed;
+	}
+	return changed;
+}
+
+// how big unrolling can make a loop, in instructions
+static constexpr int64_t unroll_budget = 64;
+
+static int64_t loop_cost(const IrFunction& function, const Loop& loop) {
+	int64_t cost = 0;
+	for (const auto block : loop.blocks)
+		for (const auto& instr : function.blocks[block].code)
+			cost += instr.op != IrOp::Phi && instr.op != IrOp::Const && instr.op != IrOp::Jump;
+	return cost;
+}
+
+// a copy of every block of a loop, with new blocks and values for the ones the loop defines
+struct LoopCopy {
+	std::vector<BlockId> blocks;
+	std::vector<ValueId> values;
+
+	BlockId block(BlockId id) const { return blocks[id] != no_block ? blocks[id] : id; }
+	ValueId value(ValueId id) const { return id < values.size() && values[id] != no_value ? values[id] : id; }
+};
+
+// the copy goes after the existing blocks, one loop shallower unless it's still part of a loop
+static LoopCopy copy_loop(IrFunction& function, const std::vector<BlockId>& blocks, bool still_loop) {
+	LoopCopy copy { .blocks = std::vector<BlockId>(function.blocks.size(), no_block), .values = std::vector<ValueId>(function.next_value, no_value) };
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		copy.blocks[blocks[i]] = static_cast<BlockId>(function.blocks.size() + i);
+		for (const auto& instr : function.blocks[blocks[i]].code)
+			if (instr.result != no_value) copy.values[instr.result] = function.new_value();
+	}
+	for (const auto b : blocks) {
+		auto block = function.blocks[b];
+		if (!still_loop) --block.loop_depth;
+		block.unrolled = false;
+		for (auto& pred : block.preds) pred = copy.block(pred);
+		for (auto& instr : block.code) {
+			if (instr.result != no_value) instr.result = copy.value(instr.result);
+			for (auto& arg : instr.args) arg = copy.value(arg);
+			for (auto& target : instr.targets) target = copy.block(target);
+		}
+		function.blocks.push_back(std::move(block));
+	}
+	return copy;
+}
+
+static void retarget(IrBlock& block, BlockId from, BlockId to) {
+	for (auto& target : block.terminator().targets)
+		if (target == from) target = to;
+}
+
+// runs `copies` iterations per trip around a new loop, checking only once whether to go on, and the
+// iterations that are left after it in straight line code. with no loop the whole trip count is
+// straight line. the original loop is left unreachable
+static void unroll(IrFunction& function, const Loop& loop, int64_t copies) {
+	auto blocks = loop.blocks;
+	std::sort(blocks.begin(), blocks.end());
+	const auto original_count = static_cast<BlockId>(function.blocks.size());
+	const auto header = loop.header;
+	const auto& branch = function.blocks[header].terminator();
+	const auto stay = loop.contains(branch.targets[0]) ? branch.targets[0] : branch.targets[1];
+	const auto exit = loop.contains(branch.targets[0]) ? branch.targets[1] : branch.targets[0];
+	const auto& header_preds = function.blocks[header].preds;
+	const auto entry_index = header_preds[0] == loop.preheader ? 0 : 1;
+	const auto back_index = 1 - entry_index;
+	std::vector<IrInstr> phis;
+	for (const auto& instr : function.blocks[header].code)
+		if (instr.op == IrOp::Phi) phis.push_back(instr);
+
+	const auto trip_count = *loop.trip_count;
+	const auto rounds = copies < trip_count ? trip_count / copies : 0;
+	const auto rest = trip_count - rounds * copies;
+	std::vector<ValueId> replacements;
+	const auto replace = [&](ValueId value, ValueId with) {
+		replacements.resize(function.next_value, no_value);
+		replacements[value] = with;
+	};
+
+	// the values going into the next iteration, and the block that goes on to it
+	std::vector<ValueId> incoming;
+	for (const auto& phi : phis)
+		incoming.push_back(phi.args[entry_index]);
+	BlockId previous = loop.preheader;
+
+	// the copies of the header after the first one lose their phis and check, going straight into
+	// the body with what the copy before them left behind
+	const auto chain = [&](const LoopCopy& copy, const LoopCopy* before) {
+		auto& copied = function.blocks[copy.block(header)];
+		for (size_t i = 0; i < phis.size(); ++i)
+			replace(copy.value(phis[i].result), before ? before->value(phis[i].args[back_index]) : incoming[i]);
+		copied.code.erase(copied.code.begin(), copied.code.begin() + static_cast<std::ptrdiff_t>(phis.size()));
+		copied.preds = { before ? before->block(loop.latch) : previous };
+		if (before)
+			retarget(function.blocks[before->block(loop.latch)], before->block(header), copy.block(header));
+		else
+			retarget(function.blocks[previous], header, copy.block(header));
+		copied.terminator() = IrInstr { .op = IrOp::Jump, .targets = { copy.block(stay) } };
+	};
+
+	if (rounds > 0) {
+		std::vector<LoopCopy> unrolled;
+		for (int64_t i = 0; i < copies; ++i)
+			unrolled.push_back(copy_loop(function, blocks, true));
+		const auto& first = unrolled.front();
+		const auto& last = unrolled.back();
+		const auto top = first.block(header);
+		for (size_t i = 1; i < unrolled.size(); ++i)
+			chain(unrolled[i], &unrolled[i - 1]);
+
+		// the first header keeps the phis, now coming around from the last copy
+		auto& head = function.blocks[top];
+		head.unrolled = true;
+		head.preds = { previous, last.block(loop.latch) };
+		for (size_t i = 0; i < phis.size(); ++i)
+			head.code[i].args = { incoming[i], last.value(phis[i].args[back_index]) };
+		retarget(function.blocks[last.block(loop.latch)], last.block(header), top);
+		retarget(function.blocks[previous], header, top);
+
+		// and goes on for as long as there's another whole round left
+		const auto counter = std::find_if(loop.induction_variables.begin(), loop.induction_variables.end(),
+			[&](const InductionVariable& variable) { return variable.phi == loop.counter; });
+		const auto end = function.new_value();
+		const auto check = function.new_value();
+		head.code.insert(head.code.end() - 1, {
+			IrInstr { .op = IrOp::Const, .result = end, .imm = wrap(*counter->initial + rounds * copies * counter->step) },
+			IrInstr { .op = IrOp::Ne, .result = check, .args = { first.value(loop.counter), end } },
+		});
+		// the straight line part is linked in where the exit is, like it was coming from the preheader
+		head.terminator() = IrInstr { .op = IrOp::Branch, .args = { check }, .targets = { first.block(stay), header } };
+
+		for (size_t i = 0; i < phis.size(); ++i)
+			incoming[i] = first.value(phis[i].result);
+		previous = top;
+	}
+
+	std::vector<LoopCopy> straight;
+	for (int64_t i = 0; i <= rest; ++i) {
+		straight.push_back(copy_loop(function, blocks, false));
+		chain(straight.back(), i ? &straight[straight.size() - 2] : nullptr);
+	}
+	// the last header copy is the check that fails, going to the exit with its values
+	const auto& last = straight.back();
+	auto& check = function.blocks[last.block(header)];
+	check.terminator().targets = { exit };
+	// the rest of that copy never runs, but still jumps back here until it gets removed
+	check.preds.push_back(last.block(loop.latch));
+	auto& exit_block = function.blocks[exit];
+	const auto index = std::find(exit_block.preds.begin(), exit_block.preds.end(), header) - exit_block.preds.begin();
+	exit_block.preds.push_back(last.block(header));
+	for (auto& phi : exit_block.code) {
+		if (phi.op != IrOp::Phi) break;
+		phi.args.push_back(phi.args[static_cast<size_t>(index)]);
+	}
+	// only the header's values make it out of the loop
+	for (const auto& instr : function.blocks[header].code)
+		if (instr.result != no_value) replace(instr.result, last.value(instr.result));
+	replace_values(function, replacements);
+
+	// the copies go where the loop was
+	std::vector<BlockId> order;
+	for (BlockId b = 0; b < original_count; ++b) {
+		if (b == header)
+			for (auto copy = original_count; copy < function.blocks.size(); ++copy) order.push_back(copy);
+		order.push_back(b);
+	}
+	reorder_blocks(function, order);
+	remove_unreachable_blocks(function);
+}
+
+bool unroll_loops(IrFunction& function, int factor) {
+	if (factor <= 1) return false;
+	bool changed = false;
+	// unrolling renumbers the blocks, so look again after each one
+	for (bool unrolled = true; unrolled;) {
+		unrolled = false;
+		const auto loops = find_loops(function);
+		for (size_t i = 0; i < loops.size() && !unrolled; ++i) {
+			const auto& loop = loops[i];
+			const bool innermost = std::none_of(loops.begin(), loops.end(), [&](const Loop& other) { return other.parent == i; });
+			if (!innermost || !loop.trip_count || loop.latch == no_block || loop.latch == loop.header
+				|| function.blocks[loop.header].unrolled)
+				continue;
+			const auto cost = loop_cost(function, loop);
+			const auto trip_count = *loop.trip_count;
+			if (trip_count * cost <= unroll_budget) {
+				unroll(function, loop, trip_count);
+				unrolled = true;
+				continue;
+			}
+			// the header runs one more time for the check that ends the unrolled loop, so it can't do anything
+			const auto& header = function.blocks[loop.header].code;
+			const bool pure_header = std::all_of(header.begin(), header.end(),
+				[](const IrInstr& instr) { return is_pure(instr.op) || is_terminator(instr.op); });
+			if (trip_count >= factor * 2 && cost * factor <= unroll_budget && pure_header) {
+				unroll(function, loop, factor);
+				unrolled = true;
+			}
+		}
+		changed |= unrolled;
+	}
+	return changed;
+}
+
+namespace {
+	// vector values either hold numbers, or masks with every bit of a lane set where a comparison was true
+	enum class VectorKind : uint8_t {
+		Number,
+		Mask,
+	};
+
+	struct Reduction {
+		const IrInstr* phi;
+		// Add, Lt for the smallest or Gt for the largest
+		IrOp op;
+	};
+
+	using Users = std::vector<std::vector<std::pair<BlockId, const IrInstr*>>>;
+}
+
+// where an array index is relative to the counter, when it's counter + constant
+static std::optional<int64_t> counter_offset(const IrFunction& function, const std::vector<IrDef>& defs, ValueId index,
+	ValueId counter) {
+	if (index == counter) return 0;
+	const auto def = defs[index];
+	if (def.block == no_block) return {};
+	const auto& instr = function.blocks[def.block].code[def.index];
+	if (instr.op == IrOp::Add && instr.args[0] == counter)
+		return constant_value(function, defs, instr.args[1]);
+	if (instr.op == IrOp::Add && instr.args[1] == counter)
+		return constant_value(function, defs, instr.args[0]);
+	if (instr.op == IrOp::Sub && instr.args[0] == counter) {
+		if (const auto value = constant_value(function, defs, instr.args[1]))
+			return -*value;
+	}
+	return {};
+}
+
+// how a header phi accumulates, when everything using it in the loop only adds to it, or keeps the
+// smaller or larger of it and something else, on the way back around. then every lane can do that on
+// its own, with the lanes getting combined after the loop
+static std::optional<IrOp> find_reduction(const IrFunction& function, const Loop& loop, const std::vector<IrDef>& defs,
+	const std::vector<BlockId>& idom, const Users& users, const IrInstr& phi, ValueId back) {
+	std::vector<BlockId> phi_blocks(function.next_value, no_block);
+	std::vector<bool> chain(function.next_value);
+	chain[phi.result] = true;
+	std::vector<const IrInstr*> members;
+	std::vector<const IrInstr*> compares;
+	std::vector<ValueId> work { phi.result };
+	while (!work.empty()) {
+		const auto value = work.back();
+		work.pop_back();
+		for (const auto& [block, user] : users[value]) {
+			if (user == &phi) continue;
+			if (is_comparison(user->op)) {
+				compares.push_back(user);
+				continue;
+			}
+			const bool merges = (user->op == IrOp::Phi && block != loop.header) || user->op == IrOp::Add
+				|| (user->op == IrOp::Select && user->args[0] != value);
+			if (!merges) return {};
+			if (chain[user->result]) continue;
+			chain[user->result] = true;
+			phi_blocks[user->result] = block;
+			members.push_back(user);
+			work.push_back(user->result);
+		}
+	}
+	if (!chain[back] || back == phi.result) return {};
+
+	std::optional<IrOp> op;
+	const auto agree = [&](IrOp kind) {
+		if (op && *op != kind) return false;
+		op = kind;
+		return true;
+	};
+	std::vector<const IrInstr*> matched;
+	for (const auto* instr : members) {
+		const auto& args = instr->args;
+		if (instr->op == IrOp::Add) {
+			if (chain[args[0]] == chain[args[1]] || !agree(IrOp::Add)) return {};
+		} else if (instr->op == IrOp::Phi && std::all_of(args.begin(), args.end(), [&](ValueId arg) { return chain[arg]; })) {
+			continue;
+		} else if (instr->op == IrOp::Phi || chain[args[1]] != chain[args[2]]) {
+			// select(x op acc, x, acc), or the same as an if around setting it to x, with the comparison
+			// only used for that
+			ValueId condition, other, acc;
+			bool picks_other;
+			if (instr->op == IrOp::Select) {
+				condition = args[0];
+				picks_other = !chain[args[1]];
+				other = picks_other ? args[1] : args[2];
+				acc = picks_other ? args[2] : args[1];
+			} else {
+				const auto block = phi_blocks[instr->result];
+				const auto& preds = function.blocks[block].preds;
+				const auto branch = idom[block];
+				const auto& terminator = function.blocks[branch].terminator();
+				if (args.size() != 2 || chain[args[0]] == chain[args[1]] || terminator.op != IrOp::Branch) return {};
+				// which way the branch went for each pred
+				const auto side = [&](BlockId pred) -> std::optional<size_t> {
+					const auto from = pred == branch ? block : pred;
+					if ((pred != branch && function.blocks[pred].preds != std::vector { branch })
+						|| terminator.targets[0] == terminator.targets[1])
+						return {};
+					return terminator.targets[0] == from ? 0 : 1;
+				};
+				const auto taken = side(preds[0]);
+				const auto not_taken = side(preds[1]);
+				if (!taken || !not_taken || *taken == *not_taken) return {};
+				const size_t x = chain[args[0]] ? 1 : 0;
+				condition = terminator.args[0];
+				picks_other = (x == 0 ? *taken : *not_taken) == 0;
+				other = args[x];
+				acc = args[1 - x];
+			}
+			const auto def = defs[condition];
+			if (def.block == no_block) return {};
+			const auto& compare = function.blocks[def.block].code[def.index];
+			if (!is_comparison(compare.op) || users[compare.result].size() != 1) return {};
+			auto compare_op = compare.op;
+			if (compare.args[0] == acc && compare.args[1] == other)
+				compare_op = mirror(compare_op);
+			else if (compare.args[0] != other || compare.args[1] != acc)
+				return {};
+			if (!picks_other) compare_op = negate(compare_op);
+			const bool larger = compare_op == IrOp::Gt || compare_op == IrOp::Ge;
+			const bool smaller = compare_op == IrOp::Lt || compare_op == IrOp::Le;
+			if ((!larger && !smaller) || !agree(larger ? IrOp::Gt : IrOp::Lt)) return {};
+			matched.push_back(&compare);
+		} else if (!chain[args[1]]) {
+			return {};
+		}
+	}
+	// comparing the accumulator only works as part of picking the smaller or larger one
+	for (const auto* compare : compares)
+		if (std::find(matched.begin(), matched.end(), compare) == matched.end()) return {};
+	return op;
+}
+
+// an induction variable going up by one that the loop keeps going on while it's below bound, or until it
+// gets to it when that's a known number of iterations away. it can't wrap around either way
+struct Counter {
+	const InductionVariable* variable;
+	ValueId bound;
+	// whether it's the first kind
+	bool below;
+};
+
+static std::optional<Counter> find_counter(const IrFunction& function, const std::vector<IrDef>& defs, const Loop& loop) {
+	const auto& branch = function.blocks[loop.header].terminator();
+	if (branch.op != IrOp::Branch) return {};
+	const auto def = defs[branch.args[0]];
+	const auto& condition = function.blocks[def.block].code[def.index];
+	if (!is_comparison(condition.op)) return {};
+	const bool stays_if_true = loop.contains(branch.targets[0]);
+	if (stays_if_true == loop.contains(branch.targets[1])) return {};
+	for (const auto& variable : loop.induction_variables) {
+		auto op = condition.op;
+		ValueId other;
+		if (condition.args[0] == variable.phi) {
+			other = condition.args[1];
+		} else if (condition.args[1] == variable.phi) {
+			other = condition.args[0];
+			op = mirror(op);
+		} else {
+			continue;
+		}
+		if (!stays_if_true) op = negate(op);
+		// != only stops at the bound when it starts below it, which is what having a trip count means
+		if (variable.step == 1 && (op == IrOp::Lt || (op == IrOp::Ne && loop.trip_count && loop.counter == variable.phi)))
+			return Counter { &variable, other, op == IrOp::Lt };
+	}
+	return {};
+}
+
+// builds a loop doing `lanes` iterations of an innermost one at a time in front of it, leaving the
+// original to do the iterations left over. only loops that go on while a counter going up by one is
+// below some bound, with no other way out and a body that's nothing but arithmetic and array accesses
+// at the counter plus a constant. ifs in the body get turned into selects on masks of the lanes they
+// run for, which only works for array accesses where the same element is accessed either way
+static bool vectorize(IrFunction& function, const Loop& loop, int lanes) {
+	auto& blocks = function.blocks;
+	const auto header = loop.header;
+	if (loop.latch == no_block || loop.latch == header || loop.preheader == no_block || blocks[header].preds.size() != 2)
+		return false;
+	// not worth it for a couple of trips around
+	if (loop.trip_count && *loop.trip_count < lanes * 2) return false;
+	const auto defs = find_defs(function);
+	const auto idom = compute_idoms(function);
+	const auto inside = loop_values(function, loop);
+
+	// the header can only decide whether to go around again
+	const auto& branch = blocks[header].terminator();
+	if (branch.op != IrOp::Branch) return false;
+	for (const auto& instr : blocks[header].code) {
+		if (instr.op != IrOp::Phi && instr.op != IrOp::Const && instr.op != IrOp::Branch && instr.result != branch.args[0])
+			return false;
+	}
+	if (defs[branch.args[0]].block != header) return false;
+	const bool stays_if_true = loop.contains(branch.targets[0]);
+	const auto found = find_counter(function, defs, loop);
+	if (!found) return false;
+	const auto* counter = found->variable;
+	const auto bound = found->bound;
+	if (inside[bound] && !constant_value(function, defs, bound)) return false;
+
+	// the body in an order where blocks come after everything leading to them, without any exits
+	const auto body_entry = branch.targets[stays_if_true ? 0 : 1];
+	std::vector<BlockId> body;
+	for (const auto block : reverse_postorder(function))
+		if (block != header && loop.contains(block)) body.push_back(block);
+	if (body.empty() || body[0] != body_entry || blocks[body_entry].code[0].op == IrOp::Phi) return false;
+	for (const auto block : body)
+		for (const auto succ : blocks[block].successors())
+			if (!loop.contains(succ)) return false;
+
+	Users users(function.next_value);
+	for (const auto block : loop.blocks)
+		for (const auto& instr : blocks[block].code)
+			for (const auto arg : instr.args)
+				users[arg].push_back({ block, &instr });
+
+	// header phis are either induction variables or reductions
+	const size_t entry_index = blocks[header].preds[0] == loop.preheader ? 0 : 1;
+	std::vector<Reduction> reductions;
+	for (const auto& phi : blocks[header].code) {
+		if (phi.op != IrOp::Phi) break;
+		if (std::any_of(loop.induction_variables.begin(), loop.induction_variables.end(),
+			[&](const InductionVariable& variable) { return variable.phi == phi.result; }))
+			continue;
+		const auto op = find_reduction(function, loop, defs, idom, users, phi, phi.args[1 - entry_index]);
+		if (!op) return false;
+		reductions.push_back({ &phi, *op });
+	}
+
+	// lanes only touch their own elements as long as arrays that get stored to are always at the same
+	// offset. elements accessed every time around can also be accessed in lanes that skip an if.
+	// what a pointer points to could be anything else, so they only go with stores when nothing else is accessed
+	const auto object = [](const IrInstr& instr) {
+		return instr.op == IrOp::Load || instr.op == IrOp::Store ? instr.imm : -1 - static_cast<int64_t>(instr.args[0]);
+	};
+	const auto index_arg = [](const IrInstr& instr) {
+		return instr.op == IrOp::Load || instr.op == IrOp::Store ? instr.args[0] : instr.args[1];
+	};
+	std::set<std::pair<int64_t, int64_t>> always_accessed;
+	std::map<int64_t, std::set<int64_t>> offsets;
+	std::set<int64_t> stored;
+	bool pointers = false;
+	for (const auto block : body) {
+		for (const auto& instr : blocks[block].code) {
+			if (instr.op != IrOp::Load && instr.op != IrOp::Store && instr.op != IrOp::Read && instr.op != IrOp::Write) continue;
+			// lanes of pointers aren't a thing
+			if (instr.pointer) return false;
+			const bool pointer = instr.op == IrOp::Read || instr.op == IrOp::Write;
+			if (pointer && inside[instr.args[0]]) return false;
+			pointers |= pointer;
+			const auto offset = counter_offset(function, defs, index_arg(instr), counter->phi);
+			if (!offset) return false;
+			offsets[object(instr)].insert(*offset);
+			if (instr.op == IrOp::Store || instr.op == IrOp::Write) stored.insert(object(instr));
+			if (dominates(idom, block, loop.latch)) always_accessed.insert({ object(instr), *offset });
+		}
+	}
+	for (const auto array : stored)
+		if (offsets[array].size() != 1) return false;
+	if (pointers && !stored.empty() && offsets.size() > 1) return false;
+
+	// everything from here on adds to the preheader, which goes back to how it was if something in
+	// the body can't be vectorized
+	const auto original_values = function.next_value;
+	const auto original_preheader = blocks[loop.preheader].code;
+	const auto width = static_cast<uint8_t>(lanes);
+	const auto vector_head = static_cast<BlockId>(blocks.size());
+	const auto vector_body = vector_head + 1;
+	const auto vector_end = vector_head + 2;
+	std::vector<IrInstr> head_code, body_code, end_code;
+
+	const auto before = [&](IrInstr instr) { return add_to_preheader(function, loop, std::move(instr)); };
+	std::map<int64_t, ValueId> constants;
+	const auto constant = [&](int64_t value) {
+		const auto [it, added] = constants.try_emplace(wrap(value));
+		if (added) it->second = before({ .op = IrOp::Const, .imm = wrap(value) });
+		return it->second;
+	};
+	// values from before the loop, or constants, with their own copy in the preheader if they're inside it
+	const auto outside = [&](ValueId value) {
+		if (!inside[value]) return value;
+		return constant(*constant_value(function, defs, value));
+	};
+	std::map<ValueId, ValueId> splats;
+	const auto splat = [&](ValueId value) {
+		const auto [it, added] = splats.try_emplace(value);
+		if (added) it->second = before({ .op = IrOp::Splat, .args = { value }, .lanes = width });
+		return it->second;
+	};
+	const auto add = [&](IrInstr instr) {
+		instr.result = function.new_value();
+		body_code.push_back(std::move(instr));
+		return body_code.back().result;
+	};
+	const auto vector_op = [&](IrOp op, std::vector<ValueId> args) {
+		return add({ .op = op, .args = std::move(args), .lanes = width });
+	};
+
+	std::vector<ValueId> vectors(original_values, no_value);
+	std::vector<VectorKind> kinds(original_values, VectorKind::Number);
+	const auto is_constant = [&](ValueId value) { return constant_value(function, defs, value).has_value(); };
+	// the vector of a value from the body, or a splat of one that's the same every time around.
+	// no_value for values that aren't vectorized yet
+	const auto vector_of = [&](ValueId value, VectorKind kind = VectorKind::Number) {
+		if (!inside[value] || is_constant(value)) return kind == VectorKind::Number ? splat(outside(value)) : no_value;
+		return kinds[value] == kind ? vectors[value] : no_value;
+	};
+	// conditions that aren't comparisons are 0 or 1 in every lane
+	const auto mask_of = [&](ValueId value) {
+		if (inside[value] && !is_constant(value) && kinds[value] == VectorKind::Mask) return vectors[value];
+		const auto number = vector_of(value);
+		return number == no_value ? no_value : vector_op(IrOp::Ne, { number, splat(constant(0)) });
+	};
+	const auto vectorize_at = [&](ValueId result, ValueId vector, VectorKind kind = VectorKind::Number) {
+		vectors[result] = vector;
+		kinds[result] = kind;
+		return vector != no_value;
+	};
+
+	// the header: every induction variable both as it is, going up by `lanes` steps at a time, and as a
+	// vector of the values it has in each lane. reductions get a vector of the values so far
+	struct Carried {
+		ValueId phi;
+		ValueId from_body;
+	};
+	std::vector<std::pair<Carried, Carried>> variables;
+	ValueId scalar_counter = no_value;
+	for (const auto& variable : loop.induction_variables) {
+		const Carried scalar { function.new_value(), function.new_value() };
+		head_code.push_back({ .op = IrOp::Phi, .result = scalar.phi, .args = { variable.init, scalar.from_body } });
+		const Carried vector { function.new_value(), function.new_value() };
+		const auto start = before({ .op = IrOp::Splat, .args = { variable.init }, .imm = variable.step, .lanes = width });
+		head_code.push_back({ .op = IrOp::Phi, .result = vector.phi, .args = { start, vector.from_body }, .lanes = width });
+		vectorize_at(variable.phi, vector.phi);
+		if (variable.phi == counter->phi) scalar_counter = scalar.phi;
+		variables.push_back({ scalar, vector });
+	}
+	std::vector<ValueId> accumulators;
+	for (const auto& reduction : reductions) {
+		const auto init = reduction.phi->args[entry_index];
+		const auto start = splat(reduction.op == IrOp::Add ? constant(0) : init);
+		const auto phi = function.new_value();
+		head_code.push_back({ .op = IrOp::Phi, .result = phi, .args = { start, no_value }, .lanes = width });
+		vectorize_at(reduction.phi->result, phi);
+		accumulators.push_back(phi);
+	}
+	// counter < bound - (lanes - 1), without wrapping around when the bound is close to the smallest i32
+	const auto limit = before({ .op = IrOp::Select, .args = {
+		before({ .op = IrOp::Lt, .args = { outside(bound), constant(INT32_MIN + lanes - 1) } }),
+		constant(INT32_MIN),
+		before({ .op = IrOp::Sub, .args = { outside(bound), constant(lanes - 1) } }),
+	} });
+	const auto goes_on = function.new_value();
+	head_code.push_back({ .op = IrOp::Lt, .result = goes_on, .args = { scalar_counter, limit } });
+	head_code.push_back({ .op = IrOp::Branch, .args = { goes_on }, .targets = { vector_body, vector_end } });
+
+	std::map<int64_t, ValueId> indices;
+	const auto index_at = [&](int64_t offset) {
+		const auto [it, added] = indices.try_emplace(offset);
+		if (added) it->second = offset ? add({ .op = IrOp::Add, .args = { scalar_counter, constant(offset) } }) : scalar_counter;
+		return it->second;
+	};
+	// the lanes running each block, no_value for all of them
+	std::vector<ValueId> predicates(blocks.size(), no_value);
+	std::vector<ValueId> branch_masks(blocks.size(), no_value);
+	const auto both = [&](ValueId a, ValueId b) {
+		return a == no_value ? b : b == no_value ? a : vector_op(IrOp::And, { a, b });
+	};
+	const auto edge = [&](BlockId from, BlockId to) {
+		const auto& terminator = blocks[from].terminator();
+		if (terminator.op == IrOp::Jump || terminator.targets[0] == terminator.targets[1]) return predicates[from];
+		const auto mask = branch_masks[from];
+		return both(predicates[from], terminator.targets[0] == to ? mask : vector_op(IrOp::Eq, { mask, splat(constant(0)) }));
+	};
+
+	const auto translate = [&](BlockId block, const IrInstr& instr) {
+		const auto& args = instr.args;
+		const auto predicate = predicates[block];
+		switch (instr.op) {
+			case IrOp::Const:
+			case IrOp::Jump:
+				return true;
+			case IrOp::Phi: {
+				const auto& preds = blocks[block].preds;
+				auto value = vector_of(args.back());
+				for (size_t i = args.size() - 1; i-- && value != no_value;) {
+					const auto arg = vector_of(args[i]);
+					const auto taken = edge(preds[i], block);
+					value = arg == no_value ? no_value : taken == no_value ? arg : vector_op(IrOp::Select, { taken, arg, value });
+				}
+				return vectorize_at(instr.result, value);
+			}
+			case IrOp::Load:
+			case IrOp::Store:
+			case IrOp::Read:
+			case IrOp::Write: {
+				const auto offset = *counter_offset(function, defs, index_arg(instr), counter->phi);
+				if (predicate != no_value && !always_accessed.count({ object(instr), offset })) return false;
+				const auto index = index_at(offset);
+				const bool pointer = instr.op == IrOp::Read || instr.op == IrOp::Write;
+				const auto load = [&] {
+					if (pointer)
+						return add({ .op = IrOp::Read, .args = { args[0], index }, .lanes = width });
+					return add({ .op = IrOp::Load, .args = { index }, .imm = instr.imm, .lanes = width });
+				};
+				if (instr.op == IrOp::Load || instr.op == IrOp::Read)
+					return vectorize_at(instr.result, load());
+				auto value = vector_of(args.back());
+				if (value == no_value) return false;
+				// lanes that skip the store keep what was there
+				if (predicate != no_value)
+					value = vector_op(IrOp::Select, { predicate, value, load() });
+				if (pointer)
+					body_code.push_back({ .op = IrOp::Write, .args = { args[0], index, value }, .lanes = width });
+				else
+					body_code.push_back({ .op = IrOp::Store, .args = { index, value }, .imm = instr.imm, .lanes = width });
+				return true;
+			}
+			case IrOp::Add:
+			case IrOp::Sub:
+			case IrOp::Mul: {
+				const auto a = vector_of(args[0]);
+				const auto b = vector_of(args[1]);
+				return a != no_value && b != no_value && vectorize_at(instr.result, vector_op(instr.op, { a, b }));
+			}
+			case IrOp::And:
+			case IrOp::Or: {
+				// of numbers or masks, but not one of each
+				for (const auto kind : { VectorKind::Number, VectorKind::Mask }) {
+					const auto a = vector_of(args[0], kind);
+					const auto b = vector_of(args[1], kind);
+					if (a != no_value && b != no_value)
+						return vectorize_at(instr.result, vector_op(instr.op, { a, b }), kind);
+				}
+				return false;
+			}
+			case IrOp::Eq:
+			case IrOp::Ne:
+			case IrOp::Lt:
+			case IrOp::Le:
+			case IrOp::Gt:
+			case IrOp::Ge: {
+				const auto a = vector_of(args[0]);
+				const auto b = vector_of(args[1]);
+				return a != no_value && b != no_value && vectorize_at(instr.result, vector_op(instr.op, { a, b }), VectorKind::Mask);
+			}
+			case IrOp::Select: {
+				const auto mask = mask_of(args[0]);
+				const auto a = vector_of(args[1]);
+				const auto b = vector_of(args[2]);
+				return mask != no_value && a != no_value && b != no_value
+					&& vectorize_at(instr.result, vector_op(IrOp::Select, { mask, a, b }));
+			}
+			case IrOp::Branch:
+				branch_masks[block] = mask_of(args[0]);
+				return branch_masks[block] != no_value;
+			default:
+				return false;
+		}
+	};
+	const auto vectorize_body = [&] {
+		for (const auto block : body) {
+			if (block != body_entry && !dominates(idom, block, loop.latch)) {
+				ValueId any = no_value;
+				const auto& preds = blocks[block].preds;
+				for (size_t i = 0; i < preds.size(); ++i) {
+					const auto taken = edge(preds[i], block);
+					if (taken == no_value) {
+						any = no_value;
+						break;
+					}
+					any = i ? vector_op(IrOp::Or, { any, taken }) : taken;
+				}
+				predicates[block] = any;
+			}
+			for (const auto& instr : blocks[block].code)
+				if (!translate(block, instr)) return false;
+		}
+		return true;
+	};
+	if (!vectorize_body()) {
+		blocks[loop.preheader].code = original_preheader;
+		function.next_value = original_values;
+		return false;
+	}
+
+	for (size_t i = 0; i < variables.size(); ++i) {
+		const auto step = loop.induction_variables[i].step;
+		const auto& [scalar, vector] = variables[i];
+		body_code.push_back({ .op = IrOp::Add, .result = scalar.from_body, .args = { scalar.phi, constant(step * lanes) } });
+		body_code.push_back({ .op = IrOp::Add, .result = vector.from_body, .args = { vector.phi, splat(constant(step * lanes)) },
+			.lanes = width });
+	}
+	body_code.push_back({ .op = IrOp::Jump, .targets = { vector_head } });
+
+	// the original loop starts off where the vector one left off, with the lanes of the reductions combined
+	auto& header_phis = blocks[header].code;
+	for (size_t i = 0; i < reductions.size(); ++i) {
+		const auto& reduction = reductions[i];
+		for (auto& phi : head_code)
+			if (phi.result == accumulators[i]) phi.args[1] = vectors[reduction.phi->args[1 - entry_index]];
+		const auto combined = function.new_value();
+		end_code.push_back({ .op = IrOp::Reduce, .result = combined, .args = { accumulators[i] }, .imm = static_cast<int64_t>(reduction.op),
+			.lanes = width });
+		auto value = combined;
+		if (reduction.op == IrOp::Add) {
+			value = function.new_value();
+			end_code.push_back({ .op = IrOp::Add, .result = value, .args = { reduction.phi->args[entry_index], combined } });
+		}
+		const auto phi = static_cast<size_t>(reduction.phi - header_phis.data());
+		header_phis[phi].args[entry_index] = value;
+	}
+	for (size_t i = 0; i < variables.size(); ++i) {
+		for (auto& phi : header_phis)
+			if (phi.op == IrOp::Phi && phi.result == loop.induction_variables[i].phi) phi.args[entry_index] = variables[i].first.phi;
+	}
+	end_code.push_back({ .op = IrOp::Jump, .targets = { header } });
+
+	const auto depth = blocks[header].loop_depth;
+	blocks[header].preds[entry_index] = vector_end;
+	blocks[header].vectorized = true;
+	retarget(blocks[loop.preheader], header, vector_head);
+	const auto preheader = loop.preheader;
+	blocks.push_back({ .code = std::move(head_code), .preds = { preheader, vector_body }, .kind = "vector_start",
+		.loop_depth = depth, .vectorized = true });
+	blocks.push_back({ .code = std::move(body_code), .preds = { vector_head }, .kind = "vector_body", .loop_depth = depth });
+	blocks.push_back({ .code = std::move(end_code), .preds = { vector_head }, .kind = "vector_end",
+		.loop_depth = static_cast<uint8_t>(depth - 1) });
+
+	std::vector<BlockId> order;
+	for (BlockId b = 0; b < vector_head; ++b) {
+		if (b == header)
+			for (auto added = vector_head; added <= vector_end; ++added) order.push_back(added);
+		order.push_back(b);
+	}
+	reorder_blocks(function, order);
+	return true;
+}
+
+bool vectorize_loops(IrFunction& function, int lanes) {
+	if (lanes <= 1) return false;
+	bool changed = false;
+	// vectorizing renumbers the blocks, so look again after each one
+	for (bool vectorized = true; vectorized;) {
+		vectorized = false;
+		const auto loops = find_loops(function);
+		for (size_t i = 0; i < loops.size() && !vectorized; ++i) {
+			const bool innermost = std::none_of(loops.begin(), loops.end(), [&](const Loop& other) { return other.parent == i; });
+			if (innermost && !function.blocks[loops[i].header].vectorized)
+				vectorized = vectorize(function, loops[i], lanes);
+		}
+		changed |= vectorized;
+	}
+	return changed;
+}
+
+namespace {
+
+// a <= b + c, with no_value on either side standing for zero
+struct Fact {
+	ValueId a;
+	ValueId b;
+	int64_t c;
+};
+
+// proves things about values from the facts known where they're used, which come from the branches and
+// checks that had to go a certain way to get there, along with constants and counters. lengths are never
+// more than max_array_length, so limits never wrap around
+struct BoundsProver {
+	const IrFunction& function;
+	const std::vector<IrDef>& defs;
+	// the smallest and largest values of counters that can't wrap around, in terms of other values
+	std::vector<ValueId> lowest;
+	std::vector<std::optional<int64_t>> highest;
+	std::vector<Fact> facts;
+
+	static constexpr int depth = 3;
+
+	const IrInstr* def(ValueId value) const {
+		const auto def = defs[value];
+		return def.block == no_block ? nullptr : &function.blocks[def.block].code[def.index];
+	}
+
+	std::optional<int64_t> constant(ValueId value) const {
+		if (value == no_value) return 0;
+		const auto* instr = def(value);
+		if (!instr || instr->op != IrOp::Const) return {};
+		return instr->imm;
+	}
+
+	int64_t upper(ValueId value, int left) const {
+		if (const auto c = constant(value)) return *c;
+		int64_t best = INT32_MAX;
+		if (highest[value]) best = *highest[value];
+		if (left > 0) {
+			if (const auto* instr = def(value); instr && instr->op == IrOp::Select && instr->lanes == 1)
+				best = std::min(best, std::max(upper(instr->args[1], left - 1), upper(instr->args[2], left - 1)));
+			for (const auto& fact : facts)
+				if (fact.a == value) best = std::min(best, upper(fact.b, left - 1) + fact.c);
+		}
+		return best;
+	}
+
+	int64_t lower(ValueId value, int left) const {
+		if (const auto c = constant(value)) return *c;
+		int64_t best = INT32_MIN;
+		if (left > 0) {
+			if (lowest[value] != no_value) best = lower(lowest[value], left - 1);
+			if (const auto* instr = def(value); instr && instr->op == IrOp::Select && instr->lanes == 1)
+				best = std::max(best, std::min(lower(instr->args[1], left - 1), lower(instr->args[2], left - 1)));
+			for (const auto& fact : facts)
+				if (fact.b == value) best = std::max(best, lower(fact.a, left - 1) - fact.c);
+		}
+		return best;
+	}
+
+	// value as some other value plus a constant, looking through additions of constants that can't wrap around
+	std::pair<ValueId, int64_t> linear(ValueId value, int left) const {
+		if (const auto c = constant(value)) return { no_value, *c };
+		const auto* instr = def(value);
+		if (left <= 0 || !instr || (instr->op != IrOp::Add && instr->op != IrOp::Sub) || instr->lanes != 1)
+			return { value, 0 };
+		const auto& args = instr->args;
+		ValueId other = no_value;
+		int64_t k = 0;
+		if (const auto c = constant(args[1])) {
+			other = args[0];
+			k = instr->op == IrOp::Add ? *c : -*c;
+		} else if (const auto c = constant(args[0]); c && instr->op == IrOp::Add) {
+			other = args[1];
+			k = *c;
+		} else {
+			return { value, 0 };
+		}
+		if (k > 0 ? upper(other, left - 1) > INT32_MAX - k : lower(other, left - 1) < INT32_MIN - k)
+			return { value, 0 };
+		const auto [base, offset] = linear(other, left - 1);
+		return { base, offset + k };
+	}
+
+	// whether x <= y + c
+	bool prove(ValueId x, ValueId y, int64_t c, int left = depth) const {
+		const auto [xb, xk] = linear(x, left);
+		const auto [yb, yk] = linear(y, left);
+		const auto d = c + yk - xk;
+		if (xb == yb) return d >= 0;
+		if (upper(xb, left) <= lower(yb, left) + d) return true;
+		if (left <= 0) return false;
+		for (const auto& fact : facts) {
+			// xb <= fact.b + fact.c <= yb + d
+			if (fact.a == xb && fact.a != no_value && prove(fact.b, yb, d - fact.c, left - 1)) return true;
+			// xb <= fact.a - fact.c + d <= yb + d
+			if (fact.b == yb && fact.b != no_value && prove(xb, fact.a, d - fact.c, left - 1)) return true;
+		}
+		return false;
+	}
+
+	bool in_bounds(const IrInstr& check) const {
+		return prove(no_value, check.args[0], 0) && prove(check.args[0], check.args[1], -1);
+	}
+
+	// what a comparison being true says, or false when negated
+	void add_comparison(const IrInstr& compare, bool negated) {
+		const auto op = negated ? negate(compare.op) : compare.op;
+		const auto a = compare.args[0];
+		const auto b = compare.args[1];
+		switch (op) {
+			case IrOp::Lt: facts.push_back({ a, b, -1 }); break;
+			case IrOp::Le: facts.push_back({ a, b, 0 }); break;
+			case IrOp::Gt: facts.push_back({ b, a, -1 }); break;
+			case IrOp::Ge: facts.push_back({ b, a, 0 }); break;
+			case IrOp::Eq:
+				facts.push_back({ a, b, 0 });
+				facts.push_back({ b, a, 0 });
+				break;
+			default:
+				break;
+		}
+	}
+};
+
+}
+
+// moves the checks of an innermost loop that can't fail part way through it into its preheader, as checks
+// of the first and last elements it gets to. that's only the same when nothing the loop does before a check
+// fails can be seen, or trap some other way, and it always gets through the whole thing
+static bool hoist_checks(IrFunction& function, const Loop& loop) {
+	auto& blocks = function.blocks;
+	if (loop.preheader == no_block || loop.latch == no_block || blocks[loop.header].preds.size() != 2) return false;
+	const auto defs = find_defs(function);
+	const auto counter = find_counter(function, defs, loop);
+	const auto inside = loop_values(function, loop);
+	if (!counter || !counter->below || inside[counter->bound]) return false;
+	bool any = false;
+	for (const auto block : loop.blocks) {
+		if (block != loop.header)
+			for (const auto succ : blocks[block].successors())
+				if (!loop.contains(succ)) return false;
+		for (const auto& instr : blocks[block].code) {
+			if (instr.op == IrOp::Call || instr.op == IrOp::Syscall || instr.op == IrOp::Asm) return false;
+			if (instr.op == IrOp::Div || instr.op == IrOp::Mod) {
+				const auto divisor = constant_value(function, defs, instr.args[1]);
+				if (!divisor || *divisor == 0 || *divisor == -1) return false;
+			}
+			any |= instr.op == IrOp::Check;
+		}
+	}
+	if (!any) return false;
+
+	const auto idom = compute_idoms(function);
+	const auto* variable = counter->variable;
+	const auto add = [&](IrInstr instr) { return add_to_preheader(function, loop, std::move(instr)); };
+	const auto constant = [&](int64_t value) { return add({ .op = IrOp::Const, .imm = value }); };
+	std::optional<ValueId> runs, zero;
+	// the limit and offset from the counter of the checks already hoisted
+	std::set<std::pair<ValueId, int64_t>> hoisted;
+	bool changed = false;
+	const auto most = static_cast<int64_t>(max_array_length);
+	for (const auto block : loop.blocks) {
+		// the header runs once more than the rest, with the counter at the bound
+		if (block == loop.header || !dominates(idom, block, loop.latch)) continue;
+		auto& code = blocks[block].code;
+		for (size_t i = 0; i < code.size(); ++i) {
+			const auto check = code[i];
+			if (check.op != IrOp::Check || inside[check.args[1]]) continue;
+			const auto offset = counter_offset(function, defs, check.args[0], variable->phi);
+			// bigger ones could wrap around between the first and last element
+			if (!offset || *offset < -most || *offset > most) continue;
+			code.erase(code.begin() + static_cast<std::ptrdiff_t>(i--));
+			changed = true;
+			if (!hoisted.insert({ check.args[1], *offset }).second) continue;
+
+			// checking 0 against 1 can't fail, which is what happens when the loop doesn't run at all
+			if (!runs) {
+				runs = add({ .op = IrOp::Lt, .args = { variable->init, counter->bound } });
+				zero = constant(0);
+			}
+			const auto limit = add({ .op = IrOp::Select, .args = { *runs, check.args[1], constant(1) } });
+			const auto first = add({ .op = IrOp::Add, .args = { variable->init, constant(*offset) } });
+			const auto last = add({ .op = IrOp::Add, .args = { counter->bound, constant(*offset - 1) } });
+			for (const auto index : { first, last }) {
+				const auto checked = add({ .op = IrOp::Select, .args = { *runs, index, *zero } });
+				auto& preheader = blocks[loop.preheader].code;
+				preheader.insert(preheader.end() - 1, IrInstr { .op = IrOp::Check, .args = { checked, limit }, .imm = check.imm });
+			}
+		}
+	}
+	return changed;
+}
+
+bool eliminate_bounds_checks(IrFunction& function) {
+	auto& blocks = function.blocks;
+	const auto loops = find_loops(function);
+	const auto defs = find_defs(function);
+	const auto idom = compute_idoms(function);
+	std::vector<std::vector<BlockId>> children(blocks.size());
+	for (const auto block : reverse_postorder(function))
+		if (block != 0) children[idom[block]].push_back(block);
+
+	BoundsProver prover {
+		.function = function,
+		.defs = defs,
+		.lowest = std::vector<ValueId>(function.next_value, no_value),
+		.highest = std::vector<std::optional<int64_t>>(function.next_value),
+	};
+	for (const auto& loop : loops) {
+		if (loop.preheader == no_block) continue;
+		if (const auto counter = find_counter(function, defs, loop)) {
+			prover.lowest[counter->variable->phi] = counter->variable->init;
+			if (loop.trip_count && *loop.trip_count > 0 && loop.counter == counter->variable->phi)
+				prover.highest[counter->variable->phi] = *counter->variable->initial + *loop.trip_count - 1;
+		}
+	}
+
+	// removed afterwards, since the defs have to stay right until then
+	std::vector<std::vector<bool>> removed(blocks.size());
+	bool changed = false;
+	const auto visit = [&](const auto& self, BlockId b) -> void {
+		const auto facts = prover.facts.size();
+		// what the branch into a block with no other way in went on
+		if (b != 0 && blocks[b].preds.size() == 1) {
+			const auto& branch = blocks[blocks[b].preds[0]].terminator();
+			const auto* compare = branch.op == IrOp::Branch ? prover.def(branch.args[0]) : nullptr;
+			if (compare && is_comparison(compare->op) && compare->lanes == 1 && branch.targets[0] != branch.targets[1])
+				prover.add_comparison(*compare, branch.targets[0] != b);
+		}
+		removed[b].resize(blocks[b].code.size());
+		for (size_t i = 0; i < blocks[b].code.size(); ++i) {
+			const auto& instr = blocks[b].code[i];
+			if (instr.op != IrOp::Check) continue;
+			if (prover.in_bounds(instr)) {
+				removed[b][i] = true;
+				changed = true;
+				continue;
+			}
+			prover.facts.push_back({ no_value, instr.args[0], 0 });
+			prover.facts.push_back({ instr.args[0], instr.args[1], -1 });
+		}
+		for (const auto child : children[b])
+			self(self, child);
+		prover.facts.resize(facts);
+	};
+	visit(visit, 0);
+	for (BlockId b = 0; b < blocks.size(); ++b) {
+		size_t i = 0;
+		std::erase_if(blocks[b].code, [&](const IrInstr&) { return i < removed[b].size() && removed[b][i++]; });
+	}
+
+	for (size_t i = 0; i < loops.size(); ++i) {
+		const bool innermost = std::none_of(loops.begin(), loops.end(), [&](const Loop& other) { return other.parent == i; });
+		// the blocks stay the same, so the other loops are still right
+		if (innermost) changed |= hoist_checks(function, loops[i]);
+	}
+	return changed;
+}
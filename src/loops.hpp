@@ -0,0 +1,61 @@
+#pragma once
+#include "ir.hpp"
+#include <optional>
+
+// a value going up by the same constant every iteration, i = phi(init, i + step)
+struct InductionVariable {
+	// the header phi, which is the value during an iteration
+	ValueId phi;
+	// coming in from the preheader
+	ValueId init;
+	// coming back from the latch, phi + step
+	ValueId next;
+	int64_t step;
+	// init, if it's a constant
+	std::optional<int64_t> initial;
+};
+
+struct Loop {
+	BlockId header;
+	// every block in the loop, including the header and nested loops
+	std::vector<BlockId> blocks;
+	// the only pred from outside the loop, which jumps straight to the header
+	BlockId preheader = no_block;
+	// the block jumping back to the header, if there's only one
+	BlockId latch = no_block;
+	// index of the innermost loop around this one
+	size_t parent = SIZE_MAX;
+	std::vector<InductionVariable> induction_variables;
+	// how many times the body runs, when the only way out is the header's condition on an
+	// induction variable with constant bounds
+	std::optional<int64_t> trip_count;
+	// the phi of the induction variable the trip count comes from
+	ValueId counter = no_value;
+
+	bool contains(BlockId block) const;
+};
+
+// Finds the natural loops of a function, innermost first, along with their induction variables
+// and trip counts. Loops without a preheader get one first, so code can be hoisted out of them.
+std::vector<Loop> find_loops(IrFunction& function);
+
+// Loop invariant code motion into preheaders, strength reduction of induction variables multiplied
+// by invariants into their own induction variable that gets added to instead, replacing uses of
+// induction variables after a loop with their final value, and removing loops that end up
+// computing nothing.
+bool optimize_loops(IrFunction& function);
+
+// Unrolls innermost loops with a known trip count: completely when the copies stay small, otherwise
+// `factor` iterations at a time with a single exit check, and the iterations left over straight after
+// the unrolled loop. a factor of 1 or less leaves every loop alone.
+bool unroll_loops(IrFunction& function, int factor);
+
+// Turns innermost loops going over arrays one element at a time into ones doing `lanes` elements per
+// iteration, with the iterations left over done by the original loop afterwards. ifs in the body become
+// selects, and sums, minimums and maximums get kept per lane and combined at the end.
+bool vectorize_loops(IrFunction& function, int lanes);
+
+// Removes the bounds checks that can't fail, going by the comparisons that had to be true to get to them,
+// the checks before them and the counters of loops. checks in innermost loops that don't do anything
+// visible are replaced with checks of the first and last element they get to before the loop.
+bool eliminate_bounds_checks(IrFunction& function);
@@ -2,8 +2,17 @@
 #include "lexer.hpp"
 #include "parser.hpp"
 #include "checker.hpp"
+#include "consteval.hpp"
 #include "compiler.hpp"
 #include "evaluator.hpp"
+#include "batch.hpp"
+#include "watch.hpp"
+#include "assembler.hpp"
+#include "elf.hpp"
+#include <filesystem>
+#include <set>
+#include <thread>
+#include <unistd.h>
 
 #include "enums.hpp"
 #include "format.hpp"
@@ -20,7 +29,7 @@ void print_expression(const Expression& exp, const int depth = 0) {
 		}, value);
 	} else if (exp.type == ExpressionType::Declaration) {
 		const auto& var = std::get<Expression::DeclarationData>(exp.data).var;
-		print("({}: {}) ", var.name, var.type.name);
+		print("({}: {}) ", var.name, var.type);
 	} else if (exp.type == ExpressionType::Variable) {
 		print("({}) ", std::get<Expression::VariableData>(exp.data).name);
 	} else if (exp.type == ExpressionType::Operator) {
@@ -63,6 +72,130 @@ auto& operator<<(std::ostream& stream, const Token& token) {
 	return stream;
 }
 
+struct CompileOptions {
+	Target target = Target::X86;
+	int opt_level = 2;
+	int inline_threshold = 10;
+	int unroll_factor = 4;
+	Simd simd = Simd::Sse2;
+	// function calls + loop iterations a const fn call or const local gets while compiling
+	uint64_t const_fuel = 100000;
+	bool show_asm = false;
+	bool emit_ir = false;
+	bool report_bounds_checks = false;
+	std::string output_file;
+	// what extern functions come from. either makes cc link the executable
+	std::vector<std::string> objects;
+	std::vector<std::string> libraries;
+};
+
+// writes the object to a temporary file and has cc link it with the rest, keeping tack's own _start
+static bool link_executable(const ObjectCode& object, const CompileOptions& options) {
+	// a name of its own, so it can't clobber an object file of the same name that's being linked in
+	auto object_file = (std::filesystem::temp_directory_path() / "tackXXXXXX.o").string();
+	const int fd = mkstemps(object_file.data(), 2);
+	if (fd == -1) {
+		print("[error] Couldn't create a temporary object file in {}\n", std::filesystem::temp_directory_path().string());
+		return false;
+	}
+	close(fd);
+	{
+		std::ofstream file(object_file, std::ios::binary);
+		write_object(file, object);
+	}
+	auto command = format("cc -nostartfiles -no-pie{} -o '{}' '{}'",
+		options.target == Target::X86 ? " -m32" : "", options.output_file, object_file);
+	// no libraries means no c library either
+	if (options.libraries.empty())
+		command += " -nostdlib -static";
+	for (const auto& object : options.objects)
+		command += format(" '{}'", object);
+	for (const auto& library : options.libraries)
+		command += format(" -l'{}'", library);
+	print("Linking: {}\n", command);
+	const auto status = std::system(command.c_str());
+	std::filesystem::remove(object_file);
+	if (status != 0) {
+		print("[error] Linking failed\n");
+		return false;
+	}
+	return true;
+}
+
+bool compile_program(Parser& parser, const CompileOptions& options) {
+	const auto& output_file = options.output_file;
+	const auto target = options.target;
+	fold_const_calls(parser, EvalLimits { .fuel = options.const_fuel });
+	Compiler compiler(parser, target, options.opt_level);
+	compiler.m_inline_threshold = options.inline_threshold;
+	compiler.m_unroll_factor = options.unroll_factor;
+	compiler.m_simd = options.simd;
+	compiler.m_libc = !options.libraries.empty();
+	compiler.compile();
+
+	print("Compiler finished\n");
+
+	if (options.emit_ir) {
+		std::stringstream stream;
+		compiler.write_ir(stream);
+		print("{}", stream.str());
+	}
+	if (options.report_bounds_checks) {
+		size_t count = 0;
+		for (const auto& function : compiler.m_ir) {
+			// unrolling and hoisting can leave several checks for the same indexing
+			std::set<std::pair<size_t, size_t>> seen;
+			for (const auto& block : function.blocks) {
+				for (const auto& instr : block.code) {
+					if (instr.op != IrOp::Check) continue;
+					const auto& span = function.checks[static_cast<size_t>(instr.imm)];
+					if (!seen.insert({ span.line, span.column }).second) continue;
+					print("[bounds check] in {}", function.name);
+					print_file_span(parser.m_file_name, span);
+					print('\n');
+					++count;
+				}
+			}
+		}
+		print("{} bounds checks left\n", count);
+	}
+	if (options.show_asm) {
+		std::stringstream stream;
+		compiler.write_asm(stream);
+		print("{}\n", stream.str());
+	}
+	if (output_file.empty()) return true;
+
+	// the extension picks the format: asm text, an object file, or else a ready to run executable
+	const auto extension = std::filesystem::path(output_file).extension();
+	if (extension == ".asm" || extension == ".s") {
+		std::ofstream file(output_file, std::ios::binary);
+		compiler.write_asm(file);
+		return true;
+	}
+	const auto object = assemble(target, compiler.m_functions, compiler.m_strings, compiler.m_globals);
+	if (extension != ".o" && (!options.objects.empty() || !options.libraries.empty()))
+		return link_executable(object, options);
+	if (extension != ".o") {
+		for (const auto& relocation : object.relocations) {
+			if (object.symbols.contains(relocation.symbol)) continue;
+			print("[error] {} isn't defined anywhere, link what has it with -l or --link\n", relocation.symbol);
+			return false;
+		}
+	}
+	std::ofstream file(output_file, std::ios::binary);
+	if (extension == ".o") {
+		write_object(file, object);
+	} else {
+		write_executable(file, object);
+		file.close();
+		using std::filesystem::perms;
+		std::filesystem::permissions(output_file, perms::owner_exec | perms::group_exec | perms::others_exec,
+			std::filesystem::perm_options::add);
+	}
+	return true;
+}
+
 int main(int argc, char** argv) {
 	std::cout << std::boolalpha;
 
@@ -75,21 +208,48 @@ int main(int argc, char** argv) {
 			"\n"
 			"  input - input file to compile\n"
 			"  opts:\n"
-			"    -o output - output asm file\n"
+			"    -o output - output file. .asm or .s writes nasm text, .o an object file,\n"
+			"                anything else a static executable\n"
+			"    -l name - links with a library, like c for the c library, where extern functions can come from.\n"
+			"              the executable gets linked by cc\n"
+			"    --link file - links with an object file or archive, also through cc\n"
 			"    --show-tokens - prints lexer tokens\n"
 			"    --show-ast - prints parser ast\n"
 			"    --show-asm - prints output asm\n"
+			"    --emit-ir - prints the ssa ir of every function, after optimizing\n"
+			"    --report-bounds-checks - lists the indexing and slicing still bounds checked after optimizing\n"
+			"    -O0, -O1, -O2 - optimization level (default 2). -O0 skips all optimizations,\n"
+			"                    -O1 propagates constants and removes dead code, -O2 adds value numbering\n"
+			"    --inline-threshold n - how many instructions bigger than the call they replace functions\n"
+			"                           can be and still get inlined (default 10). -O1 and up\n"
+			"    --unroll n - iterations per trip around loops with a known trip count too long to unroll\n"
+			"                 completely (default 4, 1 turns unrolling off). -O2\n"
+			"    --simd=none|sse2|avx2 - vector instructions loops over arrays get vectorized with (default sse2). -O2\n"
+			"                            avx2 also lets popcount, clz and ctz use popcnt, lzcnt and tzcnt\n"
+			"    --const-fuel n - function calls + loop iterations a const fn call can take while compiling,\n"
+			"                     after which it's left to run at runtime (default 100000)\n"
+			"    --target=x86|x86_64 - architecture to compile for (default x86)\n"
 			"    --eval - uses evaluator\n"
-			, args[0]
+			"    --batch file - evaluates main once per line of file (- for stdin), results go to -o or stdout\n"
+			"    --threads n - number of threads for --batch, defaults to all cores\n"
+			"    --fuel n - stop evaluating after n function calls + loop iterations\n"
+			"    --max-depth n - maximum call depth for the evaluator (default {})\n"
+			"    --watch - keeps running, reloading the functions that change in input.\n"
+			"              with --eval they get swapped into the running program\n"
+			, args[0], EvalLimits{}.max_depth
 		);
 		return 1;
 	}
 
 	bool show_tokens = false;
 	bool show_ast = false;
-	bool show_asm = false;
 	bool evaluate = false;
-	std::string output_file;
+	bool watch = false;
+	std::string batch_file;
+	size_t thread_count = std::thread::hardware_concurrency();
+	EvalLimits limits;
+	CompileOptions options;
+	auto& output_file = options.output_file;
 	auto rest = args.slice(2);
 	for (size_t i = 0; i < rest.size(); ++i) {
 		const std::string_view arg = rest[i];
@@ -97,14 +257,68 @@ int main(int argc, char** argv) {
 			assert(i + 1 < rest.size(), "Expected file name");
 			output_file = rest[i + 1];
 			++i;
+		} else if (arg == "-l") {
+			assert(i + 1 < rest.size(), "Expected library name");
+			options.libraries.push_back(rest[i + 1]);
+			++i;
+		} else if (arg == "--link") {
+			assert(i + 1 < rest.size(), "Expected file to link");
+			options.objects.push_back(rest[i + 1]);
+			++i;
 		} else if (arg == "--show-tokens") {
 			show_tokens = true;
 		} else if (arg == "--show-ast") {
 			show_ast = true;
 		} else if (arg == "--show-asm") {
-			show_asm = true;
+			options.show_asm = true;
+		} else if (arg == "--emit-ir") {
+			options.emit_ir = true;
+		} else if (arg == "--report-bounds-checks") {
+			options.report_bounds_checks = true;
+		} else if (arg == "-O0" || arg == "-O1" || arg == "-O2") {
+			options.opt_level = arg[2] - '0';
+		} else if (arg == "--inline-threshold") {
+			assert(i + 1 < rest.size(), "Expected inline threshold");
+			options.inline_threshold = std::stoi(rest[i + 1]);
+			++i;
+		} else if (arg == "--unroll") {
+			assert(i + 1 < rest.size(), "Expected unroll factor");
+			options.unroll_factor = std::stoi(rest[i + 1]);
+			++i;
+		} else if (arg == "--simd=none") {
+			options.simd = Simd::None;
+		} else if (arg == "--simd=sse2") {
+			options.simd = Simd::Sse2;
+		} else if (arg == "--simd=avx2") {
+			options.simd = Simd::Avx2;
+		} else if (arg == "--const-fuel") {
+			assert(i + 1 < rest.size(), "Expected fuel amount");
+			options.const_fuel = std::stoull(rest[i + 1]);
+			++i;
+		} else if (arg == "--target=x86") {
+			options.target = Target::X86;
+		} else if (arg == "--target=x86_64") {
+			options.target = Target::X86_64;
 		} else if (arg == "--eval") {
 			evaluate = true;
+		} else if (arg == "--watch") {
+			watch = true;
+		} else if (arg == "--batch") {
+			assert(i + 1 < rest.size(), "Expected batch input file");
+			batch_file = rest[i + 1];
+			++i;
+		} else if (arg == "--threads") {
+			assert(i + 1 < rest.size(), "Expected thread count");
+			thread_count = std::stoul(rest[i + 1]);
+			++i;
+		} else if (arg == "--fuel") {
+			assert(i + 1 < rest.size(), "Expected fuel amount");
+			limits.fuel = std::stoull(rest[i + 1]);
+			++i;
+		} else if (arg == "--max-depth") {
+			assert(i + 1 < rest.size(), "Expected call depth");
+			limits.max_depth = std::stoul(rest[i + 1]);
+			++i;
 		} else {
 			print("Unknown option \"{}\"\n", arg);
 			return 1;
@@ -137,16 +351,38 @@ int main(int argc, char** argv) {
 		.arguments = { Variable { Type { "i32" }, "number" } },
 		.builtin = true
 	});
+	// print only writes out once its buffer fills up, when the program exits or before a failed bounds
+	// check, division or alloc traps. going through a null pointer crashes without writing it out
+	parser.m_functions.push_back(Function {
+		.return_type = Type { "void" },
+		.name = "flush",
+		.builtin = true
+	});
+
+	try {
+		parser.parse();
+		print("File parsed\n");
 
-	parser.parse();
-	print("File parsed\n");
+		// the evaluator can't run asm, so it doesn't matter which target that's checked against
+		const bool compiling = !evaluate && batch_file.empty();
+		TypeChecker checker(parser, compiling ? std::optional(options.target) : std::nullopt);
+		checker.check();
+	} catch (const CompileError&) {
+		return 1;
+	}
 
-	TypeChecker checker(parser);
-	checker.check();
+	if (evaluate && batch_file.empty()) {
+		const auto& funcs = parser.m_functions;
+		const auto main = std::find_if(funcs.begin(), funcs.end(), [](const Function& f) { return f.name == "main"; });
+		if (main != funcs.end() && !main->arguments.empty()) {
+			print("[error] main takes {} arguments, use --batch to give them\n", main->arguments.size());
+			return 1;
+		}
+	}
 
 	if (show_ast) {
 		for (auto& function : parser.m_functions) {
-			if (function.builtin) continue;
+			if (function.builtin || function.external) continue;
 			print("Function {}: {}\n", function.name, function.return_type.name);
 			for (auto& statement : function.statements) {
 				print_statement(statement, 1);
@@ -154,34 +390,38 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	if (evaluate) {
-		Evaluator evaluator(parser);
-		const int result = evaluator.run();
-		print("Program returned: {}\n", result);
-	} else {
-		std::stringstream stream;
-		Compiler compiler(stream, parser);
-		compiler.compile();
-
-		print("Compiler finished\n");
-
-		if (!output_file.empty()) {
-			std::ofstream file(output_file);
-			file << 
-				"section .text\n"
-				"global _start\n"
-				"\n"
-				"_start:\n"
-				"	call main\n"
-				"	mov ebx, eax\n"
-				"	mov al, 1\n"
-				"	int 0x80\n"
-				"\n"
-				"; -- generated asm --\n\n";
-			file << stream.str();
-		} else if (show_asm) {
-			print("{}\n", stream.str());
+	if (!batch_file.empty()) {
+		std::ifstream batch_input;
+		if (batch_file != "-") {
+			batch_input.open(batch_file);
+			if (!batch_input.is_open()) {
+				print("File \"{}\" could not be opened\n", batch_file);
+				return 1;
+			}
+		}
+		std::ofstream batch_output;
+		if (!output_file.empty())
+			batch_output.open(output_file);
+		return run_batch(parser,
+			batch_file == "-" ? std::cin : batch_input,
+			output_file.empty() ? std::cout : batch_output,
+			thread_count, limits);
+	} else if (watch) {
+		if (!evaluate)
+			compile_program(parser, options);
+		return run_watch(parser, args[1], evaluate ? std::optional(limits) : std::nullopt,
+			evaluate ? std::nullopt : std::optional(options.target),
+			[&](Parser& parser) { compile_program(parser, options); });
+	} else if (evaluate) {
+		Evaluator evaluator(parser, std::cout, limits);
+		const auto result = evaluator.run();
+		if (result.status != EvalStatus::Ok) {
+			print("[error] Program stopped: {}\n", result.status);
+			return 2;
 		}
+		print("Program returned: {}\n", result.value);
+	} else if (!compile_program(parser, options)) {
+		return 1;
 	}
 
 	return 0;
@@ -0,0 +1,621 @@
+#include "optimizer.hpp"
+#include "intrinsics.hpp"
+#include "loops.hpp"
+#include "utils.hpp"
+#include <map>
+#include <optional>
+#include <set>
+#include <span>
+#include <tuple>
+
+// values are i32, wrapping like the hardware does
+static int64_t wrap(int64_t value) {
+	return static_cast<int32_t>(static_cast<uint32_t>(value));
+}
+
+// result of a pure instruction on constant arguments, if it can be computed
+static std::optional<int64_t> fold(IrOp op, std::span<const int64_t> args) {
+	switch (op) {
+		case IrOp::Add: return wrap(args[0] + args[1]);
+		case IrOp::Sub: return wrap(args[0] - args[1]);
+		case IrOp::Mul: return wrap(args[0] * args[1]);
+		// left for the trap at runtime, which int min / -1 gets too
+		case IrOp::Div:
+		case IrOp::Mod:
+			if (args[1] == 0 || (args[0] == INT32_MIN && args[1] == -1)) return std::nullopt;
+			return wrap(op == IrOp::Div ? args[0] / args[1] : args[0] % args[1]);
+		case IrOp::Neg: return wrap(-args[0]);
+		case IrOp::Not: return wrap(~args[0]);
+		case IrOp::And: return args[0] & args[1];
+		case IrOp::Or: return args[0] | args[1];
+		case IrOp::Shl: return wrap(args[0] << args[1]);
+		case IrOp::Shr: return wrap(static_cast<uint32_t>(args[0]) >> args[1]);
+		case IrOp::Eq: return args[0] == args[1];
+		case IrOp::Ne: return args[0] != args[1];
+		case IrOp::Lt: return args[0] < args[1];
+		case IrOp::Le: return args[0] <= args[1];
+		case IrOp::Gt: return args[0] > args[1];
+		case IrOp::Ge: return args[0] >= args[1];
+		case IrOp::Select: return args[0] ? args[1] : args[2];
+		default: {
+			const auto* intrinsic = find_intrinsic(op);
+			if (!intrinsic || !is_pure(op)) return {};
+			int32_t values[2] = {};
+			for (size_t i = 0; i < args.size(); ++i)
+				values[i] = static_cast<int32_t>(args[i]);
+			return intrinsic->evaluate(std::span(values, args.size()));
+		}
+	}
+}
+
+namespace {
+
+struct Lattice {
+	enum class State : uint8_t {
+		// nothing reaching it has run yet
+		Unknown,
+		Constant,
+		// could be anything
+		Varying,
+	};
+	State state = State::Unknown;
+	int64_t value = 0;
+
+	bool operator==(const Lattice&) const = default;
+};
+
+}
+
+bool propagate_constants(IrFunction& function) {
+	using State = Lattice::State;
+	auto& blocks = function.blocks;
+	std::vector<std::vector<IrDef>> users(function.next_value);
+	for (BlockId b = 0; b < blocks.size(); ++b)
+		for (size_t i = 0; i < blocks[b].code.size(); ++i)
+			for (const auto arg : blocks[b].code[i].args)
+				users[arg].push_back({ b, i });
+
+	std::vector<Lattice> values(function.next_value);
+	std::vector<bool> block_runs(blocks.size());
+	// indexed like each block's preds
+	std::vector<std::vector<bool>> edge_runs(blocks.size());
+	for (BlockId b = 0; b < blocks.size(); ++b)
+		edge_runs[b].resize(blocks[b].preds.size());
+	std::vector<std::pair<BlockId, BlockId>> flow_work { { no_block, 0 } };
+	std::vector<ValueId> value_work;
+
+	const auto set = [&](ValueId value, Lattice lattice) {
+		if (values[value] == lattice) return;
+		values[value] = lattice;
+		value_work.push_back(value);
+	};
+
+	const auto evaluate = [&](BlockId b, const IrInstr& instr) {
+		switch (instr.op) {
+			case IrOp::Const:
+				set(instr.result, { State::Constant, instr.imm });
+				return;
+			case IrOp::Phi: {
+				Lattice result;
+				for (size_t i = 0; i < instr.args.size(); ++i) {
+					if (!edge_runs[b][i]) continue;
+					const auto& arg = values[instr.args[i]];
+					if (arg.state == State::Unknown) continue;
+					if (arg.state == State::Varying || (result.state == State::Constant && result.value != arg.value)) {
+						result = { State::Varying };
+						break;
+					}
+					result = arg;
+				}
+				set(instr.result, result);
+				return;
+			}
+			case IrOp::Jump:
+				flow_work.push_back({ b, instr.targets[0] });
+				return;
+			case IrOp::Branch: {
+				const auto& condition = values[instr.args[0]];
+				if (condition.state == State::Constant) {
+					flow_work.push_back({ b, instr.targets[condition.value ? 0 : 1] });
+				} else if (condition.state == State::Varying) {
+					flow_work.push_back({ b, instr.targets[0] });
+					flow_work.push_back({ b, instr.targets[1] });
+				}
+				return;
+			}
+			case IrOp::Switch: {
+				const auto& value = values[instr.args[0]];
+				if (value.state == State::Constant) {
+					flow_work.push_back({ b, switch_target(instr, value.value) });
+				} else if (value.state == State::Varying) {
+					for (const auto target : instr.targets)
+						flow_work.push_back({ b, target });
+				}
+				return;
+			}
+			case IrOp::Return:
+				return;
+			default:
+				break;
+		}
+		if (instr.result == no_value) return;
+		if (!is_pure(instr.op) || instr.op == IrOp::Arg) {
+			set(instr.result, { State::Varying });
+			return;
+		}
+		std::vector<int64_t> args;
+		bool unknown = false;
+		for (const auto arg : instr.args) {
+			const auto& lattice = values[arg];
+			if (lattice.state == State::Varying) {
+				set(instr.result, { State::Varying });
+				return;
+			}
+			unknown |= lattice.state == State::Unknown;
+			args.push_back(lattice.value);
+		}
+		if (unknown) return;
+		const auto result = fold(instr.op, args);
+		set(instr.result, result ? Lattice { State::Constant, *result } : Lattice { State::Varying });
+	};
+
+	while (!flow_work.empty() || !value_work.empty()) {
+		if (!flow_work.empty()) {
+			const auto [from, to] = flow_work.back();
+			flow_work.pop_back();
+			auto& block = blocks[to];
+			if (from != no_block) {
+				bool new_edge = false;
+				for (size_t i = 0; i < block.preds.size(); ++i) {
+					if (block.preds[i] == from && !edge_runs[to][i]) {
+						edge_runs[to][i] = true;
+						new_edge = true;
+					}
+				}
+				if (!new_edge) continue;
+			}
+			if (!block_runs[to]) {
+				block_runs[to] = true;
+				for (const auto& instr : block.code)
+					evaluate(to, instr);
+			} else {
+				// only the phis care about which edges run
+				for (const auto& instr : block.code) {
+					if (instr.op != IrOp::Phi) break;
+					evaluate(to, instr);
+				}
+			}
+		} else {
+			const auto value = value_work.back();
+			value_work.pop_back();
+			for (const auto& use : users[value])
+				if (block_runs[use.block]) evaluate(use.block, blocks[use.block].code[use.index]);
+		}
+	}
+
+	bool changed = false;
+	for (BlockId b = 0; b < blocks.size(); ++b) {
+		if (!block_runs[b]) continue;
+		auto& code = blocks[b].code;
+		for (auto& instr : code) {
+			if (instr.result != no_value && instr.op != IrOp::Const && values[instr.result].state == State::Constant) {
+				// only pure instructions can end up constant
+				instr = IrInstr { .op = IrOp::Const, .result = instr.result, .imm = values[instr.result].value };
+				changed = true;
+			}
+		}
+		auto& terminator = blocks[b].terminator();
+		if (terminator.op == IrOp::Branch && values[terminator.args[0]].state == State::Constant) {
+			const bool taken = values[terminator.args[0]].value != 0;
+			const auto target = terminator.targets[taken ? 0 : 1];
+			remove_pred(blocks[terminator.targets[taken ? 1 : 0]], b);
+			terminator = IrInstr { .op = IrOp::Jump, .targets = { target } };
+			changed = true;
+		}
+		if (terminator.op == IrOp::Switch && values[terminator.args[0]].state == State::Constant) {
+			const auto target = switch_target(terminator, values[terminator.args[0]].value);
+			// every edge but one to the target goes away
+			bool kept = false;
+			for (const auto t : terminator.targets) {
+				if (t == target && !kept)
+					kept = true;
+				else
+					remove_pred(blocks[t], b);
+			}
+			terminator = IrInstr { .op = IrOp::Jump, .targets = { target } };
+			changed = true;
+		}
+		// phis that became constants have to move out of the phi section
+		std::stable_partition(code.begin(), code.end(), [](const IrInstr& instr) { return instr.op == IrOp::Phi; });
+	}
+	changed |= remove_unreachable_blocks(function);
+	return changed;
+}
+
+// replaces an instruction with something simpler, returning an existing value it's equal to,
+// or turning it into a constant in place
+static ValueId simplify(IrInstr& instr, const std::vector<IrDef>& defs, const IrFunction& function) {
+	const auto constant = [&](ValueId value) -> std::optional<int64_t> {
+		const auto def = defs[value];
+		if (def.block == no_block) return {};
+		const auto& instr = function.blocks[def.block].code[def.index];
+		if (instr.op != IrOp::Const) return {};
+		return instr.imm;
+	};
+	const auto make_constant = [&](int64_t value) {
+		instr.op = IrOp::Const;
+		instr.imm = value;
+		instr.args.clear();
+		return no_value;
+	};
+	const auto& args = instr.args;
+
+	if (instr.op == IrOp::Phi) {
+		ValueId same = no_value;
+		for (const auto arg : args) {
+			if (arg == same || arg == instr.result) continue;
+			if (same != no_value) return no_value;
+			same = arg;
+		}
+		return same;
+	}
+
+	std::vector<int64_t> values;
+	for (const auto arg : args) {
+		const auto value = constant(arg);
+		if (!value) break;
+		values.push_back(*value);
+	}
+	if (!args.empty() && values.size() == args.size()) {
+		if (const auto result = fold(instr.op, values))
+			return make_constant(*result);
+	}
+
+	const auto is = [&](size_t i, int64_t value) {
+		const auto c = constant(args[i]);
+		return c && *c == value;
+	};
+	switch (instr.op) {
+		case IrOp::Add:
+			if (is(1, 0)) return args[0];
+			if (is(0, 0)) return args[1];
+			break;
+		case IrOp::Sub:
+			if (is(1, 0)) return args[0];
+			if (args[0] == args[1]) return make_constant(0);
+			break;
+		case IrOp::Offset:
+			if (is(1, 0)) return args[0];
+			break;
+		case IrOp::Mul:
+			if (is(1, 1)) return args[0];
+			if (is(0, 1)) return args[1];
+			if (is(0, 0) || is(1, 0)) return make_constant(0);
+			break;
+		case IrOp::Div:
+			if (is(1, 1)) return args[0];
+			break;
+		case IrOp::And:
+			if (is(0, 0) || is(1, 0)) return make_constant(0);
+			if (is(1, -1) || args[0] == args[1]) return args[0];
+			if (is(0, -1)) return args[1];
+			break;
+		case IrOp::Or:
+			if (is(1, 0) || args[0] == args[1]) return args[0];
+			if (is(0, 0)) return args[1];
+			break;
+		case IrOp::Shl:
+		case IrOp::Shr:
+			if (is(0, 0)) return make_constant(0);
+			break;
+		case IrOp::Mod:
+			// not -1, which has to trap for int min
+			if (is(1, 1)) return make_constant(0);
+			break;
+		case IrOp::Eq:
+		case IrOp::Le:
+		case IrOp::Ge:
+			if (args[0] == args[1]) return make_constant(1);
+			break;
+		case IrOp::Ne:
+		case IrOp::Lt:
+		case IrOp::Gt:
+			if (args[0] == args[1]) return make_constant(0);
+			break;
+		case IrOp::Select:
+			if (args[1] == args[2]) return args[1];
+			if (const auto c = constant(args[0])) return args[*c ? 1 : 2];
+			break;
+		default:
+			break;
+	}
+	return no_value;
+}
+
+bool number_values(IrFunction& function) {
+	auto& blocks = function.blocks;
+	const auto idom = compute_idoms(function);
+	std::vector<std::vector<BlockId>> children(blocks.size());
+	for (const auto block : reverse_postorder(function))
+		if (block != 0) children[idom[block]].push_back(block);
+
+	const auto defs = find_defs(function);
+	std::vector<ValueId> replacements(function.next_value, no_value);
+	const auto resolve = [&](ValueId value) {
+		while (replacements[value] != no_value) value = replacements[value];
+		return value;
+	};
+
+	// phis are only equal to phis in the same block, everything else goes by operation and arguments
+	using Key = std::tuple<IrOp, int64_t, uint8_t, BlockId, std::vector<ValueId>>;
+	std::map<Key, ValueId> available;
+	bool changed = false;
+
+	// array elements known to hold a value, by array, index and lanes. they only carry over to blocks
+	// that can't be reached any other way, since a store could be on the other path
+	using Element = std::tuple<int64_t, ValueId, uint8_t>;
+	using Elements = std::map<Element, ValueId>;
+	const auto constant_of = [&](ValueId value) -> std::optional<int64_t> {
+		const auto& instr = blocks[defs[value].block].code[defs[value].index];
+		if (instr.op != IrOp::Const) return std::nullopt;
+		return instr.imm;
+	};
+	// arrays that have been turned into slices can also be written through pointers, by this function
+	// or anything it calls
+	std::set<int64_t> sliced;
+	for (const auto& block : blocks)
+		for (const auto& instr : block.code)
+			if (instr.op == IrOp::Address) sliced.insert(instr.imm);
+	const auto visit = [&](const auto& self, BlockId b, Elements elements) -> void {
+		std::vector<Key> added;
+		for (auto& instr : blocks[b].code) {
+			for (auto& arg : instr.args)
+				arg = resolve(arg);
+			// going through a pointer straight to an array is going to the array, which knows more
+			if (instr.op == IrOp::Read || instr.op == IrOp::Write) {
+				const auto def = defs[instr.args[0]];
+				const auto& pointer = blocks[def.block].code[def.index];
+				if (pointer.op == IrOp::Address) {
+					instr.imm = pointer.imm;
+					instr.op = instr.op == IrOp::Read ? IrOp::Load : IrOp::Store;
+					instr.args.erase(instr.args.begin());
+					changed = true;
+				}
+			}
+			if (instr.op == IrOp::Write || instr.op == IrOp::Call || instr.op == IrOp::Asm)
+				std::erase_if(elements, [&](const auto& element) { return sliced.contains(std::get<0>(element.first)); });
+			if (instr.op == IrOp::Store) {
+				// elements at other constant indices can't be the one getting stored to
+				const auto index = constant_of(instr.args[0]);
+				std::erase_if(elements, [&](const auto& element) {
+					const auto& [array, other, lanes] = element.first;
+					if (array != instr.imm) return false;
+					const auto other_index = constant_of(other);
+					return !index || !other_index || (*other_index < *index + instr.lanes && *index < *other_index + lanes);
+				});
+				elements[{ instr.imm, instr.args[0], instr.lanes }] = instr.args[1];
+				continue;
+			}
+			if (instr.op == IrOp::Load) {
+				const auto [it, added_load] = elements.try_emplace({ instr.imm, instr.args[0], instr.lanes }, instr.result);
+				if (!added_load) {
+					replacements[instr.result] = it->second;
+					changed = true;
+				}
+				continue;
+			}
+			if (instr.result == no_value || !is_pure(instr.op) || instr.op == IrOp::Arg) continue;
+
+			// the rules are for scalars, x - x is a vector of zeros and not a constant
+			if (const auto same = instr.lanes == 1 ? simplify(instr, defs, function) : no_value; same != no_value) {
+				replacements[instr.result] = same;
+				changed = true;
+				continue;
+			}
+			auto args = instr.args;
+			if (is_commutative(instr.op))
+				std::sort(args.begin(), args.end());
+			Key key { instr.op, instr.imm, instr.lanes, instr.op == IrOp::Phi ? b : no_block, std::move(args) };
+			const auto it = available.find(key);
+			if (it != available.end()) {
+				replacements[instr.result] = it->second;
+				changed = true;
+			} else {
+				available.emplace(key, instr.result);
+				added.push_back(std::move(key));
+			}
+		}
+		for (const auto child : children[b])
+			self(self, child, blocks[child].preds.size() == 1 ? elements : Elements {});
+		for (const auto& key : added)
+			available.erase(key);
+	};
+	visit(visit, 0, {});
+
+	if (!changed) return false;
+	for (auto& block : blocks) {
+		std::erase_if(block.code, [&](const IrInstr& instr) {
+			return instr.result != no_value && replacements[instr.result] != no_value;
+		});
+	}
+	replace_values(function, replacements);
+	return true;
+}
+
+bool eliminate_dead_code(IrFunction& function) {
+	const auto defs = find_defs(function);
+	std::vector<bool> live(function.next_value);
+	std::vector<ValueId> work;
+	for (const auto& block : function.blocks)
+		for (const auto& instr : block.code)
+			if (!is_pure(instr.op) && !is_read(instr.op)) work.insert(work.end(), instr.args.begin(), instr.args.end());
+
+	while (!work.empty()) {
+		const auto value = work.back();
+		work.pop_back();
+		if (live[value]) continue;
+		live[value] = true;
+		const auto def = defs[value];
+		const auto& args = function.blocks[def.block].code[def.index].args;
+		work.insert(work.end(), args.begin(), args.end());
+	}
+
+	// stores to arrays nothing reads from, or could through a pointer
+	std::vector<bool> read(function.arrays.size());
+	for (const auto& block : function.blocks)
+		for (const auto& instr : block.code)
+			if (instr.op == IrOp::Load || (instr.op == IrOp::Address && live[instr.result])) read[static_cast<size_t>(instr.imm)] = true;
+
+	bool changed = false;
+	for (auto& block : function.blocks) {
+		changed |= std::erase_if(block.code, [&](const IrInstr& instr) {
+			if (instr.op == IrOp::Store) return !read[static_cast<size_t>(instr.imm)];
+			return (is_pure(instr.op) || is_read(instr.op)) && !live[instr.result];
+		}) != 0;
+	}
+	return changed;
+}
+
+// leaves a block with no preds and no successors, for remove_unreachable_blocks to drop
+static void clear_block(IrBlock& block) {
+	block.preds.clear();
+	block.code = { IrInstr { .op = IrOp::Return } };
+}
+
+static size_t phi_count(const IrBlock& block) {
+	size_t count = 0;
+	while (count < block.code.size() && block.code[count].op == IrOp::Phi) ++count;
+	return count;
+}
+
+// whether every edge from pred to block passes the same values to the phis, so they can be one edge
+static bool same_edges(const IrBlock& block, BlockId pred) {
+	const auto first = std::find(block.preds.begin(), block.preds.end(), pred) - block.preds.begin();
+	for (size_t p = static_cast<size_t>(first) + 1; p < block.preds.size(); ++p) {
+		if (block.preds[p] != pred) continue;
+		for (size_t i = 0; i < phi_count(block); ++i)
+			if (block.code[i].args[static_cast<size_t>(first)] != block.code[i].args[p]) return false;
+	}
+	return true;
+}
+
+bool simplify_cfg(IrFunction& function) {
+	auto& blocks = function.blocks;
+	bool any = false;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+
+		for (BlockId b = 0; b < blocks.size(); ++b) {
+			auto& terminator = blocks[b].terminator();
+			if (terminator.op == IrOp::Switch) {
+				// cases going where the else does anyway
+				const auto other = terminator.targets.back();
+				for (size_t i = terminator.cases.size(); i--;) {
+					if (terminator.targets[i] != other || !same_edges(blocks[other], b)) continue;
+					remove_pred(blocks[other], b);
+					terminator.cases.erase(terminator.cases.begin() + static_cast<std::ptrdiff_t>(i));
+					terminator.targets.erase(terminator.targets.begin() + static_cast<std::ptrdiff_t>(i));
+					changed = true;
+				}
+				if (terminator.cases.empty())
+					terminator = IrInstr { .op = IrOp::Jump, .targets = { other } };
+				continue;
+			}
+			if (terminator.op != IrOp::Branch || terminator.targets[0] != terminator.targets[1]) continue;
+			// both edges have to agree on the phis to become one
+			auto& target = blocks[terminator.targets[0]];
+			if (!same_edges(target, b)) continue;
+			remove_pred(target, b);
+			terminator = IrInstr { .op = IrOp::Jump, .targets = { terminator.targets[0] } };
+			changed = true;
+		}
+
+		std::vector<ValueId> replacements(function.next_value, no_value);
+		for (BlockId b = 1; b < blocks.size(); ++b) {
+			auto& block = blocks[b];
+			if (block.preds.size() != 1) continue;
+			const auto p = block.preds[0];
+			auto& pred = blocks[p];
+			if (p == b || pred.terminator().op != IrOp::Jump) continue;
+
+			// merge into the only pred, whose phis only have the one argument
+			const auto phis = phi_count(block);
+			for (size_t i = 0; i < phis; ++i)
+				replacements[block.code[i].result] = block.code[i].args[0];
+			pred.code.pop_back();
+			std::move(block.code.begin() + phis, block.code.end(), std::back_inserter(pred.code));
+			for (const auto succ : pred.successors())
+				std::replace(blocks[succ].preds.begin(), blocks[succ].preds.end(), b, p);
+			clear_block(block);
+			changed = true;
+		}
+		replace_values(function, replacements);
+
+		for (BlockId b = 1; b < blocks.size(); ++b) {
+			auto& block = blocks[b];
+			if (block.code.size() != 1 || block.terminator().op != IrOp::Jump || block.preds.empty()) continue;
+			const auto c = block.terminator().targets[0];
+			if (c == b) continue;
+			auto& target = blocks[c];
+			// a pred already going to the target would need two different phi arguments from one edge
+			const auto phis = phi_count(target);
+			if (phis) {
+				bool conflict = false;
+				for (size_t i = 0; i < block.preds.size(); ++i) {
+					const auto pred = block.preds[i];
+					conflict |= std::find(target.preds.begin(), target.preds.end(), pred) != target.preds.end();
+					conflict |= std::find(block.preds.begin() + i + 1, block.preds.end(), pred) != block.preds.end();
+				}
+				if (conflict) continue;
+			}
+
+			// send the preds straight to the target, with the values they would have passed through
+			const auto index = std::find(target.preds.begin(), target.preds.end(), b) - target.preds.begin();
+			target.preds[index] = block.preds[0];
+			for (size_t i = 1; i < block.preds.size(); ++i) {
+				target.preds.push_back(block.preds[i]);
+				for (size_t j = 0; j < phis; ++j)
+					target.code[j].args.push_back(target.code[j].args[index]);
+			}
+			for (const auto pred : block.preds)
+				for (auto& t : blocks[pred].terminator().targets)
+					if (t == b) t = c;
+			clear_block(block);
+			changed = true;
+		}
+
+		changed |= remove_unreachable_blocks(function);
+		any |= changed;
+	}
+	return any;
+}
+
+static void run_passes(IrFunction& function, int level) {
+	// later passes open up more chances for the earlier ones, but it settles quickly
+	const int rounds = level >= 2 ? 4 : 1;
+	for (int i = 0; i < rounds; ++i) {
+		bool changed = propagate_constants(function);
+		if (level >= 2)
+			changed |= number_values(function);
+		changed |= eliminate_dead_code(function);
+		changed |= simplify_cfg(function);
+		if (!changed) break;
+	}
+}
+
+void optimize(IrFunction& function, int level, int unroll_factor, int vector_lanes) {
+	if (level <= 0) return;
+	run_passes(function, level);
+	// the loops are easier to see through once the rest is cleaned up, and leave plenty behind
+	if (level >= 2 && optimize_loops(function))
+		run_passes(function, level);
+	// hoisted checks can be left with constants that are always in bounds, which the next go removes
+	while (eliminate_bounds_checks(function))
+		run_passes(function, level);
+	if (level >= 2 && vectorize_loops(function, vector_lanes))
+		run_passes(function, level);
+	// unrolled copies of the body fold a lot, with the induction variables being constants in them
+	if (level >= 2 && unroll_loops(function, unroll_factor))
+		run_passes(function, level);
+}
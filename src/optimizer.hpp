@@ -0,0 +1,23 @@
+#pragma once
+#include "ir.hpp"
+
+// Sparse conditional constant propagation (Wegman and Zadeck): finds the values that are
+// constant along the paths that can actually run, folding them and the branches on them.
+bool propagate_constants(IrFunction& function);
+// Dominator based global value numbering: an expression already computed in a dominating
+// block is reused, along with some algebraic identities like x + 0. loads of an element that was
+// just stored or loaded, with nothing else stored to the array in between, reuse that value. writes
+// through pointers and calls count as stores to every array that's been sliced, unless the pointer is
+// the array's own, which makes them plain loads and stores.
+bool number_values(IrFunction& function);
+// Removes instructions whose results never reach a side effect or a return, and stores to arrays
+// that never get read.
+bool eliminate_dead_code(IrFunction& function);
+// Folds branches with both sides the same, merges blocks into their only pred, skips over
+// blocks that only jump somewhere else, and drops unreachable ones.
+bool simplify_cfg(IrFunction& function);
+
+// runs the passes for an optimization level. 0 leaves the function alone,
+// 1 propagates constants, removes bounds checks and cleans up, 2 adds value numbering, iterates, and
+// optimizes, vectorizes and unrolls loops
+void optimize(IrFunction& function, int level, int unroll_factor, int vector_lanes);
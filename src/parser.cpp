@@ -11,7 +11,7 @@ void Parser::error_at_token(const Token& token, const std::string_view& msg) con
 	if (!m_file_name.empty())
 		print_file_span(m_file_name, token.span);
 	print('\n');
-	std::exit(1);
+	throw CompileError {};
 }
 
 Token& Parser::expect_token_type(Token& token, TokenType type, const std::string_view& msg) const {
@@ -24,32 +24,84 @@ void Parser::parse() {
 	while (m_tokens.size()) {
 		auto& token = m_tokens.get();
 		if (token.type == TokenType::Keyword && token.data == "fn") {
-			auto& function = m_functions.emplace_back();
-			function.name = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected function name").data;
-			expect_token_type(m_tokens.get(), TokenType::LeftParen, "Expected function args");
+			m_functions.push_back(parse_function());
+		} else if (token.type == TokenType::Keyword && token.data == "extern") {
+			if (m_tokens.get() != Token(TokenType::Keyword, "fn"))
+				error_at_token(m_tokens.prev(), "Expected fn after extern");
+			m_functions.push_back(parse_function(true));
+		} else if (token.type == TokenType::Keyword && token.data == "const") {
+			if (m_tokens.get() != Token(TokenType::Keyword, "fn"))
+				error_at_token(m_tokens.prev(), "Expected fn after const");
+			m_functions.push_back(parse_function());
+			m_functions.back().constant = true;
+		} else if (token.type == TokenType::Keyword && token.data == "struct") {
+			m_structs.push_back(parse_struct(StructLayout::Reordered));
+		} else if (token.type == TokenType::Identifier && (token.data == "packed" || token.data == "ordered")
+			&& m_tokens.peek() == Token(TokenType::Keyword, "struct")) {
+			m_tokens.get();
+			m_structs.push_back(parse_struct(token.data == "packed" ? StructLayout::Packed : StructLayout::Ordered));
+		} else {
+			error_at_token(token, "Unexpected token in global scope");
+		}
+	}
+}
 
-			parse_comma_list([&] {
-				function.arguments.push_back(parse_var_decl());
-			});
+Function Parser::parse_function(bool external) {
+	Function function { .external = external };
+	const auto& name = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected function name");
+	function.name = name.data;
+	function.span = name.span;
+	expect_token_type(m_tokens.get(), TokenType::LeftParen, "Expected function args");
 
-			if (m_tokens.peek().type == TokenType::TypeIndicator) {
-				m_tokens.get();
-				function.return_type = parse_type();
-				// expect_token_type(m_tokens.get(), TokenType::LeftBracket, "Expected bracket");
-			} else if (m_tokens.peek().type == TokenType::LeftBracket) {
-				m_tokens.get();
-				function.return_type = Type { "void" };
-			} else {
-				expect_token_type(m_tokens.peek(), TokenType::LeftBracket, "Expected bracket or type indicator");
-			}
+	parse_comma_list([&] {
+		function.arguments.push_back(parse_var_decl());
+		if (function.arguments.back().type.is_array())
+			error_at_token(m_tokens.prev(), "Arrays can't be passed to functions, take a slice instead");
+	});
 
-			m_cur_function = &function;
-			parse_block(function.statements);
-			m_cur_function = nullptr;
-		} else {
-			assert(false, "Unimplemented token outside in global scope");
-		}
+	if (m_tokens.peek().type == TokenType::TypeIndicator) {
+		m_tokens.get();
+		function.return_type = parse_type();
+		// slices could point into the frame that's going away
+		if (function.return_type.is_array() || function.return_type.is_slice())
+			error_at_token(m_tokens.prev(), "Arrays and slices can't be returned from functions");
+		// expect_token_type(m_tokens.get(), TokenType::LeftBracket, "Expected bracket");
+	} else if (external) {
+		function.return_type = Type { "void" };
+	} else if (m_tokens.peek().type == TokenType::LeftBracket) {
+		m_tokens.get();
+		function.return_type = Type { "void" };
+	} else {
+		expect_token_type(m_tokens.peek(), TokenType::LeftBracket, "Expected bracket or type indicator");
+	}
+
+	if (external) {
+		expect_token_type(m_tokens.get(), TokenType::Semicolon, "Expected semicolon");
+		return function;
+	}
+
+	m_cur_function = &function;
+	parse_block(function.statements);
+	m_cur_function = nullptr;
+	return function;
+}
+
+Struct Parser::parse_struct(StructLayout layout) {
+	Struct result { .layout = layout };
+	const auto& name = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected struct name");
+	result.name = name.data;
+	result.span = name.span;
+	expect_token_type(m_tokens.get(), TokenType::LeftBracket, "Expected left bracket");
+	// fields are separated by commas, which can also come after the last one
+	while (m_tokens.peek().type != TokenType::RightBracket) {
+		result.fields.push_back(parse_var_decl());
+		if (result.fields.back().type.is_array() || result.fields.back().type.is_slice())
+			error_at_token(m_tokens.prev(), "Struct fields can't be arrays or slices");
+		if (m_tokens.peek().type != TokenType::Comma) break;
+		m_tokens.get();
 	}
+	expect_token_type(m_tokens.get(), TokenType::RightBracket, "Expected right bracket");
+	return result;
 }
 
 void Parser::parse_block(std::vector<Statement>& statements) {
@@ -58,7 +110,8 @@ void Parser::parse_block(std::vector<Statement>& statements) {
 		statements.push_back(parse_statement());
 		const auto& stmt = statements.back();
 		// TODO: uhh not this
-		if (stmt.type != StatementType::If && stmt.type != StatementType::While)
+		if (stmt.type != StatementType::If && stmt.type != StatementType::While && stmt.type != StatementType::For
+			&& stmt.type != StatementType::Match)
 			expect_token_type(m_tokens.get(), TokenType::Semicolon, "Expected semicolon");
 	}
 	m_tokens.get(); // should be right bracket
@@ -66,6 +119,30 @@ void Parser::parse_block(std::vector<Statement>& statements) {
 
 Type Parser::parse_type() {
 	// TODO: fancier types
+	if (m_tokens.peek().type == TokenType::LeftSquare) {
+		// arrays are [element; length], slices [element]
+		m_tokens.get();
+		const auto& element = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected element type");
+		if (element.data != "i32")
+			error_at_token(element, "Only i32 arrays are supported");
+		if (m_tokens.peek().type == TokenType::RightSquare) {
+			m_tokens.get();
+			return Type { .name = element.data, .slice = true };
+		}
+		expect_token_type(m_tokens.get(), TokenType::Semicolon, "Expected ;");
+		const auto& length = expect_token_type(m_tokens.get(), TokenType::Number, "Expected array length");
+		// big enough for anything reasonable, and well within the stack
+		const auto value = length.data.size() > 8 ? INT64_MAX : std::stoll(length.data);
+		if (value == 0 || value > static_cast<int64_t>(max_array_length))
+			error_at_token(length, format("Array length has to be between 1 and {}", max_array_length));
+		expect_token_type(m_tokens.get(), TokenType::RightSquare, "Expected ]");
+		return Type { .name = element.data, .length = static_cast<size_t>(value) };
+	}
+	if (m_tokens.peek().type == TokenType::Operator && m_tokens.peek().data == "*") {
+		m_tokens.get();
+		const auto& pointee = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected the type pointed to");
+		return Type { .name = pointee.data, .pointer = true };
+	}
 	const auto token = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected type");
 	return Type { token.data };
 }
@@ -93,6 +170,8 @@ Statement Parser::parse_statement() {
 		return stmt;
 	} else if (first.type == TokenType::Keyword && first.data == "if") {
 		return parse_if();
+	} else if (first.type == TokenType::Keyword && first.data == "match") {
+		return parse_match();
 	} else if (first.type == TokenType::Keyword && first.data == "while") {
 		m_tokens.get();
 		Statement stmt { StatementType::While };
@@ -100,6 +179,22 @@ Statement Parser::parse_statement() {
 		stmt.expressions.push_back(parse_expression());
 		parse_block(stmt.children);
 		return stmt;
+	} else if (first.type == TokenType::Keyword && first.data == "for") {
+		m_tokens.get();
+		Statement stmt { StatementType::For };
+		stmt.span = first.span;
+		const auto& name = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected loop variable name");
+		Expression declaration(ExpressionType::Declaration,
+			Expression::DeclarationData { Variable { Type { "i32" }, name.data } }, {});
+		declaration.span = name.span;
+		stmt.expressions.push_back(std::move(declaration));
+		if (m_tokens.get() != Token(TokenType::Keyword, "in"))
+			error_at_token(m_tokens.prev(), "Expected in");
+		stmt.expressions.push_back(parse_expression());
+		expect_token_type(m_tokens.get(), TokenType::Range, "Expected ..");
+		stmt.expressions.push_back(parse_expression());
+		parse_block(stmt.children);
+		return stmt;
 	} else {
 		const auto exp = parse_expression();
 		return Statement {
@@ -132,16 +227,69 @@ Statement Parser::parse_if() {
 	return stmt;
 }
 
+Statement Parser::parse_match() {
+	const auto& token = m_tokens.get();
+	Statement stmt { StatementType::Match };
+	stmt.span = token.span;
+	stmt.expressions.push_back(parse_expression());
+	expect_token_type(m_tokens.get(), TokenType::LeftBracket, "Expected left bracket");
+	while (m_tokens.peek().type != TokenType::RightBracket) {
+		Statement arm { StatementType::Case };
+		arm.span = m_tokens.peek().span;
+		if (m_tokens.peek() == Token(TokenType::Keyword, "else")) {
+			m_tokens.get();
+		} else {
+			arm.expressions.push_back(parse_case_value());
+			while (m_tokens.peek().type == TokenType::Comma) {
+				m_tokens.get();
+				arm.expressions.push_back(parse_case_value());
+			}
+		}
+		expect_token_type(m_tokens.get(), TokenType::Arrow, "Expected =>");
+		parse_block(arm.children);
+		stmt.children.push_back(std::move(arm));
+	}
+	m_tokens.get(); // right bracket
+	return stmt;
+}
+
+Expression Parser::parse_case_value() {
+	auto& first = m_tokens.get();
+	Expression exp(ExpressionType::Literal);
+	exp.span = first.span;
+	if (first.type == TokenType::Keyword && (first.data == "true" || first.data == "false")) {
+		exp.data = Expression::LiteralData { first.data == "true" };
+		return exp;
+	}
+	const bool negative = first == Token(TokenType::Operator, "-");
+	auto& number = negative ? m_tokens.get() : first;
+	expect_token_type(number, TokenType::Number, "Expected a number, true or false");
+	// the digits alone can be one past the largest i32 when negated
+	auto value = number.data.size() > 10 ? INT64_MAX : std::stoll(number.data);
+	if (negative) value = -value;
+	if (value < INT32_MIN || value > INT32_MAX)
+		error_at_token(number, "Case value doesn't fit in an i32");
+	exp.data = Expression::LiteralData { static_cast<int>(value) };
+	return exp;
+}
+
 OperatorType op_type_from_token(const Token& token) {
 	assert(token.type == TokenType::Operator, "token should be an operator");
 	if (token.data == "+") return OperatorType::Addition;
 	if (token.data == "-") return OperatorType::Subtraction;
 	if (token.data == "*") return OperatorType::Multiplication;
 	if (token.data == "/") return OperatorType::Division;
+	if (token.data == "%") return OperatorType::Modulo;
 	if (token.data == "!") return OperatorType::Not;
 	if (token.data == "~") return OperatorType::Bitflip;
 	if (token.data == "==") return OperatorType::Equals;
 	if (token.data == "!=") return OperatorType::NotEquals;
+	if (token.data == "<") return OperatorType::Less;
+	if (token.data == "<=") return OperatorType::LessEquals;
+	if (token.data == ">") return OperatorType::Greater;
+	if (token.data == ">=") return OperatorType::GreaterEquals;
+	if (token.data == "&&") return OperatorType::And;
+	if (token.data == "||") return OperatorType::Or;
 	return {};
 }
 
@@ -163,11 +311,26 @@ Expression Parser::parse_exp_primary() {
 			parse_comma_list([&] {
 				exp.children.push_back(parse_expression());
 			});
-			return exp;
+			return parse_fields(std::move(exp));
 		} else {
 			Expression exp(ExpressionType::Variable);
 			exp.data = Expression::VariableData { token.data };
-			return exp;
+			exp.span = token.span;
+			if (m_tokens.peek().type != TokenType::LeftSquare)
+				return parse_fields(std::move(exp));
+			m_tokens.get();
+			Expression index(ExpressionType::Index);
+			index.span = token.span;
+			index.children.push_back(std::move(exp));
+			index.children.push_back(parse_expression());
+			// a[start..end] is a slice of it instead
+			if (m_tokens.peek().type == TokenType::Range) {
+				m_tokens.get();
+				index.type = ExpressionType::Slice;
+				index.children.push_back(parse_expression());
+			}
+			expect_token_type(m_tokens.get(), TokenType::RightSquare, "Expected ]");
+			return index;
 		}
 	} else if (token.type == TokenType::LeftParen) {
 		auto exp = parse_expression();
@@ -186,13 +349,17 @@ Expression Parser::parse_exp_primary() {
 		exp.data = Expression::OperatorData { type };
 		exp.children.push_back(parse_exp_primary());
 		return exp;
-	} else if (token.type == TokenType::Keyword && token.data == "let") {
+	} else if (token.type == TokenType::Keyword && (token.data == "let" || token.data == "const")) {
 		const auto var = parse_var_decl();
 		return Expression {
 			ExpressionType::Declaration,
-			Expression::DeclarationData { var },
+			Expression::DeclarationData { var, token.data == "const" },
 			{}
 		};
+	} else if (token.type == TokenType::Keyword && token.data == "asm") {
+		auto exp = parse_asm();
+		exp.span = token.span;
+		return exp;
 	} else if (token.type == TokenType::Keyword && (token.data == "true" || token.data == "false")) {
 		return Expression {
 			ExpressionType::Literal,
@@ -205,18 +372,69 @@ Expression Parser::parse_exp_primary() {
 	std::abort();
 }
 
+Expression Parser::parse_fields(Expression exp) {
+	while (m_tokens.peek().type == TokenType::Dot) {
+		m_tokens.get();
+		const auto& name = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected field name");
+		Expression field(ExpressionType::Field);
+		field.data = Expression::FieldData { name.data };
+		field.span = name.span;
+		field.children.push_back(std::move(exp));
+		exp = std::move(field);
+	}
+	return exp;
+}
+
+Expression Parser::parse_asm() {
+	Expression exp(ExpressionType::Asm);
+	Expression::AsmData data;
+	if (m_tokens.peek().type == TokenType::LeftParen) {
+		m_tokens.get();
+		parse_comma_list([&] {
+			data.inputs.push_back(expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected register").data);
+			expect_token_type(m_tokens.get(), TokenType::Assign, "Expected =");
+			// above assignments, since the = is already taken
+			exp.children.push_back(parse_exp_inner(1));
+		});
+	}
+	if (m_tokens.peek().type == TokenType::TypeIndicator) {
+		m_tokens.get();
+		data.output = expect_token_type(m_tokens.get(), TokenType::Identifier, "Expected register").data;
+	}
+	expect_token_type(m_tokens.get(), TokenType::LeftBracket, "Expected left bracket");
+	while (m_tokens.peek().type != TokenType::RightBracket) {
+		const auto& text = expect_token_type(m_tokens.get(), TokenType::String, "Expected instruction string").data;
+		for (size_t start = 0; start <= text.size();) {
+			const auto end = std::min(text.find(';', start), text.size());
+			const auto line = text.substr(start, end - start);
+			if (line.find_first_not_of(" \t") != std::string::npos)
+				data.lines.push_back(line);
+			start = end + 1;
+		}
+	}
+	m_tokens.get();
+	exp.data = std::move(data);
+	return exp;
+}
+
 // not very elegant but oh well
-static constexpr int max_precedence = 3;
+static constexpr int max_precedence = 6;
 int precedence_for_token(const Token& token) {
 	if (token.type == TokenType::Assign) {
 		return 0;
 	} else if (token.type == TokenType::Operator) {
-		if (token.data == "==" || token.data == "!=")
+		if (token.data == "||")
 			return 1;
-		if (token.data == "+" || token.data == "-")
+		if (token.data == "&&")
 			return 2;
-		if (token.data == "*" || token.data == "/")
+		if (token.data == "==" || token.data == "!=")
 			return 3;
+		if (token.data == "<" || token.data == "<=" || token.data == ">" || token.data == ">=")
+			return 4;
+		if (token.data == "+" || token.data == "-")
+			return 5;
+		if (token.data == "*" || token.data == "/" || token.data == "%")
+			return 6;
 	}
 	return 999;
 }
@@ -226,23 +444,22 @@ Expression Parser::parse_exp_inner(int prio) {
 	const auto span = m_tokens.peek().span;
 	auto part = parse_exp_inner(prio + 1);
 	part.span = span;
-	const auto& next = m_tokens.peek();
-	if (precedence_for_token(next) == prio) {
-		m_tokens.get();
+	// operators go left to right, a - b - c is (a - b) - c. assignment goes the other way
+	while (precedence_for_token(m_tokens.peek()) == prio) {
+		const auto& next = m_tokens.get();
 		Expression exp(ExpressionType::Operator);
 		exp.span = next.span;
-		exp.children.push_back(part);
+		exp.children.push_back(std::move(part));
 		if (next.type == TokenType::Assign) {
 			exp.type = ExpressionType::Assignment;
 			exp.children.push_back(parse_exp_inner(prio));
-		} else if (next.type == TokenType::Operator) {
-			exp.data = Expression::OperatorData { op_type_from_token(next) };
-			exp.children.push_back(parse_exp_inner(prio));
+			return exp;
 		}
-		return exp;
-	} else {
-		return part;
+		exp.data = Expression::OperatorData { op_type_from_token(next) };
+		exp.children.push_back(parse_exp_inner(prio + 1));
+		part = std::move(exp);
 	}
+	return part;
 }
 
 Expression Parser::parse_expression() {
@@ -11,6 +11,12 @@ struct Type {
 	// TODO: enum for built in types, etc
 	std::string name;
 	bool reference = false;
+	// an array of `length` name elements when it's not 0
+	size_t length = 0;
+	// a pointer and length to name elements somewhere else
+	bool slice = false;
+	// points to a name struct on the heap, or nothing when it's null
+	bool pointer = false;
 
 	bool operator==(const Type&) const = default;
 	Type add_reference() const {
@@ -24,12 +30,23 @@ struct Type {
 		return result;
 	}
 	bool unref_eq(const Type& other) const {
-		return name == other.name;
+		return name == other.name && length == other.length && slice == other.slice && pointer == other.pointer;
 	}
+	bool is_array() const { return length != 0; }
+	bool is_slice() const { return slice; }
+	bool is_pointer() const { return pointer; }
+	Type element() const { return Type { name }; }
 };
 
 inline auto& operator<<(std::ostream& stream, const Type& type) {
-	stream << type.name;
+	if (type.is_array())
+		stream << '[' << type.name << "; " << type.length << ']';
+	else if (type.is_slice())
+		stream << '[' << type.name << ']';
+	else if (type.is_pointer())
+		stream << '*' << type.name;
+	else
+		stream << type.name;
 	if (type.reference) stream << '&';
 	return stream;
 }
@@ -47,6 +64,12 @@ enum class ExpressionType {
 	Operator,
 	Call,
 	Cast,
+	Index, // children are the array or slice and the index
+	// children are the array or slice, then the start and end of the range. only the first when it's
+	// all of it, which is how arrays turn into slices
+	Slice,
+	Field, // children are the struct
+	Asm,   // children are the inputs
 };
 
 enum class OperatorType {
@@ -59,10 +82,28 @@ enum class OperatorType {
 	Subtraction,
 	Multiplication,
 	Division,
+	Modulo,
 	Equals,
 	NotEquals,
+	// signed
+	Less,
+	LessEquals,
+	Greater,
+	GreaterEquals,
+	// short circuiting, on bools
+	And,
+	Or,
 };
 
+inline bool is_operator_comparison(const OperatorType type) {
+	return type == OperatorType::Equals || type == OperatorType::NotEquals || type == OperatorType::Less
+		|| type == OperatorType::LessEquals || type == OperatorType::Greater || type == OperatorType::GreaterEquals;
+}
+
+inline bool is_operator_logical(const OperatorType type) {
+	return type == OperatorType::And || type == OperatorType::Or;
+}
+
 inline bool is_operator_binary(const OperatorType type) {
 	return !(type == OperatorType::Negation || type == OperatorType::Not || type == OperatorType::Bitflip);
 }
@@ -76,6 +117,8 @@ struct Expression {
 	// TODO: consider dynamic polymorphism instead of this
 	struct DeclarationData {
 		Variable var;
+		// declared with const, so it can't be assigned to again and its value has to be known while compiling
+		bool constant = false;
 	};
 	struct VariableData {
 		std::string name;
@@ -90,7 +133,20 @@ struct Expression {
 		// TODO: have the function name be an expression?
 		std::string function_name;
 	};
-	std::variant<std::monostate, DeclarationData, VariableData, LiteralData, OperatorData, CallData> data;
+	struct FieldData {
+		std::string name;
+		// where it is in the struct's fields, filled in by the checker
+		size_t index = 0;
+	};
+	struct AsmData {
+		// the registers the children go into, lined up with them
+		std::vector<std::string> inputs;
+		// the register the result comes out of, empty when there isn't one
+		std::string output;
+		// an instruction or label each
+		std::vector<std::string> lines;
+	};
+	std::variant<std::monostate, DeclarationData, VariableData, LiteralData, OperatorData, CallData, FieldData, AsmData> data;
 	Span span;
 	// TODO: better name, and maybe a better default
 	// exp_type, result_type, IDK
@@ -109,6 +165,10 @@ struct Expression {
 				return ov(MatchValue<ExpressionType::Assignment>{});
 			} else if (type == ExpressionType::Cast) {
 				return ov(MatchValue<ExpressionType::Cast>{});
+			} else if (type == ExpressionType::Index) {
+				return ov(MatchValue<ExpressionType::Index>{});
+			} else if (type == ExpressionType::Slice) {
+				return ov(MatchValue<ExpressionType::Slice>{});
 			} else {
 				assert(false, "Missing data on Expression");
 				std::exit(1);
@@ -124,7 +184,10 @@ enum class StatementType {
 	Return,     // statement returns an expression
 	If,
 	While,
+	For,   // expressions are the loop variable's declaration, then the start and end of the range
 	Else,
+	Match, // children are the cases, expressions[0] is what gets matched
+	Case,  // expressions are the values it matches, none for the else case
 };
 
 struct Statement {
@@ -138,6 +201,28 @@ struct Statement {
 
 struct Function;
 
+enum class StructLayout : uint8_t {
+	// fields get reordered to leave as little padding as possible
+	Reordered,
+	// fields stay in order, and nothing gets aligned
+	Packed,
+	// fields stay in order, aligned like c does
+	Ordered,
+};
+
+struct Struct {
+	std::string name;
+	std::vector<Variable> fields;
+	StructLayout layout = StructLayout::Reordered;
+	Span span;
+	// filled in by the checker. byte offset of every field, lined up with fields
+	std::vector<size_t> offsets;
+	size_t size = 0;
+	size_t align = 1;
+	// has pointers in it, nested structs included
+	bool pointers = false;
+};
+
 struct Scope {
 	std::vector<Variable> variables;
 };
@@ -149,12 +234,28 @@ struct Function {
 	Scope scope;
 	std::vector<Statement> statements;
 	bool builtin = false;
+	// declared with extern fn, so it has no body and lives in whatever gets linked in, called the
+	// way c functions are
+	bool external = false;
+	// declared with const fn, so calls with constant arguments get run while compiling. it can only
+	// call other const fns and take and return i32s and bools
+	bool constant = false;
+	// where the name is
+	Span span;
 };
 
+// 4MB of i32s
+static constexpr size_t max_array_length = 1 << 20;
+// 64MB of i32s, the longest slice alloc can make
+static constexpr size_t max_alloc_length = 1 << 24;
+// bytes of output print holds on to before writing them out
+static constexpr size_t print_buffer_size = 4096;
+
 class Parser {
 public:
 	Scope m_global_scope;
 	std::vector<Function> m_functions;
+	std::vector<Struct> m_structs;
 	std::string m_file_name;
 	ArrayStream<Token> m_tokens;
 	Function* m_cur_function = nullptr;
@@ -162,9 +263,16 @@ public:
 	// Parser() {}
 	Parser(const std::string_view& file_name, ArrayStream<Token> tokens);
 
+	// parses a function after its `fn` keyword, or just the signature of an extern one
+	Function parse_function(bool external = false);
+	// parses a struct after its `struct` keyword
+	Struct parse_struct(StructLayout layout);
 	Variable parse_var_decl();
 	Statement parse_statement();
 	Statement parse_if();
+	Statement parse_match();
+	// a literal a match case compares against
+	Expression parse_case_value();
 
 	void parse_block(std::vector<Statement>&);
 
@@ -173,6 +281,11 @@ public:
 	Expression parse_expression();
 	Expression parse_exp_inner(int prio);
 	Expression parse_exp_primary();
+	// wraps exp in the field accesses after it, like .a.b
+	Expression parse_fields(Expression exp);
+	// parses an asm block after its `asm` keyword: asm(eax = x, ecx = n): eax { "add eax, ecx" }, with the
+	// inputs and output both optional. a string can have several instructions separated by ;
+	Expression parse_asm();
 
 	[[noreturn]] void error_at_token(const Token& token, const std::string_view& msg) const;
 	Token& expect_token_type(Token& token, TokenType type, const std::string_view& msg) const;
@@ -210,4 +323,9 @@ public:
 		}
 		std::abort();
 	}
+
+	const Struct* find_struct(const std::string& name) const {
+		const auto it = std::find_if(m_structs.begin(), m_structs.end(), [&](const auto& s) { return s.name == name; });
+		return it != m_structs.end() ? &*it : nullptr;
+	}
 };
\ No newline at end of file
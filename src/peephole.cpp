@@ -0,0 +1,384 @@
+#include "peephole.hpp"
+#include "utils.hpp"
+#include <unordered_map>
+
+// only physical registers are left by now, so a bit per register does
+using RegSet = uint32_t;
+
+static RegSet reg_bit(RegId reg) {
+	return reg < first_virtual_reg ? RegSet(1) << reg : 0;
+}
+
+static RegSet uses_of(const Instr& instr) {
+	std::vector<RegId> regs;
+	instr_uses(instr, regs);
+	RegSet set = 0;
+	for (const auto reg : regs) set |= reg_bit(reg);
+	return set;
+}
+
+static RegSet defs_of(const Instr& instr) {
+	std::vector<RegId> regs;
+	instr_defs(instr, regs);
+	RegSet set = 0;
+	for (const auto reg : regs) set |= reg_bit(reg);
+	return set;
+}
+
+// registers live right after each instruction
+static std::vector<RegSet> compute_liveness(const std::vector<Instr>& code) {
+	const auto blocks = build_blocks(code);
+	std::vector<RegSet> live_in(blocks.size());
+	std::vector<RegSet> live_after(code.size());
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t b = blocks.size(); b--;) {
+			RegSet live = 0;
+			for (const auto successor : blocks[b].successors)
+				live |= live_in[successor];
+			for (size_t i = blocks[b].last + 1; i-- > blocks[b].first;) {
+				live_after[i] = live;
+				live = (live & ~defs_of(code[i])) | uses_of(code[i]);
+			}
+			if (live != live_in[b]) {
+				live_in[b] = live;
+				changed = true;
+			}
+		}
+	}
+	return live_after;
+}
+
+static bool reads_flags(const Instr& instr) {
+	return instr.op == Op::Jcc || instr.op == Op::Setcc || instr.op == Op::Cmov;
+}
+
+static bool writes_flags(const Instr& instr) {
+	switch (instr.op) {
+		case Op::Add:
+		case Op::Sub:
+		case Op::Imul:
+		case Op::Neg:
+		case Op::And:
+		case Op::Or:
+		case Op::Xor:
+		case Op::Cmp:
+		case Op::Test:
+		case Op::Bt:
+		case Op::Idiv:
+		case Op::Popcnt:
+		case Op::Lzcnt:
+		case Op::Tzcnt:
+		case Op::Bsr:
+		case Op::Bsf:
+			return true;
+		// shifting by a cl of 0 leaves them alone
+		case Op::Shl:
+		case Op::Shr:
+		case Op::Sar:
+			return !instr.operands[1].is_reg();
+		// rol, ror, inc and dec leave some of them alone, so whatever was there before can still be read
+		default:
+			return false;
+	}
+}
+
+// whether the flags set at i are read by instructions matching `reader`, until something else sets them.
+// the compiler never reads flags across a label, call or jump
+template <class F>
+static bool flag_readers_all(const std::vector<Instr>& code, const std::vector<bool>& removed, size_t i, F&& reader) {
+	for (size_t j = i + 1; j < code.size(); ++j) {
+		if (removed[j]) continue;
+		const auto& instr = code[j];
+		if (reads_flags(instr) && !reader(instr)) return false;
+		if (writes_flags(instr)) return true;
+		if (instr.op == Op::Label || instr.op == Op::Call || instr.op == Op::Ret || instr.op == Op::Jmp) return true;
+	}
+	return true;
+}
+
+static bool is_pointer_reg(RegId reg) {
+	return reg == reg_id(Reg::Sp) || reg == reg_id(Reg::Bp);
+}
+
+static bool mentions(const Operand& operand, RegId reg) {
+	return (operand.is_reg() || operand.is_mem()) && (operand.reg == reg || operand.index == reg);
+}
+
+// whether the constant in a register can be used as an immediate in operand `index` instead
+static bool takes_immediate(const Instr& instr, size_t index) {
+	switch (instr.op) {
+		case Op::Mov:
+		case Op::Add:
+		case Op::Sub:
+		case Op::And:
+		case Op::Or:
+		case Op::Xor:
+		case Op::Cmp:
+		case Op::Test:
+			return index == 1 && instr.operands.size() == 2;
+		case Op::Imul:
+			// becomes the three operand form
+			return index == 1 && instr.operands.size() == 2 && instr.operands[0].is_reg();
+		case Op::Push:
+			return index == 0;
+		default:
+			return false;
+	}
+}
+
+static void remove_marked(std::vector<Instr>& code, const std::vector<bool>& removed) {
+	size_t i = 0;
+	std::erase_if(code, [&](const Instr&) { return removed[i++]; });
+}
+
+static bool rewrite_instructions(std::vector<Instr>& code) {
+	const auto live_after = compute_liveness(code);
+	std::vector<bool> removed(code.size());
+	bool changed = false;
+	const auto remove = [&](size_t i) {
+		removed[i] = true;
+		changed = true;
+	};
+	const auto next = [&](size_t i) {
+		do ++i; while (i < code.size() && removed[i]);
+		return i;
+	};
+	const auto dead_after = [&](RegId reg, size_t i) { return !(live_after[i] & reg_bit(reg)); };
+
+	for (size_t i = 0; i < code.size(); ++i) {
+		if (removed[i] || code[i].verbatim) continue;
+		auto& instr = code[i];
+		auto& ops = instr.operands;
+		const auto n = next(i);
+		const bool has_next = n < code.size();
+
+		// mov r, r
+		if (instr.op == Op::Mov && ops[0].is_reg() && ops[0] == ops[1]) {
+			remove(i);
+			continue;
+		}
+
+		// results nobody reads
+		if (!ops.empty() && ops[0].is_reg() && !is_pointer_reg(ops[0].reg) && dead_after(ops[0].reg, i) && instr.implicit_defs.empty()) {
+			const bool pure = instr.op == Op::Mov || instr.op == Op::Movzx || instr.op == Op::Lea || instr.op == Op::Setcc
+				|| instr.op == Op::Not;
+			const bool arithmetic = instr.op == Op::Add || instr.op == Op::Sub || instr.op == Op::And || instr.op == Op::Or
+				|| instr.op == Op::Xor || instr.op == Op::Neg || instr.op == Op::Shl || instr.op == Op::Shr || instr.op == Op::Sar
+				|| (instr.op == Op::Imul && ops.size() > 1);
+			if (pure || (arithmetic && flag_readers_all(code, removed, i, [](const Instr&) { return false; }))) {
+				remove(i);
+				continue;
+			}
+		}
+
+		// mov r, imm; ...; op x, r -> op x, imm
+		if (instr.op == Op::Mov && ops[0].is_reg() && ops[1].is_imm() && !is_pointer_reg(ops[0].reg)) {
+			const auto reg = ops[0].reg;
+			size_t j = n;
+			for (; j < code.size(); j = next(j)) {
+				const auto& other = code[j];
+				if (other.op == Op::Label || other.op == Op::Call || other.op == Op::Ret || is_terminator(other) || other.op == Op::Jcc) {
+					j = code.size();
+					break;
+				}
+				if ((uses_of(other) | defs_of(other)) & reg_bit(reg)) break;
+			}
+			if (j < code.size() && dead_after(reg, j)) {
+				auto& user = code[j];
+				const auto it = std::find_if(user.operands.begin(), user.operands.end(), [&](const auto& operand) { return mentions(operand, reg); });
+				const auto index = static_cast<size_t>(it - user.operands.begin());
+				const bool only_once = std::count_if(user.operands.begin(), user.operands.end(),
+					[&](const auto& operand) { return mentions(operand, reg); }) == 1;
+				const auto implicit = std::find(user.implicit_uses.begin(), user.implicit_uses.end(), reg) != user.implicit_uses.end();
+				if (!user.verbatim && it != user.operands.end() && it->is_reg() && only_once && !implicit && takes_immediate(user, index)
+					&& (user.op == Op::Push || it->size == ops[0].size)
+					&& !(user.op == Op::Mov && user.operands[0].is_mem() && it->size == 8)) {
+					auto value = ops[1];
+					value.size = it->size;
+					if (user.op == Op::Imul)
+						user.operands = { user.operands[0], user.operands[0], value };
+					else
+						*it = value;
+					remove(i);
+					continue;
+				}
+			}
+		}
+
+		// mov r, x; mov y, r -> mov y, x
+		if (instr.op == Op::Mov && ops[0].is_reg() && !is_pointer_reg(ops[0].reg) && has_next) {
+			auto& copy = code[n];
+			const auto reg = ops[0].reg;
+			if (copy.op == Op::Mov && !copy.verbatim && copy.operands[1].is_reg(reg) && copy.operands[1].size == ops[0].size
+				&& !mentions(copy.operands[0], reg) && dead_after(reg, n)
+				&& !(copy.operands[0].is_mem() && ops[1].is_mem()) && !mentions(ops[1], reg)) {
+				copy.operands[1] = ops[1];
+				if (!copy.operands[1].is_mem()) copy.operands[1].size = copy.operands[0].size;
+				remove(i);
+				continue;
+			}
+		}
+
+		// setcc r8; movzx r, r8; test r, r; je/jne -> jcc
+		if (instr.op == Op::Setcc && ops[0].is_reg() && has_next) {
+			const auto movzx = n;
+			const auto test = next(movzx);
+			const auto jump = next(test);
+			if (jump < code.size() && code[movzx].op == Op::Movzx && code[movzx].operands[1].is_reg(ops[0].reg)
+				&& code[test].op == Op::Test && code[test].operands[0].is_reg(code[movzx].operands[0].reg)
+				&& code[test].operands[1].is_reg(code[movzx].operands[0].reg)
+				&& code[jump].op == Op::Jcc && (code[jump].cond == Cond::E || code[jump].cond == Cond::Ne)
+				&& !code[movzx].verbatim && !code[test].verbatim && !code[jump].verbatim
+				&& dead_after(code[movzx].operands[0].reg, jump)) {
+				code[jump].cond = code[jump].cond == Cond::E ? invert_cond(instr.cond) : instr.cond;
+				remove(i);
+				remove(movzx);
+				remove(test);
+				continue;
+			}
+		}
+
+		// arithmetic already sets the zero flag for its result
+		if ((instr.op == Op::Add || instr.op == Op::Sub || instr.op == Op::And || instr.op == Op::Or || instr.op == Op::Xor)
+			&& ops[0].is_reg() && has_next) {
+			const auto& test = code[n];
+			if (test.op == Op::Test && !test.verbatim && test.operands[0] == ops[0] && test.operands[1] == ops[0]
+				&& flag_readers_all(code, removed, n, [](const Instr& reader) { return reader.cond == Cond::E || reader.cond == Cond::Ne; })) {
+				remove(n);
+				continue;
+			}
+		}
+
+		// popping the call arguments right before the frame gets dropped anyway
+		if (instr.op == Op::Add && ops[0].is_reg(reg_id(Reg::Sp)) && has_next && code[n].op == Op::Mov
+			&& code[n].operands[0].is_reg(reg_id(Reg::Sp)) && code[n].operands[1].is_reg(reg_id(Reg::Bp))) {
+			remove(i);
+			continue;
+		}
+	}
+
+	if (changed)
+		remove_marked(code, removed);
+	return changed;
+}
+
+static bool clean_jumps(std::vector<Instr>& code) {
+	bool changed = false;
+	std::unordered_map<std::string, size_t> labels;
+	std::unordered_map<std::string, size_t> references;
+	for (size_t i = 0; i < code.size(); ++i) {
+		if (code[i].op == Op::Label) {
+			labels[code[i].operands[0].label] = i;
+			continue;
+		}
+		for (const auto& operand : code[i].operands)
+			if (!operand.label.empty()) ++references[operand.label];
+		for (const auto& target : code[i].targets)
+			++references[target];
+	}
+	// whether label comes before any real instruction after i
+	const auto falls_into = [&](size_t i, const std::string& label) {
+		for (size_t j = i + 1; j < code.size() && code[j].op == Op::Label; ++j)
+			if (code[j].operands[0].label == label) return true;
+		return false;
+	};
+	const auto first_instr = [&](size_t i) {
+		while (i < code.size() && code[i].op == Op::Label) ++i;
+		return i;
+	};
+
+	std::vector<bool> removed(code.size());
+	for (size_t i = 0; i < code.size(); ++i) {
+		auto& instr = code[i];
+		const bool is_jump = (instr.op == Op::Jmp || instr.op == Op::Jcc) && instr.operands[0].kind == Operand::Kind::Label;
+		// jump table entries pointing at a jmp
+		for (auto& target : instr.targets) {
+			const auto it = labels.find(target);
+			const auto next = first_instr(it->second);
+			if (next >= code.size() || code[next].op != Op::Jmp || code[next].operands[0].kind != Operand::Kind::Label
+				|| code[next].operands[0].label == target)
+				continue;
+			--references[target];
+			target = code[next].operands[0].label;
+			++references[target];
+			changed = true;
+		}
+		if (is_jump) {
+			// jumping to a jmp
+			for (size_t hops = 0; hops < 8; ++hops) {
+				const auto it = labels.find(instr.operands[0].label);
+				if (it == labels.end()) break;
+				const auto target = first_instr(it->second);
+				if (target >= code.size() || code[target].op != Op::Jmp || code[target].operands[0].kind != Operand::Kind::Label
+					|| code[target].operands[0].label == instr.operands[0].label || target == i)
+					break;
+				--references[instr.operands[0].label];
+				instr.operands[0].label = code[target].operands[0].label;
+				++references[instr.operands[0].label];
+				changed = true;
+			}
+			// jumping to the very next instruction
+			if (falls_into(i, instr.operands[0].label)) {
+				--references[instr.operands[0].label];
+				removed[i] = true;
+				changed = true;
+				continue;
+			}
+			// jcc over a jmp
+			if (instr.op == Op::Jcc && i + 1 < code.size() && code[i + 1].op == Op::Jmp
+				&& code[i + 1].operands[0].kind == Operand::Kind::Label && falls_into(i + 1, instr.operands[0].label)) {
+				--references[instr.operands[0].label];
+				instr.cond = invert_cond(instr.cond);
+				instr.operands[0] = code[i + 1].operands[0];
+				removed[i + 1] = true;
+				changed = true;
+				++i;
+				continue;
+			}
+		}
+		// nothing falls through or jumps into code right after a jmp or ret
+		if (instr.op == Op::Jmp || instr.op == Op::Ret) {
+			for (size_t j = i + 1; j < code.size() && code[j].op != Op::Label; ++j) {
+				for (const auto& operand : code[j].operands)
+					if (!operand.label.empty()) --references[operand.label];
+				for (const auto& target : code[j].targets)
+					--references[target];
+				removed[j] = true;
+				changed = true;
+			}
+		}
+	}
+	for (size_t i = 0; i < code.size(); ++i) {
+		if (!removed[i] && code[i].op == Op::Label && references[code[i].operands[0].label] == 0) {
+			removed[i] = true;
+			changed = true;
+		}
+	}
+
+	if (changed)
+		remove_marked(code, removed);
+	return changed;
+}
+
+// mov r, 0 -> xor r, r, when the flags don't matter. done last since the other rewrites look for the mov
+static void use_zero_idiom(std::vector<Instr>& code) {
+	const std::vector<bool> removed(code.size());
+	for (size_t i = 0; i < code.size(); ++i) {
+		auto& instr = code[i];
+		auto& ops = instr.operands;
+		if (instr.op == Op::Mov && !instr.verbatim && ops[0].is_reg() && ops[0].size >= 4 && ops[1].is_imm() && ops[1].label.empty() && ops[1].imm == 0
+			&& flag_readers_all(code, removed, i, [](const Instr&) { return false; })) {
+			instr.op = Op::Xor;
+			// the 32 bit form clears the upper half too
+			ops[0].size = 4;
+			ops[1] = ops[0];
+		}
+	}
+}
+
+void peephole(MachineFunction& function) {
+	// both only ever shrink the code, so this always ends
+	while (clean_jumps(function.code) | rewrite_instructions(function.code)) {}
+	use_zero_idiom(function.code);
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "x86.hpp"
+
+// Cleans up allocated code with small local rewrites, repeated until nothing changes:
+// folding constants into the instruction that uses them, turning setcc + test + jcc into
+// a single jcc, forwarding copies, dropping dead moves and unreachable code, and
+// straightening out jumps.
+void peephole(MachineFunction& function);
@@ -0,0 +1,416 @@
+#include "regalloc.hpp"
+#include "utils.hpp"
+#include <cmath>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+	// inclusive, in positions where instruction i reads at 2i and writes at 2i + 1
+	struct Range {
+		size_t from, to;
+	};
+	using Ranges = std::vector<Range>;
+
+	struct Interval {
+		RegId reg;
+		Ranges ranges;
+		float weight = 0;
+		bool byte = false;
+		// holds xmm or ymm values
+		bool vector = false;
+		std::vector<RegId> hints;
+	};
+}
+
+static bool is_tracked(RegId reg) {
+	return reg != reg_id(Reg::Sp) && reg != reg_id(Reg::Bp);
+}
+
+static void add_range(Ranges& ranges, size_t from, size_t to) {
+	ranges.push_back(Range { from, to });
+}
+
+static void normalize(Ranges& ranges) {
+	std::sort(ranges.begin(), ranges.end(), [](const auto& a, const auto& b) { return a.from < b.from; });
+	Ranges merged;
+	for (const auto& range : ranges) {
+		if (!merged.empty() && range.from <= merged.back().to + 1)
+			merged.back().to = std::max(merged.back().to, range.to);
+		else
+			merged.push_back(range);
+	}
+	ranges = std::move(merged);
+}
+
+static bool intersects(const Ranges& a, const Ranges& b) {
+	size_t i = 0, j = 0;
+	while (i < a.size() && j < b.size()) {
+		if (a[i].to < b[j].from) ++i;
+		else if (b[j].to < a[i].from) ++j;
+		else return true;
+	}
+	return false;
+}
+
+// live ranges of every register, indexed by register id
+static std::vector<Ranges> compute_live_ranges(const MachineFunction& function) {
+	const auto& code = function.code;
+	const auto reg_count = function.next_vreg;
+	const auto blocks = build_blocks(code);
+
+	std::vector<RegId> regs;
+	std::vector<std::vector<bool>> block_use(blocks.size(), std::vector<bool>(reg_count));
+	std::vector<std::vector<bool>> block_def(blocks.size(), std::vector<bool>(reg_count));
+	for (size_t b = 0; b < blocks.size(); ++b) {
+		for (size_t i = blocks[b].first; i <= blocks[b].last; ++i) {
+			regs.clear();
+			instr_uses(code[i], regs);
+			for (const auto reg : regs)
+				if (is_tracked(reg) && !block_def[b][reg]) block_use[b][reg] = true;
+			regs.clear();
+			instr_defs(code[i], regs);
+			for (const auto reg : regs)
+				if (is_tracked(reg)) block_def[b][reg] = true;
+		}
+	}
+
+	std::vector<std::vector<bool>> live_in(blocks.size(), std::vector<bool>(reg_count));
+	std::vector<std::vector<bool>> live_out(blocks.size(), std::vector<bool>(reg_count));
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t b = blocks.size(); b--;) {
+			auto out = std::vector<bool>(reg_count);
+			for (const auto succ : blocks[b].successors)
+				for (RegId reg = 0; reg < reg_count; ++reg)
+					if (live_in[succ][reg]) out[reg] = true;
+			auto in = block_use[b];
+			for (RegId reg = 0; reg < reg_count; ++reg)
+				if (out[reg] && !block_def[b][reg]) in[reg] = true;
+			if (in != live_in[b] || out != live_out[b]) {
+				changed = true;
+				live_in[b] = std::move(in);
+				live_out[b] = std::move(out);
+			}
+		}
+	}
+
+	std::vector<Ranges> ranges(reg_count);
+	static constexpr auto closed = SIZE_MAX;
+	std::vector<size_t> open_end(reg_count, closed);
+	std::vector<RegId> open;
+	for (size_t b = 0; b < blocks.size(); ++b) {
+		const auto& block = blocks[b];
+		open.clear();
+		for (RegId reg = 0; reg < reg_count; ++reg) {
+			if (live_out[b][reg]) {
+				open_end[reg] = block.last * 2 + 1;
+				open.push_back(reg);
+			}
+		}
+		for (size_t i = block.last + 1; i-- > block.first;) {
+			regs.clear();
+			instr_defs(code[i], regs);
+			for (const auto reg : regs) {
+				if (!is_tracked(reg)) continue;
+				if (open_end[reg] != closed) {
+					add_range(ranges[reg], i * 2 + 1, open_end[reg]);
+					open_end[reg] = closed;
+				} else {
+					// dead def, still clobbers the register
+					add_range(ranges[reg], i * 2 + 1, i * 2 + 1);
+				}
+			}
+			regs.clear();
+			instr_uses(code[i], regs);
+			for (const auto reg : regs) {
+				if (!is_tracked(reg) || open_end[reg] != closed) continue;
+				open_end[reg] = i * 2;
+				open.push_back(reg);
+			}
+		}
+		for (const auto reg : open) {
+			if (open_end[reg] == closed) continue;
+			add_range(ranges[reg], block.first * 2, open_end[reg]);
+			open_end[reg] = closed;
+		}
+	}
+	for (auto& reg_ranges : ranges)
+		normalize(reg_ranges);
+	return ranges;
+}
+
+template <class F>
+static void for_each_reg_operand(Instr& instr, F&& callback) {
+	for (auto& operand : instr.operands) {
+		if (operand.kind == Operand::Kind::Reg) {
+			callback(operand.reg, operand.size);
+		} else if (operand.kind == Operand::Kind::Mem) {
+			if (operand.reg != no_reg) callback(operand.reg, 4);
+			if (operand.index != no_reg) callback(operand.index, 4);
+		}
+	}
+}
+
+// whether operand i of instr can be swapped for a stack slot
+static bool can_fold_memory(const Instr& instr, size_t i) {
+	for (size_t j = 0; j < instr.operands.size(); ++j)
+		if (j != i && instr.operands[j].is_mem()) return false;
+	switch (instr.op) {
+		case Op::Mov:
+		case Op::Add:
+		case Op::Sub:
+		case Op::And:
+		case Op::Or:
+		case Op::Xor:
+		case Op::Cmp:
+			return true;
+		case Op::Imul:
+			// the source of the two and three operand forms
+			return instr.operands.size() == 1 || i == 1;
+		case Op::Cmov:
+		case Op::Popcnt:
+		case Op::Lzcnt:
+		case Op::Tzcnt:
+		case Op::Bsr:
+		case Op::Bsf:
+			return i == 1;
+		case Op::Movzx:
+			return i == 1 && instr.operands.size() == 2;
+		case Op::Test:
+		case Op::Neg:
+		case Op::Not:
+		case Op::Push:
+		case Op::Idiv:
+		case Op::Setcc:
+		case Op::Shl:
+		case Op::Shr:
+		case Op::Sar:
+		case Op::Rol:
+		case Op::Ror:
+			return i == 0;
+		default:
+			return false;
+	}
+}
+
+// rewrites every use of a spilled register to go through its stack slot
+static void insert_spill_code(MachineFunction& function, const std::unordered_set<RegId>& spilled,
+	std::unordered_set<RegId>& unspillable) {
+	const auto pointer_size = function.pointer_size();
+	// big enough for the widest use, vectors included
+	std::unordered_map<RegId, uint8_t> slot_sizes;
+	for (const auto reg : spilled)
+		slot_sizes[reg] = pointer_size;
+	for (auto& instr : function.code) {
+		for_each_reg_operand(instr, [&](RegId reg, uint8_t size) {
+			const auto it = slot_sizes.find(reg);
+			if (it != slot_sizes.end()) it->second = std::max(it->second, size);
+		});
+	}
+	std::unordered_map<RegId, int64_t> slots;
+	for (const auto reg : spilled)
+		slots[reg] = function.alloc_stack(slot_sizes[reg], slot_sizes[reg]);
+
+	std::vector<Instr> code;
+	code.reserve(function.code.size());
+	std::vector<RegId> regs;
+	std::vector<RegId> targets;
+	std::vector<Instr> after;
+	for (auto& instr : function.code) {
+		targets.clear();
+		for_each_reg_operand(instr, [&](RegId reg, uint8_t) {
+			if (slots.count(reg) && std::find(targets.begin(), targets.end(), reg) == targets.end())
+				targets.push_back(reg);
+		});
+		after.clear();
+		for (const auto target : targets) {
+			const auto slot = slots[target];
+			size_t count = 0;
+			for_each_reg_operand(instr, [&](RegId reg, uint8_t) { count += reg == target; });
+			if (count == 1) {
+				const auto it = std::find_if(instr.operands.begin(), instr.operands.end(),
+					[&](const auto& operand) { return operand.is_reg(target); });
+				if (it != instr.operands.end() && can_fold_memory(instr, it - instr.operands.begin())) {
+					*it = mem_op(Reg::Bp, slot, it->size, pointer_size);
+					continue;
+				}
+			}
+
+			regs.clear();
+			instr_uses(instr, regs);
+			const bool used = std::find(regs.begin(), regs.end(), target) != regs.end();
+			regs.clear();
+			instr_defs(instr, regs);
+			const bool defined = std::find(regs.begin(), regs.end(), target) != regs.end();
+
+			const auto temp = function.new_vreg();
+			unspillable.insert(temp);
+			// the whole register, when part of it gets used too
+			uint8_t size = 0;
+			for (auto& operand : instr.operands) {
+				if (operand.is_reg(target)) {
+					operand.reg = temp;
+					size = std::max(size, operand.size);
+				}
+				if (operand.is_mem()) {
+					if (operand.reg == target) operand.reg = temp;
+					if (operand.index == target) operand.index = temp;
+				}
+			}
+			if (!size) size = pointer_size;
+			if (used) {
+				code.emplace_back(Op::Mov, std::vector { reg_op(temp, size), mem_op(Reg::Bp, slot, size, pointer_size) });
+				code.back().loop_depth = instr.loop_depth;
+			}
+			if (defined) {
+				after.emplace_back(Op::Mov, std::vector { mem_op(Reg::Bp, slot, size, pointer_size), reg_op(temp, size) });
+				after.back().loop_depth = instr.loop_depth;
+			}
+		}
+		code.push_back(std::move(instr));
+		for (auto& store : after)
+			code.push_back(std::move(store));
+	}
+	function.code = std::move(code);
+}
+
+static std::vector<Interval> build_intervals(MachineFunction& function, std::vector<Ranges>& ranges) {
+	std::vector<Interval> intervals;
+	std::vector<size_t> interval_of(function.next_vreg, SIZE_MAX);
+	for (RegId reg = first_virtual_reg; reg < function.next_vreg; ++reg) {
+		if (ranges[reg].empty()) continue;
+		interval_of[reg] = intervals.size();
+		intervals.push_back(Interval { reg, std::move(ranges[reg]) });
+	}
+	for (auto& instr : function.code) {
+		const float weight = instr.loop_depth >= 4 ? 10000.f : std::pow(10.f, instr.loop_depth);
+		for_each_reg_operand(instr, [&](RegId reg, uint8_t size) {
+			if (!is_virtual(reg) || interval_of[reg] == SIZE_MAX) return;
+			auto& interval = intervals[interval_of[reg]];
+			interval.weight += weight;
+			if (size == 1) interval.byte = true;
+			if (size >= 16) interval.vector = true;
+		});
+		if (instr.op == Op::Mov && instr.operands[0].is_reg() && instr.operands[1].is_reg()) {
+			const auto a = instr.operands[0].reg;
+			const auto b = instr.operands[1].reg;
+			if (is_virtual(a) && interval_of[a] != SIZE_MAX) intervals[interval_of[a]].hints.push_back(b);
+			if (is_virtual(b) && interval_of[b] != SIZE_MAX) intervals[interval_of[b]].hints.push_back(a);
+		}
+	}
+	for (auto& interval : intervals) {
+		size_t length = 0;
+		for (const auto& range : interval.ranges)
+			length += range.to - range.from + 1;
+		interval.weight /= static_cast<float>(length);
+	}
+	std::sort(intervals.begin(), intervals.end(),
+		[](const auto& a, const auto& b) { return a.ranges.front().from < b.ranges.front().from; });
+	return intervals;
+}
+
+void allocate_registers(MachineFunction& function) {
+	const auto& regs = target_regs(function.target);
+	std::unordered_set<RegId> unspillable;
+	std::vector<RegId> assignment;
+	while (true) {
+		auto ranges = compute_live_ranges(function);
+		std::vector<Ranges> fixed(first_virtual_reg);
+		for (RegId reg = 0; reg < first_virtual_reg && reg < ranges.size(); ++reg)
+			fixed[reg] = ranges[reg];
+		auto intervals = build_intervals(function, ranges);
+
+		assignment.assign(function.next_vreg, no_reg);
+		std::vector<std::vector<size_t>> assigned(first_virtual_reg);
+		std::vector<Ranges> occupied = fixed;
+		std::unordered_set<RegId> spilled;
+
+		const auto rebuild_occupied = [&](RegId reg) {
+			occupied[reg] = fixed[reg];
+			for (const auto index : assigned[reg])
+				occupied[reg].insert(occupied[reg].end(), intervals[index].ranges.begin(), intervals[index].ranges.end());
+			normalize(occupied[reg]);
+		};
+		const auto assign = [&](size_t index, RegId reg) {
+			assignment[intervals[index].reg] = reg;
+			assigned[reg].push_back(index);
+			rebuild_occupied(reg);
+		};
+
+		for (size_t index = 0; index < intervals.size(); ++index) {
+			const auto& interval = intervals[index];
+			std::vector<RegId> candidates;
+			for (const auto hint : interval.hints) {
+				const auto reg = is_virtual(hint) ? assignment[hint] : hint;
+				if (reg != no_reg) candidates.push_back(reg);
+			}
+			const auto reg_class = interval.vector ? regs.vector : interval.byte ? regs.byte : regs.allocatable;
+			for (const auto reg : reg_class)
+				candidates.push_back(reg_id(reg));
+
+			const auto allowed = [&](RegId reg) {
+				return std::find(reg_class.begin(), reg_class.end(), static_cast<Reg>(reg)) != reg_class.end();
+			};
+
+			const auto free = std::find_if(candidates.begin(), candidates.end(),
+				[&](RegId reg) { return allowed(reg) && !intersects(interval.ranges, occupied[reg]); });
+			if (free != candidates.end()) {
+				assign(index, *free);
+				continue;
+			}
+
+			// nothing free, so either spill this one or evict whatever is cheapest to spill
+			RegId best_reg = no_reg;
+			float best_cost = 0;
+			for (const auto reg : candidates) {
+				if (!allowed(reg) || intersects(interval.ranges, fixed[reg])) continue;
+				float cost = 0;
+				bool possible = true;
+				for (const auto other : assigned[reg]) {
+					if (!intersects(interval.ranges, intervals[other].ranges)) continue;
+					if (unspillable.count(intervals[other].reg)) possible = false;
+					cost += intervals[other].weight;
+				}
+				if (possible && (best_reg == no_reg || cost < best_cost)) {
+					best_reg = reg;
+					best_cost = cost;
+				}
+			}
+			const bool must_assign = unspillable.count(interval.reg) != 0;
+			if (best_reg != no_reg && (must_assign || best_cost < interval.weight)) {
+				auto& evicted = assigned[best_reg];
+				std::erase_if(evicted, [&](size_t other) {
+					if (!intersects(interval.ranges, intervals[other].ranges)) return false;
+					spilled.insert(intervals[other].reg);
+					assignment[intervals[other].reg] = no_reg;
+					return true;
+				});
+				assign(index, best_reg);
+			} else {
+				assert(!must_assign, "ran out of registers");
+				spilled.insert(interval.reg);
+			}
+		}
+
+		if (spilled.empty()) break;
+		insert_spill_code(function, spilled, unspillable);
+	}
+
+	std::vector<bool> used(first_virtual_reg);
+	for (auto& instr : function.code) {
+		for (auto& operand : instr.operands) {
+			if (is_virtual(operand.reg)) operand.reg = assignment[operand.reg];
+			if (is_virtual(operand.index)) operand.index = assignment[operand.index];
+			if (operand.reg != no_reg) used[operand.reg] = true;
+			if (operand.index != no_reg) used[operand.index] = true;
+		}
+		for (const auto reg : instr.implicit_defs) used[reg] = true;
+	}
+	std::erase_if(function.code, [](const Instr& instr) {
+		return instr.op == Op::Mov && !instr.verbatim && instr.operands[0].is_reg() && instr.operands[0] == instr.operands[1];
+	});
+
+	function.saved_regs.clear();
+	for (const auto reg : regs.callee_saved)
+		if (used[reg_id(reg)]) function.saved_regs.push_back(reg);
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "x86.hpp"
+
+// Linear scan register allocation over the virtual registers of a function.
+// Liveness is computed over its basic blocks, giving every register a list of live ranges
+// (with holes), so physical registers used directly by the code, like call clobbers or
+// syscall arguments, just block their own ranges. Virtual registers that don't fit are
+// spilled to a stack slot, folded straight into instructions that can take a memory operand,
+// and allocation runs again until everything fits.
+// Afterwards the code only refers to physical registers, and function.saved_regs lists
+// the callee saved registers it clobbers.
+void allocate_registers(MachineFunction& function);
@@ -31,6 +31,10 @@ inline void unhandled(const std::string_view msg, const SourceLocation location
 }
 
 
+// thrown by the parser and checker after reporting an error to the user,
+// so tools like --watch can keep going after a bad edit
+struct CompileError {};
+
 template <class T>
 class ArrayView {
 	T* m_data;
@@ -0,0 +1,328 @@
+#include "watch.hpp"
+#include "checker.hpp"
+#include "enums.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <thread>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace {
+	// a top level item as source text, so unchanged ones can be skipped without lexing them
+	struct SourceItem {
+		std::string name;
+		std::string text;
+		size_t line; // line the text starts on in the file
+	};
+}
+
+// whether an item is a function with a body, which const fns are too. the rest are structs and externs
+static bool is_function_item(const std::string& text) {
+	if (text.starts_with("const")) {
+		const auto fn = text.find_first_not_of(" \t\r\n", 5);
+		return fn != 5 && fn != std::string::npos && text.compare(fn, 2, "fn") == 0;
+	}
+	return text.starts_with("fn");
+}
+
+// splits source into top level items by tracking braces, skipping comments and strings.
+// fails if they don't balance, which is normal halfway through an edit
+static bool split_items(const std::string& source, std::vector<SourceItem>& items) {
+	size_t line = 1;
+	size_t line_start = 0;
+	size_t depth = 0;
+	size_t item_start = std::string::npos;
+	size_t item_line = 0;
+	size_t prev_end = 0;
+	const auto end_item = [&](size_t end) {
+		auto text = source.substr(item_start, end - item_start);
+		std::string name = text;
+		if (is_function_item(text)) {
+			const auto start = text.find("fn") + 2;
+			const auto paren = text.find('(');
+			name = text.substr(start, paren == std::string::npos ? std::string::npos : paren - start);
+			std::erase_if(name, [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; });
+		}
+		items.push_back(SourceItem { name, std::move(text), item_line });
+		item_start = std::string::npos;
+		prev_end = end;
+	};
+	for (size_t i = 0; i < source.size(); ++i) {
+		const auto c = source[i];
+		if (c == '\n') {
+			++line;
+			line_start = i + 1;
+			continue;
+		}
+		if (c == '/' && i + 1 < source.size() && source[i + 1] == '/') {
+			while (i + 1 < source.size() && source[i + 1] != '\n') ++i;
+			continue;
+		}
+		if (c == ' ' || c == '\t' || c == '\r') continue;
+		if (item_start == std::string::npos) {
+			item_start = std::max(line_start, prev_end);
+			item_line = line;
+		}
+		if (c == '"') {
+			for (++i; i < source.size() && source[i] != '"'; ++i) {
+				if (source[i] == '\n') {
+					++line;
+					line_start = i + 1;
+				}
+			}
+		} else if (c == '{') {
+			++depth;
+		} else if (c == '}') {
+			if (depth == 0) return false;
+			if (--depth == 0) end_item(i + 1);
+		} else if (c == ';' && depth == 0) {
+			end_item(i + 1);
+		}
+	}
+	return depth == 0 && item_start == std::string::npos;
+}
+
+static Function parse_item(const SourceItem& item, const std::string& file_name) {
+	std::stringstream stream(item.text);
+	Lexer lexer(stream, item.line);
+	auto tokens = lexer.get_tokens();
+	// sentinel so running off the end of the item is a parse error instead of an out of bounds abort
+	Token end(TokenType::Unknown, "end of item");
+	if (!tokens.empty()) end.span = tokens.back().span;
+	tokens.push_back(end);
+
+	Parser parser(file_name, ArrayStream(ArrayView { tokens }));
+	const bool constant = parser.m_tokens.peek() == Token(TokenType::Keyword, "const");
+	if (constant) parser.m_tokens.get();
+	const auto& first = parser.m_tokens.get();
+	if (first != Token(TokenType::Keyword, "fn"))
+		parser.error_at_token(first, "Expected a function");
+	auto function = parser.parse_function();
+	function.constant = constant;
+	if (parser.m_tokens.peek().type != TokenType::Unknown)
+		parser.error_at_token(parser.m_tokens.peek(), "Unexpected token after function");
+	return function;
+}
+
+static Function signature_of(const Function& function) {
+	return Function {
+		.return_type = function.return_type,
+		.name = function.name,
+		.arguments = function.arguments,
+		.builtin = function.builtin,
+		.external = function.external,
+		.constant = function.constant
+	};
+}
+
+static bool same_signature(const Function& a, const Function& b) {
+	// callers of a function that stops being const might not be allowed to call it anymore
+	if (a.return_type != b.return_type || a.arguments.size() != b.arguments.size() || a.constant != b.constant) return false;
+	for (size_t i = 0; i < a.arguments.size(); ++i) {
+		if (a.arguments[i].type != b.arguments[i].type) return false;
+	}
+	return true;
+}
+
+static std::string read_file(const std::string& file_name) {
+	std::ifstream file(file_name);
+	std::stringstream stream;
+	stream << file.rdbuf();
+	return stream.str();
+}
+
+namespace {
+	class Watcher {
+		std::string m_file_name;
+		std::vector<SourceItem> m_items;
+		// signatures of every function, which is all the checker needs from the rest of the program
+		Parser m_signatures;
+		std::optional<Target> m_target;
+	public:
+		Watcher(const std::string& file_name, const Parser& parser, std::optional<Target> target)
+			: m_file_name(file_name), m_signatures(file_name, ArrayStream(ArrayView<Token>())), m_target(target) {
+			for (const auto& function : parser.m_functions)
+				m_signatures.m_functions.push_back(signature_of(function));
+			m_signatures.m_structs = parser.m_structs;
+			split_items(read_file(file_name), m_items);
+		}
+
+		// returns the new and changed functions, all checked against the updated signatures.
+		// throws CompileError if they don't parse or check, keeping the previous state
+		std::vector<std::unique_ptr<Function>> reload(const std::string& source, std::vector<std::string>& removed) {
+			std::vector<SourceItem> items;
+			if (!split_items(source, items)) {
+				print("[watch] unbalanced braces, waiting for the next change\n");
+				throw CompileError {};
+			}
+
+			const auto find_item = [](const std::vector<SourceItem>& items, const std::string& name) {
+				return std::find_if(items.begin(), items.end(), [&](const auto& item) { return item.name == name; });
+			};
+
+			// the layout of a struct is baked into everything using it, and extern functions into the
+			// executable they got linked into
+			const auto structs = [](const std::vector<SourceItem>& items) {
+				std::vector<std::string> texts;
+				for (const auto& item : items)
+					if (!is_function_item(item.text)) texts.push_back(item.text);
+				return texts;
+			};
+			if (structs(items) != structs(m_items)) {
+				print("[watch] structs and extern functions can't change while running, restart to pick up the change\n");
+				throw CompileError {};
+			}
+
+			// a changed signature or a removed function means callers have to be checked again,
+			// which needs their fresh asts, so then everything gets reparsed
+			bool reparse_all = false;
+			for (const auto& item : m_items) {
+				if (is_function_item(item.text) && find_item(items, item.name) == items.end()) {
+					removed.push_back(item.name);
+					reparse_all = true;
+				}
+			}
+
+			std::vector<std::unique_ptr<Function>> functions;
+			std::vector<bool> parsed(items.size(), false);
+			for (size_t i = 0; i < items.size(); ++i) {
+				if (!is_function_item(items[i].text)) continue;
+				const auto old = find_item(m_items, items[i].name);
+				if (old != m_items.end() && old->text == items[i].text) continue;
+				functions.push_back(std::make_unique<Function>(parse_item(items[i], m_file_name)));
+				parsed[i] = true;
+				const auto& function = *functions.back();
+				const auto sig = std::find_if(m_signatures.m_functions.begin(), m_signatures.m_functions.end(),
+					[&](const auto& other) { return other.name == function.name; });
+				// calls to const fns got replaced with what they returned when compiling, so the callers need
+				// their original asts back
+				if (sig == m_signatures.m_functions.end() || !same_signature(*sig, function) || function.constant)
+					reparse_all = true;
+			}
+			if (reparse_all) {
+				for (size_t i = 0; i < items.size(); ++i) {
+					if (!parsed[i] && is_function_item(items[i].text))
+						functions.push_back(std::make_unique<Function>(parse_item(items[i], m_file_name)));
+				}
+			}
+
+			Parser signatures(m_file_name, ArrayStream(ArrayView<Token>()));
+			for (const auto& function : m_signatures.m_functions) {
+				const auto replaced = std::find_if(functions.begin(), functions.end(),
+					[&](const auto& other) { return other->name == function.name; });
+				const bool was_removed = std::find(removed.begin(), removed.end(), function.name) != removed.end();
+				if (replaced == functions.end() && !was_removed)
+					signatures.m_functions.push_back(signature_of(function));
+			}
+			for (const auto& function : functions)
+				signatures.m_functions.push_back(signature_of(*function));
+
+			TypeChecker checker(signatures, m_target);
+			for (auto& function : functions)
+				checker.check_function(*function);
+
+			m_items = std::move(items);
+			m_signatures.m_functions = std::move(signatures.m_functions);
+			return functions;
+		}
+	};
+}
+
+int run_watch(Parser& parser, const std::string& file_name, const std::optional<EvalLimits>& eval_limits,
+	std::optional<Target> target, const std::function<void(Parser&)>& rebuild) {
+	const auto path = std::filesystem::absolute(file_name);
+	const int fd = inotify_init1(IN_CLOEXEC);
+	// watch the directory since editors tend to replace the file instead of writing to it
+	if (fd < 0 || inotify_add_watch(fd, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		print("[error] could not watch \"{}\"\n", file_name);
+		return 1;
+	}
+
+	Watcher watcher(file_name, parser, target);
+	auto source = read_file(file_name);
+
+	// the program runs on its own thread, and is restarted on the next change after it returns
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool finished = false;
+	std::optional<Evaluator> evaluator;
+	if (eval_limits) {
+		evaluator.emplace(parser, std::cout, *eval_limits);
+		std::thread([&] {
+			while (true) {
+				const auto result = evaluator->run();
+				if (result.status == EvalStatus::Ok)
+					print("Program returned: {}\n", result.value);
+				else
+					print("[error] Program stopped: {}\n", result.status);
+				std::unique_lock lock(mutex);
+				finished = true;
+				condition.wait(lock, [&] { return !finished; });
+			}
+		}).detach();
+	}
+
+	print("[watch] watching {}\n", file_name);
+	alignas(inotify_event) char buffer[4096];
+	while (true) {
+		const auto length = read(fd, buffer, sizeof(buffer));
+		if (length <= 0) {
+			print("[error] lost watch on \"{}\"\n", file_name);
+			std::exit(1);
+		}
+		bool changed = false;
+		for (ssize_t offset = 0; offset < length;) {
+			const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+			if (event->len && path.filename() == event->name)
+				changed = true;
+			offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+		}
+		if (!changed) continue;
+
+		const auto start = std::chrono::steady_clock::now();
+		auto new_source = read_file(file_name);
+		if (new_source == source) continue;
+		source = std::move(new_source);
+
+		std::vector<std::unique_ptr<Function>> functions;
+		std::vector<std::string> removed;
+		try {
+			functions = watcher.reload(source, removed);
+		} catch (const CompileError&) {
+			print("[watch] keeping the previous version\n");
+			continue;
+		}
+
+		std::string names;
+		for (const auto& function : functions)
+			names += (names.empty() ? "" : ", ") + function->name;
+		const auto count = functions.size();
+
+		if (evaluator) {
+			// removed functions stay around in the evaluator, nothing that still checks can call them
+			evaluator->post_reload(std::move(functions));
+			const std::lock_guard lock(mutex);
+			if (finished) {
+				finished = false;
+				condition.notify_one();
+			}
+		} else {
+			auto& program = parser.m_functions;
+			for (const auto& name : removed)
+				std::erase_if(program, [&](const auto& function) { return function.name == name; });
+			for (auto& function : functions) {
+				const auto it = std::find_if(program.begin(), program.end(),
+					[&](const auto& other) { return other.name == function->name; });
+				if (it == program.end())
+					program.push_back(std::move(*function));
+				else
+					*it = std::move(*function);
+			}
+			rebuild(parser);
+		}
+
+		const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		print("[watch] reloaded {} function(s) in {}ms: {}\n", count, elapsed, names);
+	}
+}
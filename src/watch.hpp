@@ -0,0 +1,12 @@
+#pragma once
+#include "parser.hpp"
+#include "evaluator.hpp"
+#include "x86.hpp"
+#include <functional>
+
+// Watches file_name with inotify and on every change re-lexes, parses and checks only the
+// functions whose source changed. With eval_limits the program keeps running in the evaluator
+// and the new function bodies are swapped in at its next call boundary, otherwise rebuild
+// gets called with the updated program. target is what asm blocks get checked against, none when evaluating.
+int run_watch(Parser& parser, const std::string& file_name, const std::optional<EvalLimits>& eval_limits,
+	std::optional<Target> target, const std::function<void(Parser&)>& rebuild);
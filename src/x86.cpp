@@ -0,0 +1,815 @@
+#include "x86.hpp"
+#include "utils.hpp"
+#include <cctype>
+#include <charconv>
+#include <unordered_map>
+
+namespace {
+	using enum Reg;
+	constexpr Reg x86_caller_saved[] = { Ax, Cx, Dx, Xmm0, Xmm1, Xmm2, Xmm3, Xmm4, Xmm5, Xmm6, Xmm7 };
+	constexpr Reg x86_callee_saved[] = { Bx, Si, Di };
+	constexpr Reg x86_allocatable[] = { Ax, Cx, Dx, Bx, Si, Di };
+	// only these have an 8 bit low register (al, cl, dl, bl)
+	constexpr Reg x86_byte[] = { Ax, Cx, Dx, Bx };
+	// like gcc's regparm(3)
+	constexpr Reg x86_internal_args[] = { Ax, Dx, Cx };
+	constexpr Reg x86_syscall_args[] = { Ax, Bx, Cx, Dx, Si, Di };
+	constexpr Reg x86_vector[] = { Xmm0, Xmm1, Xmm2, Xmm3, Xmm4, Xmm5, Xmm6, Xmm7 };
+
+	// System V
+	constexpr Reg x86_64_caller_saved[] = {
+		Ax, Cx, Dx, Si, Di, R8, R9, R10, R11,
+		Xmm0, Xmm1, Xmm2, Xmm3, Xmm4, Xmm5, Xmm6, Xmm7, Xmm8, Xmm9, Xmm10, Xmm11, Xmm12, Xmm13, Xmm14, Xmm15,
+	};
+	constexpr Reg x86_64_callee_saved[] = { Bx, R12, R13, R14, R15 };
+	constexpr Reg x86_64_allocatable[] = { Ax, Cx, Dx, Si, Di, R8, R9, R10, R11, Bx, R12, R13, R14, R15 };
+	constexpr Reg x86_64_args[] = { Di, Si, Dx, Cx, R8, R9 };
+	constexpr Reg x86_64_syscall_args[] = { Ax, Di, Si, Dx, R10, R8, R9 };
+	constexpr Reg x86_64_syscall_clobbers[] = { Cx, R11 };
+	constexpr Reg x86_64_vector[] = {
+		Xmm0, Xmm1, Xmm2, Xmm3, Xmm4, Xmm5, Xmm6, Xmm7, Xmm8, Xmm9, Xmm10, Xmm11, Xmm12, Xmm13, Xmm14, Xmm15,
+	};
+
+	constexpr TargetRegs x86_regs {
+		.caller_saved = x86_caller_saved,
+		.callee_saved = x86_callee_saved,
+		.allocatable = x86_allocatable,
+		.byte = x86_byte,
+		.args = {},
+		.internal_args = x86_internal_args,
+		.syscall_args = x86_syscall_args,
+		.syscall_clobbers = {},
+		.pointer_size = 4,
+		.vector = x86_vector,
+	};
+	constexpr TargetRegs x86_64_regs {
+		.caller_saved = x86_64_caller_saved,
+		.callee_saved = x86_64_callee_saved,
+		.allocatable = x86_64_allocatable,
+		// every register has one with a rex prefix
+		.byte = x86_64_allocatable,
+		.args = x86_64_args,
+		.internal_args = x86_64_args,
+		.syscall_args = x86_64_syscall_args,
+		.syscall_clobbers = x86_64_syscall_clobbers,
+		.pointer_size = 8,
+		.vector = x86_64_vector,
+	};
+}
+
+const TargetRegs& target_regs(Target target) {
+	return target == Target::X86_64 ? x86_64_regs : x86_regs;
+}
+
+static void operand_uses(const Operand& operand, std::vector<RegId>& uses) {
+	if (operand.kind == Operand::Kind::Reg) {
+		uses.push_back(operand.reg);
+	} else if (operand.kind == Operand::Kind::Mem) {
+		if (operand.reg != no_reg) uses.push_back(operand.reg);
+		if (operand.index != no_reg) uses.push_back(operand.index);
+	}
+}
+
+// whether the first operand is only written to
+static bool first_operand_is_def_only(const Instr& instr) {
+	switch (instr.op) {
+		case Op::Mov:
+		case Op::Movzx:
+		case Op::Lea:
+		case Op::Setcc:
+		case Op::Pop:
+		case Op::Movd:
+		case Op::Pshufd:
+		case Op::Vpbroadcastd:
+		case Op::Vextracti128:
+		case Op::Popcnt:
+		case Op::Lzcnt:
+		case Op::Tzcnt:
+		case Op::Bsr:
+		case Op::Bsf:
+			return true;
+		// imul r, src, imm only reads src
+		case Op::Imul:
+			return instr.operands.size() == 3;
+		// xor r, r is how registers get zeroed, it doesn't depend on the old value. same for
+		// pcmpeqd r, r setting every bit
+		case Op::Xor:
+		case Op::Pxor:
+		case Op::Pcmpeqd:
+			return instr.operands[1].is_reg(instr.operands[0].reg);
+		default:
+			return false;
+	}
+}
+
+// whether the first operand is written to at all
+static bool first_operand_is_def(const Instr& instr) {
+	switch (instr.op) {
+		case Op::Add:
+		case Op::Sub:
+		case Op::Neg:
+		case Op::Not:
+		case Op::Inc:
+		case Op::Dec:
+		case Op::And:
+		case Op::Or:
+		case Op::Xor:
+		case Op::Shl:
+		case Op::Shr:
+		case Op::Sar:
+		case Op::Rol:
+		case Op::Ror:
+		case Op::Bswap:
+		case Op::Cmov:
+		case Op::Paddd:
+		case Op::Psubd:
+		case Op::Pmulld:
+		case Op::Pmuludq:
+		case Op::Pand:
+		case Op::Pandn:
+		case Op::Por:
+		case Op::Pxor:
+		case Op::Pcmpeqd:
+		case Op::Pcmpgtd:
+		case Op::Punpckldq:
+			return true;
+		case Op::Imul:
+			return instr.operands.size() > 1;
+		default:
+			return first_operand_is_def_only(instr);
+	}
+}
+
+bool operand_sizes_match(const Instr& instr) {
+	switch (instr.op) {
+		case Op::Mov:
+		case Op::Add:
+		case Op::Sub:
+		case Op::And:
+		case Op::Or:
+		case Op::Xor:
+		case Op::Cmp:
+		case Op::Test:
+		case Op::Imul:
+		case Op::Cmov:
+		case Op::Bt:
+		case Op::Popcnt:
+		case Op::Lzcnt:
+		case Op::Tzcnt:
+		case Op::Bsr:
+		case Op::Bsf:
+			break;
+		default:
+			return true;
+	}
+	if (instr.operands.size() < 2) return true;
+	// immediates get extended to the size of the operation, so only registers and memory have to agree
+	const auto& first = instr.operands[0];
+	const auto& second = instr.operands[1];
+	return !(first.is_reg() || first.is_mem()) || !(second.is_reg() || second.is_mem()) || first.size == second.size;
+}
+
+void instr_uses(const Instr& instr, std::vector<RegId>& uses) {
+	for (size_t i = 0; i < instr.operands.size(); ++i) {
+		const auto& operand = instr.operands[i];
+		if (i == 0 && operand.is_reg() && first_operand_is_def_only(instr)) continue;
+		operand_uses(operand, uses);
+	}
+	if (instr.op == Op::Cdq || (instr.op == Op::Imul && instr.operands.size() == 1)) {
+		uses.push_back(reg_id(Reg::Ax));
+	} else if (instr.op == Op::Idiv) {
+		uses.push_back(reg_id(Reg::Ax));
+		uses.push_back(reg_id(Reg::Dx));
+	}
+	uses.insert(uses.end(), instr.implicit_uses.begin(), instr.implicit_uses.end());
+}
+
+void instr_defs(const Instr& instr, std::vector<RegId>& defs) {
+	if (!instr.operands.empty() && instr.operands[0].is_reg() && first_operand_is_def(instr))
+		defs.push_back(instr.operands[0].reg);
+	if (instr.op == Op::Cdq) {
+		defs.push_back(reg_id(Reg::Dx));
+	} else if (instr.op == Op::Idiv || instr.op == Op::Rdtsc || (instr.op == Op::Imul && instr.operands.size() == 1)) {
+		defs.push_back(reg_id(Reg::Ax));
+		defs.push_back(reg_id(Reg::Dx));
+	}
+	defs.insert(defs.end(), instr.implicit_defs.begin(), instr.implicit_defs.end());
+}
+
+bool is_terminator(const Instr& instr) {
+	return instr.op == Op::Jmp || instr.op == Op::Ret;
+}
+
+std::vector<BasicBlock> build_blocks(const std::vector<Instr>& code) {
+	std::vector<BasicBlock> blocks;
+	std::unordered_map<std::string, size_t> label_blocks;
+	size_t start = 0;
+	for (size_t i = 0; i < code.size(); ++i) {
+		const auto& instr = code[i];
+		if (instr.op == Op::Label) {
+			if (i != start) {
+				blocks.push_back(BasicBlock { start, i - 1 });
+				start = i;
+			}
+			label_blocks[instr.operands[0].label] = blocks.size();
+		}
+		if (instr.op == Op::Jmp || instr.op == Op::Jcc || instr.op == Op::Ret) {
+			blocks.push_back(BasicBlock { start, i });
+			start = i + 1;
+		}
+	}
+	if (start < code.size())
+		blocks.push_back(BasicBlock { start, code.size() - 1 });
+
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		auto& block = blocks[i];
+		const auto& last = code[block.last];
+		if (last.op == Op::Jmp || last.op == Op::Jcc) {
+			const auto it = label_blocks.find(last.operands[0].label);
+			if (it != label_blocks.end())
+				block.successors.push_back(it->second);
+			for (const auto& target : last.targets)
+				block.successors.push_back(label_blocks.at(target));
+		}
+		if (last.op != Op::Jmp && last.op != Op::Ret && i + 1 < blocks.size())
+			block.successors.push_back(i + 1);
+	}
+	return blocks;
+}
+
+Cond invert_cond(Cond cond) {
+	switch (cond) {
+		case Cond::None: return Cond::None;
+		case Cond::E: return Cond::Ne;
+		case Cond::Ne: return Cond::E;
+		case Cond::L: return Cond::Ge;
+		case Cond::Le: return Cond::G;
+		case Cond::G: return Cond::Le;
+		case Cond::Ge: return Cond::L;
+		case Cond::B: return Cond::Ae;
+		case Cond::Be: return Cond::A;
+		case Cond::A: return Cond::Be;
+		case Cond::Ae: return Cond::B;
+	}
+	return Cond::None;
+}
+
+Cond swap_cond(Cond cond) {
+	switch (cond) {
+		case Cond::L: return Cond::G;
+		case Cond::Le: return Cond::Ge;
+		case Cond::G: return Cond::L;
+		case Cond::Ge: return Cond::Le;
+		case Cond::B: return Cond::A;
+		case Cond::Be: return Cond::Ae;
+		case Cond::A: return Cond::B;
+		case Cond::Ae: return Cond::Be;
+		default: return cond;
+	}
+}
+
+static const char* cond_name(Cond cond) {
+	switch (cond) {
+		case Cond::None: return "";
+		case Cond::E: return "e";
+		case Cond::Ne: return "ne";
+		case Cond::L: return "l";
+		case Cond::Le: return "le";
+		case Cond::G: return "g";
+		case Cond::Ge: return "ge";
+		case Cond::B: return "b";
+		case Cond::Be: return "be";
+		case Cond::A: return "a";
+		case Cond::Ae: return "ae";
+	}
+	return "";
+}
+
+static const char* mnemonic(Op op) {
+	switch (op) {
+		case Op::Label: return "";
+		case Op::Mov: return "mov";
+		case Op::Movzx: return "movzx";
+		case Op::Lea: return "lea";
+		case Op::Add: return "add";
+		case Op::Sub: return "sub";
+		case Op::Imul: return "imul";
+		case Op::Neg: return "neg";
+		case Op::Not: return "not";
+		case Op::Inc: return "inc";
+		case Op::Dec: return "dec";
+		case Op::And: return "and";
+		case Op::Or: return "or";
+		case Op::Xor: return "xor";
+		case Op::Shl: return "shl";
+		case Op::Shr: return "shr";
+		case Op::Sar: return "sar";
+		case Op::Rol: return "rol";
+		case Op::Ror: return "ror";
+		case Op::Cmp: return "cmp";
+		case Op::Test: return "test";
+		case Op::Bt: return "bt";
+		case Op::Popcnt: return "popcnt";
+		case Op::Lzcnt: return "lzcnt";
+		case Op::Tzcnt: return "tzcnt";
+		case Op::Bsr: return "bsr";
+		case Op::Bsf: return "bsf";
+		case Op::Bswap: return "bswap";
+		case Op::Setcc: return "set";
+		case Op::Cdq: return "cdq";
+		case Op::Idiv: return "idiv";
+		case Op::Push: return "push";
+		case Op::Pop: return "pop";
+		case Op::Jmp: return "jmp";
+		case Op::Jcc: return "j";
+		case Op::Call: return "call";
+		case Op::Ret: return "ret";
+		case Op::Int: return "int";
+		case Op::Syscall: return "syscall";
+		case Op::Ud2: return "ud2";
+		case Op::Rdtsc: return "rdtsc";
+		case Op::Pause: return "pause";
+		case Op::Cmov: return "cmov";
+		case Op::Movd: return "movd";
+		case Op::Paddd: return "paddd";
+		case Op::Psubd: return "psubd";
+		case Op::Pmulld: return "pmulld";
+		case Op::Pmuludq: return "pmuludq";
+		case Op::Pand: return "pand";
+		case Op::Pandn: return "pandn";
+		case Op::Por: return "por";
+		case Op::Pxor: return "pxor";
+		case Op::Pcmpeqd: return "pcmpeqd";
+		case Op::Pcmpgtd: return "pcmpgtd";
+		case Op::Pshufd: return "pshufd";
+		case Op::Punpckldq: return "punpckldq";
+		case Op::Vpbroadcastd: return "vpbroadcastd";
+		case Op::Vextracti128: return "vextracti128";
+		case Op::Vzeroupper: return "vzeroupper";
+	}
+	return "";
+}
+
+namespace {
+	constexpr const char* names_64[] = {
+		"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+	};
+	constexpr const char* names_32[] = {
+		"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+	};
+	constexpr const char* names_16[] = {
+		"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w",
+	};
+	constexpr const char* names_8[] = {
+		"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+	};
+}
+
+static const char* reg_name(RegId reg, uint8_t size) {
+	static constexpr const char* names_vector[] = {
+		"xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+		"xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+		"ymm0", "ymm1", "ymm2", "ymm3", "ymm4", "ymm5", "ymm6", "ymm7",
+		"ymm8", "ymm9", "ymm10", "ymm11", "ymm12", "ymm13", "ymm14", "ymm15",
+	};
+	if (reg >= reg_id(Reg::Xmm0)) {
+		assert(reg < first_virtual_reg, "unknown register");
+		return names_vector[reg - reg_id(Reg::Xmm0) + (size == 32 ? 16 : 0)];
+	}
+	switch (size) {
+		case 1: return names_8[reg];
+		case 2: return names_16[reg];
+		case 8: return names_64[reg];
+		default: return names_32[reg];
+	}
+}
+
+static void print_reg(std::ostream& stream, RegId reg, uint8_t size) {
+	if (is_virtual(reg))
+		stream << 'v' << reg - first_virtual_reg << (size == 1 ? "b" : size == 8 ? "q" : size == 16 ? "x" : size == 32 ? "y" : "");
+	else
+		stream << reg_name(reg, size);
+}
+
+static const char* size_name(uint8_t size) {
+	switch (size) {
+		case 1: return "BYTE";
+		case 2: return "WORD";
+		case 8: return "QWORD";
+		case 16: return "OWORD";
+		case 32: return "YWORD";
+		default: return "DWORD";
+	}
+}
+
+static void print_displacement(std::ostream& stream, int64_t value, bool first) {
+	if (value < 0)
+		stream << (first ? "-" : " - ") << -value;
+	else if (value > 0 || first)
+		stream << (first ? "" : " + ") << value;
+}
+
+std::ostream& operator<<(std::ostream& stream, const Operand& operand) {
+	switch (operand.kind) {
+		case Operand::Kind::None: break;
+		case Operand::Kind::Reg:
+			print_reg(stream, operand.reg, operand.size);
+			break;
+		case Operand::Kind::Imm:
+			if (operand.label.empty()) {
+				stream << operand.imm;
+			} else {
+				stream << operand.label;
+				print_displacement(stream, operand.imm, false);
+			}
+			break;
+		case Operand::Kind::Mem: {
+			stream << '[';
+			bool first = true;
+			if (!operand.label.empty()) {
+				stream << operand.label;
+				first = false;
+			}
+			if (operand.reg != no_reg) {
+				if (!first) stream << " + ";
+				print_reg(stream, operand.reg, operand.address_size);
+				first = false;
+			}
+			if (operand.index != no_reg) {
+				if (!first) stream << " + ";
+				print_reg(stream, operand.index, operand.address_size);
+				if (operand.scale != 1) stream << '*' << int(operand.scale);
+				first = false;
+			}
+			print_displacement(stream, operand.imm, first);
+			stream << ']';
+			break;
+		}
+		case Operand::Kind::Label:
+			stream << operand.label;
+			break;
+	}
+	return stream;
+}
+
+std::ostream& operator<<(std::ostream& stream, const Instr& instr) {
+	if (instr.op == Op::Label)
+		return stream << instr.operands[0] << ':';
+	const bool vector_mov = instr.op == Op::Mov && instr.operands[0].size >= 16;
+	if (instr.vex && mnemonic(instr.op)[0] != 'v')
+		stream << 'v';
+	assert(operand_sizes_match(instr), "operand sizes don't match");
+	stream << mnemonic(instr.op) << (vector_mov ? "dqu" : "") << cond_name(instr.cond);
+	// the vex forms of the two operand instructions take the first source separately
+	auto operands = instr.operands;
+	if (instr.vex && operands.size() == 2 && instr.op != Op::Mov && instr.op != Op::Movd && instr.op != Op::Vpbroadcastd)
+		operands.insert(operands.begin(), operands[0]);
+	for (size_t i = 0; i < operands.size(); ++i) {
+		const auto& operand = operands[i];
+		stream << (i ? ", " : " ");
+		if (operand.is_mem() && instr.op != Op::Lea)
+			stream << size_name(operand.size) << ' ';
+		stream << operand;
+	}
+	return stream;
+}
+
+std::optional<std::pair<RegId, uint8_t>> parse_register(std::string_view name) {
+	static constexpr std::pair<const char* const*, uint8_t> tables[] = { { names_8, 1 }, { names_16, 2 }, { names_32, 4 }, { names_64, 8 } };
+	for (const auto& [names, size] : tables)
+		for (RegId reg = 0; reg < 16; ++reg)
+			if (name == names[reg]) return std::pair { reg, size };
+	return {};
+}
+
+namespace {
+	constexpr std::pair<std::string_view, Op> asm_mnemonics[] = {
+		{ "mov", Op::Mov }, { "movzx", Op::Movzx }, { "lea", Op::Lea }, { "add", Op::Add }, { "sub", Op::Sub },
+		{ "imul", Op::Imul }, { "neg", Op::Neg }, { "not", Op::Not }, { "inc", Op::Inc }, { "dec", Op::Dec },
+		{ "and", Op::And }, { "or", Op::Or }, { "xor", Op::Xor }, { "shl", Op::Shl }, { "sal", Op::Shl },
+		{ "shr", Op::Shr }, { "sar", Op::Sar }, { "rol", Op::Rol }, { "ror", Op::Ror }, { "cmp", Op::Cmp },
+		{ "test", Op::Test }, { "bt", Op::Bt }, { "popcnt", Op::Popcnt }, { "lzcnt", Op::Lzcnt }, { "tzcnt", Op::Tzcnt },
+		{ "bsr", Op::Bsr }, { "bsf", Op::Bsf }, { "bswap", Op::Bswap }, { "cdq", Op::Cdq }, { "idiv", Op::Idiv },
+		{ "jmp", Op::Jmp }, { "rdtsc", Op::Rdtsc }, { "pause", Op::Pause },
+	};
+	// the ones that go on the end of j, set and cmov
+	constexpr std::pair<std::string_view, Cond> asm_conds[] = {
+		{ "e", Cond::E }, { "z", Cond::E }, { "ne", Cond::Ne }, { "nz", Cond::Ne }, { "l", Cond::L }, { "nge", Cond::L },
+		{ "le", Cond::Le }, { "ng", Cond::Le }, { "g", Cond::G }, { "nle", Cond::G }, { "ge", Cond::Ge }, { "nl", Cond::Ge },
+		{ "b", Cond::B }, { "c", Cond::B }, { "nae", Cond::B }, { "be", Cond::Be }, { "na", Cond::Be }, { "a", Cond::A },
+		{ "nbe", Cond::A }, { "ae", Cond::Ae }, { "nc", Cond::Ae }, { "nb", Cond::Ae },
+	};
+
+	bool fits_i32(int64_t value) { return value >= INT32_MIN && value <= INT32_MAX; }
+
+	std::string_view trim(std::string_view text) {
+		while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+		while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+		return text;
+	}
+
+	bool is_identifier(std::string_view text) {
+		if (text.empty() || (text[0] >= '0' && text[0] <= '9')) return false;
+		return std::all_of(text.begin(), text.end(), [](char c) { return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '.'; });
+	}
+
+	std::optional<int64_t> parse_number(std::string_view text) {
+		const bool negative = !text.empty() && text[0] == '-';
+		if (negative) text = trim(text.substr(1));
+		int base = 10;
+		if (text.starts_with("0x")) {
+			text.remove_prefix(2);
+			base = 16;
+		}
+		uint64_t value;
+		const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+		if (text.empty() || error != std::errc() || end != text.data() + text.size()) return {};
+		return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+	}
+
+	// what the asm block parser knows about the target
+	class AsmParser {
+	public:
+		AsmParser(Target target) : m_target(target), m_pointer_size(target_regs(target).pointer_size) {}
+
+		// a general purpose register that exists on the target and isn't esp or ebp
+		std::string reg(std::string_view text, Operand& operand) const {
+			const auto parsed = parse_register(text);
+			if (!parsed) return format("Unknown register {}", text);
+			const auto [reg, size] = *parsed;
+			if (reg == reg_id(Reg::Sp) || reg == reg_id(Reg::Bp))
+				return "esp and ebp belong to the compiler";
+			// spl, bpl, sil and dil need a rex prefix too
+			if (m_target == Target::X86 && (size == 8 || reg >= 8 || (size == 1 && reg >= 4)))
+				return format("{} only exists on x86_64", text);
+			operand = reg_op(reg, size);
+			return {};
+		}
+
+		// [base + index*scale + disp], with any of them left out but a register
+		std::string memory(std::string_view text, Operand& operand) const {
+			operand = mem_op(no_reg, 0, 0, m_pointer_size);
+			size_t i = 0;
+			while (i < text.size()) {
+				const bool negative = text[i] == '-';
+				if (text[i] == '+' || text[i] == '-') ++i;
+				const auto end = std::min(text.find_first_of("+-", i), text.size());
+				const auto term = trim(text.substr(i, end - i));
+				i = end;
+				if (const auto value = parse_number(term)) {
+					operand.imm += negative ? -*value : *value;
+					continue;
+				}
+				if (negative) return "Registers can't be subtracted in addresses";
+				auto name = term;
+				uint8_t scale = 0;
+				if (const auto star = term.find('*'); star != std::string_view::npos) {
+					auto factor = trim(term.substr(star + 1));
+					name = trim(term.substr(0, star));
+					if (parse_number(name)) std::swap(name, factor);
+					const auto value = parse_number(factor);
+					if (!value || (*value != 1 && *value != 2 && *value != 4 && *value != 8)) return "Scales can only be 1, 2, 4 or 8";
+					scale = static_cast<uint8_t>(*value);
+				}
+				Operand reg_operand;
+				if (auto error = reg(name, reg_operand); !error.empty()) return error;
+				if (reg_operand.size != m_pointer_size)
+					return format("Addresses take {} bit registers on this target", m_pointer_size * 8);
+				if (!scale && operand.reg == no_reg) {
+					operand.reg = reg_operand.reg;
+				} else if (operand.index == no_reg) {
+					operand.index = reg_operand.reg;
+					operand.scale = scale ? scale : 1;
+				} else {
+					return "Too many registers in address";
+				}
+			}
+			if (operand.reg == no_reg && operand.index == no_reg) return "Addresses need a register";
+			if (!fits_i32(operand.imm)) return "Displacement doesn't fit in 32 bits";
+			return {};
+		}
+
+		std::string operand(std::string_view text, Operand& operand) const {
+			uint8_t size = 0;
+			for (const auto& [name, bytes] : { std::pair { "byte", 1 }, { "word", 2 }, { "dword", 4 }, { "qword", 8 } }) {
+				const auto length = std::string_view(name).size();
+				if (text.starts_with(name) && text.size() > length && (text[length] == ' ' || text[length] == '[')) {
+					size = static_cast<uint8_t>(bytes);
+					text = trim(text.substr(length));
+					if (text.starts_with("ptr ")) text = trim(text.substr(4));
+					break;
+				}
+			}
+			if (text.starts_with('[')) {
+				if (!text.ends_with(']')) return "Expected ]";
+				auto error = memory(text.substr(1, text.size() - 2), operand);
+				operand.size = size;
+				return error;
+			}
+			if (size) return "Only memory operands take a size";
+			if (const auto value = parse_number(text)) {
+				operand = imm_op(*value, 0);
+				return {};
+			}
+			if (parse_register(text)) return reg(text, operand);
+			if (!is_identifier(text)) return format("Can't make sense of {}", text);
+			operand = label_op(std::string(text));
+			return {};
+		}
+
+		// checks the operands are a form the assembler encodes, filling in the sizes of memory operands and
+		// immediates from the registers next to them
+		std::string check(Instr& instr) const {
+			auto& ops = instr.operands;
+			const auto count = [&](size_t n) { return ops.size() == n; };
+			const auto is_rm = [&](size_t i) { return ops[i].is_reg() || ops[i].is_mem(); };
+			// the sizes of the register and memory operands, which have to be the same
+			const auto unify = [&]() -> std::string {
+				uint8_t size = 0;
+				for (const auto& operand : ops)
+					if ((operand.is_reg() || operand.is_mem()) && operand.size) {
+						if (size && operand.size != size) return "Operand sizes don't match";
+						size = operand.size;
+					}
+				if (!size) return "Operand size needed, like dword [...]";
+				if (size == 2) return "16 bit operands only work as the source of movzx";
+				for (auto& operand : ops)
+					if (operand.kind != Operand::Kind::Label) operand.size = size;
+				return {};
+			};
+			// immediates sign extended from 32 bits, or the size of the operation when it's smaller
+			const auto immediate_fits = [&](const Operand& operand) {
+				if (!operand.is_imm()) return true;
+				if (operand.size == 1) return operand.imm >= INT8_MIN && operand.imm <= UINT8_MAX;
+				if (operand.size == 4) return operand.imm >= INT32_MIN && operand.imm <= UINT32_MAX;
+				return fits_i32(operand.imm);
+			};
+			const auto none = [&](const char* form) -> std::string { return format("{} takes {}", mnemonic(instr.op), form); };
+			switch (instr.op) {
+				case Op::Mov:
+				case Op::Add:
+				case Op::Sub:
+				case Op::And:
+				case Op::Or:
+				case Op::Xor:
+				case Op::Cmp:
+				case Op::Test: {
+					const bool test = instr.op == Op::Test;
+					if (!count(2) || !is_rm(0) || ops[1].kind == Operand::Kind::Label || (ops[0].is_mem() && ops[1].is_mem())
+						|| (test && ops[1].is_mem()))
+						return none(test ? "a register or memory, then a register or immediate" : "two operands, at most one of them memory");
+					if (auto error = unify(); !error.empty()) return error;
+					// the only instruction with a 64 bit immediate
+					const bool wide_mov = instr.op == Op::Mov && ops[0].is_reg() && ops[0].size == 8;
+					if (!wide_mov && !immediate_fits(ops[1])) return "Immediate too big";
+					return {};
+				}
+				case Op::Movzx: {
+					if (!count(2) || !ops[0].is_reg() || !is_rm(1)) return none("a register, then a register or memory");
+					if (ops[1].size != 1 && ops[1].size != 2) return "movzx extends bytes and words, which memory needs the size of";
+					if (ops[0].size < 4) return "movzx goes into a 32 or 64 bit register";
+					return {};
+				}
+				case Op::Lea:
+					if (!count(2) || !ops[0].is_reg() || !ops[1].is_mem() || ops[0].size < 4) return none("a 32 or 64 bit register, then memory");
+					ops[1].size = ops[0].size;
+					return {};
+				case Op::Imul:
+					// imul r, imm is imul r, r, imm
+					if (count(2) && ops[0].is_reg() && ops[1].is_imm())
+						ops.insert(ops.begin() + 1, ops[0]);
+					if (!(count(1) && is_rm(0)) && !(count(2) && ops[0].is_reg() && is_rm(1))
+						&& !(count(3) && ops[0].is_reg() && is_rm(1) && ops[2].is_imm()))
+						return none("a register or memory, or a register and then a register, memory or immediate");
+					if (auto error = unify(); !error.empty()) return error;
+					if (ops[0].size == 1) return "imul can't multiply bytes here";
+					if (count(3)) {
+						ops[2].size = ops[0].size;
+						if (!fits_i32(ops[2].imm)) return "Immediate too big";
+					}
+					return {};
+				case Op::Neg:
+				case Op::Not:
+				case Op::Inc:
+				case Op::Dec:
+				case Op::Idiv:
+					if (!count(1) || !is_rm(0)) return none("a register or memory");
+					if (auto error = unify(); !error.empty()) return error;
+					if (instr.op == Op::Idiv && ops[0].size == 1) return "idiv can't divide bytes here";
+					return {};
+				case Op::Shl:
+				case Op::Shr:
+				case Op::Sar:
+				case Op::Rol:
+				case Op::Ror: {
+					const bool by_cl = count(2) && ops[1].is_reg(reg_id(Reg::Cx)) && ops[1].size == 1;
+					if (!count(2) || !is_rm(0) || (!by_cl && !ops[1].is_imm())) return none("a register or memory, then an immediate or cl");
+					const auto amount = ops[1];
+					ops.pop_back();
+					if (auto error = unify(); !error.empty()) return error;
+					ops.push_back(amount);
+					if (amount.is_imm() && (amount.imm < 0 || amount.imm > 63)) return "Shift amount has to be between 0 and 63";
+					if (amount.is_imm()) ops[1].size = 1;
+					return {};
+				}
+				case Op::Bt:
+				case Op::Cmov:
+				case Op::Popcnt:
+				case Op::Lzcnt:
+				case Op::Tzcnt:
+				case Op::Bsr:
+				case Op::Bsf: {
+					// bt goes the other way around
+					const bool bt = instr.op == Op::Bt;
+					if (!count(2) || !ops[bt ? 1 : 0].is_reg() || !is_rm(bt ? 0 : 1))
+						return none(bt ? "a register or memory, then a register" : "a register, then a register or memory");
+					if (auto error = unify(); !error.empty()) return error;
+					if (ops[0].size == 1) return format("{} doesn't work on bytes", mnemonic(instr.op));
+					return {};
+				}
+				case Op::Bswap:
+					if (!count(1) || !ops[0].is_reg() || ops[0].size < 4) return none("a 32 or 64 bit register");
+					return {};
+				case Op::Setcc:
+					if (!count(1) || !is_rm(0)) return none("a byte register or memory");
+					if (!ops[0].size) ops[0].size = 1;
+					if (ops[0].size != 1) return "set only writes bytes";
+					return {};
+				case Op::Jmp:
+				case Op::Jcc:
+					if (!count(1) || ops[0].kind != Operand::Kind::Label) return none("a label in the same asm block");
+					return {};
+				case Op::Cdq:
+				case Op::Rdtsc:
+				case Op::Pause:
+					if (!ops.empty()) return none("no operands");
+					return {};
+				default:
+					unhandled("asm instruction");
+			}
+		}
+
+		// one instruction, maybe with a label in front. prefix goes in front of labels
+		std::string line(std::string_view text, const std::string& prefix, std::vector<Instr>& code) const {
+			text = trim(text);
+			if (const auto colon = text.find(':'); colon != std::string_view::npos) {
+				const auto name = trim(text.substr(0, colon));
+				if (!is_identifier(name)) return format("Bad label {}", name);
+				code.emplace_back(Op::Label, std::vector { label_op(format("{}_{}", prefix, name)) });
+				text = trim(text.substr(colon + 1));
+				if (text.empty()) return {};
+			}
+			const auto space = std::min(text.find_first_of(" \t"), text.size());
+			const auto name = text.substr(0, space);
+			std::optional<Instr> instr;
+			for (const auto& [mnemonic, op] : asm_mnemonics)
+				if (name == mnemonic) instr.emplace(op);
+			for (const auto& [start, op] : { std::pair { "j", Op::Jcc }, { "set", Op::Setcc }, { "cmov", Op::Cmov } }) {
+				if (instr || !name.starts_with(start)) continue;
+				for (const auto& [suffix, cond] : asm_conds)
+					if (name.substr(std::string_view(start).size()) == suffix) instr.emplace(op, std::vector<Operand> {}, cond);
+			}
+			if (!instr) {
+				if (name == "push" || name == "pop" || name == "call" || name == "ret" || name == "int" || name == "syscall")
+					return format("{} would move the stack or leave the function under the compiler", name);
+				return format("Unknown instruction {}", name);
+			}
+			for (auto rest = trim(text.substr(space)); !rest.empty();) {
+				const auto comma = std::min(rest.find(','), rest.size());
+				auto& added = instr->operands.emplace_back();
+				if (auto error = operand(trim(rest.substr(0, comma)), added); !error.empty()) return error;
+				if (added.kind == Operand::Kind::Label) added.label = format("{}_{}", prefix, added.label);
+				if (comma == rest.size()) break;
+				rest = trim(rest.substr(comma + 1));
+				if (rest.empty()) return "Expected an operand after ,";
+			}
+			if (auto error = check(*instr); !error.empty()) return error;
+			instr->verbatim = true;
+			code.push_back(std::move(*instr));
+			return {};
+		}
+
+	private:
+		Target m_target;
+		uint8_t m_pointer_size;
+	};
+}
+
+std::string parse_asm(const std::vector<std::string>& lines, Target target, const std::string& prefix, std::vector<Instr>& code) {
+	const AsmParser parser(target);
+	const auto first = code.size();
+	for (const auto& line : lines) {
+		auto lower = line;
+		std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		if (auto error = parser.line(lower, prefix, code); !error.empty())
+			return format("{} in `{}`", error, line);
+	}
+	std::unordered_map<std::string, size_t> labels;
+	for (auto i = first; i < code.size(); ++i)
+		if (code[i].op == Op::Label && labels[code[i].operands[0].label]++)
+			return format("Label {} is there twice", code[i].operands[0].label.substr(prefix.size() + 1));
+	for (auto i = first; i < code.size(); ++i)
+		if ((code[i].op == Op::Jmp || code[i].op == Op::Jcc) && !labels.contains(code[i].operands[0].label))
+			return format("There's no label {} in the asm block", code[i].operands[0].label.substr(prefix.size() + 1));
+	return {};
+}
@@ -0,0 +1,291 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+// Register ids. General purpose registers use their hardware encoding, so the same id is eax or rax
+// depending on operand size, then come the vector registers, where xmm and ymm also go by size.
+// Virtual registers start at first_virtual_reg.
+using RegId = uint32_t;
+
+enum class Reg : RegId {
+	Ax, Cx, Dx, Bx, Sp, Bp, Si, Di,
+	// x86_64 only
+	R8, R9, R10, R11, R12, R13, R14, R15,
+	Xmm0, Xmm1, Xmm2, Xmm3, Xmm4, Xmm5, Xmm6, Xmm7,
+	// x86_64 only
+	Xmm8, Xmm9, Xmm10, Xmm11, Xmm12, Xmm13, Xmm14, Xmm15,
+};
+
+inline constexpr RegId reg_id(Reg reg) { return static_cast<RegId>(reg); }
+
+static constexpr RegId first_virtual_reg = 32;
+static constexpr RegId no_reg = UINT32_MAX;
+
+inline constexpr bool is_virtual(RegId reg) { return reg != no_reg && reg >= first_virtual_reg; }
+inline constexpr bool is_vector_reg(RegId reg) { return reg >= reg_id(Reg::Xmm0) && reg < first_virtual_reg; }
+
+struct Operand {
+	enum class Kind : uint8_t {
+		None,
+		Reg,
+		Imm,
+		Mem,
+		Label,
+	};
+	Kind kind = Kind::None;
+	// in bytes, 16 and 32 being xmm and ymm vectors
+	uint8_t size = 4;
+	// Reg: the register, Mem: the base register
+	RegId reg = no_reg;
+	// Mem only, [reg + index * scale + imm]
+	RegId index = no_reg;
+	uint8_t scale = 1;
+	// Mem only, size of the base and index registers
+	uint8_t address_size = 4;
+	// Imm: the value, Mem: the displacement
+	int64_t imm = 0;
+	// Label: the target, Imm and Mem: a symbol whose address is added on top
+	std::string label;
+
+	bool is_reg() const { return kind == Kind::Reg; }
+	bool is_reg(RegId id) const { return kind == Kind::Reg && reg == id; }
+	bool is_imm() const { return kind == Kind::Imm; }
+	bool is_mem() const { return kind == Kind::Mem; }
+
+	bool operator==(const Operand&) const = default;
+};
+
+inline Operand reg_op(RegId reg, uint8_t size = 4) {
+	return Operand { .kind = Operand::Kind::Reg, .size = size, .reg = reg };
+}
+inline Operand reg_op(Reg reg, uint8_t size = 4) { return reg_op(reg_id(reg), size); }
+
+inline Operand imm_op(int64_t value, uint8_t size = 4) {
+	return Operand { .kind = Operand::Kind::Imm, .size = size, .imm = value };
+}
+
+// address of a symbol as an immediate
+inline Operand symbol_op(const std::string& symbol) {
+	return Operand { .kind = Operand::Kind::Imm, .label = symbol };
+}
+
+inline Operand mem_op(RegId base, int64_t disp, uint8_t size = 4, uint8_t address_size = 4) {
+	return Operand { .kind = Operand::Kind::Mem, .size = size, .reg = base, .address_size = address_size, .imm = disp };
+}
+inline Operand mem_op(Reg base, int64_t disp, uint8_t size = 4, uint8_t address_size = 4) {
+	return mem_op(reg_id(base), disp, size, address_size);
+}
+
+inline Operand label_op(const std::string& label) {
+	return Operand { .kind = Operand::Kind::Label, .label = label };
+}
+
+enum class Op : uint8_t {
+	Label, // pseudo instruction, defines operands[0]
+	Mov,
+	Movzx,
+	Lea,
+	Add,
+	Sub,
+	// with one operand, edx:eax = eax * operand
+	Imul,
+	Neg,
+	Not,
+	Inc,
+	Dec,
+	And,
+	Or,
+	Xor,
+	// by an immediate, or cl
+	Shl,
+	Shr,
+	Sar,
+	Rol,
+	Ror,
+	Cmp,
+	Test,
+	// carry = bit operands[1] of operands[0]
+	Bt,
+	// bit counts, with lzcnt and tzcnt giving the operand size for 0 where bsr and bsf leave the
+	// destination undefined. popcnt, lzcnt and tzcnt are newer than the rest, roughly as new as avx2
+	Popcnt,
+	Lzcnt,
+	Tzcnt,
+	Bsr,
+	Bsf,
+	Bswap,
+	Setcc,
+	Cdq,
+	Idiv,
+	Push,
+	Pop,
+	Jmp,
+	Jcc,
+	Call,
+	Ret,
+	Int,
+	Syscall,
+	// traps with an invalid opcode
+	Ud2,
+	// edx:eax = time stamp counter
+	Rdtsc,
+	// spin loop hint
+	Pause,
+	Cmov,
+	// vector instructions, with the binary ones taking the destination as the first source like the
+	// scalar ones. Mov with vector operands is movdqu, since the stack on x86 is only 4 byte aligned
+	Movd,
+	Paddd,
+	Psubd,
+	// avx2 only, sse2 makes do with pmuludq on every other lane
+	Pmulld,
+	Pmuludq,
+	Pand,
+	// operands[0] = ~operands[0] & operands[1]
+	Pandn,
+	Por,
+	Pxor,
+	Pcmpeqd,
+	Pcmpgtd,
+	// operands[0] = the lanes of operands[1] picked by the immediate
+	Pshufd,
+	Punpckldq,
+	Vpbroadcastd,
+	// operands[0] = the upper half of the ymm in operands[1]
+	Vextracti128,
+	Vzeroupper,
+};
+
+enum class Cond : uint8_t {
+	None,
+	E,
+	Ne,
+	L,
+	Le,
+	G,
+	Ge,
+	B,
+	Be,
+	A,
+	Ae,
+};
+
+struct Instr {
+	Op op;
+	std::vector<Operand> operands;
+	Cond cond = Cond::None;
+	// registers read or written without showing up as operands, like call clobbers
+	std::vector<RegId> implicit_uses;
+	std::vector<RegId> implicit_defs;
+	// how many loops deep this is, used to weigh spill costs
+	uint8_t loop_depth = 0;
+	// jmp through a jump table only, the labels in it. the table itself is operands[0].label
+	std::vector<std::string> targets;
+	// vector instructions only, use the vex encoding avx needs for ymm registers. the destination
+	// goes in as the first source, so it works the same as the two operand form
+	bool vex = false;
+	// written by hand in an asm block, so the peephole leaves it the way it is
+	bool verbatim = false;
+
+	Instr(Op op, std::vector<Operand> operands = {}, Cond cond = Cond::None)
+		: op(op), operands(std::move(operands)), cond(cond) {}
+};
+
+enum class Target : uint8_t {
+	X86,
+	X86_64,
+};
+
+struct TargetRegs {
+	// calls clobber these, the rest are saved by the callee
+	std::span<const Reg> caller_saved;
+	std::span<const Reg> callee_saved;
+	// the order the allocator tries registers in, caller saved first since those don't need saving
+	std::span<const Reg> allocatable;
+	// registers with an 8 bit low part
+	std::span<const Reg> byte;
+	// where call arguments go, the rest are pushed. empty if everything goes on the stack
+	std::span<const Reg> args;
+	// the same for calls between tack functions, which also pop their own stack arguments
+	std::span<const Reg> internal_args;
+	// where syscall takes its number and arguments
+	std::span<const Reg> syscall_args;
+	// clobbered by the syscall instruction itself
+	std::span<const Reg> syscall_clobbers;
+	// size of pointers and stack slots
+	uint8_t pointer_size;
+	// xmm registers, which calls clobber all of
+	std::span<const Reg> vector;
+};
+
+const TargetRegs& target_regs(Target target);
+
+struct MachineFunction {
+	std::string name;
+	Target target = Target::X86;
+	// visible outside the object file
+	bool global = false;
+	std::vector<Instr> code;
+	RegId next_vreg = first_virtual_reg;
+	// bytes reserved below ebp, for buffers and spill slots
+	size_t stack_size = 0;
+	// whether the function sets up ebp, needed for stack arguments and stack slots
+	bool needs_frame = false;
+	// x86_64 keeps the stack 16 byte aligned at calls, which needs to know about them
+	bool has_calls = false;
+	// callee saved registers the function ended up using, filled in by the allocator
+	std::vector<Reg> saved_regs;
+	// dirties the upper halves of the ymm registers, which have to be cleared before calls and
+	// returning so sse code elsewhere doesn't slow down
+	bool uses_ymm = false;
+
+	RegId new_vreg() { return next_vreg++; }
+	uint8_t pointer_size() const { return target_regs(target).pointer_size; }
+	// returns the ebp offset of the new slot, a multiple of align
+	int64_t alloc_stack(size_t bytes, size_t align = 1) {
+		stack_size = (stack_size + bytes + align - 1) / align * align;
+		needs_frame = true;
+		return -static_cast<int64_t>(stack_size);
+	}
+};
+
+// zero initialized memory, aligned to 8, which goes in .bss
+struct Global {
+	std::string name;
+	size_t size;
+};
+
+// registers read and written by an instruction, including implicit ones
+void instr_uses(const Instr& instr, std::vector<RegId>& uses);
+void instr_defs(const Instr& instr, std::vector<RegId>& defs);
+
+bool is_terminator(const Instr& instr);
+// whether the register and memory operands of an instruction that works on one size, like add or cmp,
+// are all that size. x86 has no encoding for cmp rdx, ecx, so anything else is a bug in the compiler
+bool operand_sizes_match(const Instr& instr);
+
+// a straight line run of instructions, [first, last]
+struct BasicBlock {
+	size_t first, last;
+	std::vector<size_t> successors;
+};
+
+// splits code at labels and jumps. successors are indices into the returned blocks
+std::vector<BasicBlock> build_blocks(const std::vector<Instr>& code);
+Cond invert_cond(Cond cond);
+// the condition for the same comparison with its operands swapped
+Cond swap_cond(Cond cond);
+
+// parses the lines of an asm block, in the syntax write_asm gives, into instructions for target. labels
+// get prefix in front so every copy of the block has its own, and jumps can only go to them. gives back
+// what's wrong instead when a line isn't something the assembler can encode, or touches esp or ebp
+std::string parse_asm(const std::vector<std::string>& lines, Target target, const std::string& prefix, std::vector<Instr>& code);
+// a general purpose register written by any of its names, along with the size that name is
+std::optional<std::pair<RegId, uint8_t>> parse_register(std::string_view name);
+
+std::ostream& operator<<(std::ostream& stream, const Operand& operand);
+std::ostream& operator<<(std::ostream& stream, const Instr& instr);
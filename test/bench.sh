@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# Usage: ./bench.sh [runs] [tack opts]
+# times every test through the evaluator, extra opts are passed along (e.g. --fuel 1000000000)
+
+cd "$(dirname $0)"
+
+runs=${1:-10}
+[ $# -gt 0 ] && shift
+
+for folder in */; do
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt $runs ]; do
+		../build/tack $folder/main.tack --eval "$@" > /dev/null
+		i=$(( i + 1 ))
+	done
+	end=$(date +%s%N)
+	echo "$folder $(( (end - start) / runs / 1000 ))us"
+done
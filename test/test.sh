@@ -2,20 +2,18 @@
 
 if [ $# -lt 1 ]; then
 	echo "Usage: $0 folder"
+	echo "Set TARGET=x86_64 to test the 64 bit backend"
 	exit
 fi
 
+target=${TARGET:-x86}
+
 cd "$(dirname $0)"
 
 set -e
 
 echo "\e[32m- Running compiler\e[m"
-../build/tack $1/main.tack -o $1/main.asm
-
-echo "\e[34m- Running nasm\e[m"
-nasm -f elf $1/main.asm
-ld -m elf_i386 $1/main.o -o $1/main
-rm $1/main.o
+../build/tack $1/main.tack -o $1/main --target=$target
 
 set +e
 